@@ -36,209 +36,92 @@ SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
 
 For more information, please refer to <http://unlicense.org/>
 ***************************************************************************************************/
-#include <exception>
+#include <cstring>
+#include <fstream>
+#include <iomanip>
 #include <string>
 #include <sstream>
+#include <vector>
 
 #include<windows.h>
 
+#include "Relay.h"
+#include "ConsoleSink.h"
+#include "FileSource.h"
+#include "Pager.h"
+#include "SessionIndex.h"
+#include "JsonSink.h"
+#include "RuleClassifier.h"
+#include "Server.h"
+#include "VtSink.h"
 #include "Utils\utils.h"
+#include "Utils\colorutils.h"
 #include "Utils\conutils.h"
 
 #define OPTPARSE_IMPLEMENT
 #include "Utils\optparse.h"
 
-#define PIPE_BUFFER_SIZE  255
-#define CLOSEHANDLE(h)    if( h && h != INVALID_HANDLE_VALUE )  { ::CloseHandle( h ); h = 0; }
-
-#define CR_STATUS_SUCCESS    0
-#define CR_STATUS_ERROR     -1
-#define CR_STATUS_WINAPI    -2
-#define CR_STATUS_ABORTED   -3
-
-BOOL  ResumeChildAndWaitForExit( PROCESS_INFORMATION& piChild, DWORD dwTimeoutOnceSignaled_ms );
-DWORD WINAPI ReadAndPutOutputThread( LPVOID lpvThreadParam );
-DWORD WINAPI GetAndWriteInputThread( LPVOID lpvThreadParam );
-
-//==================================================================================================
-enum EIoThreadType { StdOutRead, StdErrRead, StdInWrite, NUM_EIOTHREADTYPES };
-
-//==================================================================================================
-struct SOutputThreadInfo { HANDLE hReadPipe; EIoThreadType eType; };
-
-//==================================================================================================
-struct exit_exception : public std::exception 
-{ 
-    exit_exception( char const *szMsg, int code =CR_STATUS_ERROR ) 
-        : std::exception( szMsg ), m_code( code ) { }
-
-    virtual int code() const { return m_code; }
-
-private:
-    int m_code;
-};
-
 //=== GLOBALS ======================================================================================
-HANDLE  g_hStdIn           = NULL; // Handle to parents std input.
-BOOL    g_fRunThreads      = TRUE;
 WORD    g_defaultAttr      = conutils::console.get_attribute();
-WORD    g_soutColor        = g_defaultAttr;
-WORD    g_serrColor        = g_defaultAttr;
-bool    g_fLineMode        = false;
-bool    g_fSkipLastEol     = false;
-
-utils::Mutex       g_mutex;
-utils::Event       g_abortChildEvent;
-std::exception_ptr g_threadExceptions[NUM_EIOTHREADTYPES];
+bool    g_fShowStats       = false;
+
+CRelay          g_relay;                                       // runs the child and relays its i/o
+CRuleClassifier g_classifier;                                  // lines and --rule matches of the output
+CConsoleSink    g_consoleSink( g_defaultAttr, g_classifier );  // renders the child's output
+CJsonSink       g_jsonSink( g_classifier );                    // --json records
+CVtSink         g_vtSink;                                      // --vt, the child's escape sequences
+CFileSource     g_fileSource;                                  // cr --file, renders a file in place of a child
+CFileFollower   g_fileFollower;                                // cr --follow, renders what's appended to files
+bool            g_fFileMode   = false;
+bool            g_fFollowMode = false;
+CPager          g_pager( g_defaultAttr, g_classifier );       // --pager, pages through the output
+bool            g_fPager      = false;
+CSessionRecorder g_recorder;                                   // --record, the session with its index
+CSessionSearch   g_search;                                     // cr --search, in a recorded session
+std::string      g_recordPath;
+bool             g_fSearchMode = false;
+
+bool        g_fJson     = false;
+std::string g_jsonPath;              // empty for stdout
+HANDLE      g_hJsonFile = INVALID_HANDLE_VALUE;
+
+std::string  g_serveName;            // --serve, run as the server of this name
+std::string  g_serverName;           // --server, run the child through this server
+CRelayClient g_client;
+DWORD        g_dwStartup_ms = 0;     // from our start until the child was started, for --stats
 
 std::stringstream  g_ssErr;  // used for error message construction
 
 //==================================================================================================
 inline void ExitProgram( int code, std::string const &errMsg ) 
 { 
-    g_fRunThreads = FALSE;
     throw exit_exception( errMsg.c_str(), code );
 }
 
 //==================================================================================================
-inline void ThreadAbortChildProcess( EIoThreadType threadType, 
-	                                 int errCode, std::string const &errMsg )
-{
-    g_threadExceptions[threadType] 
-        = copy_exception( exit_exception( errMsg.c_str(), errCode ) );
-
-    /* force child process to close which will cause the rest of our threads to exit when the child
-     * side pipe handles disconnect.
-	*/
-    g_abortChildEvent.Signal();
-}
-
-//==================================================================================================
-// Get the systems error message associated with dwErrorCode.
-//==================================================================================================
-std::string GetApiErrorString( DWORD dwErrorCode, std::string const& apiNameStr )
-{
-    LPVOID pFormatBuffer;
-
-    ::FormatMessageA( FORMAT_MESSAGE_ALLOCATE_BUFFER|FORMAT_MESSAGE_FROM_SYSTEM,
-                      NULL, dwErrorCode,
-                      MAKELANGID(LANG_NEUTRAL, SUBLANG_DEFAULT),
-                      (LPSTR)&pFormatBuffer, 0, NULL );
-
-    /* remove the trailing \r\n from the returned message */
-    char *pCrlf = ::strchr( (char*)pFormatBuffer, '\r' );
-    if( pCrlf ) { *pCrlf = '\0'; }
-
-    std::stringstream ss;
-    ss << "[WINAPI - " << apiNameStr << "](" << (int)dwErrorCode << ") " << (char*)pFormatBuffer;
-
-    ::LocalFree( pFormatBuffer );
-	return ss.str();
-}
-
+// Ctrl+C and Ctrl+Break are forwarded to the child's process group as a CTRL_BREAK_EVENT (the only
+// event that can be targeted at a group; the child ignores Ctrl+C since it's in its own group).
+// Handling them keeps us alive so the child's output is still relayed while it shuts down.
 //==================================================================================================
-class CIoRedirectionManager
+BOOL WINAPI ConsoleCtrlHandler( DWORD dwCtrlType )
 {
-public:
-	CIoRedirectionManager()
-		: m_hStdOutWrite(0), m_hStdErrWrite(0), m_hStdInRead(0)
-		, m_hStdOutRead(0) , m_hStdErrRead(0) , m_hStdInWrite(0)
-	{ 
-	}
-
-	~CIoRedirectionManager() { DestroyPipeHandles(); }
-	
-	BOOL DestroyPipeHandles()
-	{
-		CLOSEHANDLE( m_hStdOutWrite );
-		CLOSEHANDLE( m_hStdErrWrite );
-		CLOSEHANDLE( m_hStdInRead );
-
-		CLOSEHANDLE( m_hStdOutRead );
-		CLOSEHANDLE( m_hStdErrRead );
-		CLOSEHANDLE( m_hStdInWrite );
-
-		return TRUE;
-	}
-
-	BOOL CreatePipeHandles()
+	if( dwCtrlType == CTRL_C_EVENT || dwCtrlType == CTRL_BREAK_EVENT )
 	{
-		HANDLE hStdOutTmp, hStdErrTmp, hStdInTmp;
-		
-		/* Set up the security attributes and create the child-side io pipe handles.
-		*/
-		SECURITY_ATTRIBUTES sa;
-		sa.nLength              = sizeof(SECURITY_ATTRIBUTES);
-		sa.lpSecurityDescriptor = NULL;
-		sa.bInheritHandle       = TRUE;
-
-		if( !::CreatePipe( &hStdOutTmp, &m_hStdOutWrite, &sa, PIPE_BUFFER_SIZE )
-			|| !::CreatePipe( &hStdErrTmp, &m_hStdErrWrite, &sa, PIPE_BUFFER_SIZE )
-			|| !::CreatePipe( &m_hStdInRead, &hStdInTmp,    &sa, PIPE_BUFFER_SIZE ) ) 
-		{ 
-            g_ssErr.str("");
-            g_ssErr << "Could not create chid-side pipe handles. " 
-                    << GetApiErrorString( ::GetLastError(), "CreatePipe" );
-			
-            ExitProgram( CR_STATUS_WINAPI, g_ssErr.str() );
-		}
-
-		/* Create copies of the parent-side pipe handles with Properties set to FALSE to prevent
-		 * them from being inherited by the child process and making them uncloseable.
-		*/
-		HANDLE hProcess = ::GetCurrentProcess();
-		if( !::DuplicateHandle( hProcess, hStdOutTmp, hProcess, &m_hStdOutRead, 0, FALSE, DUPLICATE_SAME_ACCESS )
-			|| !::DuplicateHandle( hProcess, hStdErrTmp, hProcess, &m_hStdErrRead, 0, FALSE, DUPLICATE_SAME_ACCESS )
-			|| !::DuplicateHandle( hProcess, hStdInTmp, hProcess, &m_hStdInWrite, 0, FALSE, DUPLICATE_SAME_ACCESS ) ) 
+		if( g_client.IsServed() ) 
 		{ 
-            DWORD dwLastError = ::GetLastError();
-			
-            g_ssErr.str("");
-            g_ssErr << "Could not create chid-side pipe handles. " 
-                    << GetApiErrorString( dwLastError, "DuplicateHandle" );
-			
-            DestroyPipeHandles();
-            ExitProgram( CR_STATUS_WINAPI, g_ssErr.str() );
+			g_client.Break(); 
+			return TRUE; 
 		}
 
-		/* Now that a duplicate set of parent-side pipe handles have been created, close the 
-		 * original handles to prevent them from being inhereted by the child process.
-		*/
-		CLOSEHANDLE( hStdOutTmp );
-		CLOSEHANDLE( hStdErrTmp );
-		CLOSEHANDLE( hStdInTmp );
-
-		return TRUE;
-	}
-
-	BOOL CloseChildSidePipeHandles()
-	{
-		/* Close child-side pipe handles to make sure that no handles to the pipes are maintained
-		 * in this process or else the pipe will not close when the child process exits and the 
-		 * ReadFile will hang. 
-		 *
-		 * Note: This function should be called right after the child process has been created in a
-		 * suspended state and before it is resumed.
-		*/
-		CLOSEHANDLE( m_hStdOutWrite );
-		CLOSEHANDLE( m_hStdErrWrite );
-		CLOSEHANDLE( m_hStdInRead );
+		g_fileSource.Abort();    // cr --file, stop after the chunk being rendered
+		g_fileFollower.Abort();  // cr --follow
 
+		DWORD dwChildGroupId = g_relay.GetChildProcessId();
+		if( dwChildGroupId ) { ::GenerateConsoleCtrlEvent( CTRL_BREAK_EVENT, dwChildGroupId ); }
 		return TRUE;
 	}
-
-	HANDLE GetStdOutWrite() { return m_hStdOutWrite; }
-	HANDLE GetStdErrWrite() { return m_hStdErrWrite; }
-	HANDLE GetStdInRead()   { return m_hStdInRead; }
-	
-	HANDLE GetStdOutRead()  { return m_hStdOutRead; }
-	HANDLE GetStdErrRead()  { return m_hStdErrRead; }
-	HANDLE GetStdInWrite()  { return m_hStdInWrite; }
-
-private:
-	HANDLE m_hStdOutWrite, m_hStdErrWrite, m_hStdInRead;  // child-side handles
-	HANDLE m_hStdOutRead,  m_hStdErrRead,  m_hStdInWrite; // parent-side handles
-};
+	return FALSE;
+}
 
 //==================================================================================================
 void ShowHelp()
@@ -285,42 +168,191 @@ void ShowHelp()
 	}
 }
 
+//==================================================================================================
+// Options accepted in CR_OPTS and the CR_CONFIG file. Every long option maps onto the short option
+// character it duplicates, so both forms are handled by the same case in ProcessCommandLine.
+//==================================================================================================
+#define CR_SHORT_OPTS    "e:lo:s"
+
+enum ECrLongOnlyOpts 
+{ 
+	OptShutdownGrace = 256, OptShutdownKill, OptLinger, OptStats, OptOrdered, 
+	OptMaxLines, OptMaxBytes, OptCollapse, OptProgress, OptStormKeep, OptRule, OptJson, OptServe,
+	OptServer, OptIoEngine, OptVt, OptPager, OptRecord
+};
+
+static optutils::optparse_longopt const s_crLongOpts[] =
+{
+	{ "stderr",        optutils::OPTPARSE_REQUIRED, 0, 'e' },
+	{ "line-mode",     optutils::OPTPARSE_NONE,     0, 'l' },
+	{ "stdout",        optutils::OPTPARSE_REQUIRED, 0, 'o' },
+	{ "skip-last-eol", optutils::OPTPARSE_NONE,     0, 's' },
+
+	{ "shutdown-grace", optutils::OPTPARSE_REQUIRED, 0, OptShutdownGrace },
+	{ "shutdown-kill",  optutils::OPTPARSE_REQUIRED, 0, OptShutdownKill },
+	{ "linger",         optutils::OPTPARSE_REQUIRED, 0, OptLinger },
+	{ "stats",          optutils::OPTPARSE_NONE,     0, OptStats },
+	{ "ordered",        optutils::OPTPARSE_OPTIONAL, 0, OptOrdered },
+	{ "max-lines",      optutils::OPTPARSE_REQUIRED, 0, OptMaxLines },
+	{ "max-bytes",      optutils::OPTPARSE_REQUIRED, 0, OptMaxBytes },
+	{ "collapse",       optutils::OPTPARSE_NONE,     0, OptCollapse },
+	{ "progress",       optutils::OPTPARSE_OPTIONAL, 0, OptProgress },
+	{ "storm-keep",     optutils::OPTPARSE_REQUIRED, 0, OptStormKeep },
+	{ "rule",           optutils::OPTPARSE_REQUIRED, 0, OptRule },
+	{ "json",           optutils::OPTPARSE_OPTIONAL, 0, OptJson },
+	{ "serve",          optutils::OPTPARSE_REQUIRED, 0, OptServe },
+	{ "server",         optutils::OPTPARSE_REQUIRED, 0, OptServer },
+	{ "io-engine",      optutils::OPTPARSE_REQUIRED, 0, OptIoEngine },
+	{ "vt",             optutils::OPTPARSE_REQUIRED, 0, OptVt },
+	{ "pager",          optutils::OPTPARSE_NONE,     0, OptPager },
+	{ "record",         optutils::OPTPARSE_REQUIRED, 0, OptRecord },
+	OPTPARSE_LONGOPT_LAST
+};
+
+//==================================================================================================
+// Returns the argument of the option just parsed, exiting with a usage error if it has none.
+//==================================================================================================
+static char const* RequireArg( optutils::optparse_info const &optInfo, char const *name )
+{
+	if( optInfo.optarg == NULL )
+	{
+		g_ssErr.str("");
+		g_ssErr << "Option '" << name << "' requires an argument.";
+		ExitProgram( CR_STATUS_ERROR, g_ssErr.str() );
+	}
+	return optInfo.optarg;
+}
+
 //==================================================================================================
 bool ProcessCommandLine( char const *options )
 {
-	bool fIntensify = false;
-	
-	int  argc;
-	char **argv = utils::CommandLineToArgvA( options, &argc );
+	/* Split a private copy of the options in place. An argv of (length/2 + 2) entries can always 
+	 * hold every argument.
+	*/
+	std::vector<char>  cmdLine( options, options + ::strlen( options ) + 1 );
+	std::vector<char*> argv( cmdLine.size() / 2 + 2 );
+
+	SRelayOptions   &relayOpts   = g_relay.Options();
+	SConsoleOptions &consoleOpts = g_consoleSink.Options();
 
 	int opt;
     optutils::optparse_info optInfo;
-    optutils::optparse_init( &optInfo, argv );
-	optInfo.optind = 0; /* we don't have a program name in argv[0] so start options at index 0 */
-	while( (opt = optutils::optparse( &optInfo, "e:lo:s" )) != EOF )
+    optutils::optparse_init( &optInfo, &cmdLine[0], &argv[0], (int)argv.size() );
+	while( (opt = optutils::optparse_long( &optInfo, CR_SHORT_OPTS, s_crLongOpts, NULL )) != EOF )
 	{
 		switch( opt )
 		{
 			case 'e': { // stderr color
+				char const *arg = RequireArg( optInfo, "-e" );
 				int val;
-				if( *optInfo.optarg == '$' ) { ::sscanf( &optInfo.optarg[1], "%x", &val ); }
-				else                         { val = ::atoi( optInfo.optarg ); }
-				g_serrColor = (WORD)(val & 0xFF );
+				if( *arg == '$' ) { ::sscanf( &arg[1], "%x", &val ); }
+				else              { val = ::atoi( arg ); }
+				consoleOpts.stderrAttr = (WORD)(val & 0xFF );
 			} break;
 
 			case 'l':   // line mode
-				g_fLineMode = true;
+				consoleOpts.fLineMode = true;
 				break;
 
 			case 'o': { // stdout color
+				char const *arg = RequireArg( optInfo, "-o" );
 				int val;
-				if( *optInfo.optarg == '$' ) { ::sscanf( &optInfo.optarg[1], "%x", &val ); }
-				else                         { val = ::atoi( optInfo.optarg ); }
-				g_soutColor = (WORD)val;
+				if( *arg == '$' ) { ::sscanf( &arg[1], "%x", &val ); }
+				else              { val = ::atoi( arg ); }
+				consoleOpts.stdoutAttr = (WORD)val;
 			} break;
 
 			case 's':   // skip coloring last newline
-				g_fSkipLastEol = true;
+				consoleOpts.fSkipLastEol = true;
+				break;
+
+			case OptShutdownGrace: // ms between CTRL_BREAK and terminating the child tree on abort
+				relayOpts.dwShutdownGrace = (DWORD)::strtoul( RequireArg( optInfo, "--shutdown-grace" ), NULL, 10 );
+				break;
+
+			case OptShutdownKill:  // ms to wait for the terminated child tree to exit
+				relayOpts.dwShutdownKill = (DWORD)::strtoul( RequireArg( optInfo, "--shutdown-kill" ), NULL, 10 );
+				break;
+
+			case OptLinger:        // ms the child's tree may outlive the child
+				relayOpts.dwTreeLinger = (DWORD)::strtoul( RequireArg( optInfo, "--linger" ), NULL, 10 );
+				break;
+
+			case OptStats:         // print a resource usage summary at exit
+				g_fShowStats = true;
+				break;
+
+			case OptOrdered:       // merge stdout/stderr in read order, optional reorder window in ms
+				relayOpts.fOrdered = true;
+				if( optInfo.optarg ) { relayOpts.dwOrderWindow = (DWORD)::strtoul( optInfo.optarg, NULL, 10 ); }
+				break;
+
+			case OptMaxLines:      // lines/s written to the console per stream
+				relayOpts.dwMaxLines = (DWORD)::strtoul( RequireArg( optInfo, "--max-lines" ), NULL, 10 );
+				break;
+
+			case OptMaxBytes:      // bytes/s written to the console per stream
+				relayOpts.dwMaxBytes = (DWORD)::strtoul( RequireArg( optInfo, "--max-bytes" ), NULL, 10 );
+				break;
+
+			case OptCollapse:      // collapse repeated lines
+				relayOpts.fCollapse = true;
+				break;
+
+			case OptProgress:      // redraw lines rewritten in place at most 30 (or the given) times/s
+				relayOpts.dwProgressRate = optInfo.optarg ? (DWORD)::strtoul( optInfo.optarg, NULL, 10 ) : 30;
+				break;
+
+			case OptStormKeep:     // suppressed lines to show after the report
+				relayOpts.dwStormKeep = (DWORD)::strtoul( RequireArg( optInfo, "--storm-keep" ), NULL, 10 );
+				break;
+
+			case OptRule: {        // attr:pattern, color occurrences of pattern with attr
+				char const            *arg = RequireArg( optInfo, "--rule" );
+				char const            *pEnd;
+				colorutils::text_attr  attr;
+				if( !colorutils::parse_attr( arg, &pEnd, attr ) )
+				{
+					g_ssErr.str("");
+					g_ssErr << "Invalid --rule attribute '" << arg << "'.";
+					ExitProgram( CR_STATUS_ERROR, g_ssErr.str() );
+				}
+				if( *pEnd == ':' ) { g_classifier.AddRule( pEnd + 1, attr ); }
+			} break;
+
+			case OptJson:          // write JSON lines records, to stdout or the given file
+				g_fJson    = true;
+				g_jsonPath = optInfo.optarg ? optInfo.optarg : "";
+				break;
+
+			case OptServe:         // run as the server of the given name
+				g_serveName = RequireArg( optInfo, "--serve" );
+				break;
+
+			case OptServer:        // run the child through the server of the given name if it's up
+				g_serverName = RequireArg( optInfo, "--server" );
+				break;
+
+			case OptIoEngine: {    // how the child's output is read, threads or iocp
+				std::string engine( RequireArg( optInfo, "--io-engine" ) );
+				if( engine == "threads" )   { relayOpts.eIoEngine = IoEngineThreads; }
+				else if( engine == "iocp" ) { relayOpts.eIoEngine = IoEngineIocp; }
+			} break;
+
+			case OptVt: {          // the child's escape sequences: pass, strip, translate or merge
+				std::string mode( RequireArg( optInfo, "--vt" ) );
+				if( mode == "pass" )           { consoleOpts.eVtMode = VtPass; }
+				else if( mode == "strip" )     { consoleOpts.eVtMode = VtStrip; }
+				else if( mode == "translate" ) { consoleOpts.eVtMode = VtTranslate; }
+				else if( mode == "merge" )     { consoleOpts.eVtMode = VtMerge; }
+			} break;
+
+			case OptPager:         // page through the output instead of writing it to the console
+				g_fPager = true;
+				break;
+
+			case OptRecord:        // record the session, with a search index, to the given file
+				g_recordPath = RequireArg( optInfo, "--record" );
 				break;
 
 			default:
@@ -331,464 +363,371 @@ bool ProcessCommandLine( char const *options )
 
 	/* ignore any extra arguments */
 
-    if( argv ) { ::LocalFree( argv ); }
 	return true;
 }
 
 //==================================================================================================
-int main( int argc, char **argv )
+// Read options from the file named by the CR_CONFIG environment variable. The file uses the same
+// syntax as CR_OPTS spread over any number of lines, where lines whose first non-blank character is
+// '#' are comments. The whole file is joined and parsed in a single pass.
+//==================================================================================================
+bool ProcessConfigFile( char const *path )
 {
-	CIoRedirectionManager ioMgr;
-	PROCESS_INFORMATION   pi;
-	SOutputThreadInfo     otiStdOut, otiStdErr;
-    
-	HANDLE  hThreads[3] = {0};
-	int     errLevel = 0;
-
-	/* If app is ran without options, display help and exit.
-	*/
-	if( argc == 1 ) { ShowHelp(); return 0; }
+	std::ifstream file( path, std::ios::in | std::ios::binary );
+	if( !file )
+	{
+		g_ssErr.str("");
+		g_ssErr << "Could not open configuration file '" << path << "' given by CR_CONFIG.";
 
-	try
+		ExitProgram( CR_STATUS_ERROR, g_ssErr.str() );
+	}
+
+	std::string options, line;
+	while( std::getline( file, line ) )
 	{
-		/* Get std input handle so you can close it and force the ReadFile() to fail when you want
-			* the input thread to exit.
-		*/
-		if( (g_hStdIn = ::GetStdHandle( STD_INPUT_HANDLE )) == INVALID_HANDLE_VALUE )
-		{
-			g_ssErr.str("");
-			g_ssErr << "Could not get standard input handle. " 
-					<< GetApiErrorString( ::GetLastError(), "GetStdHandle" );
-			
-			ExitProgram( CR_STATUS_WINAPI, g_ssErr.str() );
-		}
+		size_t first = line.find_first_not_of( " \t\r" );
+		if( first == std::string::npos || line[first] == '#' ) { continue; }
 
-		/* Parse CR_OPTS environment variable and set global options accordingly. If CR_OPTS does not
-		 * exist, add it to the environment and configure global option with the default values.
-		*/
-		char const *pCrOpts = ::getenv( "CR_OPTS" );
-		if( NULL == pCrOpts )
-		{
-			char options[20];
-			::sprintf( options, "CR_OPTS=-e%d", conutils::red );
-			//::sprintf( options, "CR_OPTS=-e%d -l -s", FOREGROUND(conutils::red) | BACKGROUND(conutils::white) );
-			::_putenv( options );
-			pCrOpts = ::getenv( "CR_OPTS" );
-		}
-		ProcessCommandLine( pCrOpts );
+		size_t last = line.find_last_not_of( " \t\r" );
+		options.append( line, first, last - first + 1 );
+		options += ' ';
+	}
 
-		/* Create parent-side and client-side pipe handles
-		*/
-		ioMgr.CreatePipeHandles();
+	return ProcessCommandLine( options.c_str() );
+}
 
-		/* Construct target application's command line by skipping over our application name.
-		*/
-		bool    fInQuote = false;
-		wchar_t *cmdLineArgs = ::GetCommandLineW();
+//==================================================================================================
+// Print the --stats summary for the child's process tree, and the relay itself, to stderr.
+//==================================================================================================
+void PrintStats()
+{
+	SResourceUsage usage;
+	double const   MB      = 1024.0 * 1024.0;
+	bool const     fServed = g_client.IsServed();
 
-		if( *cmdLineArgs == L'\"' ) { fInQuote = true; cmdLineArgs++; }
-		while( *cmdLineArgs )
-		{
-			if( fInQuote && *cmdLineArgs == L'\"' ) { cmdLineArgs++; fInQuote = false; }
-			if( !fInQuote && *cmdLineArgs == L' ' ) 
-			{ 
-				while( *cmdLineArgs == L' ' ) { cmdLineArgs++; }
-				break; 
-			}
-			cmdLineArgs++;
-		}
+	std::cerr << "[cr] startup    : " << g_dwStartup_ms << " ms" 
+	          << (fServed ? " (server " + g_serverName + ")" : std::string()) << "\n";
 
-		/* Launch the process were redirecting in suspended mode so we can start up the stdio
-		 * monitoring threads before resuming it.
-		*/
-		STARTUPINFO si;
-		::ZeroMemory( &si, sizeof(STARTUPINFO) );
-		si.cb         = sizeof(STARTUPINFO);
-		si.dwFlags    = STARTF_USESTDHANDLES;
-		si.hStdOutput = ioMgr.GetStdOutWrite();
-		si.hStdError  = ioMgr.GetStdErrWrite();
-		si.hStdInput  = ioMgr.GetStdInRead();
-
-		if( !::CreateProcessW( NULL, cmdLineArgs, NULL, NULL, TRUE, 
-			                   CREATE_SUSPENDED, NULL, NULL, &si, &pi ) )
-		{
-            g_ssErr.str("");
-            g_ssErr << "Could not create child process. " 
-                    << GetApiErrorString( ::GetLastError(), "CreateProcess" );
-			
-            ExitProgram( CR_STATUS_WINAPI, g_ssErr.str() );
-		}
+	if( g_classifier.HasRules() )
+	{
+		unsigned long long hits    = fServed ? g_client.CacheHits() : g_classifier.CacheHits();
+		unsigned long long lookups = fServed ? g_client.CacheLookups() : g_classifier.CacheLookups();
+		std::cerr << std::fixed << std::setprecision( 1 )
+		          << "[cr] rule cache : " << hits << " of " << lookups << " lines ("
+		          << (lookups ? 100.0 * hits / lookups : 0.0) << "% hits)\n";
+	}
 
-		/* Close child-side pipe handles as they are no longer needed in parent-side.
-		*/
-		ioMgr.CloseChildSidePipeHandles();
-
-		/* Lauch the monitoring threads for child stdio. When the child process exits, the write
-		 * end of the output pipes should close causing ReadFile() to return ERROR_BROKEN_PIPE,
-		 * causing the output monitoring threads to exit. In order to signal that the input
-		 * monitoring thread should shut down, we just need to close the std input handle gotten
-		 * earilier. This causes ReadConsole to return with a nonzero (success) result with 
-		 * lpNumberOfCharsRead set to zero. The subsequent WriteFile will then immediatly fail
-		 * with ERROR_NO_DATA causing the thread to exit.
-		*/
-		DWORD dwThreadId;
-		otiStdOut.hReadPipe = ioMgr.GetStdOutRead();
-		otiStdOut.eType     = StdOutRead;
-		otiStdErr.hReadPipe = ioMgr.GetStdErrRead();
-		otiStdErr.eType     = StdErrRead;
-
-        if( !(hThreads[1] = CreateThread( NULL, 0, ReadAndPutOutputThread, 
-			                              (LPVOID)&otiStdOut, 0, &dwThreadId ))
-            || !(hThreads[2] = CreateThread( NULL, 0, ReadAndPutOutputThread, 
-			                                 (LPVOID)&otiStdErr, 0, &dwThreadId )) )
-        {
-            g_ssErr.str("");
-            g_ssErr << "Could not create monitoring threads for child stdout/stderr. " 
-                    << GetApiErrorString( ::GetLastError(), "CreateThread" );
-			
-            ExitProgram( CR_STATUS_WINAPI, g_ssErr.str() );
-        }
-
-        /* Create the stdin thread last so its ReadFile() on stdin is not done untill the other
-         * threads have been created successfully. 
-        */
-		hThreads[0] = CreateThread( NULL, 0, GetAndWriteInputThread, (LPVOID)ioMgr.GetStdInWrite(), 0, &dwThreadId );
-		if( !hThreads[0] ) 
-        { 
-            g_ssErr.str("");
-            g_ssErr << "Could not create monitoring thread for parent stdin. " 
-                    << GetApiErrorString( ::GetLastError(), "CreateThread" );
-			
-            ExitProgram( CR_STATUS_WINAPI, g_ssErr.str() );
-        }
-
-		/* Resume child process and wait for it to exit.
-		*/
-		ResumeChildAndWaitForExit( pi, 5000 );
+	if( g_fFileMode )
+	{
+		std::cerr << std::fixed << std::setprecision( 1 )
+		          << "[cr] file       : " << g_fileSource.Bytes() / MB << " MB in " 
+		          << g_fileSource.Chunks() << " chunks" << std::endl;
+		return;
+	}
 
-		/* Redirection is complete so force the stdin thread to exit by closing the stdin handle.
-		*/
-		::CloseHandle( g_hStdIn );
+	if( g_fSearchMode )
+	{
+		std::cerr << "[cr] search     : " << g_search.Matches() << " matches, " << g_search.Compared()
+		          << " of " << g_search.Lines() << " lines compared (" << g_search.Segments() 
+		          << " index segments, " << g_search.Unindexed() << " lines not indexed)" << std::endl;
+		return;
+	}
 
-		/* Signal threads to stop monitoring for child process i/o and wait for the threads to die.
-		*/
-		g_fRunThreads = FALSE;
-		if( ::WaitForMultipleObjects( 3, &hThreads[0], TRUE, INFINITE ) == WAIT_FAILED )
-		{ 
-            g_ssErr.str("");
-            g_ssErr << "Failed waiting for monitor threads to die. " 
-                    << GetApiErrorString( ::GetLastError(), "WaitForMultipleObjects" );
-			
-            ExitProgram( CR_STATUS_WINAPI, g_ssErr.str() );
-		}
+	if( g_fFollowMode )
+	{
+		std::cerr << std::fixed << std::setprecision( 1 )
+		          << "[cr] followed   : " << g_fileFollower.Bytes() / MB << " MB from " 
+		          << g_fileFollower.Files() << " files" << std::endl;
+		return;
+	}
 
-        /* Rethrow transported exceptions from threads
-		*/
-        for( int i = 0; i < NUM_EIOTHREADTYPES; i++ )
-        {
-            if( !(g_threadExceptions[i] == nullptr) ) 
-            { 
-                rethrow_exception( g_threadExceptions[i] ); 
-            }
-        }
-
-        DWORD dwExitCode;
-		if( 0 == ::GetExitCodeProcess( pi.hProcess, &dwExitCode ) )
-		{
-            g_ssErr.str("");
-            g_ssErr << "Exit code for child processes in unavailiable. " 
-                    << GetApiErrorString( ::GetLastError(), "GetExitCodeProcess" );
-			
-            ExitProgram( CR_STATUS_WINAPI, g_ssErr.str() );
-		}
-        errLevel = (int)dwExitCode;
+	if( !g_recordPath.empty() && !fServed )
+	{
+		std::cerr << std::fixed << std::setprecision( 1 )
+		          << "[cr] recorded   : " << g_recorder.Lines() << " lines, " << g_recorder.Bytes() / MB 
+		          << " MB (" << g_recorder.Segments() << " index segments)\n";
 	}
-	catch( exit_exception& except )
+
+	if( g_fPager )
 	{
-		errLevel = 255; /* note: largest dos error level is 255 */
-        std::cerr << "(" << except.code() << ") " << except.what() << std::endl;
+		std::cerr << std::fixed << std::setprecision( 1 )
+		          << "[cr] paged      : " << g_pager.Lines() << " lines, " << g_pager.Bytes() / MB 
+		          << " MB spooled (indexed every " << g_pager.Step() << " lines)\n";
 	}
 
-	conutils::console.set_attribute( g_defaultAttr );
+	if( !fServed )
+	{
+		SRelayIoStats io;
+		g_relay.GetIoStats( io );
+		std::cerr << std::fixed << std::setprecision( 1 )
+		          << "[cr] relay i/o  : " << io.ullBytes / MB << " MB in " << io.ullCalls << " calls ("
+		          << (io.ullBytes ? io.ullCalls / (io.ullBytes / MB) : 0.0) << " per MB, "
+		          << (g_relay.Options().eIoEngine == IoEngineIocp ? "iocp" : "threads") << ")\n";
+	}
 
-	/* Cleanup any open handles for stdio, monitor threads or the child process.
+	/* Latency of the output from being read to being rendered, p50/p99/p999 per stream.
 	*/
-	ioMgr.DestroyPipeHandles();
-	for( int i=0; i < 3; i++ ) { CLOSEHANDLE( hThreads[i] ); }
-	CLOSEHANDLE( pi.hThread );
-	CLOSEHANDLE( pi.hProcess );
+	SRelayLatencyStats latency;
+	if( fServed ) { g_client.GetLatency( latency ); }
+	else          { g_relay.GetLatency( latency ); }
+	for( int i = StdOutRead; i <= StdErrRead; i++ )
+	{
+		SLatencyPercentiles const *kinds[3] = { &latency.endToEnd[i], &latency.queued[i], &latency.render[i] };
+		char const                *names[3] = { "", "queued ", "render " };
+		if( !kinds[0]->ullCount ) { continue; }
 
-	return errLevel;
+		std::cerr << std::fixed << std::setprecision( 2 )
+		          << (i == StdOutRead ? "[cr] out latency: " : "[cr] err latency: ");
+		for( int k = 0; k < 3; k++ )
+		{
+			std::cerr << (k ? ", " : "") << names[k] << kinds[k]->p50 / 1000.0 << "/" 
+			          << kinds[k]->p99 / 1000.0 << "/" << kinds[k]->p999 / 1000.0 << " ms";
+		}
+		std::cerr << " (p50/p99/p999 of " << kinds[0]->ullCount << " chunks)\n";
+	}
+
+	if( !(fServed ? g_client.GetResourceUsage( usage ) : g_relay.GetResourceUsage( usage )) ) { return; }
+
+	std::cerr << std::fixed << std::setprecision( 3 )
+	          << "[cr] processes  : " << usage.dwProcesses << "\n"
+	          << "[cr] cpu time   : " << usage.ullUserTime / 1e7 << "s user, " 
+	                                  << usage.ullKernelTime / 1e7 << "s kernel\n"
+	          << std::setprecision( 1 )
+	          << "[cr] peak memory: ";
+	if( usage.ullPeakMemory ) { std::cerr << usage.ullPeakMemory / MB << " MB\n"; }
+	else                      { std::cerr << "n/a\n"; }
+	std::cerr << "[cr] i/o        : " << usage.ullReadBytes / MB << " MB read, " 
+	                                  << usage.ullWriteBytes / MB << " MB written" << std::endl;
 }
 
 //==================================================================================================
-// Callback used by the call to EnumWindows() in ResumeChildAndWaitForExit.
+// Milliseconds since this process was created.
 //==================================================================================================
-BOOL CALLBACK TerminateChildEnum( HWND hwnd, LPARAM lParam )
+DWORD MsSinceStart()
 {
-    DWORD dwID ;
-    ::GetWindowThreadProcessId( hwnd, &dwID ) ;
-    if( dwID == (DWORD)lParam ) { ::PostMessage( hwnd, WM_CLOSE, 0, 0 ); }
+	FILETIME ftCreate, ftExit, ftKernel, ftUser, ftNow;
 
-    return TRUE ;
+	if( !::GetProcessTimes( ::GetCurrentProcess(), &ftCreate, &ftExit, &ftKernel, &ftUser ) ) { return 0; }
+	::GetSystemTimeAsFileTime( &ftNow );
+
+	ULONGLONG ullCreate = ((ULONGLONG)ftCreate.dwHighDateTime << 32) | ftCreate.dwLowDateTime;
+	ULONGLONG ullNow    = ((ULONGLONG)ftNow.dwHighDateTime << 32) | ftNow.dwLowDateTime;
+	return (DWORD)((ullNow - ullCreate) / 10000);
 }
 
 //==================================================================================================
-// Resume child process and wait for it to exit. If an error in one of our monitoring threads
-// occurs, an abort event will be signaled indicating we should request the child process exit. If
-// this request fails try force the termination of the child process. 
-//
-// This function always returns TRUE. If the child process cannot be resumed or it can't force the
-// child process to exit when requested, an exit_exception is thrown.
+// cr --search <session> [--stdout|--stderr] [--from <time>] [--to <time>] <text>
 //==================================================================================================
-BOOL ResumeChildAndWaitForExit( PROCESS_INFORMATION& piChild, DWORD dwTimeoutOnceSignaled_ms )
+SSearchQuery ParseSearchArgs( int argc, char **argv )
 {
-	HANDLE hWaitHandles[2];
-
-	hWaitHandles[0] = g_abortChildEvent;
-	hWaitHandles[1] = piChild.hThread;
-
-	if( (DWORD)-1 == ::ResumeThread( piChild.hThread ) ) 
-    { 
-        g_ssErr.str("");
-        g_ssErr << "Could not resume child process. " 
-                << GetApiErrorString( ::GetLastError(), "ResumeThread" );
-			
-        ExitProgram( CR_STATUS_WINAPI, g_ssErr.str() );
-    }
-	
-	DWORD dwStatus = ::WaitForMultipleObjects( 2, hWaitHandles, FALSE, INFINITE );
-	if( dwStatus == WAIT_FAILED ) 
-    { 
-        g_ssErr.str("");
-        g_ssErr << "Failed waiting for child process to exit. " 
-                << GetApiErrorString( ::GetLastError(), "WaitForMultipleObjects" );
-			
-        ExitProgram( CR_STATUS_WINAPI, g_ssErr.str() );
-    }
-
-	if( dwStatus == WAIT_OBJECT_0 )
+	SSearchQuery query;
+
+	int i = 3;
+	for( ; i < argc - 1; i++ )
 	{
-		/* Post WM_CLOSE to all windows whose PID matches our child processes PID
-		*/
-		::EnumWindows((WNDENUMPROC)TerminateChildEnum, (LPARAM)piChild.dwProcessId );
-		if( WAIT_OBJECT_0 != ::WaitForSingleObject( piChild.hThread, dwTimeoutOnceSignaled_ms ) )
-		{
-            if( !::TerminateProcess( piChild.hProcess, 0 ) )
-            {
-                g_ssErr.str("");
-                g_ssErr << "Could not force terminate child process. " 
-                        << GetApiErrorString( ::GetLastError(), "TerminateProcess" );
-			
-                ExitProgram( CR_STATUS_WINAPI, g_ssErr.str() );
-            }
-		} 
+		if( !::strcmp( argv[i], "--stdout" ) )                    { query.fStdErr = false; }
+		else if( !::strcmp( argv[i], "--stderr" ) )               { query.fStdOut = false; }
+		else if( !::strcmp( argv[i], "--from" ) && i < argc - 2 ) { query.from = argv[++i]; }
+		else if( !::strcmp( argv[i], "--to" ) && i < argc - 2 )   { query.to = argv[++i]; }
+		else                                                      { break; }
 	}
 
-	return TRUE;
+	if( i != argc - 1 || !*argv[i] )
+	{
+		ExitProgram( CR_STATUS_ERROR, 
+		             "Usage: cr --search <session> [--stdout|--stderr] [--from <time>] [--to <time>] <text>" );
+	}
+	query.text = argv[i];
+	return query;
 }
 
 //==================================================================================================
-//
+// Settle how output is rendered now that the options are known, and return the sink the output
+// goes to first.
 //==================================================================================================
-char* lineTok( char** begin )
+IRelaySink* StartSinks()
 {
-    if( !begin || !*begin || !**begin ) { return 0; }
-    
-    char* p   = *begin;  
-    
-    /* skip leading newline, adjust begin if \r\r\n is encountered */
-    if( p[0] == '\r' ) 
-    {
-        if( p[1] == '\r' && p[2] == '\n' ) { p+=3; (*begin)++; }
-        else if( p[1] == '\n' )            { p+=2; }
-        else                               { p++; }
-    }
-
-    /* find trailing newline */
-    while( *p )
-    {
-        if( p[0] == '\r' ) 
-		{ 
-			if( p[1] == '\n' || p[1] == '\r' && p[2] == '\n' ) { break; } 
+	IRelaySink *pSink = &g_consoleSink;
+
+	g_classifier.Start();
+	g_consoleSink.Start( ::GetStdHandle( STD_OUTPUT_HANDLE ), &g_vtSink );
+
+	/* With --pager the output is spooled for the pager in place of being written to the console.
+	*/
+	if( g_fPager )
+	{
+		g_pager.Start( g_consoleSink.Options() );
+		pSink = &g_pager;
+	}
+
+	/* With --json the records take the place of the console output, or with --json=file they
+	 * go to the file and the output is rendered to the console (or paged) as well.
+	*/
+	if( g_fJson && g_jsonPath.empty() )
+	{
+		g_jsonSink.Start( ::GetStdHandle( STD_OUTPUT_HANDLE ) );
+		pSink = &g_jsonSink;
+	}
+	else if( g_fJson )
+	{
+		g_hJsonFile = ::CreateFileA( g_jsonPath.c_str(), GENERIC_WRITE, FILE_SHARE_READ, NULL, 
+		                             CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL );
+		if( g_hJsonFile == INVALID_HANDLE_VALUE )
+		{
+			g_ssErr.str("");
+			g_ssErr << "Could not create --json file '" << g_jsonPath << "'. " 
+			        << GetApiErrorString( ::GetLastError(), "CreateFile" );
+
+			ExitProgram( CR_STATUS_WINAPI, g_ssErr.str() );
 		}
-        p++;
-    }
-    
-    return p;
+		g_jsonSink.Start( g_hJsonFile, pSink );
+		pSink = &g_jsonSink;
+	}
+
+	/* Unless they're passed on, escape sequences are taken out before anything else sees the output.
+	 * The pager never passes them, they'd be cut with the lines.
+	*/
+	EVtMode eVtMode = g_consoleSink.Options().eVtMode;
+	if( g_fPager && eVtMode == VtPass ) { eVtMode = VtStrip; }
+	if( eVtMode != VtPass )
+	{
+		g_vtSink.Start( eVtMode, g_consoleSink.OutputAttr( StdOutRead ), g_consoleSink.OutputAttr( StdErrRead ), 
+		                pSink );
+		pSink = &g_vtSink;
+	}
+	return pSink;
 }
 
 //==================================================================================================
-// Monitors the child process and relay output to the consoles stdout/stderr. The thread ends when 
-// the global g_fRunThreads variable is set to false after the main thread has detected that the 
-// child process has exited.
-//
-// If the thread is waiting on a ReadFile() operation to complete, the termination of the child
-// process will result in the child-side pipe handles being closed. This in-turn will cause the
-// blocking ReadFile() operation to complete with a ERROR_BROKEN_PIPE error and the thread to exit.
-//
-// There's a slight hickup when writing to stdout/stderr in that depending on how the child 
-// process writes to its stdout/stderr streams, the ReadFile from this thread could return before
-// all the text from the child stream has be written out. In this case, the thread may have to
-// execute multiple calls to ReadFile to get the remainder of the data. The hickup is where the
-// other thread has also returned from ReadFile and takes ownership of the global mutex before this
-// thread has had a chance to finish reading all of the data from the stream. When this happens the
-// output from the two stream may get mixed up while being sent to the console. The only way I can
-// think to prevent this situation from occuring is to have a single thread which issues 
-// PeekNamedPipe/ReadFile on each stream and only switch which stream is being read from when it 
-// has determined that more data is available.
-//==================================================================================================
-DWORD WINAPI ReadAndPutOutputThread( LPVOID lpvThreadParam )
+int main( int argc, char **argv )
 {
-    BYTE lpBuffer[PIPE_BUFFER_SIZE];
-    DWORD nBytesRead, nBytesWritten;
+	int errLevel = 0;
 
-	WORD outputAttr;
-	WORD lineAttr;
-    
-	SOutputThreadInfo *pOti = (SOutputThreadInfo*)lpvThreadParam;
+	try
+	{
+		/* Parse the CR_CONFIG file and then the CR_OPTS environment variable, so CR_OPTS can override
+		 * the configuration file, and set global options accordingly. If neither exist, add CR_OPTS 
+		 * to the environment and configure global option with the default values.
+		*/
+		char const *pCrConfig = ::getenv( "CR_CONFIG" );
+		if( NULL != pCrConfig ) { ProcessConfigFile( pCrConfig ); }
 
-	HANDLE hPipeRead = pOti->hReadPipe;
-	HANDLE hStdWrite = ::GetStdHandle( STD_OUTPUT_HANDLE );
+		char const *pCrOpts = ::getenv( "CR_OPTS" );
+		if( NULL == pCrOpts && NULL == pCrConfig )
+		{
+			char options[20];
+			::sprintf( options, "CR_OPTS=-e%d", conutils::red );
+			//::sprintf( options, "CR_OPTS=-e%d -l -s", FOREGROUND(conutils::red) | BACKGROUND(conutils::white) );
+			::_putenv( options );
+			pCrOpts = ::getenv( "CR_OPTS" );
+		}
+		if( NULL != pCrOpts ) { ProcessCommandLine( pCrOpts ); }
 
-	if( pOti->eType == StdOutRead )      { outputAttr = g_soutColor; }
-	else if( pOti->eType == StdErrRead ) { outputAttr = g_serrColor; }
+		/* With --serve we become the server of that name, with the options and rules settled once
+		 * for all of its clients. Otherwise, if app is ran without options, display help and exit.
+		*/
+		if( !g_serveName.empty() )
+		{
+			g_classifier.Start();
+			CRelayServer server( g_relay.Options(), g_consoleSink.Options(), g_defaultAttr, g_classifier );
+			server.Run( g_serveName );
+		}
+		if( argc == 1 ) { ShowHelp(); return 0; }
 
-	if( g_fLineMode ) { lineAttr = outputAttr; }
-	else              { lineAttr = g_defaultAttr; }
+		g_fFileMode   = (argc == 3 && !::strcmp( argv[1], "--file" ));
+		g_fFollowMode = (argc >= 3 && !::strcmp( argv[1], "--follow" ));
+		g_fSearchMode = (argc >= 4 && !::strcmp( argv[1], "--search" ));
 
-	if( pOti->eType == StdOutRead )      
-	{ 
-		int i = 0; 
-	}
+		/* The pager pages through a child's output, on a console; otherwise --pager is ignored.
+		*/
+		DWORD dwMode;
+		g_fPager = g_fPager && !g_fFileMode && !g_fFollowMode && !g_fSearchMode 
+		           && !(g_fJson && g_jsonPath.empty())
+		           && ::GetConsoleMode( ::GetStdHandle( STD_INPUT_HANDLE ), &dwMode )
+		           && ::GetConsoleMode( ::GetStdHandle( STD_OUTPUT_HANDLE ), &dwMode );
 
-	DWORD nBytesAvailable = 0;
-    while( 1 )
-    {
-		/* Check to see if we have any more data to read. Need to do this so thread doesn't exit 
-		 * untill all data has been read from pipe. 
+		/* Construct target application's command line by skipping over our application name.
 		*/
-		::PeekNamedPipe( hPipeRead, NULL, NULL, NULL, &nBytesAvailable, NULL );		
-        if( !g_fRunThreads && !nBytesAvailable ) { break; }
-
-        nBytesRead = 0;
-		if( !::ReadFile( hPipeRead, lpBuffer, sizeof(lpBuffer)-1, &nBytesRead, NULL ) || !nBytesRead )
-        {
-            /* ERROR_BROKEN_PIPE means child-side pipe handle has been closed and is the normal
-			 * exit path.
-			*/
-            DWORD dwLastError = ::GetLastError();
-			if( dwLastError != ERROR_BROKEN_PIPE )
-            { 
-                g_ssErr.str("");
-                g_ssErr << "Could not read from output side of " 
-                        << ((pOti->eType == StdOutRead) ? "StdOutRead" : "StdErrRead") << " pipe. " 
-                        << GetApiErrorString( dwLastError, "ReadFile" );
-                
-                ThreadAbortChildProcess( pOti->eType, CR_STATUS_WINAPI, g_ssErr.str() );
-            }
-            break;
-        }
-		lpBuffer[nBytesRead] = 0;
-
-		/* Write lpBuffer to the console one line at a time, where the line termination characters
-		 * of the current line are written with the next line. If there is no 'next line' then just
-		 * the line termination characters are written.
-		 *
-		 * After the text for the current line has been written, the background of the remainder of
-		 * the line is set based on g_fLineMode. If true, the current background attribute is used,
-		 * if false, the default background attribute. On the last line, where just the termination
-		 * characters are written, the background attribute is set based on g_fSkipLastEol. If 
-		 * g_fSkipLastEol is true, the background attribute is set to the default background 
-		 * attribute. if g_fSkipLastEol is false, the current background attribute is used.
+		utils::wcmdline  cmdLine( ::GetCommandLineW(), true );
+		utils::wstrview  appName;
+		cmdLine.next_raw( appName );
+
+		wchar_t *cmdLineArgs = (wchar_t*)cmdLine.tail();
+
+		/* From here on Ctrl+C/Ctrl+Break are forwarded to the child instead of terminating us.
 		*/
-		g_mutex.Enter();
-		conutils::console.set_attribute( outputAttr );
+		::SetConsoleCtrlHandler( ConsoleCtrlHandler, TRUE );
 
-		BYTE *begin = &lpBuffer[0];
-		BYTE *end = (BYTE*)lineTok( (char**)&begin );
+		/* cr --file renders the file in place of a child's output, cr --follow what's appended to
+		 * the files until Ctrl+C, and cr --search the lines of a recorded session that contain the 
+		 * text (exiting with 1 when none does). With --server the child is run by that server when it's up 
+		 * (--json, --pager and --record are always done here). Otherwise run the child process 
+		 * and relay its i/o until it, and its process tree, are done.
+		*/
+		if( g_fFileMode )
+		{
+			g_fileSource.SetSink( StartSinks() );
+			g_dwStartup_ms = MsSinceStart();
+			g_fileSource.Run( argv[2] );
+		}
+		else if( g_fSearchMode )
+		{
+			SSearchQuery query = ParseSearchArgs( argc, argv );
+			g_search.SetSink( StartSinks() );
+			g_dwStartup_ms = MsSinceStart();
+			g_search.Run( argv[2], query );
+			errLevel       = g_search.Matches() ? 0 : 1;
+		}
+		else if( g_fFollowMode )
+		{
+			for( int i = 2; i < argc; i++ ) { g_fileFollower.Add( argv[i] ); }
+			g_fileFollower.SetSink( StartSinks() );
+			g_dwStartup_ms = MsSinceStart();
+			g_fileFollower.Run();
+		}
+		else if(    !g_serverName.empty() && !g_fJson && !g_fPager && g_recordPath.empty() 
+			     && g_client.Connect( g_serverName ) 
+			     && g_client.Run( cmdLineArgs, g_defaultAttr ) )
+		{
+			g_dwStartup_ms = MsSinceStart();
+			errLevel       = (int)g_client.Wait();
+		}
+		else
+		{
+			/* The pager reads the console's input, so the child doesn't get it.
+			*/
+			if( g_fPager ) { g_relay.Options().fForwardStdIn = false; }
 
-        while( end != NULL )
-        {
-			if( !::WriteFile( hStdWrite, begin, (end - begin), &nBytesWritten, NULL ) )
-			{
-				g_ssErr.str("");
-				g_ssErr << "Could not write to " 
-						<< ((pOti->eType == StdOutRead) ? "stdout" : "stderr") << ". " 
-						<< GetApiErrorString( ::GetLastError(), "WriteFile" );
-                
-				ThreadAbortChildProcess( pOti->eType, CR_STATUS_WINAPI, g_ssErr.str() );
-			}
-			begin = end;
-            end = (BYTE*)lineTok( (char**)&begin );
-			
-			conutils::console.clear_eol( lineAttr );
-            
-			if( end == NULL )
+			/* --record records the lines as they're rendered.
+			*/
+			if( !g_recordPath.empty() )
 			{
-				if( nBytesWritten == 2 && g_fSkipLastEol )
-					{ conutils::console.clear_eol( g_defaultAttr ); }
-				else
-					{ conutils::console.clear_eol( lineAttr ); }
+				g_recorder.Start( g_recordPath.c_str() );
+				g_relay.SetLineCallback( CSessionRecorder::LineCallback, &g_recorder );
 			}
-        }
 
-		conutils::console.set_attribute( g_defaultAttr );
-		g_mutex.Leave();
-    }
+			g_relay.SetSink( StartSinks() );
+			g_relay.Run( cmdLineArgs );
+			g_dwStartup_ms = MsSinceStart();
+			errLevel       = (int)(g_fPager ? g_pager.Run( g_relay ) : g_relay.Wait());
+			if( !g_recordPath.empty() ) { g_recorder.Close(); }
+		}
+	}
+	catch( exit_exception& except )
+	{
+		errLevel = 255; /* note: largest dos error level is 255 */
+        std::cerr << "(" << except.code() << ") " << except.what() << std::endl;
+	}
+
+	conutils::console.set_attribute( g_defaultAttr );
 
-	return 1;
-}
+	if( g_fShowStats ) { PrintStats(); }
 
-//==================================================================================================
-// Monitors the console for input and relay std input to the child process. The thread ends when 
-// the global g_fRunThreads variable is set to false. 
-//
-// Because the thread may be waiting on ReadFile() to return when the main thread detects that the
-// child process has exited, the main thread will also close the handle to its std input. When the 
-// std input handle is closed, any pending ReadFile() operation on that handle will complete 
-// setting nBytesRead to 0. This in turn causes the subsequent WriteFile() to fail with
-// ERROR_NO_DATA and allows the thread to exit.
-//==================================================================================================
-DWORD WINAPI GetAndWriteInputThread( LPVOID lpvThreadParam )
-{
-    BYTE read_buff[PIPE_BUFFER_SIZE];
-    DWORD nBytesRead,nBytesWritten;
-	HANDLE hPipeWrite = (HANDLE)lpvThreadParam;
+	g_relay.Close();
+	g_classifier.Stop();
+	if( g_hJsonFile != INVALID_HANDLE_VALUE ) { ::CloseHandle( g_hJsonFile ); }
 
-    /* Get input from our console and send it to child through the pipe.
-	*/
-    while( g_fRunThreads )
-    {
-        if( !::ReadFile( g_hStdIn, read_buff, sizeof(read_buff) - 1, &nBytesRead, NULL ) )
-		{ 
-            g_ssErr.str("");
-            g_ssErr << "Could not read from stdin. " 
-                    << GetApiErrorString( ::GetLastError(), "ReadFile" );
-                
-            ThreadAbortChildProcess( StdInWrite, CR_STATUS_WINAPI, g_ssErr.str() );
-            break;
-        }
-        read_buff[nBytesRead] = 0;
-
-        if( !::WriteFile( hPipeWrite, read_buff, nBytesRead, &nBytesWritten, NULL ) )
-        {
-            /* ERROR_NO_DATA means pipe was closed and is the threads normal exit path.
-			*/
-			DWORD dwLastError = ::GetLastError();
-            if( dwLastError != ERROR_NO_DATA ) 
-            { 
-                g_ssErr.str("");
-                g_ssErr << "Could not write to input side of StdInWrite pipe. " 
-                        << GetApiErrorString( dwLastError, "WriteFile" );
-                
-                ThreadAbortChildProcess( StdInWrite, CR_STATUS_WINAPI, g_ssErr.str() );
-            }
-            break;
-        }
-    }
-
-    return 1;
+	return errLevel;
 }
 
 /* */
\ No newline at end of file
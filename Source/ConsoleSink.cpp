@@ -0,0 +1,393 @@
+/***********************************************************************************************//**
+\file    ConsoleSink.cpp
+\author  hdaniel
+\version $Id$
+
+\brief CConsoleSink, colored rendering of the relayed output (see ConsoleSink.h).
+ 
+\details
+
+Writing a chunk takes m_mutex, so the streams' threads never interleave their attribute changes
+with each other's text. The rendering loop is a template, PutOutputT(), instantiated for each
+combination of line mode, rules and backend and picked once by Start(); the loop for the common
+case (no rules, console backend) has no option tests left in it.
+
+\license
+
+This file is free and unencumbered software released into the public domain.
+
+Anyone is free to copy, modify, publish, use, compile, sell, or distribute this software, either in
+source code form or as a compiled binary, for any purpose, commercial or non-commercial, and by any
+means.
+
+In jurisdictions that recognize copyright laws, the author or authors of this software dedicate any
+and all copyright interest in the software to the public domain. We make this dedication for the 
+benefit of the public at large and to the detriment of our heirs and successors. We intend this 
+dedication to be an overt act of relinquishment in perpetuity of all present and future rights to
+this software under copyright law.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT
+NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND 
+NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+For more information, please refer to <http://unlicense.org/>
+***************************************************************************************************/
+#include <cstring>
+#include <string>
+
+#include <windows.h>
+
+#include "ConsoleSink.h"
+#include "Utils\conutils.h"
+
+/* Not in the Visual Studio 2010 SDK. */
+#ifndef ENABLE_VIRTUAL_TERMINAL_PROCESSING
+#  define ENABLE_VIRTUAL_TERMINAL_PROCESSING  0x0004
+#endif
+
+//==================================================================================================
+//
+//==================================================================================================
+static char* lineTok( char** begin )
+{
+    if( !begin || !*begin || !**begin ) { return 0; }
+    
+    char* p   = *begin;  
+    
+    /* skip leading newline, adjust begin if \r\r\n is encountered */
+    if( p[0] == '\r' ) 
+    {
+        if( p[1] == '\r' && p[2] == '\n' ) { p+=3; (*begin)++; }
+        else if( p[1] == '\n' )            { p+=2; }
+        else                               { p++; }
+    }
+
+    /* find trailing newline */
+    while( *p )
+    {
+        if( p[0] == '\r' ) 
+		{ 
+			if( p[1] == '\n' || p[1] == '\r' && p[2] == '\n' ) { break; } 
+		}
+        p++;
+    }
+    
+    return p;
+}
+
+//==================================================================================================
+// Render backends for PutOutputT(). The console backend colors through the console API with the
+// nearest console attributes, the VT backend writes the attributes' SGR sequences, and the plain
+// backend is used when our stdout isn't a console (redirected to a file or pipe) where there is
+// nothing to color, so the output is written as is.
+//==================================================================================================
+typedef CConsoleSink::SRenderTarget SRenderTarget;
+
+struct SConsoleBackend
+{
+	static void SetAttribute( SRenderTarget &t, colorutils::attr_id attr ) 
+	{ 
+		t.pConsole->set_attribute( t.pAttrs->legacy( attr, t.defaultAttr ) ); 
+	}
+
+	static void ClearEol( SRenderTarget &t, colorutils::attr_id attr )
+	{
+		t.pConsole->clear_eol( t.pAttrs->legacy( attr, t.defaultAttr ) );
+	}
+};
+
+struct SVtBackend
+{
+	static void Write( SRenderTarget &t, std::string const &seq )
+	{
+		DWORD nWritten;
+		::WriteFile( t.hOutput, seq.data(), (DWORD)seq.size(), &nWritten, NULL );
+	}
+
+	static void SetAttribute( SRenderTarget &t, colorutils::attr_id attr )
+	{
+		Write( t, (*t.pAttrs)[attr].sgr );
+		t.current = attr;
+	}
+
+	/* The erase takes the background of the attribute set last, so another attribute is set for it
+	 * and the last one set again.
+	*/
+	static void ClearEol( SRenderTarget &t, colorutils::attr_id attr )
+	{
+		static std::string const s_eraseEol( "\x1b[K" );
+
+		if( attr == t.current ) { Write( t, s_eraseEol ); }
+		else
+		{
+			Write( t, (*t.pAttrs)[attr].sgrEol );
+			Write( t, (*t.pAttrs)[t.current].sgr );
+		}
+	}
+};
+
+struct SPlainBackend
+{
+	static void SetAttribute( SRenderTarget&, colorutils::attr_id ) { }
+	static void ClearEol( SRenderTarget&, colorutils::attr_id )     { }
+};
+
+//==================================================================================================
+// The spans of colors (console attributes) with the spans of rules drawn over them, in order, into
+// out, with the attributes of colors interned in attrs. Both lists are in order and without
+// overlaps of their own.
+//==================================================================================================
+static void OverlaySpans( ruleutils::spans const &colors, ruleutils::spans const &rules, 
+                          colorutils::attr_table &attrs, ruleutils::spans &out )
+{
+	size_t r = 0;
+
+	out.clear();
+	for( size_t c = 0; c < colors.size(); c++ )
+	{
+		size_t pos = colors[c].begin;
+		size_t end = colors[c].begin + colors[c].len;
+
+		while( pos < end )
+		{
+			while( r < rules.size() && rules[r].begin + rules[r].len <= pos ) { out.push_back( rules[r++] ); }
+
+			if( r < rules.size() && rules[r].begin <= pos )
+			{
+				pos = rules[r].begin + rules[r].len;  // covered by the rule
+				continue;
+			}
+
+			size_t stop = (r < rules.size() && rules[r].begin < end) ? rules[r].begin : end;
+			ruleutils::span sp = { pos, stop - pos, attrs.intern_legacy( colors[c].attr ), colors[c].rule };
+			out.push_back( sp );
+			pos = stop;
+		}
+	}
+	out.insert( out.end(), rules.begin() + r, rules.end() );
+}
+
+//==================================================================================================
+// WriteFile() replacement for PutOutputT() when rules are in effect: writes the len bytes at begin,
+// part of the chunk at pChunk, switching to the attribute of each span that falls in them. iSpan is
+// the first of spans not yet fully written.
+//==================================================================================================
+template<class Backend>
+BOOL CConsoleSink::WriteSpans( ruleutils::spans const &spans, BYTE const *pChunk, BYTE const *begin, DWORD len, 
+	                           colorutils::attr_id outputAttr, size_t &iSpan, DWORD *pnWritten )
+{
+	size_t segBegin = begin - pChunk;
+	size_t segEnd   = segBegin + len;
+	size_t pos      = segBegin;
+	DWORD  nWritten;
+
+	*pnWritten = 0;
+	for( ; iSpan < spans.size() && spans[iSpan].begin < segEnd; iSpan++ )
+	{
+		ruleutils::span const &sp = spans[iSpan];
+
+		size_t spBegin = (sp.begin < pos) ? pos : sp.begin;
+		size_t spEnd   = (sp.begin + sp.len > segEnd) ? segEnd : sp.begin + sp.len;
+		if( spBegin >= spEnd ) { continue; }
+
+		if( spBegin > pos )
+		{
+			if( !::WriteFile( m_target.hOutput, pChunk + pos, (DWORD)(spBegin - pos), &nWritten, NULL ) ) { return FALSE; }
+			*pnWritten += nWritten;
+		}
+
+		Backend::SetAttribute( m_target, sp.attr );
+		BOOL fOk = ::WriteFile( m_target.hOutput, pChunk + spBegin, (DWORD)(spEnd - spBegin), &nWritten, NULL );
+		Backend::SetAttribute( m_target, outputAttr );
+		if( !fOk ) { return FALSE; }
+
+		*pnWritten += nWritten;
+		pos = spEnd;
+
+		if( sp.begin + sp.len > segEnd ) { break; }  // rest of the span is in the next segment
+	}
+
+	if( pos < segEnd )
+	{
+		if( !::WriteFile( m_target.hOutput, pChunk + pos, (DWORD)(segEnd - pos), &nWritten, NULL ) ) { return FALSE; }
+		*pnWritten += nWritten;
+	}
+	return TRUE;
+}
+
+//==================================================================================================
+// Write a NUL terminated chunk of stream eType's output with the stream's colors. Returns 0 on 
+// success, or the error of the WriteFile() that failed.
+//
+// The options that shape rendering are template parameters, so each combination compiles to its own
+// loop without option tests. SelectPutOutput() picks the instantiation once options are known and
+// it's called through m_pfnPutOutput.
+//==================================================================================================
+template<bool LineMode, bool SkipLastEol, bool Rules, class Backend>
+DWORD CConsoleSink::PutOutputT( EIoThreadType eType, BYTE *lpBuffer )
+{
+	DWORD               nBytesWritten;
+	colorutils::attr_id defaultAttr = colorutils::attr_table::DEFAULT_ID;
+	colorutils::attr_id outputAttr  = m_outputId[eType];
+	colorutils::attr_id lineAttr    = LineMode ? outputAttr : defaultAttr;
+	DWORD               dwError     = 0;
+	size_t              iSpan       = 0;
+
+	/* Write lpBuffer to the console one line at a time, where the line termination characters
+	 * of the current line are written with the next line. If there is no 'next line' then just
+	 * the line termination characters are written.
+	 *
+	 * After the text for the current line has been written, the background of the remainder of
+	 * the line is set based on LineMode. If true, the current background attribute is used,
+	 * if false, the default background attribute. On the last line, where just the termination
+	 * characters are written, the background attribute is set based on SkipLastEol. If 
+	 * SkipLastEol is true, the background attribute is set to the default background 
+	 * attribute. if SkipLastEol is false, the current background attribute is used.
+	*/
+	ruleutils::spans const *pSpans = NULL;
+	if( Rules )
+	{
+		m_pClassifier->Enter();
+		m_pClassifier->Classify( eType, (char const*)lpBuffer, ::strlen( (char const*)lpBuffer ) );
+
+		pSpans = &m_pClassifier->Spans();
+		if( m_pVt && !m_pVt->Colors( eType ).empty() )
+		{
+			OverlaySpans( m_pVt->Colors( eType ), *pSpans, *m_target.pAttrs, m_overlay );
+			pSpans = &m_overlay;
+		}
+	}
+	m_mutex.Enter();
+	Backend::SetAttribute( m_target, outputAttr );
+
+	BYTE *begin = &lpBuffer[0];
+	BYTE *end = (BYTE*)lineTok( (char**)&begin );
+
+    while( end != NULL )
+    {
+		BOOL fWritten = Rules ? WriteSpans<Backend>( *pSpans, lpBuffer, begin, (DWORD)(end - begin), outputAttr, 
+			                                         iSpan, &nBytesWritten )
+		                      : ::WriteFile( m_target.hOutput, begin, (DWORD)(end - begin), &nBytesWritten, NULL );
+		if( !fWritten )
+		{
+			dwError = ::GetLastError();
+			break;
+		}
+		begin = end;
+        end = (BYTE*)lineTok( (char**)&begin );
+			
+		if( SkipLastEol && end == NULL && nBytesWritten == 2 )
+			{ Backend::ClearEol( m_target, defaultAttr ); }
+		else
+			{ Backend::ClearEol( m_target, lineAttr ); }
+    }
+
+	Backend::SetAttribute( m_target, defaultAttr );
+	m_mutex.Leave();
+	if( Rules )
+	{
+		m_pClassifier->Forget();
+		m_pClassifier->Leave();
+	}
+
+	return dwError;
+}
+
+//==================================================================================================
+// Pick the PutOutputT() instantiation for the given options.
+//==================================================================================================
+CConsoleSink::PutOutputFn CConsoleSink::SelectPutOutput( bool fLineMode, bool fSkipLastEol, bool fRules, EBackend eBackend )
+{
+	/* indexed by [eBackend][fRules][fSkipLastEol][fLineMode] */
+	static PutOutputFn const s_putOutput[NUM_BACKENDS][2][2][2] =
+	{
+		{ { { &CConsoleSink::PutOutputT<false, false, false, SPlainBackend>,   &CConsoleSink::PutOutputT<true, false, false, SPlainBackend> },
+		    { &CConsoleSink::PutOutputT<false, true,  false, SPlainBackend>,   &CConsoleSink::PutOutputT<true, true,  false, SPlainBackend> } },
+		  { { &CConsoleSink::PutOutputT<false, false, true,  SPlainBackend>,   &CConsoleSink::PutOutputT<true, false, true,  SPlainBackend> },
+		    { &CConsoleSink::PutOutputT<false, true,  true,  SPlainBackend>,   &CConsoleSink::PutOutputT<true, true,  true,  SPlainBackend> } } },
+		{ { { &CConsoleSink::PutOutputT<false, false, false, SConsoleBackend>, &CConsoleSink::PutOutputT<true, false, false, SConsoleBackend> },
+		    { &CConsoleSink::PutOutputT<false, true,  false, SConsoleBackend>, &CConsoleSink::PutOutputT<true, true,  false, SConsoleBackend> } },
+		  { { &CConsoleSink::PutOutputT<false, false, true,  SConsoleBackend>, &CConsoleSink::PutOutputT<true, false, true,  SConsoleBackend> },
+		    { &CConsoleSink::PutOutputT<false, true,  true,  SConsoleBackend>, &CConsoleSink::PutOutputT<true, true,  true,  SConsoleBackend> } } },
+		{ { { &CConsoleSink::PutOutputT<false, false, false, SVtBackend>,      &CConsoleSink::PutOutputT<true, false, false, SVtBackend> },
+		    { &CConsoleSink::PutOutputT<false, true,  false, SVtBackend>,      &CConsoleSink::PutOutputT<true, true,  false, SVtBackend> } },
+		  { { &CConsoleSink::PutOutputT<false, false, true,  SVtBackend>,      &CConsoleSink::PutOutputT<true, false, true,  SVtBackend> },
+		    { &CConsoleSink::PutOutputT<false, true,  true,  SVtBackend>,      &CConsoleSink::PutOutputT<true, true,  true,  SVtBackend> } } }
+	};
+
+	return s_putOutput[eBackend][fRules][fSkipLastEol][fLineMode];
+}
+
+
+//==================================================================================================
+CConsoleSink::CConsoleSink( WORD defaultAttr, CRuleClassifier &classifier )
+	: m_options(defaultAttr), m_defaultAttr(defaultAttr), m_dwConsoleMode(0), m_fRestoreMode(false)
+	, m_pfnPutOutput(NULL), m_pClassifier(&classifier), m_pVt(NULL)
+{
+	m_outputAttr[StdOutRead] = m_outputAttr[StdErrRead] = m_defaultAttr;
+	m_outputId[StdOutRead]   = m_outputId[StdErrRead]   = colorutils::attr_table::DEFAULT_ID;
+
+	m_target.hOutput     = NULL;
+	m_target.pConsole    = NULL;
+	m_target.pAttrs      = NULL;
+	m_target.defaultAttr = defaultAttr;
+	m_target.current     = colorutils::attr_table::DEFAULT_ID;
+}
+
+CConsoleSink::~CConsoleSink()
+{
+	if( m_fRestoreMode ) { ::SetConsoleMode( m_target.hOutput, m_dwConsoleMode ); }
+	delete m_target.pConsole;
+}
+
+//==================================================================================================
+// Settle how output is rendered to hOutput now that the options and rules are known. With 
+// VtTranslate the child's colors take the place of -o/-e, so the streams keep the default attribute.
+//
+// Escape sequences are turned on only when an attribute needs them, consoles that don't have them
+// (before Windows 10) show the nearest console colors instead.
+//==================================================================================================
+void CConsoleSink::Start( HANDLE hOutput, CVtSink const *pVt )
+{
+	DWORD dwConsoleMode;
+	bool  fTranslate = (m_options.eVtMode == VtTranslate);
+
+	colorutils::attr_table &attrs = m_pClassifier->Attributes();
+
+	m_target.hOutput         = hOutput;
+	m_target.pAttrs          = &attrs;
+	m_outputAttr[StdOutRead] = fTranslate ? m_defaultAttr : m_options.stdoutAttr;
+	m_outputAttr[StdErrRead] = fTranslate ? m_defaultAttr : m_options.stderrAttr;
+	m_pVt                    = (fTranslate || m_options.eVtMode == VtMerge) ? pVt : NULL;
+
+	for( int i = StdOutRead; i <= StdErrRead; i++ )
+	{
+		m_outputId[i] = (m_outputAttr[i] == m_defaultAttr) ? (colorutils::attr_id)colorutils::attr_table::DEFAULT_ID
+		                                                   : attrs.intern_legacy( m_outputAttr[i] );
+	}
+
+	EBackend eBackend = BackendPlain;
+	if( ::GetConsoleMode( hOutput, &dwConsoleMode ) )
+	{
+		eBackend = BackendConsole;
+		if( !m_target.pConsole ) { m_target.pConsole = new conutils::_tag_console( hOutput ); }
+
+		if( attrs.needs_vt() && !m_fRestoreMode
+		    && ::SetConsoleMode( hOutput, dwConsoleMode | ENABLE_VIRTUAL_TERMINAL_PROCESSING ) )
+		{
+			m_dwConsoleMode = dwConsoleMode;
+			m_fRestoreMode  = true;
+		}
+		if( m_fRestoreMode ) { eBackend = BackendVt; }
+	}
+	m_pfnPutOutput = SelectPutOutput( m_options.fLineMode, m_options.fSkipLastEol, 
+	                                  eBackend != BackendPlain && (m_pClassifier->HasRules() || m_pVt), eBackend );
+}
+
+//==================================================================================================
+DWORD CConsoleSink::Write( EIoThreadType eStream, BYTE *pData, DWORD nBytes )
+{
+	return (this->*m_pfnPutOutput)( eStream, pData );
+}
@@ -0,0 +1,133 @@
+/***********************************************************************************************//**
+\file    ConsoleSink.h
+\author  hdaniel
+\version $Id$
+
+\brief IRelaySink that writes the child's output to our stdout in color.
+
+\details
+
+The rendering half of cr: each stream is written with its own console attribute, optionally colored
+to the end of each line (line mode), and occurrences of --rule patterns are written with the rule's
+attribute. When our stdout isn't a console the output is passed through as is.
+
+Attributes are ids of the classifier's colorutils::attr_table. When a rule has a color the console
+can't show with its 16 colors, and the console processes escape sequences, each attribute change
+writes the attribute's SGR sequence; otherwise it sets the nearest console attribute.
+
+\license
+
+This file is free and unencumbered software released into the public domain.
+
+Anyone is free to copy, modify, publish, use, compile, sell, or distribute this software, either in
+source code form or as a compiled binary, for any purpose, commercial or non-commercial, and by any
+means.
+
+In jurisdictions that recognize copyright laws, the author or authors of this software dedicate any
+and all copyright interest in the software to the public domain. We make this dedication for the
+benefit of the public at large and to the detriment of our heirs and successors. We intend this
+dedication to be an overt act of relinquishment in perpetuity of all present and future rights to
+this software under copyright law.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT
+NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+For more information, please refer to <http://unlicense.org/>
+***************************************************************************************************/
+#ifndef _consolesink_h_
+#define _consolesink_h_
+
+#include <windows.h>
+
+#include "Relay.h"
+#include "RuleClassifier.h"
+#include "VtSink.h"
+#include "Utils\colorutils.h"
+#include "Utils\utils.h"
+
+namespace conutils { class _tag_console; }
+
+//==================================================================================================
+// Rendering options of a CConsoleSink, cr's -o/-e/-l/-s/--vt.
+//==================================================================================================
+struct SConsoleOptions
+{
+	SConsoleOptions( WORD defaultAttr )
+		: stdoutAttr(defaultAttr), stderrAttr(defaultAttr), fLineMode(false), fSkipLastEol(false)
+		, eVtMode(VtPass)
+	{
+	}
+
+	WORD    stdoutAttr;
+	WORD    stderrAttr;
+	bool    fLineMode;     // color to the end of each line
+	bool    fSkipLastEol;  // but not the line after the last one
+	EVtMode eVtMode;       // the child's escape sequences, see CVtSink
+};
+
+//==================================================================================================
+// Options are set up first, then Start() settles how output is rendered and the sink is handed to
+// a CRelay. defaultAttr is the console's attribute to restore after each chunk (and the streams'
+// attribute unless the options say otherwise). Output is colored by the rules of classifier, which
+// must be started before the sink.
+//
+// Unless eVtMode is VtPass the sink is fed by a CVtSink, given to Start(), whose colors are drawn
+// under the rules'. The CVtSink is started with OutputAttr() once the sink is started.
+//==================================================================================================
+class CConsoleSink : public IRelaySink
+{
+public:
+	CConsoleSink( WORD defaultAttr, CRuleClassifier &classifier );
+	~CConsoleSink();
+
+	SConsoleOptions& Options() { return m_options; }
+
+	void Start( HANDLE hOutput, CVtSink const *pVt =NULL );
+
+	WORD OutputAttr( EIoThreadType eStream ) const { return m_outputAttr[eStream]; }
+
+	virtual DWORD Write( EIoThreadType eStream, BYTE *pData, DWORD nBytes );
+
+	/* What the render backends of PutOutputT() draw on.
+	*/
+	enum EBackend { BackendPlain, BackendConsole, BackendVt, NUM_BACKENDS };
+
+	struct SRenderTarget
+	{
+		HANDLE                  hOutput;
+		conutils::_tag_console *pConsole;     // draws on hOutput when it's a console
+		colorutils::attr_table *pAttrs;
+		WORD                    defaultAttr;  // the console's, for the attributes that leave colors to it
+		colorutils::attr_id     current;      // the attribute last set, for BackendVt
+	};
+
+private:
+	typedef DWORD (CConsoleSink::*PutOutputFn)( EIoThreadType eType, BYTE *lpBuffer );
+
+	static PutOutputFn SelectPutOutput( bool fLineMode, bool fSkipLastEol, bool fRules, EBackend eBackend );
+
+	template<bool LineMode, bool SkipLastEol, bool Rules, class Backend>
+	DWORD PutOutputT( EIoThreadType eType, BYTE *lpBuffer );
+
+	template<class Backend>
+	BOOL WriteSpans( ruleutils::spans const &spans, BYTE const *pChunk, BYTE const *begin, DWORD len, 
+	                 colorutils::attr_id outputAttr, size_t &iSpan, DWORD *pnWritten );
+
+	SConsoleOptions         m_options;
+	WORD                    m_defaultAttr;
+	WORD                    m_outputAttr[2];  // indexed by StdOutRead/StdErrRead
+	colorutils::attr_id     m_outputId[2];    // their ids
+	SRenderTarget           m_target;         // where child output is rendered
+	DWORD                   m_dwConsoleMode;  // to restore, when escape sequences were turned on
+	bool                    m_fRestoreMode;
+	PutOutputFn             m_pfnPutOutput;   // see SelectPutOutput()
+	utils::Mutex            m_mutex;          // one chunk is written at a time
+	CRuleClassifier        *m_pClassifier;
+	CVtSink const          *m_pVt;            // the child's own colors, with VtTranslate/VtMerge
+	ruleutils::spans        m_overlay;        // the child's colors with the rules' drawn over them
+};
+
+#endif // _consolesink_h_
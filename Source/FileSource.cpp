@@ -0,0 +1,516 @@
+/***********************************************************************************************//**
+\file    FileSource.cpp
+\author  hdaniel
+\version $Id$
+
+\brief CFileSource, the file mode of cr (see FileSource.h).
+
+\details
+
+Both classes deliver on the thread that calls Run(), which the sinks see as a child's stdout
+thread. Abort() only sets a flag (and, for the follower, posts to its completion port), so it's
+safe to call from the console control handler while Run() is delivering.
+
+\license
+
+This file is free and unencumbered software released into the public domain.
+
+Anyone is free to copy, modify, publish, use, compile, sell, or distribute this software, either in
+source code form or as a compiled binary, for any purpose, commercial or non-commercial, and by any
+means.
+
+In jurisdictions that recognize copyright laws, the author or authors of this software dedicate any
+and all copyright interest in the software to the public domain. We make this dedication for the 
+benefit of the public at large and to the detriment of our heirs and successors. We intend this 
+dedication to be an overt act of relinquishment in perpetuity of all present and future rights to
+this software under copyright law.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT
+NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND 
+NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+For more information, please refer to <http://unlicense.org/>
+***************************************************************************************************/
+#include <sstream>
+#include <string>
+
+#include <windows.h>
+
+#include "FileSource.h"
+
+//==================================================================================================
+static std::stringstream g_ssErr;  // used for error message construction
+
+//==================================================================================================
+inline void FileError( int code, std::string const &errMsg ) 
+{ 
+    throw exit_exception( errMsg.c_str(), code );
+}
+
+//==================================================================================================
+// The file is mapped FILE_VIEW_SIZE bytes at a time, and delivered in chunks of up to 
+// FILE_CHUNK_SIZE bytes; large enough for the classifier to spread each one over its workers.
+//==================================================================================================
+#define FILE_VIEW_SIZE   (64 * 1024 * 1024)
+#define FILE_CHUNK_SIZE  (1024 * 1024)
+
+//==================================================================================================
+CFileSource::CFileSource()
+	: m_pSink(NULL), m_hFile(INVALID_HANDLE_VALUE), m_hMapping(NULL), m_pView(NULL)
+	, m_fAborted(false), m_ullBytes(0), m_ullChunks(0)
+{
+}
+
+CFileSource::~CFileSource()
+{
+	Close();
+}
+
+//==================================================================================================
+void CFileSource::Close()
+{
+	if( m_pView )                         { ::UnmapViewOfFile( m_pView ); m_pView = NULL; }
+	if( m_hMapping )                      { ::CloseHandle( m_hMapping ); m_hMapping = NULL; }
+	if( m_hFile != INVALID_HANDLE_VALUE ) { ::CloseHandle( m_hFile ); m_hFile = INVALID_HANDLE_VALUE; }
+}
+
+//==================================================================================================
+// Hand a chunk of the view to the sink, NUL terminated. The view is copy-on-write, so the byte
+// after the chunk is swapped for a NUL and put back, which copies only the page it's on. The chunk
+// that ends the file has no byte after it and is copied whole.
+//==================================================================================================
+DWORD CFileSource::Deliver( BYTE *pData, DWORD nBytes, bool fLast )
+{
+	m_ullBytes += nBytes;
+	m_ullChunks++;
+
+	if( fLast )
+	{
+		m_last.assign( pData, pData + nBytes );
+		m_last.push_back( 0 );
+		return m_pSink->Write( StdOutRead, &m_last[0], nBytes );
+	}
+
+	BYTE  saved   = pData[nBytes];
+	pData[nBytes] = 0;
+	DWORD dwError = m_pSink->Write( StdOutRead, pData, nBytes );
+	pData[nBytes] = saved;
+	return dwError;
+}
+
+//==================================================================================================
+// Chunks end after the last line that fits in them. A line longer than a chunk is delivered in
+// chunk sized pieces, the classifier matches it across them like a line a child writes in pieces.
+//==================================================================================================
+void CFileSource::Run( char const *path )
+{
+	LARGE_INTEGER size;
+	SYSTEM_INFO   si;
+
+	m_hFile = ::CreateFileA( path, GENERIC_READ, FILE_SHARE_READ|FILE_SHARE_WRITE|FILE_SHARE_DELETE, NULL, 
+	                         OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL );
+	if( m_hFile == INVALID_HANDLE_VALUE || !::GetFileSizeEx( m_hFile, &size ) )
+	{
+		g_ssErr.str("");
+		g_ssErr << "Could not open --file '" << path << "'. " 
+		        << GetApiErrorString( ::GetLastError(), "CreateFile" );
+
+		FileError( CR_STATUS_WINAPI, g_ssErr.str() );
+	}
+
+	/* An empty file can't be mapped, and has nothing to deliver.
+	*/
+	ULONGLONG ullSize = (ULONGLONG)size.QuadPart;
+	if( ullSize && !(m_hMapping = ::CreateFileMappingA( m_hFile, NULL, PAGE_WRITECOPY, 0, 0, NULL )) )
+	{
+		g_ssErr.str("");
+		g_ssErr << "Could not map --file '" << path << "'. " 
+		        << GetApiErrorString( ::GetLastError(), "CreateFileMapping" );
+
+		FileError( CR_STATUS_WINAPI, g_ssErr.str() );
+	}
+
+	::GetSystemInfo( &si );
+	for( ULONGLONG pos = 0; pos < ullSize && !m_fAborted; )
+	{
+		/* Map the view the next chunk starts in. Unless the view ends the file, its last byte is
+		 * left to the next view, as it's where the NUL after a chunk goes.
+		*/
+		ULONGLONG viewBase = pos - pos % si.dwAllocationGranularity;
+		DWORD     viewSize = (ullSize - viewBase > FILE_VIEW_SIZE) ? FILE_VIEW_SIZE : (DWORD)(ullSize - viewBase);
+		bool      fFileEnd = (viewBase + viewSize == ullSize);
+
+		m_pView = (BYTE*)::MapViewOfFile( m_hMapping, FILE_MAP_COPY, (DWORD)(viewBase >> 32), (DWORD)viewBase, viewSize );
+		if( !m_pView )
+		{
+			g_ssErr.str("");
+			g_ssErr << "Could not map --file '" << path << "'. " 
+			        << GetApiErrorString( ::GetLastError(), "MapViewOfFile" );
+
+			FileError( CR_STATUS_WINAPI, g_ssErr.str() );
+		}
+
+		BYTE *p   = m_pView + (pos - viewBase);
+		BYTE *end = m_pView + viewSize - (fFileEnd ? 0 : 1);
+		while( p < end && !m_fAborted )
+		{
+			DWORD n   = (end - p > FILE_CHUNK_SIZE) ? FILE_CHUNK_SIZE : (DWORD)(end - p);
+			BYTE *eol = p + n;
+
+			if( !(fFileEnd && eol == end) )
+			{
+				while( eol > p && eol[-1] != '\n' ) { eol--; }
+
+				/* The view ends in a line that goes on in the next view. */
+				if( eol == p && n < FILE_CHUNK_SIZE ) { break; }
+				if( eol > p )                         { n = (DWORD)(eol - p); }
+			}
+
+			DWORD dwError = Deliver( p, n, fFileEnd && p + n == end );
+			if( dwError )
+			{
+				g_ssErr.str("");
+				g_ssErr << "Could not write to stdout. " << GetApiErrorString( dwError, "WriteFile" );
+
+				FileError( CR_STATUS_WINAPI, g_ssErr.str() );
+			}
+			p += n;
+		}
+
+		pos = viewBase + (p - m_pView);
+		::UnmapViewOfFile( m_pView );
+		m_pView = NULL;
+	}
+
+	Close();
+	m_pSink->EndOfStream( StdOutRead );
+	m_pSink->EndOfStream( StdErrRead );
+}
+
+//==================================================================================================
+// New bytes are read FOLLOW_READ_SIZE at a time. The directories are watched for the changes
+// below; writes show up as size and last write changes, rotation as names changing.
+//==================================================================================================
+#define FOLLOW_READ_SIZE     (256 * 1024)
+#define FOLLOW_NOTIFY_FILTER (FILE_NOTIFY_CHANGE_FILE_NAME|FILE_NOTIFY_CHANGE_SIZE|FILE_NOTIFY_CHANGE_LAST_WRITE)
+
+//==================================================================================================
+CFileFollower::CFileFollower()
+	: m_pSink(NULL), m_hPort(NULL), m_iLastFile((size_t)-1), m_fAborted(false), m_ullBytes(0)
+{
+}
+
+CFileFollower::~CFileFollower()
+{
+	Close();
+}
+
+//==================================================================================================
+// A directory's pending read is cancelled, and its completion waited for, before the directory is
+// freed, as the read writes to it until it completes.
+//==================================================================================================
+void CFileFollower::Close()
+{
+	for( size_t i = 0; i < m_dirs.size(); i++ )
+	{
+		SWatchedDir *pDir = m_dirs[i];
+		if( pDir->fPending && ::CancelIoEx( pDir->hDir, &pDir->ov ) )
+		{
+			DWORD nBytes;
+			::GetOverlappedResult( pDir->hDir, &pDir->ov, &nBytes, TRUE );
+		}
+		::CloseHandle( pDir->hDir );
+		delete pDir;
+	}
+	m_dirs.clear();
+
+	for( size_t i = 0; i < m_files.size(); i++ )
+	{
+		if( m_files[i].hFile != INVALID_HANDLE_VALUE ) { ::CloseHandle( m_files[i].hFile ); }
+		m_files[i].hFile = INVALID_HANDLE_VALUE;
+	}
+
+	if( m_hPort ) { ::CloseHandle( m_hPort ); }
+	m_hPort = NULL;
+}
+
+//==================================================================================================
+// Follow path, and watch its directory unless another file in it is followed already.
+//==================================================================================================
+void CFileFollower::Add( char const *path )
+{
+	char  fullPath[MAX_PATH];
+	char *pName;
+
+	DWORD nChars = ::GetFullPathNameA( path, MAX_PATH, fullPath, &pName );
+	if( !nChars || nChars >= MAX_PATH || !pName )
+	{
+		g_ssErr.str("");
+		g_ssErr << "Could not follow '" << path << "'. " << GetApiErrorString( ::GetLastError(), "GetFullPathName" );
+
+		FileError( CR_STATUS_WINAPI, g_ssErr.str() );
+	}
+
+	SFollowedFile file;
+	wchar_t       wName[MAX_PATH];
+
+	file.path  = fullPath;
+	file.name  = std::wstring( wName, ::MultiByteToWideChar( CP_ACP, 0, pName, -1, wName, MAX_PATH ) - 1 );
+	file.hFile = INVALID_HANDLE_VALUE;
+	file.dwVolume = file.dwIndexHigh = file.dwIndexLow = 0;
+	file.offset   = 0;
+
+	std::string dirPath( fullPath, pName - fullPath );
+	for( file.iDir = 0; file.iDir < m_dirs.size() && ::_stricmp( m_dirs[file.iDir]->path.c_str(), dirPath.c_str() ); file.iDir++ ) { }
+
+	if( file.iDir == m_dirs.size() )
+	{
+		SWatchedDir *pDir = new SWatchedDir;
+		pDir->path     = dirPath;
+		pDir->fPending = false;
+		pDir->hDir     = ::CreateFileA( dirPath.c_str(), FILE_LIST_DIRECTORY, FILE_SHARE_READ|FILE_SHARE_WRITE|FILE_SHARE_DELETE,
+		                                NULL, OPEN_EXISTING, FILE_FLAG_BACKUP_SEMANTICS|FILE_FLAG_OVERLAPPED, NULL );
+		if( pDir->hDir == INVALID_HANDLE_VALUE )
+		{
+			delete pDir;
+			g_ssErr.str("");
+			g_ssErr << "Could not watch directory '" << dirPath << "'. " 
+			        << GetApiErrorString( ::GetLastError(), "CreateFile" );
+
+			FileError( CR_STATUS_WINAPI, g_ssErr.str() );
+		}
+		m_dirs.push_back( pDir );
+	}
+	m_files.push_back( file );
+}
+
+//==================================================================================================
+void CFileFollower::Watch( SWatchedDir &dir )
+{
+	::ZeroMemory( &dir.ov, sizeof(dir.ov) );
+	if( !::ReadDirectoryChangesW( dir.hDir, dir.changes, sizeof(dir.changes), FALSE, FOLLOW_NOTIFY_FILTER, NULL, 
+	                              &dir.ov, NULL ) )
+	{
+		g_ssErr.str("");
+		g_ssErr << "Could not watch directory '" << dir.path << "'. " 
+		        << GetApiErrorString( ::GetLastError(), "ReadDirectoryChangesW" );
+
+		FileError( CR_STATUS_WINAPI, g_ssErr.str() );
+	}
+	dir.fPending = true;
+}
+
+//==================================================================================================
+// (Re)open the file at file.path. Returns true when it's another file than the one followed so 
+// far, which is then read to its end and let go, and the new one is followed from its start.
+//==================================================================================================
+bool CFileFollower::Open( SFollowedFile &file )
+{
+	BY_HANDLE_FILE_INFORMATION info;
+
+	HANDLE hFile = ::CreateFileA( file.path.c_str(), GENERIC_READ, FILE_SHARE_READ|FILE_SHARE_WRITE|FILE_SHARE_DELETE, 
+	                              NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL );
+	if( hFile == INVALID_HANDLE_VALUE ) { return false; }
+	if( !::GetFileInformationByHandle( hFile, &info ) )
+	{
+		::CloseHandle( hFile );
+		return false;
+	}
+
+	if( file.hFile != INVALID_HANDLE_VALUE )
+	{
+		if( info.dwVolumeSerialNumber == file.dwVolume && info.nFileIndexHigh == file.dwIndexHigh 
+		    && info.nFileIndexLow == file.dwIndexLow ) 
+		{
+			::CloseHandle( hFile );
+			return false;
+		}
+
+		ReadNew( (size_t)(&file - &m_files[0]) );
+		::CloseHandle( file.hFile );
+	}
+
+	/* What's left of the old file's last line is ended, as the new file starts a line of its own.
+	*/
+	if( !file.partial.empty() ) 
+	{ 
+		file.partial += "\r\n";
+		Deliver( (size_t)(&file - &m_files[0]), file.partial.data(), file.partial.size() );
+		file.partial.clear();
+	}
+
+	file.hFile       = hFile;
+	file.dwVolume    = info.dwVolumeSerialNumber;
+	file.dwIndexHigh = info.nFileIndexHigh;
+	file.dwIndexLow  = info.nFileIndexLow;
+	file.offset      = 0;
+	return true;
+}
+
+//==================================================================================================
+// Pass complete lines on, after a "==> path <==" line when they come from another file than the
+// last ones did.
+//==================================================================================================
+void CFileFollower::Deliver( size_t iFile, char const *pData, size_t nBytes )
+{
+	m_out.clear();
+	if( m_files.size() > 1 && iFile != m_iLastFile )
+	{
+		m_out += "==> " + m_files[iFile].path + " <==\r\n";
+		m_iLastFile = iFile;
+	}
+	m_out.append( pData, nBytes );
+
+	DWORD dwError = m_pSink->Write( StdOutRead, (BYTE*)&m_out[0], (DWORD)m_out.size() );
+	if( dwError )
+	{
+		g_ssErr.str("");
+		g_ssErr << "Could not write to stdout. " << GetApiErrorString( dwError, "WriteFile" );
+
+		FileError( CR_STATUS_WINAPI, g_ssErr.str() );
+	}
+}
+
+//==================================================================================================
+// Read a file from the offset followed so far to its end, and deliver the lines completed. A file
+// smaller than the offset has been truncated, and is followed from its start again.
+//==================================================================================================
+void CFileFollower::ReadNew( size_t iFile )
+{
+	SFollowedFile &file = m_files[iFile];
+	LARGE_INTEGER  size;
+
+	if( file.hFile == INVALID_HANDLE_VALUE || !::GetFileSizeEx( file.hFile, &size ) ) { return; }
+
+	if( (ULONGLONG)size.QuadPart < file.offset )
+	{
+		std::string note = "[cr] " + file.path + ": file truncated\r\n";
+		Deliver( iFile, note.data(), note.size() );
+		file.offset = 0;
+		file.partial.clear();
+	}
+
+	while( file.offset < (ULONGLONG)size.QuadPart && !m_fAborted )
+	{
+		ULONGLONG  left = (ULONGLONG)size.QuadPart - file.offset;
+		DWORD      n    = (left > FOLLOW_READ_SIZE) ? FOLLOW_READ_SIZE : (DWORD)left;
+		size_t     have = file.partial.size();
+		DWORD      nRead;
+		OVERLAPPED ov;
+
+		/* Read at the offset, wherever the handle's file pointer is. */
+		::ZeroMemory( &ov, sizeof(ov) );
+		ov.Offset     = (DWORD)file.offset;
+		ov.OffsetHigh = (DWORD)(file.offset >> 32);
+
+		file.partial.resize( have + n );
+		if( !::ReadFile( file.hFile, &file.partial[have], n, &nRead, &ov ) || !nRead )
+		{
+			file.partial.resize( have );
+			break;
+		}
+		file.partial.resize( have + nRead );
+		file.offset += nRead;
+		m_ullBytes  += nRead;
+
+		size_t eol = file.partial.rfind( '\n' );
+		if( eol != std::string::npos )
+		{
+			Deliver( iFile, file.partial.data(), eol + 1 );
+			file.partial.erase( 0, eol + 1 );
+		}
+	}
+}
+
+//==================================================================================================
+// A directory's notifications. Files whose name changed (renamed, deleted, created) are opened
+// again; when the change is lost (the buffer overflowed) every file in the directory is.
+//==================================================================================================
+void CFileFollower::Changed( size_t iDir, DWORD nBytes )
+{
+	SWatchedDir &dir = *m_dirs[iDir];
+	BYTE const  *p   = (BYTE const*)dir.changes;
+
+	for( ; ; )
+	{
+		FILE_NOTIFY_INFORMATION const *pInfo = (FILE_NOTIFY_INFORMATION const*)p;
+		size_t                         len   = nBytes ? pInfo->FileNameLength / sizeof(WCHAR) : 0;
+
+		for( size_t i = 0; i < m_files.size(); i++ )
+		{
+			SFollowedFile &file = m_files[i];
+			if( file.iDir != iDir ) { continue; }
+			if( nBytes && (len != file.name.size() || ::_wcsnicmp( pInfo->FileName, file.name.c_str(), len )) ) { continue; }
+
+			if( !nBytes || pInfo->Action != FILE_ACTION_MODIFIED ) { Open( file ); }
+			ReadNew( i );
+		}
+
+		if( !nBytes || !pInfo->NextEntryOffset ) { break; }
+		p += pInfo->NextEntryOffset;
+	}
+}
+
+//==================================================================================================
+// Follow the files until Abort(). They're followed from their end, and a file that doesn't exist
+// yet from its start once it's created.
+//==================================================================================================
+void CFileFollower::Run()
+{
+	m_hPort = ::CreateIoCompletionPort( INVALID_HANDLE_VALUE, NULL, 0, 1 );
+	if( !m_hPort )
+	{
+		g_ssErr.str("");
+		g_ssErr << "Could not create a completion port. " << GetApiErrorString( ::GetLastError(), "CreateIoCompletionPort" );
+
+		FileError( CR_STATUS_WINAPI, g_ssErr.str() );
+	}
+
+	for( size_t i = 0; i < m_dirs.size(); i++ )
+	{
+		::CreateIoCompletionPort( m_dirs[i]->hDir, m_hPort, (ULONG_PTR)i, 0 );
+		Watch( *m_dirs[i] );
+	}
+
+	for( size_t i = 0; i < m_files.size(); i++ )
+	{
+		LARGE_INTEGER size;
+		if( Open( m_files[i] ) && ::GetFileSizeEx( m_files[i].hFile, &size ) ) { m_files[i].offset = size.QuadPart; }
+	}
+
+	while( !m_fAborted )
+	{
+		DWORD        nBytes;
+		ULONG_PTR    key;
+		OVERLAPPED  *pOv;
+
+		BOOL fOk = ::GetQueuedCompletionStatus( m_hPort, &nBytes, &key, &pOv, INFINITE );
+		if( !pOv ) { break; }  // Abort()
+
+		m_dirs[key]->fPending = false;
+		if( !fOk && ::GetLastError() != ERROR_NOTIFY_ENUM_DIR )
+		{
+			g_ssErr.str("");
+			g_ssErr << "Could not watch directory '" << m_dirs[key]->path << "'. " 
+			        << GetApiErrorString( ::GetLastError(), "ReadDirectoryChangesW" );
+
+			FileError( CR_STATUS_WINAPI, g_ssErr.str() );
+		}
+
+		Changed( (size_t)key, fOk ? nBytes : 0 );
+		Watch( *m_dirs[key] );
+	}
+
+	Close();
+	m_pSink->EndOfStream( StdOutRead );
+	m_pSink->EndOfStream( StdErrRead );
+}
+
+//==================================================================================================
+void CFileFollower::Abort()
+{
+	m_fAborted = true;
+	if( m_hPort ) { ::PostQueuedCompletionStatus( m_hPort, 0, 0, NULL ); }
+}
@@ -0,0 +1,157 @@
+/***********************************************************************************************//**
+\file    FileSource.h
+\author  hdaniel
+\version $Id$
+
+\brief Render files the way a child's output is rendered (cr --file, cr --follow).
+
+\details
+
+Logs are often colored after the fact. Piping them through cr ("type huge.log | cr ...") pushes
+every byte through a child process and a pipe; a CFileSource instead maps the file and hands it to
+the sinks in large chunks cut at line boundaries, as if it were the stdout of a child. The rules
+of each chunk are matched on the classifier's workers, so a large file is classified on all of
+them, and the chunks are rendered in file order.
+
+A CFileFollower is "tail -f" for any number of logs: it renders what's appended to them as it's
+appended. It doesn't poll; each directory holding followed files is watched with
+ReadDirectoryChangesW() on a completion port, and a notification for a file reads the bytes past
+the offset followed so far. A file that's renamed or deleted and created again (log rotation) is
+followed from the start of the new file, and one that shrinks (truncated in place) from its new
+start. NTFS may hold back the notification of writes through a handle that stays open until the
+writer flushes or closes it, so such a writer's output can come late.
+
+\license
+
+This file is free and unencumbered software released into the public domain.
+
+Anyone is free to copy, modify, publish, use, compile, sell, or distribute this software, either in
+source code form or as a compiled binary, for any purpose, commercial or non-commercial, and by any
+means.
+
+In jurisdictions that recognize copyright laws, the author or authors of this software dedicate any
+and all copyright interest in the software to the public domain. We make this dedication for the
+benefit of the public at large and to the detriment of our heirs and successors. We intend this
+dedication to be an overt act of relinquishment in perpetuity of all present and future rights to
+this software under copyright law.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT
+NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+For more information, please refer to <http://unlicense.org/>
+***************************************************************************************************/
+#ifndef _filesource_h_
+#define _filesource_h_
+
+#include <string>
+#include <vector>
+
+#include <windows.h>
+
+#include "Relay.h"
+
+//==================================================================================================
+// Run() delivers the whole file to the sink, then ends both streams, and throws an exit_exception
+// when the file can't be read or the sink fails. Abort() makes Run() stop after the chunk it's
+// delivering, from any thread (Ctrl+C).
+//==================================================================================================
+class CFileSource
+{
+public:
+	CFileSource();
+	~CFileSource();
+
+	void SetSink( IRelaySink *pSink ) { m_pSink = pSink; }
+
+	void Run( char const *path );
+	void Abort() { m_fAborted = true; }
+
+	ULONGLONG Bytes() const  { return m_ullBytes; }
+	ULONGLONG Chunks() const { return m_ullChunks; }
+
+private:
+	CFileSource( CFileSource const& );
+	CFileSource& operator=( CFileSource const& );
+
+	DWORD Deliver( BYTE *pData, DWORD nBytes, bool fLast );
+	void  Close();
+
+	IRelaySink        *m_pSink;
+	HANDLE             m_hFile;
+	HANDLE             m_hMapping;
+	BYTE              *m_pView;
+	std::vector<BYTE>  m_last;       // the chunk that ends the file, see Deliver()
+	volatile bool      m_fAborted;
+	ULONGLONG          m_ullBytes;
+	ULONGLONG          m_ullChunks;
+};
+
+//==================================================================================================
+// Files are Add()ed first, then Run() renders what's appended to them until Abort(), which may be
+// called from any thread (Ctrl+C). A file is followed from its end when Run() starts, or from its
+// start if it's created later; its output is delivered as stdout, a complete line at a time. With
+// more than one file, a "==> path <==" line says which file the lines that follow it come from.
+// Failures throw an exit_exception.
+//==================================================================================================
+class CFileFollower
+{
+public:
+	CFileFollower();
+	~CFileFollower();
+
+	void SetSink( IRelaySink *pSink ) { m_pSink = pSink; }
+
+	void Add( char const *path );
+	void Run();
+	void Abort();
+
+	ULONGLONG Bytes() const { return m_ullBytes; }
+	size_t    Files() const { return m_files.size(); }
+
+private:
+	CFileFollower( CFileFollower const& );
+	CFileFollower& operator=( CFileFollower const& );
+
+	struct SWatchedDir
+	{
+		OVERLAPPED  ov;              // first, so a completion's OVERLAPPED* is the SWatchedDir*
+		std::string path;
+		HANDLE      hDir;
+		bool        fPending;        // a ReadDirectoryChangesW() is in flight
+		DWORD       changes[4096];   // FILE_NOTIFY_INFORMATION records, DWORD aligned
+	};
+
+	struct SFollowedFile
+	{
+		std::string  path;
+		std::wstring name;           // in its directory, as the notifications have it
+		size_t       iDir;
+		HANDLE       hFile;          // INVALID_HANDLE_VALUE while there's no file at path
+		DWORD        dwVolume;       // with the file index, tells a file from the one that replaced it
+		DWORD        dwIndexHigh;
+		DWORD        dwIndexLow;
+		ULONGLONG    offset;         // read up to here
+		std::string  partial;        // the unfinished line at offset
+	};
+
+	void Watch( SWatchedDir &dir );
+	void Changed( size_t iDir, DWORD nBytes );
+	bool Open( SFollowedFile &file );
+	void ReadNew( size_t iFile );
+	void Deliver( size_t iFile, char const *pData, size_t nBytes );
+	void Close();
+
+	IRelaySink                 *m_pSink;
+	std::vector<SFollowedFile>  m_files;
+	std::vector<SWatchedDir*>   m_dirs;       // never moved, their reads are in flight
+	HANDLE                      m_hPort;
+	size_t                      m_iLastFile;  // the file output came from last
+	std::string                 m_out;
+	volatile bool               m_fAborted;
+	ULONGLONG                   m_ullBytes;
+};
+
+#endif // _filesource_h_
@@ -0,0 +1,225 @@
+/***********************************************************************************************//**
+\file    JsonSink.cpp
+\author  hdaniel
+\version $Id$
+
+\brief CJsonSink, JSON lines output of the relayed output (see JsonSink.h).
+
+\details
+
+The records of a chunk are built in one buffer and written with a single WriteFile(), the way the
+console sink writes a chunk's runs. Lines are taken from the CRuleClassifier, which has already
+found each line's first rule match, so a line costs an escape pass over its text and nothing else.
+Lines with bytes from 0x80 up go through MultiByteToWideChar() and WideCharToMultiByte() to become
+UTF-8; plain ASCII, almost all of a build log, is escaped straight from the chunk.
+
+\license
+
+This file is free and unencumbered software released into the public domain.
+
+Anyone is free to copy, modify, publish, use, compile, sell, or distribute this software, either in
+source code form or as a compiled binary, for any purpose, commercial or non-commercial, and by any
+means.
+
+In jurisdictions that recognize copyright laws, the author or authors of this software dedicate any
+and all copyright interest in the software to the public domain. We make this dedication for the 
+benefit of the public at large and to the detriment of our heirs and successors. We intend this 
+dedication to be an overt act of relinquishment in perpetuity of all present and future rights to
+this software under copyright law.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT
+NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND 
+NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+For more information, please refer to <http://unlicense.org/>
+***************************************************************************************************/
+#include <string>
+#include <vector>
+
+#include <windows.h>
+
+#include "JsonSink.h"
+#include "Utils\utils.h"
+#include "Utils\jsonutils.h"
+
+//==================================================================================================
+CJsonSink::CJsonSink( CRuleClassifier &classifier )
+	: m_pClassifier(&classifier), m_pNext(NULL), m_hOutput(NULL), m_seq(0), m_codePage(CP_UTF8)
+{
+	m_fPartial[StdOutRead]    = m_fPartial[StdErrRead]    = false;
+	m_partialRule[StdOutRead] = m_partialRule[StdErrRead] = -1;
+	m_readTime[StdOutRead]    = m_readTime[StdErrRead]    = 0;
+}
+
+//==================================================================================================
+// Without a console of our own, the child writes in the OEM code page a console would have had.
+//==================================================================================================
+void CJsonSink::Start( HANDLE hOutput, IRelaySink *pNext )
+{
+	m_hOutput  = hOutput;
+	m_pNext    = pNext;
+	m_codePage = ::GetConsoleOutputCP();
+	if( !m_codePage ) { m_codePage = ::GetOEMCP(); }
+}
+
+//==================================================================================================
+// Chunks that don't come from a CRelay (cr --file and the like) have no read time, their records
+// are stamped when they're written.
+//==================================================================================================
+void CJsonSink::SetReadTime( EIoThreadType eStream, unsigned long long ullTime_ms )
+{
+	m_readTime[eStream] = ullTime_ms;
+	if( m_pNext ) { m_pNext->SetReadTime( eStream, ullTime_ms ); }
+}
+
+//==================================================================================================
+// Add the record of one line to m_buffer.
+//==================================================================================================
+void CJsonSink::AppendRecord( EIoThreadType eStream, int rule, char const *pText, size_t len )
+{
+	char head[96];
+	unsigned long long ts = m_readTime[eStream] ? m_readTime[eStream] : utils::UnixTimeMs();
+
+	size_t n = utils::strnfmt( head, sizeof(head), "{\"ts\":%llu,\"stream\":\"%s\",\"seq\":%llu,", 
+	                           ts, (eStream == StdErrRead) ? "stderr" : "stdout", m_seq++ );
+	m_buffer.append( head, n );
+
+	if( rule >= 0 )
+	{
+		std::string const &name = m_pClassifier->RuleName( (size_t)rule );
+		m_buffer += "\"rule\":\"";
+		AppendText( name.data(), name.size() );
+		m_buffer += "\",";
+	}
+
+	m_buffer += "\"text\":\"";
+	AppendText( pText, len );
+	m_buffer += "\"}\n";
+}
+
+//==================================================================================================
+// Add text to m_buffer escaped, and in UTF-8. What can't be converted is replaced by U+FFFD, so the
+// records are valid JSON whatever the child wrote.
+//==================================================================================================
+void CJsonSink::AppendText( char const *pText, size_t len )
+{
+	if( utils::ascii_prefix( pText, len ) == len ) 
+	{ 
+		jsonutils::append_escaped( m_buffer, pText, len ); 
+		return;
+	}
+
+	int cchWide = (m_codePage == CP_UTF8) ? 0 : ::MultiByteToWideChar( m_codePage, 0, pText, (int)len, NULL, 0 );
+
+	m_utf8.clear();
+	if( cchWide > 0 )
+	{
+		m_wide.resize( cchWide );
+		::MultiByteToWideChar( m_codePage, 0, pText, (int)len, &m_wide[0], cchWide );
+
+		int cbUtf8 = ::WideCharToMultiByte( CP_UTF8, 0, m_wide.data(), cchWide, NULL, 0, NULL, NULL );
+		m_utf8.resize( cbUtf8 );
+		if( cbUtf8 ) { ::WideCharToMultiByte( CP_UTF8, 0, m_wide.data(), cchWide, &m_utf8[0], cbUtf8, NULL, NULL ); }
+	}
+	else
+	{
+		jsonutils::append_utf8( m_utf8, pText, len );
+	}
+	jsonutils::append_escaped( m_buffer, m_utf8 );
+}
+
+//==================================================================================================
+// Write m_buffer out. Returns 0 on success, or the error of the WriteFile() that failed.
+//==================================================================================================
+DWORD CJsonSink::Flush()
+{
+	DWORD dwError = 0;
+
+	for( size_t pos = 0; pos < m_buffer.size(); )
+	{
+		DWORD nWritten;
+		if( !::WriteFile( m_hOutput, m_buffer.data() + pos, (DWORD)(m_buffer.size() - pos), &nWritten, NULL ) )
+		{
+			dwError = ::GetLastError();
+			break;
+		}
+		pos += nWritten;
+	}
+	m_buffer.clear();
+
+	return dwError;
+}
+
+//==================================================================================================
+// The records of a chunk are gathered in m_buffer and written with a single WriteFile(). A line the
+// chunk ends in the middle of is held back until the rest of it arrives.
+//==================================================================================================
+DWORD CJsonSink::Write( EIoThreadType eStream, BYTE *pData, DWORD nBytes )
+{
+	char const *pChunk = (char const*)pData;
+
+	m_pClassifier->Enter();
+	m_pClassifier->Classify( eStream, pChunk, nBytes );
+
+	std::vector<CRuleClassifier::SLine> const &lines = m_pClassifier->Lines();
+	ruleutils::spans const                    &spans = m_pClassifier->Spans();
+
+	for( size_t i = 0; i < lines.size(); i++ )
+	{
+		CRuleClassifier::SLine const &line = lines[i];
+		int rule = line.nSpans ? (int)spans[line.iSpan].rule : -1;
+
+		if( !line.fEol || m_fPartial[eStream] )
+		{
+			if( !m_fPartial[eStream] || m_partialRule[eStream] < 0 ) { m_partialRule[eStream] = rule; }
+			m_partial[eStream].append( pChunk + line.pos, line.len );
+			m_fPartial[eStream] = true;
+
+			if( !line.fEol ) { continue; }
+
+			AppendRecord( eStream, m_partialRule[eStream], m_partial[eStream].data(), m_partial[eStream].size() );
+			m_partial[eStream].clear();
+			m_fPartial[eStream] = false;
+			continue;
+		}
+
+		AppendRecord( eStream, rule, pChunk + line.pos, line.len );
+	}
+
+	DWORD dwError = Flush();
+	if( !dwError && m_pNext ) { dwError = m_pNext->Write( eStream, pData, nBytes ); }
+
+	m_pClassifier->Forget();
+	m_pClassifier->Leave();
+
+	return dwError;
+}
+
+//==================================================================================================
+// Write the line the stream ended on, if it didn't end with a line terminator.
+//==================================================================================================
+DWORD CJsonSink::EndOfStream( EIoThreadType eStream )
+{
+	DWORD dwError = 0;
+
+	m_pClassifier->Enter();
+
+	if( m_fPartial[eStream] )
+	{
+		AppendRecord( eStream, m_partialRule[eStream], m_partial[eStream].data(), m_partial[eStream].size() );
+		m_partial[eStream].clear();
+		m_fPartial[eStream] = false;
+		dwError = Flush();
+	}
+	if( m_pNext ) 
+	{ 
+		DWORD dwNextError = m_pNext->EndOfStream( eStream ); 
+		if( !dwError ) { dwError = dwNextError; }
+	}
+
+	m_pClassifier->Leave();
+
+	return dwError;
+}
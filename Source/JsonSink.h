@@ -0,0 +1,93 @@
+/***********************************************************************************************//**
+\file    JsonSink.h
+\author  hdaniel
+\version $Id$
+
+\brief IRelaySink that writes the child's output as JSON lines, one record per line.
+
+\details
+
+For log pipelines and other machine consumers (--json). Every line of output becomes a record
+
+    {"ts":1792396800123,"stream":"stderr","seq":42,"rule":"error","text":"..."}
+
+where ts is the time the line was complete in ms since 1970-01-01 UTC, seq numbers the records of
+both streams in the order they were written, and rule is the pattern of the first --rule that
+matched the line (the key is left out when none did). Records are newline terminated (NDJSON).
+
+ts is when the chunk holding the end of the line was read from the child (see SetReadTime()), so
+it doesn't depend on how long the record waited to be written. The text is converted to UTF-8 from
+the console's output code page, which is the one console programs write in.
+
+The lines and rule matches come from the CRuleClassifier the console sink uses as well, and a
+record sink can pass each chunk on to a second sink, which then finds the chunk already classified.
+
+\license
+
+This file is free and unencumbered software released into the public domain.
+
+Anyone is free to copy, modify, publish, use, compile, sell, or distribute this software, either in
+source code form or as a compiled binary, for any purpose, commercial or non-commercial, and by any
+means.
+
+In jurisdictions that recognize copyright laws, the author or authors of this software dedicate any
+and all copyright interest in the software to the public domain. We make this dedication for the
+benefit of the public at large and to the detriment of our heirs and successors. We intend this
+dedication to be an overt act of relinquishment in perpetuity of all present and future rights to
+this software under copyright law.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT
+NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+For more information, please refer to <http://unlicense.org/>
+***************************************************************************************************/
+#ifndef _jsonsink_h_
+#define _jsonsink_h_
+
+#include <string>
+
+#include <windows.h>
+
+#include "Relay.h"
+#include "RuleClassifier.h"
+
+//==================================================================================================
+// Start() is given the handle records are written to and, optionally, a sink every chunk is passed
+// on to after its records are written. The classifier must be started before the sink.
+//==================================================================================================
+class CJsonSink : public IRelaySink
+{
+public:
+	CJsonSink( CRuleClassifier &classifier );
+
+	void Start( HANDLE hOutput, IRelaySink *pNext =NULL );
+
+	virtual DWORD Write( EIoThreadType eStream, BYTE *pData, DWORD nBytes );
+	virtual DWORD EndOfStream( EIoThreadType eStream );
+	virtual void  SetReadTime( EIoThreadType eStream, unsigned long long ullTime_ms );
+
+	unsigned long long Records() const { return m_seq; }
+
+private:
+	void  AppendRecord( EIoThreadType eStream, int rule, char const *pText, size_t len );
+	void  AppendText( char const *pText, size_t len );
+	DWORD Flush();
+
+	CRuleClassifier   *m_pClassifier;    // also serializes Write() and EndOfStream()
+	IRelaySink        *m_pNext;
+	HANDLE             m_hOutput;
+	std::string        m_buffer;         // records not yet written
+	std::string        m_partial[2];     // text of an unfinished line, indexed by StdOutRead/StdErrRead
+	bool               m_fPartial[2];
+	int                m_partialRule[2]; // first rule matched by the unfinished line, or -1
+	unsigned long long m_readTime[2];    // of the chunk being written, 0 when not given one
+	unsigned long long m_seq;
+	UINT               m_codePage;       // that the child's output is in
+	std::wstring       m_wide;           // a line on its way to UTF-8, see AppendText()
+	std::string        m_utf8;
+};
+
+#endif // _jsonsink_h_
@@ -0,0 +1,548 @@
+/***********************************************************************************************//**
+\file    Pager.cpp
+\author  hdaniel
+\version $Id$
+
+\brief CPager, the --pager mode of cr (see Pager.h).
+
+\details
+
+The relay's threads append lines to the spool under m_mutex, and every m_step'th line's offset to
+m_index; the paging thread reads the spool from the line offsets it finds there, a block at a
+time, and only ever takes the mutex to look them up. Lines are spooled with their stream as a tag
+byte, so the screen can be drawn with the colors of the stream each line came from.
+
+\license
+
+This file is free and unencumbered software released into the public domain.
+
+Anyone is free to copy, modify, publish, use, compile, sell, or distribute this software, either in
+source code form or as a compiled binary, for any purpose, commercial or non-commercial, and by any
+means.
+
+In jurisdictions that recognize copyright laws, the author or authors of this software dedicate any
+and all copyright interest in the software to the public domain. We make this dedication for the 
+benefit of the public at large and to the detriment of our heirs and successors. We intend this 
+dedication to be an overt act of relinquishment in perpetuity of all present and future rights to
+this software under copyright law.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT
+NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND 
+NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+For more information, please refer to <http://unlicense.org/>
+***************************************************************************************************/
+#include <algorithm>
+#include <cstring>
+#include <sstream>
+#include <string>
+
+#include <windows.h>
+
+#include "Pager.h"
+
+//==================================================================================================
+static std::stringstream g_ssErr;  // used for error message construction
+
+//==================================================================================================
+inline void PagerError( int code, std::string const &errMsg ) 
+{ 
+    throw exit_exception( errMsg.c_str(), code );
+}
+
+//==================================================================================================
+// The index holds up to PAGER_INDEX_MAX offsets, 512KB, before its step doubles. Longer lines than
+// PAGER_MAX_LINE are spooled in pieces, so an unfinished line can't grow without bounds, and the
+// spool is read PAGER_READ_SIZE bytes at a time. Input and new output are checked every
+// PAGER_POLL_MS, which is also the most often the screen is drawn as the output grows.
+//==================================================================================================
+#define PAGER_INDEX_MAX  (64 * 1024)
+#define PAGER_MAX_LINE   (64 * 1024)
+#define PAGER_READ_SIZE  (64 * 1024)
+#define PAGER_POLL_MS    100
+
+/* The byte a line is spooled with, for its stream. */
+#define PAGER_TAG_STDOUT  'o'
+#define PAGER_TAG_STDERR  'e'
+
+//==================================================================================================
+CPager::CPager( WORD defaultAttr, CRuleClassifier &classifier )
+	: m_defaultAttr(defaultAttr), m_shared(classifier), m_screen(defaultAttr, m_classifier)
+	, m_hSpool(INVALID_HANDLE_VALUE), m_hScreen(INVALID_HANDLE_VALUE), m_hInput(NULL), m_dwInputMode(0)
+	, m_step(1), m_nLines(0), m_size(0), m_blockOffset(0)
+	, m_top(0), m_nDrawnLines(0), m_fDrawnDone(false), m_rows(1), m_columns(80)
+	, m_fFollow(true), m_fRedraw(true), m_lineNumber(0)
+{
+}
+
+//==================================================================================================
+CPager::~CPager()
+{
+	/* The spool was opened FILE_FLAG_DELETE_ON_CLOSE. */
+	if( m_hSpool  != INVALID_HANDLE_VALUE ) { ::CloseHandle( m_hSpool ); }
+	if( m_hScreen != INVALID_HANDLE_VALUE ) { ::CloseHandle( m_hScreen ); }
+}
+
+//==================================================================================================
+// Create the spool in the temp directory, and a screen buffer the size of the console's window. 
+// The screen buffer isn't shown until Run().
+//==================================================================================================
+void CPager::Start( SConsoleOptions const &options )
+{
+	char dir[MAX_PATH + 1];
+	char path[MAX_PATH + 1];
+
+	if(    !::GetTempPathA( sizeof(dir), dir ) || !::GetTempFileNameA( dir, "cr", 0, path )
+	    || (m_hSpool = ::CreateFileA( path, GENERIC_READ|GENERIC_WRITE, FILE_SHARE_READ|FILE_SHARE_DELETE, 
+	                                  NULL, CREATE_ALWAYS, 
+	                                  FILE_ATTRIBUTE_TEMPORARY|FILE_FLAG_DELETE_ON_CLOSE, NULL ))
+	       == INVALID_HANDLE_VALUE )
+	{
+		g_ssErr.str("");
+		g_ssErr << "Could not create the --pager spool. " 
+		        << GetApiErrorString( ::GetLastError(), "CreateFile" );
+		PagerError( CR_STATUS_WINAPI, g_ssErr.str() );
+	}
+
+	m_hScreen = ::CreateConsoleScreenBuffer( GENERIC_READ|GENERIC_WRITE, FILE_SHARE_READ|FILE_SHARE_WRITE, 
+	                                         NULL, CONSOLE_TEXTMODE_BUFFER, NULL );
+	if( m_hScreen == INVALID_HANDLE_VALUE )
+	{
+		g_ssErr.str("");
+		g_ssErr << "Could not create the --pager screen. " 
+		        << GetApiErrorString( ::GetLastError(), "CreateConsoleScreenBuffer" );
+		PagerError( CR_STATUS_WINAPI, g_ssErr.str() );
+	}
+
+	/* Without a scrollback, writing the last line can't scroll the screen. 
+	*/
+	CONSOLE_SCREEN_BUFFER_INFO csbi;
+	if( ::GetConsoleScreenBufferInfo( ::GetStdHandle( STD_OUTPUT_HANDLE ), &csbi ) )
+	{
+		COORD size = { (SHORT)(csbi.srWindow.Right - csbi.srWindow.Left + 1), 
+		               (SHORT)(csbi.srWindow.Bottom - csbi.srWindow.Top + 1) };
+		::SetConsoleScreenBufferSize( m_hScreen, size );
+	}
+	::SetConsoleTextAttribute( m_hScreen, m_defaultAttr );
+
+	/* Escape sequences were taken out of the output before it was spooled.
+	*/
+	m_classifier.Start( m_shared );
+	m_screen.Options()         = options;
+	m_screen.Options().eVtMode = VtStrip;
+	m_screen.Start( m_hScreen );
+}
+
+//==================================================================================================
+// Spool the complete lines of the chunk, and keep the line it ends on for the next one.
+//==================================================================================================
+DWORD CPager::Write( EIoThreadType eStream, BYTE *pData, DWORD nBytes )
+{
+	utils::MutexLock lock( m_mutex );
+
+	std::string &partial = m_partial[eStream];
+	char const  *p       = (char const*)pData;
+	char const  *pEnd    = p + nBytes;
+
+	while( p < pEnd )
+	{
+		char const *pEol = (char const*)::memchr( p, '\n', pEnd - p );
+		if( !pEol )
+		{
+			partial.append( p, pEnd );
+			if( partial.size() >= PAGER_MAX_LINE )
+			{
+				AddLine( eStream, partial.data(), partial.size() );
+				partial.clear();
+			}
+			break;
+		}
+
+		if( partial.empty() ) 
+		{ 
+			AddLine( eStream, p, pEol - p ); 
+		}
+		else
+		{
+			partial.append( p, pEol );
+			AddLine( eStream, partial.data(), partial.size() );
+			partial.clear();
+		}
+		p = pEol + 1;
+	}
+	return Flush();
+}
+
+//==================================================================================================
+DWORD CPager::EndOfStream( EIoThreadType eStream )
+{
+	utils::MutexLock lock( m_mutex );
+
+	if( !m_partial[eStream].empty() )
+	{
+		AddLine( eStream, m_partial[eStream].data(), m_partial[eStream].size() );
+		m_partial[eStream].clear();
+	}
+	return Flush();
+}
+
+//==================================================================================================
+// Add a line to m_out, and to the index when it's one of every m_step lines. A line rewritten in 
+// place is spooled as what it was last rewritten to. Called with m_mutex held.
+//==================================================================================================
+void CPager::AddLine( EIoThreadType eStream, char const *pLine, size_t len )
+{
+	if( len && pLine[len - 1] == '\r' ) { len--; }
+	for( size_t i = len; i > 0; i-- )
+	{
+		if( pLine[i - 1] == '\r' )
+		{
+			pLine += i;
+			len   -= i;
+			break;
+		}
+	}
+
+	if( m_nLines % m_step == 0 )
+	{
+		m_index.push_back( m_size + m_out.size() );
+
+		/* Entry i becomes the offset of line i * 2 * m_step, which old entry 2i has.
+		*/
+		if( m_index.size() == PAGER_INDEX_MAX )
+		{
+			for( size_t i = 1; i < PAGER_INDEX_MAX / 2; i++ ) { m_index[i] = m_index[2 * i]; }
+			m_index.resize( PAGER_INDEX_MAX / 2 );
+			m_step *= 2;
+		}
+	}
+
+	m_out += (eStream == StdErrRead) ? PAGER_TAG_STDERR : PAGER_TAG_STDOUT;
+	m_out.append( pLine, len );
+	m_out += '\n';
+	m_nLines++;
+}
+
+//==================================================================================================
+// Append m_out to the spool. Only complete lines are ever below m_size, which is what the pager
+// reads up to. Called with m_mutex held.
+//==================================================================================================
+DWORD CPager::Flush()
+{
+	if( m_out.empty() ) { return 0; }
+
+	OVERLAPPED ov   = { 0 };
+	DWORD      dwWritten;
+
+	ov.Offset     = (DWORD)m_size;
+	ov.OffsetHigh = (DWORD)(m_size >> 32);
+	if( !::WriteFile( m_hSpool, m_out.data(), (DWORD)m_out.size(), &dwWritten, &ov ) ) 
+	{ 
+		return ::GetLastError(); 
+	}
+
+	m_size += dwWritten;
+	m_out.clear();
+	return 0;
+}
+
+//==================================================================================================
+ULONGLONG CPager::Lines()
+{
+	utils::MutexLock lock( m_mutex );
+	return m_nLines;
+}
+
+//==================================================================================================
+ULONGLONG CPager::Bytes()
+{
+	utils::MutexLock lock( m_mutex );
+	return m_size;
+}
+
+//==================================================================================================
+ULONGLONG CPager::Step()
+{
+	utils::MutexLock lock( m_mutex );
+	return m_step;
+}
+
+//==================================================================================================
+// Read the spool from offset into m_block. Returns false at the end of what's been spooled.
+//==================================================================================================
+bool CPager::Fill( ULONGLONG offset )
+{
+	ULONGLONG size = Bytes();
+	if( offset >= size ) { return false; }
+
+	OVERLAPPED ov = { 0 };
+	DWORD      dwRead;
+
+	ov.Offset     = (DWORD)offset;
+	ov.OffsetHigh = (DWORD)(offset >> 32);
+	m_block.resize( (size_t)std::min<ULONGLONG>( PAGER_READ_SIZE, size - offset ) );
+	if( !::ReadFile( m_hSpool, &m_block[0], (DWORD)m_block.size(), &dwRead, &ov ) )
+	{
+		g_ssErr.str("");
+		g_ssErr << "Could not read the --pager spool. " << GetApiErrorString( ::GetLastError(), "ReadFile" );
+		PagerError( CR_STATUS_WINAPI, g_ssErr.str() );
+	}
+	m_block.resize( dwRead );
+	m_blockOffset = offset;
+	return dwRead != 0;
+}
+
+//==================================================================================================
+// Read the line at offset, up to maxLen bytes of it, and move offset to the next line. Returns 
+// false at the end of what's been spooled.
+//==================================================================================================
+bool CPager::ReadLine( ULONGLONG &offset, EIoThreadType &eStream, std::string &line, size_t maxLen )
+{
+	bool fTag = true;
+
+	line.clear();
+	for( ;; )
+	{
+		if( offset < m_blockOffset || offset >= m_blockOffset + m_block.size() )
+		{
+			if( !Fill( offset ) ) { return false; }
+		}
+
+		size_t      at     = (size_t)(offset - m_blockOffset);
+		char const *p      = m_block.data() + at;
+		size_t      nAvail = m_block.size() - at;
+
+		if( fTag )
+		{
+			eStream = (*p == PAGER_TAG_STDERR) ? StdErrRead : StdOutRead;
+			fTag    = false;
+			offset++;
+			continue;
+		}
+
+		char const *pEol = (char const*)::memchr( p, '\n', nAvail );
+		size_t      len  = pEol ? (size_t)(pEol - p) : nAvail;
+
+		if( line.size() < maxLen ) { line.append( p, std::min( len, maxLen - line.size() ) ); }
+		offset += len;
+		if( pEol ) 
+		{ 
+			offset++;
+			return true; 
+		}
+	}
+}
+
+//==================================================================================================
+// The spool offset of line iLine, which must have been spooled: the nearest indexed line before it,
+// and fewer than m_step lines read past that.
+//==================================================================================================
+ULONGLONG CPager::LineOffset( ULONGLONG iLine )
+{
+	ULONGLONG step, offset;
+	{
+		utils::MutexLock lock( m_mutex );
+		step   = m_step;
+		offset = m_index[(size_t)(iLine / step)];
+	}
+
+	EIoThreadType eStream;
+	std::string   skipped;
+	for( ULONGLONG i = iLine % step; i > 0; i-- ) { ReadLine( offset, eStream, skipped, 0 ); }
+	return offset;
+}
+
+//==================================================================================================
+// Draw the lines from m_top, cut to the width of the window, and the status line below them. Lines
+// of the same stream go to the screen's sink as one chunk.
+//==================================================================================================
+void CPager::Draw( CRelay &relay )
+{
+	CONSOLE_SCREEN_BUFFER_INFO csbi;
+	if( !::GetConsoleScreenBufferInfo( m_hScreen, &csbi ) ) { return; }
+
+	m_columns = csbi.srWindow.Right - csbi.srWindow.Left + 1;
+	m_rows    = std::max( (SHORT)(csbi.srWindow.Bottom - csbi.srWindow.Top), (SHORT)1 );
+
+	ULONGLONG nLines = Lines();
+	ULONGLONG last   = (nLines > (ULONGLONG)m_rows) ? nLines - m_rows : 0;
+	if( m_fFollow || m_top > last ) { m_top = last; }
+
+	m_nDrawnLines = nLines;
+	m_fDrawnDone  = relay.IsDone();
+	m_fRedraw     = false;
+
+	/* Clear the window, then draw from its top left. Writing the last line's line break moves the 
+	 * cursor to the status line.
+	*/
+	COORD  origin   = { 0, csbi.srWindow.Top };
+	DWORD  dwCells  = (DWORD)m_columns * (m_rows + 1);
+	DWORD  dwDone;
+	::FillConsoleOutputCharacterA( m_hScreen, ' ', dwCells, origin, &dwDone );
+	::FillConsoleOutputAttribute( m_hScreen, m_defaultAttr, dwCells, origin, &dwDone );
+	::SetConsoleCursorPosition( m_hScreen, origin );
+
+	size_t        maxLen = (size_t)std::max( m_columns - 1, 1 );  // a full row would wrap
+	ULONGLONG     offset = (m_top < nLines) ? LineOffset( m_top ) : 0;
+	EIoThreadType eChunk = StdOutRead;
+	EIoThreadType eStream;
+	std::string   line;
+
+	m_screenData.clear();
+	for( SHORT row = 0; row < m_rows && m_top + row < nLines; row++ )
+	{
+		if( !ReadLine( offset, eStream, line, maxLen ) ) { break; }
+
+		if( eStream != eChunk && !m_screenData.empty() )
+		{
+			m_screen.Write( eChunk, (BYTE*)m_screenData.c_str(), (DWORD)m_screenData.size() );
+			m_screenData.clear();
+		}
+		eChunk = eStream;
+		m_screenData += line;
+		m_screenData += "\r\n";
+	}
+	if( !m_screenData.empty() )
+	{
+		m_screen.Write( eChunk, (BYTE*)m_screenData.c_str(), (DWORD)m_screenData.size() );
+	}
+
+	/* The status line, in the default attribute's inverse.
+	*/
+	std::ostringstream status;
+	status << " lines " << (nLines ? m_top + 1 : 0) << "-" << std::min( m_top + m_rows, nLines ) 
+	       << " of " << nLines;
+	if( relay.IsDone() ) { status << ", exit code " << relay.ExitCode(); }
+	else                 { status << ", running"; }
+	if( m_lineNumber )   { status << "  :" << m_lineNumber; }
+	else                 { status << "  (q quit, g/G start/end, <n>g line n)"; }
+
+	std::string text = status.str();
+	if( text.size() > maxLen ) { text.resize( maxLen ); }
+	text.resize( maxLen, ' ' );
+
+	COORD statusPos = { 0, (SHORT)(csbi.srWindow.Top + m_rows) };
+	WORD  inverse   = (WORD)(((m_defaultAttr & 0x0F) << 4) | ((m_defaultAttr & 0xF0) >> 4));
+	::SetConsoleCursorPosition( m_hScreen, statusPos );
+	::SetConsoleTextAttribute( m_hScreen, inverse );
+	::WriteConsoleA( m_hScreen, text.data(), (DWORD)text.size(), &dwDone, NULL );
+	::SetConsoleTextAttribute( m_hScreen, m_defaultAttr );
+}
+
+//==================================================================================================
+// Act on a key, the way more and less do. Returns false when the user quits.
+//
+//   up/k, down/j/enter  - a line up or down     home/g, end/G  - the start or the end of the output
+//   pgup/b, pgdn/space  - a screen up or down   <n>g, <n>enter - line n
+//   q/esc               - quit
+//==================================================================================================
+bool CPager::Key( KEY_EVENT_RECORD const &key )
+{
+	if( !key.bKeyDown ) { return true; }
+
+	char      ch         = key.uChar.AsciiChar;
+	bool      fFollow    = m_fFollow;
+	ULONGLONG lineNumber = m_lineNumber;
+	ULONGLONG rows       = (ULONGLONG)m_rows;
+
+	m_fRedraw    = true;
+	m_lineNumber = 0;
+	if( ch >= '0' && ch <= '9' )
+	{
+		m_lineNumber = lineNumber * 10 + (ch - '0');
+		return true;
+	}
+
+	m_fFollow = false;
+	if( lineNumber && (ch == 'g' || key.wVirtualKeyCode == VK_RETURN) )
+	{
+		m_top = lineNumber - 1;
+	}
+	else if( ch == 'q' || key.wVirtualKeyCode == VK_ESCAPE ) { return false; }
+	else if( ch == 'k' || key.wVirtualKeyCode == VK_UP )     { m_top = m_top ? m_top - 1 : 0; }
+	else if( ch == 'j' || key.wVirtualKeyCode == VK_DOWN || key.wVirtualKeyCode == VK_RETURN ) 
+	{ 
+		m_top++; 
+	}
+	else if( ch == 'b' || key.wVirtualKeyCode == VK_PRIOR )  { m_top = (m_top > rows) ? m_top - rows : 0; }
+	else if( ch == ' ' || key.wVirtualKeyCode == VK_NEXT )   { m_top += rows; }
+	else if( ch == 'g' || key.wVirtualKeyCode == VK_HOME )   { m_top = 0; }
+	else if( ch == 'G' || key.wVirtualKeyCode == VK_END )    { m_fFollow = true; }
+	else
+	{
+		/* Other keys (shift, ctrl...) only drop the line number typed so far. */
+		m_fFollow = fFollow;
+		m_fRedraw = (lineNumber != 0);
+	}
+
+	/* Scrolling down to the end follows it again. 
+	*/
+	ULONGLONG nLines = Lines();
+	ULONGLONG last   = (nLines > rows) ? nLines - rows : 0;
+	if( m_top >= last ) { m_fFollow = true; }
+	return true;
+}
+
+//==================================================================================================
+// Show our screen buffer and page until the user quits, drawing the screen again when a key moved
+// it, or when there's new output (at most every PAGER_POLL_MS). The relay is polled in between.
+//==================================================================================================
+DWORD CPager::Run( CRelay &relay )
+{
+	m_hInput = ::GetStdHandle( STD_INPUT_HANDLE );
+	::GetConsoleMode( m_hInput, &m_dwInputMode );
+	::SetConsoleMode( m_hInput, ENABLE_PROCESSED_INPUT|ENABLE_WINDOW_INPUT );
+	::SetConsoleActiveScreenBuffer( m_hScreen );
+
+	try
+	{
+		bool fQuit = false;
+		while( !fQuit )
+		{
+			if( !relay.IsDone() ) { relay.Poll( 0 ); }
+
+			if( m_fRedraw || m_fDrawnDone != relay.IsDone() || m_nDrawnLines != Lines() ) 
+			{ 
+				Draw( relay ); 
+			}
+
+			if( ::WaitForSingleObject( m_hInput, PAGER_POLL_MS ) != WAIT_OBJECT_0 ) { continue; }
+
+			INPUT_RECORD records[16];
+			DWORD        nRecords = 0;
+			if( !::ReadConsoleInputA( m_hInput, records, 16, &nRecords ) )
+			{
+				g_ssErr.str("");
+				g_ssErr << "Could not read the console input. " 
+				        << GetApiErrorString( ::GetLastError(), "ReadConsoleInput" );
+				PagerError( CR_STATUS_WINAPI, g_ssErr.str() );
+			}
+
+			for( DWORD i = 0; i < nRecords && !fQuit; i++ )
+			{
+				if( records[i].EventType == KEY_EVENT )                     { fQuit = !Key( records[i].Event.KeyEvent ); }
+				else if( records[i].EventType == WINDOW_BUFFER_SIZE_EVENT ) { m_fRedraw = true; }
+			}
+		}
+	}
+	catch( ... )
+	{
+		Restore();
+		throw;
+	}
+	Restore();
+
+	/* Quitting before the child is done stops it.
+	*/
+	if( !relay.IsDone() ) { relay.Abort(); }
+	return relay.Wait();
+}
+
+//==================================================================================================
+void CPager::Restore()
+{
+	::SetConsoleMode( m_hInput, m_dwInputMode );
+	::SetConsoleActiveScreenBuffer( ::GetStdHandle( STD_OUTPUT_HANDLE ) );
+}
@@ -0,0 +1,129 @@
+/***********************************************************************************************//**
+\file    Pager.h
+\author  hdaniel
+\version $Id$
+
+\brief Page through a child's output instead of scrolling it by (--pager).
+
+\details
+
+When a child prints millions of lines the console's scrollback only keeps the last few thousand,
+and drawing all of them is most of what cr spends its time on. With --pager the output is spooled
+to a temporary file instead, and only the screen the user is looking at is drawn, on a screen 
+buffer of its own; the rules color the lines on it as they're drawn. The child keeps running 
+while its output is paged, and the pager follows the end of the output until the user scrolls up.
+
+Each line is spooled with a byte saying which stream it came from. The spool is indexed as it's
+written: the offset of every Step()th line is kept, so the offset of line N is found from the
+index entry N / step and at most step - 1 lines read past it. When the index is full, every other
+entry is dropped and the step doubles, so memory stays bounded however much output there is;
+jumping to the end or to any line reads a bounded stretch of the spool.
+
+\license
+
+This file is free and unencumbered software released into the public domain.
+
+Anyone is free to copy, modify, publish, use, compile, sell, or distribute this software, either in
+source code form or as a compiled binary, for any purpose, commercial or non-commercial, and by any
+means.
+
+In jurisdictions that recognize copyright laws, the author or authors of this software dedicate any
+and all copyright interest in the software to the public domain. We make this dedication for the
+benefit of the public at large and to the detriment of our heirs and successors. We intend this
+dedication to be an overt act of relinquishment in perpetuity of all present and future rights to
+this software under copyright law.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT
+NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+For more information, please refer to <http://unlicense.org/>
+***************************************************************************************************/
+#ifndef _pager_h_
+#define _pager_h_
+
+#include <string>
+#include <vector>
+
+#include <windows.h>
+
+#include "ConsoleSink.h"
+#include "Relay.h"
+#include "RuleClassifier.h"
+#include "Utils\utils.h"
+
+//==================================================================================================
+// A CPager is the sink of a CRelay: Start() creates the spool and the sink is handed to the relay,
+// whose threads Write() to it. Once the child is running Run() pages through its output, on the
+// calling thread, until the user quits; quitting while the child still runs aborts the relay. 
+// Run() returns the child's exit code. Failures throw an exit_exception.
+//
+// The screen is drawn by a CConsoleSink of the pager's own, with the given options and the rules
+// of classifier, which must be started first. The sink classifies with a CRuleClassifier of the
+// pager's own as well: the lines it draws aren't the output's, so they mustn't go through the 
+// stream state of the classifier the other sinks use.
+//==================================================================================================
+class CPager : public IRelaySink
+{
+public:
+	CPager( WORD defaultAttr, CRuleClassifier &classifier );
+	~CPager();
+
+	void  Start( SConsoleOptions const &options );
+	DWORD Run( CRelay &relay );
+
+	virtual DWORD Write( EIoThreadType eStream, BYTE *pData, DWORD nBytes );
+	virtual DWORD EndOfStream( EIoThreadType eStream );
+
+	ULONGLONG Lines();
+	ULONGLONG Bytes();
+	ULONGLONG Step();
+
+private:
+	CPager( CPager const& );
+	CPager& operator=( CPager const& );
+
+	void      AddLine( EIoThreadType eStream, char const *pLine, size_t len );
+	DWORD     Flush();
+	ULONGLONG LineOffset( ULONGLONG iLine );
+	bool      ReadLine( ULONGLONG &offset, EIoThreadType &eStream, std::string &line, size_t maxLen );
+	bool      Fill( ULONGLONG offset );
+	void      Draw( CRelay &relay );
+	bool      Key( KEY_EVENT_RECORD const &key );
+	void      Restore();
+
+	WORD                    m_defaultAttr;
+	CRuleClassifier        &m_shared;          // the rules, see Start()
+	CRuleClassifier         m_classifier;      // m_shared's rules, for m_screen alone
+	CConsoleSink            m_screen;          // draws the visible lines on m_hScreen
+	HANDLE                  m_hSpool;
+	HANDLE                  m_hScreen;         // our screen buffer, active while paging
+	HANDLE                  m_hInput;
+	DWORD                   m_dwInputMode;     // to restore
+
+	/* the spool, written by the relay's threads */
+	utils::Mutex            m_mutex;
+	std::string             m_partial[2];      // unfinished lines, indexed by StdOutRead/StdErrRead
+	std::string             m_out;             // lines to spool, with their stream bytes
+	std::vector<ULONGLONG>  m_index;           // m_index[i] is the offset of line i * m_step
+	ULONGLONG               m_step;
+	ULONGLONG               m_nLines;
+	ULONGLONG               m_size;            // bytes spooled
+
+	/* the pager, on the thread in Run() */
+	std::string             m_block;           // the spool from m_blockOffset, see Fill()
+	ULONGLONG               m_blockOffset;
+	std::string             m_screenData;
+	ULONGLONG               m_top;             // the first line on the screen
+	ULONGLONG               m_nDrawnLines;     // lines spooled when the screen was drawn
+	bool                    m_fDrawnDone;      // and whether the child was done
+	SHORT                   m_rows;            // lines of output on the screen, the status line aside
+	SHORT                   m_columns;
+	bool                    m_fFollow;         // keep the end of the output on the screen
+	bool                    m_fRedraw;
+	ULONGLONG               m_lineNumber;      // typed so far, for 'g'
+};
+
+#endif // _pager_h_
@@ -0,0 +1,1950 @@
+/***********************************************************************************************//**
+\file    Relay.cpp
+\author  hdaniel
+\version $Id$
+
+\brief The CRelay engine: child process, pipes and the threads relaying them (see Relay.h).
+ 
+\details
+
+The relay is built from a few private classes: CIoRedirectionManager owns the pipes,
+CChildProcess the child and its job, COutputMerger orders the chunks for --ordered and
+COutputThrottle applies --max-lines/--max-bytes and collapsing to each stream. CRelay runs the
+threads that move data between them and the sink. When the relay stops, the threads are told
+through m_stopThreads and m_stopEvent; only pending pipe reads and the stdin thread's read of stdin
+are cancelled, so a chunk that's being rendered is always written whole.
+
+\license
+
+This file is free and unencumbered software released into the public domain.
+
+Anyone is free to copy, modify, publish, use, compile, sell, or distribute this software, either in
+source code form or as a compiled binary, for any purpose, commercial or non-commercial, and by any
+means.
+
+In jurisdictions that recognize copyright laws, the author or authors of this software dedicate any
+and all copyright interest in the software to the public domain. We make this dedication for the 
+benefit of the public at large and to the detriment of our heirs and successors. We intend this 
+dedication to be an overt act of relinquishment in perpetuity of all present and future rights to
+this software under copyright law.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT
+NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND 
+NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+For more information, please refer to <http://unlicense.org/>
+***************************************************************************************************/
+#include <deque>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "Relay.h"
+#include "Utils\ringbuffer.h"
+
+#define PIPE_BUFFER_SIZE  255
+#define OUTPUT_READ_SIZE  65536  // largest chunk of child output read at once
+#define IOCP_READ_DEPTH   2      // reads kept in flight per stream with IoEngineIocp
+#define IOCP_BATCH_SIZE   8      // completions reaped per wait with IoEngineIocp
+#define CLOSEHANDLE(h)    if( h && h != INVALID_HANDLE_VALUE )  { ::CloseHandle( h ); h = 0; }
+
+static utils::Mutex g_spawnMutex;  // see CRelay::Run()
+
+//==================================================================================================
+inline void RelayError( int code, std::string const &errMsg ) 
+{ 
+    throw exit_exception( errMsg.c_str(), code );
+}
+
+//==================================================================================================
+// Get the systems error message associated with dwErrorCode.
+//==================================================================================================
+std::string GetApiErrorString( DWORD dwErrorCode, std::string const& apiNameStr )
+{
+    LPVOID pFormatBuffer;
+
+    ::FormatMessageA( FORMAT_MESSAGE_ALLOCATE_BUFFER|FORMAT_MESSAGE_FROM_SYSTEM,
+                      NULL, dwErrorCode,
+                      MAKELANGID(LANG_NEUTRAL, SUBLANG_DEFAULT),
+                      (LPSTR)&pFormatBuffer, 0, NULL );
+
+    /* remove the trailing \r\n from the returned message */
+    char *pCrlf = ::strchr( (char*)pFormatBuffer, '\r' );
+    if( pCrlf ) { *pCrlf = '\0'; }
+
+    std::stringstream ss;
+    ss << "[WINAPI - " << apiNameStr << "](" << (int)dwErrorCode << ") " << (char*)pFormatBuffer;
+
+    ::LocalFree( pFormatBuffer );
+	return ss.str();
+}
+
+//==================================================================================================
+class CIoRedirectionManager
+{
+public:
+	CIoRedirectionManager()
+		: m_hStdOutWrite(0), m_hStdErrWrite(0), m_hStdInRead(0)
+		, m_hStdOutRead(0) , m_hStdErrRead(0) , m_hStdInWrite(0)
+	{ 
+	}
+
+	~CIoRedirectionManager() { DestroyPipeHandles(); }
+	
+	BOOL DestroyPipeHandles()
+	{
+		CLOSEHANDLE( m_hStdOutWrite );
+		CLOSEHANDLE( m_hStdErrWrite );
+		CLOSEHANDLE( m_hStdInRead );
+
+		CLOSEHANDLE( m_hStdOutRead );
+		CLOSEHANDLE( m_hStdErrRead );
+		CLOSEHANDLE( m_hStdInWrite );
+
+		return TRUE;
+	}
+
+	/* The parent-side handles are opened for overlapped i/o, so that a read or write that's blocked
+	 * on a pipe held open outside the child's tree can be cancelled without cancelling anything 
+	 * else the thread may be doing (see CRelay::StopThreads()).
+	*/
+	BOOL CreatePipeHandles()
+	{
+		HANDLE hStdOutTmp, hStdErrTmp, hStdInTmp;
+		
+		/* Set up the security attributes and create the child-side io pipe handles.
+		*/
+		SECURITY_ATTRIBUTES sa;
+		sa.nLength              = sizeof(SECURITY_ATTRIBUTES);
+		sa.lpSecurityDescriptor = NULL;
+		sa.bInheritHandle       = TRUE;
+
+		if( !CreateOverlappedPipe( &hStdOutTmp, &m_hStdOutWrite, &sa, true )
+			|| !CreateOverlappedPipe( &hStdErrTmp, &m_hStdErrWrite, &sa, true )
+			|| !CreateOverlappedPipe( &hStdInTmp, &m_hStdInRead, &sa, false ) ) 
+		{ 
+            std::stringstream ssErr;
+            ssErr << "Could not create chid-side pipe handles. " 
+                    << GetApiErrorString( ::GetLastError(), "CreateNamedPipe" );
+			
+            RelayError( CR_STATUS_WINAPI, ssErr.str() );
+		}
+
+		/* Create copies of the parent-side pipe handles with Properties set to FALSE to prevent
+		 * them from being inherited by the child process and making them uncloseable.
+		*/
+		HANDLE hProcess = ::GetCurrentProcess();
+		if( !::DuplicateHandle( hProcess, hStdOutTmp, hProcess, &m_hStdOutRead, 0, FALSE, DUPLICATE_SAME_ACCESS )
+			|| !::DuplicateHandle( hProcess, hStdErrTmp, hProcess, &m_hStdErrRead, 0, FALSE, DUPLICATE_SAME_ACCESS )
+			|| !::DuplicateHandle( hProcess, hStdInTmp, hProcess, &m_hStdInWrite, 0, FALSE, DUPLICATE_SAME_ACCESS ) ) 
+		{ 
+            DWORD dwLastError = ::GetLastError();
+			
+            std::stringstream ssErr;
+            ssErr << "Could not create chid-side pipe handles. " 
+                    << GetApiErrorString( dwLastError, "DuplicateHandle" );
+			
+            DestroyPipeHandles();
+            RelayError( CR_STATUS_WINAPI, ssErr.str() );
+		}
+
+		/* Now that a duplicate set of parent-side pipe handles have been created, close the 
+		 * original handles to prevent them from being inhereted by the child process.
+		*/
+		CLOSEHANDLE( hStdOutTmp );
+		CLOSEHANDLE( hStdErrTmp );
+		CLOSEHANDLE( hStdInTmp );
+
+		return TRUE;
+	}
+
+	void CloseStdInWrite() { CLOSEHANDLE( m_hStdInWrite ); }
+
+	BOOL CloseChildSidePipeHandles()
+	{
+		/* Close child-side pipe handles to make sure that no handles to the pipes are maintained
+		 * in this process or else the pipe will not close when the child process exits and the 
+		 * ReadFile will hang. 
+		 *
+		 * Note: This function should be called right after the child process has been created in a
+		 * suspended state and before it is resumed.
+		*/
+		CLOSEHANDLE( m_hStdOutWrite );
+		CLOSEHANDLE( m_hStdErrWrite );
+		CLOSEHANDLE( m_hStdInRead );
+
+		return TRUE;
+	}
+
+	HANDLE GetStdOutWrite() { return m_hStdOutWrite; }
+	HANDLE GetStdErrWrite() { return m_hStdErrWrite; }
+	HANDLE GetStdInRead()   { return m_hStdInRead; }
+	
+	HANDLE GetStdOutRead()  { return m_hStdOutRead; }
+	HANDLE GetStdErrRead()  { return m_hStdErrRead; }
+	HANDLE GetStdInWrite()  { return m_hStdInWrite; }
+
+private:
+	/* Anonymous pipes can't do overlapped i/o, so these are named pipes with a name of their own.
+	 * Only our end (*phParent) is overlapped, the child gets an ordinary synchronous handle. The 
+	 * read end of an output pipe gets OUTPUT_READ_SIZE of buffering, so the child can go on 
+	 * writing while a chunk is being rendered.
+	*/
+	static BOOL CreateOverlappedPipe( HANDLE *phParent, HANDLE *phChild, SECURITY_ATTRIBUTES *pSa, 
+	                                  bool fInbound )
+	{
+		static volatile LONG s_serial = 0;
+
+		char name[64];
+		utils::strnfmt( name, sizeof(name), "\\\\.\\pipe\\cr-relay-%lu-%ld", 
+		                ::GetCurrentProcessId(), ::InterlockedIncrement( &s_serial ) );
+
+		DWORD dwOpenMode = (fInbound ? PIPE_ACCESS_INBOUND : PIPE_ACCESS_OUTBOUND)
+		                   |FILE_FLAG_OVERLAPPED|FILE_FLAG_FIRST_PIPE_INSTANCE;
+		*phParent = ::CreateNamedPipeA( name, dwOpenMode, PIPE_TYPE_BYTE|PIPE_WAIT|PIPE_REJECT_REMOTE_CLIENTS, 1, 
+		                                fInbound ? 0 : PIPE_BUFFER_SIZE, fInbound ? OUTPUT_READ_SIZE : 0, 
+		                                0, pSa );
+		if( *phParent == INVALID_HANDLE_VALUE ) { return FALSE; }
+
+		*phChild = ::CreateFileA( name, fInbound ? GENERIC_WRITE : GENERIC_READ, 0, pSa, OPEN_EXISTING, 
+		                          FILE_ATTRIBUTE_NORMAL, NULL );
+		if( *phChild == INVALID_HANDLE_VALUE ) 
+		{
+			::CloseHandle( *phParent );
+			return FALSE;
+		}
+		return TRUE;
+	}
+
+	HANDLE m_hStdOutWrite, m_hStdErrWrite, m_hStdInRead;  // child-side handles
+	HANDLE m_hStdOutRead,  m_hStdErrRead,  m_hStdInWrite; // parent-side handles
+};
+
+//==================================================================================================
+// Owns the child process and the job object it's placed in. The child is started suspended in its
+// own console process group so that on abort it, and anything it started from the same console,
+// can be asked to stop with a CTRL_BREAK_EVENT and, failing that, be terminated as a whole through
+// the job object. None of this depends on the number of windows on the desktop.
+//
+// The job also tells us when the last process of the tree has exited: its completion port receives
+// JOB_OBJECT_MSG_ACTIVE_PROCESS_ZERO, which a small monitor thread turns into the m_treeExited
+// event. This works even when a grandchild still holds the write end of one of our pipes, where
+// waiting for EOF would never finish.
+//==================================================================================================
+class CChildProcess
+{
+public:
+	CChildProcess() : m_hJob(0), m_hJobPort(0), m_hMonitor(0), m_fConsole(true) { ::ZeroMemory( &m_pi, sizeof(m_pi) ); }
+
+	~CChildProcess() { Close(); }
+
+	BOOL Create( wchar_t *cmdLine, STARTUPINFO &si, wchar_t const *pCurDir, void *pEnvironment )
+	{
+		DWORD dwFlags = CREATE_SUSPENDED|CREATE_NEW_PROCESS_GROUP;
+		if( pEnvironment ) { dwFlags |= CREATE_UNICODE_ENVIRONMENT; }
+
+		if( !::CreateProcessW( NULL, cmdLine, NULL, NULL, TRUE, dwFlags, pEnvironment, pCurDir, &si, &m_pi ) )
+		{
+            std::stringstream ssErr;
+            ssErr << "Could not create child process. " 
+                    << GetApiErrorString( ::GetLastError(), "CreateProcess" );
+			
+            RelayError( CR_STATUS_WINAPI, ssErr.str() );
+		}
+		m_fConsole = IsConsoleProgram( m_pi.hProcess );
+
+		/* Placing the child in a job fails when we're running inside a job that doesn't allow 
+		 * nesting (pre Windows 8). That's not fatal, the 'tree' then consists of the child alone.
+		*/
+		JOBOBJECT_ASSOCIATE_COMPLETION_PORT jacp;
+
+		m_hJob     = ::CreateJobObject( NULL, NULL );
+		m_hJobPort = ::CreateIoCompletionPort( INVALID_HANDLE_VALUE, NULL, 0, 1 );
+
+		jacp.CompletionKey  = m_hJob;
+		jacp.CompletionPort = m_hJobPort;
+
+		if( !m_hJob || !m_hJobPort
+			|| !::SetInformationJobObject( m_hJob, JobObjectAssociateCompletionPortInformation, 
+			                               &jacp, sizeof(jacp) )
+			|| !::AssignProcessToJobObject( m_hJob, m_pi.hProcess ) 
+			|| !(m_hMonitor = ::CreateThread( NULL, 0, JobMonitorThread, this, 0, NULL )) )
+		{
+			CLOSEHANDLE( m_hJob );
+			CLOSEHANDLE( m_hJobPort );
+		}
+
+		return TRUE;
+	}
+
+	BOOL Resume()
+	{
+		if( (DWORD)-1 == ::ResumeThread( m_pi.hThread ) ) 
+		{ 
+			std::stringstream ssErr;
+			ssErr << "Could not resume child process. " 
+					<< GetApiErrorString( ::GetLastError(), "ResumeThread" );
+			
+			RelayError( CR_STATUS_WINAPI, ssErr.str() );
+		}
+		return TRUE;
+	}
+
+	/* Escalating shutdown: CTRL_BREAK_EVENT to the child's process group, then after dwGrace_ms
+	 * terminate whatever is left of the tree and give it dwKill_ms to go away. The time this takes
+	 * is bounded by the sum of the two deadlines.
+	 *
+	 * A new process group starts with Ctrl+C disabled, and CTRL_C_EVENT can't be sent to a group
+	 * anyway, so Ctrl+Break is the only signal the child gets. A child without a console (a GUI
+	 * program) gets no signal at all, so it's terminated without waiting out the grace period.
+	*/
+	BOOL Shutdown( DWORD dwGrace_ms, DWORD dwKill_ms )
+	{
+		if( dwGrace_ms && m_fConsole && ::GenerateConsoleCtrlEvent( CTRL_BREAK_EVENT, m_pi.dwProcessId ) )
+		{
+			::WaitForSingleObject( m_pi.hProcess, dwGrace_ms );
+		}
+
+		/* Without a job there's nothing left to terminate once the child itself has exited.
+		*/
+		if( !m_hJob && WAIT_OBJECT_0 == ::WaitForSingleObject( m_pi.hProcess, 0 ) ) { return TRUE; }
+
+		BOOL fTerminated = m_hJob ? ::TerminateJobObject( m_hJob, (UINT)CR_STATUS_ABORTED )
+		                          : ::TerminateProcess( m_pi.hProcess, (UINT)CR_STATUS_ABORTED );
+		if( !fTerminated )
+		{
+			std::stringstream ssErr;
+			ssErr << "Could not force terminate child process. " 
+					<< GetApiErrorString( ::GetLastError(), m_hJob ? "TerminateJobObject" : "TerminateProcess" );
+			
+			RelayError( CR_STATUS_WINAPI, ssErr.str() );
+		}
+
+		if( WAIT_OBJECT_0 != ::WaitForSingleObject( m_pi.hProcess, dwKill_ms ) )
+		{
+			std::stringstream ssErr;
+			ssErr << "Child process did not exit within " << dwKill_ms << "ms of being terminated.";
+			
+			RelayError( CR_STATUS_ABORTED, ssErr.str() );
+		}
+		return TRUE;
+	}
+
+	void Close()
+	{
+		if( m_hMonitor )
+		{
+			::PostQueuedCompletionStatus( m_hJobPort, 0, 0, NULL );
+			::WaitForSingleObject( m_hMonitor, INFINITE );
+			CLOSEHANDLE( m_hMonitor );
+		}
+		CLOSEHANDLE( m_pi.hThread );
+		CLOSEHANDLE( m_pi.hProcess );
+		CLOSEHANDLE( m_hJob );
+		CLOSEHANDLE( m_hJobPort );
+	}
+
+	/* Signaled once every process in the child's tree has exited. Without a job, once the child 
+	 * has exited.
+	*/
+	HANDLE GetTreeExitHandle() { return m_hJob ? (HANDLE)m_treeExited : m_pi.hProcess; }
+
+	BOOL GetResourceUsage( SResourceUsage &usage )
+	{
+		::ZeroMemory( &usage, sizeof(usage) );
+		if( m_hJob )
+		{
+			JOBOBJECT_BASIC_AND_IO_ACCOUNTING_INFORMATION acct;
+			JOBOBJECT_EXTENDED_LIMIT_INFORMATION          limits;
+
+			if( !::QueryInformationJobObject( m_hJob, JobObjectBasicAndIoAccountingInformation, 
+				                              &acct, sizeof(acct), NULL ) )
+			{
+				return FALSE;
+			}
+			usage.dwProcesses   = acct.BasicInfo.TotalProcesses;
+			usage.ullUserTime   = acct.BasicInfo.TotalUserTime.QuadPart;
+			usage.ullKernelTime = acct.BasicInfo.TotalKernelTime.QuadPart;
+			usage.ullReadBytes  = acct.IoInfo.ReadTransferCount;
+			usage.ullWriteBytes = acct.IoInfo.WriteTransferCount;
+
+			if( ::QueryInformationJobObject( m_hJob, JobObjectExtendedLimitInformation, 
+				                             &limits, sizeof(limits), NULL ) )
+			{
+				usage.ullPeakMemory = limits.PeakJobMemoryUsed;
+			}
+			return TRUE;
+		}
+
+		/* No job, so only the child itself can be accounted for.
+		*/
+		FILETIME    ftCreate, ftExit, ftKernel, ftUser;
+		IO_COUNTERS ioCounters;
+
+		if( !::GetProcessTimes( m_pi.hProcess, &ftCreate, &ftExit, &ftKernel, &ftUser ) ) { return FALSE; }
+		usage.dwProcesses   = 1;
+		usage.ullUserTime   = ((ULONGLONG)ftUser.dwHighDateTime << 32) | ftUser.dwLowDateTime;
+		usage.ullKernelTime = ((ULONGLONG)ftKernel.dwHighDateTime << 32) | ftKernel.dwLowDateTime;
+		if( ::GetProcessIoCounters( m_pi.hProcess, &ioCounters ) )
+		{
+			usage.ullReadBytes  = ioCounters.ReadTransferCount;
+			usage.ullWriteBytes = ioCounters.WriteTransferCount;
+		}
+		return TRUE;
+	}
+
+	HANDLE GetProcess()   { return m_pi.hProcess; }
+	HANDLE GetThread()    { return m_pi.hThread; }
+	DWORD  GetProcessId() { return m_pi.dwProcessId; }
+
+private:
+	static DWORD WINAPI JobMonitorThread( LPVOID lpvThreadParam )
+	{
+		CChildProcess *pThis = (CChildProcess*)lpvThreadParam;
+
+		DWORD        dwMsg;
+		ULONG_PTR    key;
+		LPOVERLAPPED pOverlapped;
+
+		/* A zero key is our own wake-up from Close(), job notifications carry the job handle.
+		*/
+		while( ::GetQueuedCompletionStatus( pThis->m_hJobPort, &dwMsg, &key, &pOverlapped, INFINITE ) 
+			   && key != 0 )
+		{
+			if( dwMsg == JOB_OBJECT_MSG_ACTIVE_PROCESS_ZERO ) { pThis->m_treeExited.Signal(); }
+		}
+		return 0;
+	}
+
+	/* Windows programs are the ones SHGetFileInfo() gives a version for, anything it can't tell
+	 * is taken to be a console program.
+	*/
+	static bool IsConsoleProgram( HANDLE hProcess )
+	{
+		wchar_t path[MAX_PATH];
+		DWORD   cchPath = MAX_PATH;
+		if( !::QueryFullProcessImageNameW( hProcess, 0, path, &cchPath ) ) { return true; }
+
+		DWORD_PTR exeType = ::SHGetFileInfoW( path, 0, NULL, 0, SHGFI_EXETYPE );
+		return exeType == 0 || HIWORD(exeType) == 0;
+	}
+
+	PROCESS_INFORMATION m_pi;
+	HANDLE              m_hJob;
+	HANDLE              m_hJobPort;
+	HANDLE              m_hMonitor;
+	bool                m_fConsole;    // the child is a console program, see Shutdown()
+	utils::Event        m_treeExited;
+};
+
+//==================================================================================================
+// A chunk of child output as read from one of its pipes, stamped at read time.
+//==================================================================================================
+struct SOutputChunk
+{
+	LONG          seq;    // read order across both streams
+	LONGLONG      stamp;  // QueryPerformanceCounter() at read time
+	EIoThreadType eType;
+	DWORD         nBytes;
+	BYTE          data[OUTPUT_READ_SIZE];
+};
+
+//==================================================================================================
+// With fOrdered (--ordered), the output readers don't deliver to the sink themselves. Each chunk is stamped
+// with a sequence number as soon as its ReadFile() returns and queued here, and a single renderer
+// thread takes them back out in stamp order. That fixes the stdout/stderr mix-ups described above
+// CRelay::ReadAndPutOutputThread without serializing the readers on the sink.
+//
+// Each stream's queue is in stamp order already, so when both streams have a chunk pending the
+// smaller stamp is next. When only one has, a chunk of the other stream may still be in flight
+// (read but not yet queued), so the pending chunk is held for up to the reorder window before it's
+// rendered anyway. Once a stream has ended nothing is held for it.
+//
+// Chunks are recycled through a free list, and a reader waits when its stream has MAX_PENDING
+// chunks queued, so a slow console bounds memory rather than growing it.
+//==================================================================================================
+class COutputMerger
+{
+public:
+	enum { MAX_PENDING = 16 };
+
+	COutputMerger() : m_seq(0), m_window(0), m_ticksPerMs(1) { m_fEnded[0] = m_fEnded[1] = false; }
+
+	~COutputMerger()
+	{
+		for( size_t i = 0; i < m_free.size(); i++ ) { delete m_free[i]; }
+		for( int i = 0; i < 2; i++ )
+		{
+			for( size_t j = 0; j < m_pending[i].size(); j++ ) { delete m_pending[i][j]; }
+		}
+	}
+
+	void SetWindow( DWORD dwWindow_ms )
+	{
+		LARGE_INTEGER freq;
+		::QueryPerformanceFrequency( &freq );
+		m_window     = freq.QuadPart * dwWindow_ms / 1000;
+		m_ticksPerMs = freq.QuadPart / 1000 + 1;
+	}
+
+	/* Get a chunk to read stream eType into, waiting while the stream has too many queued.
+	*/
+	SOutputChunk* GetFreeChunk( EIoThreadType eType )
+	{
+		SOutputChunk *pChunk;
+
+		m_mutex.Enter();
+		while( m_pending[eType].size() >= MAX_PENDING ) { m_cond.Wait( m_mutex ); }
+		if( m_free.empty() ) 
+		{ 
+			pChunk = new SOutputChunk; 
+		}
+		else
+		{
+			pChunk = m_free.back();
+			m_free.pop_back();
+		}
+		m_mutex.Leave();
+
+		pChunk->eType = eType;
+		return pChunk;
+	}
+
+	/* Stamp a chunk that was just read and queue it for rendering.
+	*/
+	void Push( SOutputChunk *pChunk )
+	{
+		LARGE_INTEGER now;
+		::QueryPerformanceCounter( &now );
+		pChunk->seq   = ::InterlockedIncrement( &m_seq );
+		pChunk->stamp = now.QuadPart;
+
+		m_mutex.Enter();
+		m_pending[pChunk->eType].push_back( pChunk );
+		m_mutex.Leave();
+		m_cond.WakeAll();
+	}
+
+	void Release( SOutputChunk *pChunk )
+	{
+		m_mutex.Enter();
+		m_free.push_back( pChunk );
+		m_mutex.Leave();
+	}
+
+	void EndOfStream( EIoThreadType eType )
+	{
+		m_mutex.Enter();
+		m_fEnded[eType] = true;
+		m_mutex.Leave();
+		m_cond.WakeAll();
+	}
+
+	/* Next chunk in stamp order, or NULL once both streams have ended and been drained.
+	*/
+	SOutputChunk* Pop()
+	{
+		int next;
+
+		m_mutex.Enter();
+		while( 1 )
+		{
+			bool fOut = !m_pending[StdOutRead].empty();
+			bool fErr = !m_pending[StdErrRead].empty();
+
+			if( fOut && fErr )
+			{
+				/* difference rather than comparison so a wrapped sequence still orders */
+				LONG diff = m_pending[StdOutRead].front()->seq - m_pending[StdErrRead].front()->seq;
+				next = (diff < 0) ? StdOutRead : StdErrRead;
+				break;
+			}
+			if( !fOut && !fErr )
+			{
+				if( m_fEnded[StdOutRead] && m_fEnded[StdErrRead] ) { m_mutex.Leave(); return NULL; }
+				m_cond.Wait( m_mutex );
+				continue;
+			}
+
+			next = fOut ? StdOutRead : StdErrRead;
+			if( m_fEnded[1 - next] ) { break; }
+
+			LARGE_INTEGER now;
+			::QueryPerformanceCounter( &now );
+			LONGLONG age = now.QuadPart - m_pending[next].front()->stamp;
+			if( age >= m_window ) { break; }
+
+			m_cond.Wait( m_mutex, (DWORD)((m_window - age) / m_ticksPerMs) + 1 );
+		}
+
+		SOutputChunk *pChunk = m_pending[next].front();
+		m_pending[next].pop_front();
+		m_mutex.Leave();
+
+		/* a reader may be waiting for its queue to drop below MAX_PENDING */
+		m_cond.WakeAll();
+		return pChunk;
+	}
+
+private:
+	utils::Mutex               m_mutex;
+	utils::ConditionVariable   m_cond;
+	std::deque<SOutputChunk*>  m_pending[2];  // indexed by StdOutRead/StdErrRead
+	std::vector<SOutputChunk*> m_free;
+	bool                       m_fEnded[2];
+	volatile LONG              m_seq;
+	LONGLONG                   m_window;      // reorder window in QueryPerformanceCounter() ticks
+	LONGLONG                   m_ticksPerMs;
+};
+
+//==================================================================================================
+// Keeps a runaway child from making the console the bottleneck. Each output stream has one, used
+// by whichever thread renders that stream, and only ever drops or summarizes what is written to
+// the sink; the readers keep draining the pipes at full speed either way.
+//
+//   - Rate limiting: within each one second window the first dwMaxLines lines (dwMaxBytes bytes)
+//     are written, the rest are counted and reported as "N lines suppressed" when the next window
+//     starts or the stream ends. The last dwStormKeep suppressed lines are written after the 
+//     report, so both the head and the tail of a storm are visible.
+//   - Duplicate collapsing (fCollapse): a line identical to the previous one is only counted,
+//     and reported as "last line repeated N times" once a different line arrives.
+//   - Progress collapsing (dwProgressRate): a line rewritten in place, with a bare '\r' (progress
+//     bars), is redrawn at most dwProgressRate times a second with its latest state, and its final
+//     state is always written before its line terminator. The states in between are dropped, and
+//     so is what the longer of them would have left on the line.
+//
+// All work on whole lines, but a partial line at the end of a chunk isn't held back (it may be a
+// prompt). Such a line is written, or dropped, as a whole as its remainder arrives, and is never a
+// candidate for collapsing. A progress state that's held back is drawn with the stream's next
+// output, or at its end.
+//==================================================================================================
+class COutputThrottle
+{
+public:
+	COutputThrottle( SRelayOptions const &options ) 
+		: m_options(options), m_dwWindowStart(0), m_nLines(0), m_nBytes(0), m_nSuppressed(0), m_nRepeats(0)
+		, m_eMidLine(LineStart), m_fHavePrev(false), m_fLastAdmitted(false)
+		, m_dwLastDraw(0), m_fRewriting(false), m_nShown(0)
+	{ 
+	}
+
+	/* Filter a chunk of output read at dwNow (GetTickCount()) and return what to write instead.
+	*/
+	std::string const& Filter( char const *pData, size_t nBytes, DWORD dwNow )
+	{
+		m_out.clear();
+
+		if( dwNow - m_dwWindowStart >= 1000 && m_eMidLine == LineStart )
+		{
+			FlushSuppressed();
+			m_dwWindowStart = dwNow;
+			m_nLines = m_nBytes = 0;
+		}
+
+		if( m_options.dwProgressRate )
+		{
+			CollapseProgress( pData, nBytes, dwNow, false );
+			Lines( m_progress.data(), m_progress.size() );
+		}
+		else
+		{
+			Lines( pData, nBytes );
+		}
+		return m_out;
+	}
+
+	/* The stream has ended, report anything still pending.
+	*/
+	std::string const& Flush()
+	{
+		m_out.clear();
+		if( m_options.dwProgressRate )
+		{
+			CollapseProgress( NULL, 0, 0, true );
+			Lines( m_progress.data(), m_progress.size() );
+		}
+		FlushRepeats();
+		FlushSuppressed();
+		return m_out;
+	}
+
+private:
+	enum EMidLine { LineStart, LinePassed, LineDropped };
+
+	void Lines( char const *pData, size_t nBytes )
+	{
+		char const *end = pData + nBytes;
+		while( pData < end )
+		{
+			char const *eol = (char const*)::memchr( pData, '\n', end - pData );
+			size_t      len = eol ? (eol - pData + 1) : (end - pData);
+
+			if( m_eMidLine != LineStart )
+			{
+				/* remainder of a line whose start has already been written or dropped */
+				if( m_eMidLine == LinePassed ) { m_out.append( pData, len ); m_nBytes += len; }
+				else if( !m_tail.empty() )     { m_tail.back().append( pData, len ); }
+			}
+			else if( eol ) 
+			{ 
+				Line( pData, len ); 
+			}
+			else
+			{
+				FlushRepeats();
+				m_fHavePrev = false;
+				Admit( pData, len );
+			}
+
+			if( eol )                          { m_eMidLine = LineStart; }
+			else if( m_eMidLine == LineStart ) { m_eMidLine = m_fLastAdmitted ? LinePassed : LineDropped; }
+			pData += len;
+		}
+	}
+
+	/* Reduce the rewrites of a line in pData[0..nBytes) to the states to draw, into m_progress.
+	 * m_state is the line since its last bare '\r', of which m_nShown bytes have been written
+	 * (npos while the '\r' itself hasn't been). '\r's at the end of a chunk may be the start of a
+	 * "\r\n" and wait for the next chunk in m_crs.
+	*/
+	void CollapseProgress( char const *pData, size_t nBytes, DWORD dwNow, bool fEnd )
+	{
+		m_progress.clear();
+		if( !m_crs.empty() )
+		{
+			m_crs.append( pData, nBytes );
+			m_chunk.swap( m_crs );
+			m_crs.clear();
+			pData  = m_chunk.data();
+			nBytes = m_chunk.size();
+		}
+
+		char const *end = pData + nBytes;
+		while( pData < end )
+		{
+			char const *eol  = (char const*)::memchr( pData, '\n', end - pData );
+			char const *stop = eol ? eol : end;
+			char const *cr;
+
+			while( stop > pData && stop[-1] == '\r' ) { stop--; }  // line terminator
+			for( cr = stop; cr > pData && cr[-1] != '\r'; cr-- ) { }
+
+			if( cr > pData )
+			{
+				m_state.assign( cr, stop - cr );
+				m_nShown     = std::string::npos;
+				m_fRewriting = true;
+			}
+			else if( m_fRewriting ) { m_state.append( pData, stop - pData ); }
+			else                    { m_progress.append( pData, stop - pData ); }
+
+			if( eol )
+			{
+				if( m_fRewriting ) { DrawProgress(); }
+				m_progress.append( stop, eol + 1 - stop );
+				m_fRewriting = false;
+				m_state.clear();
+				pData = eol + 1;
+			}
+			else
+			{
+				if( fEnd ) { m_progress.append( stop, end - stop ); }
+				else       { m_crs.assign( stop, end - stop ); }
+				pData = end;
+			}
+		}
+
+		if( m_fRewriting && (fEnd || dwNow - m_dwLastDraw >= 1000 / m_options.dwProgressRate) )
+		{
+			DrawProgress();
+			m_dwLastDraw = dwNow;
+		}
+	}
+
+	void DrawProgress()
+	{
+		if( m_nShown == std::string::npos ) { m_progress += '\r'; m_nShown = 0; }
+		m_progress.append( m_state, m_nShown, std::string::npos );
+		m_nShown = m_state.size();
+	}
+
+	void Line( char const *pLine, size_t len )
+	{
+		if( m_options.fCollapse && m_fHavePrev && m_prevLine.compare( 0, std::string::npos, pLine, len ) == 0 )
+		{
+			m_nRepeats++;
+			return;
+		}
+		FlushRepeats();
+		Admit( pLine, len );
+
+		if( m_options.fCollapse ) { m_prevLine.assign( pLine, len ); m_fHavePrev = true; }
+	}
+
+	void Admit( char const *pLine, size_t len )
+	{
+		m_fLastAdmitted = (!m_options.dwMaxLines || m_nLines < m_options.dwMaxLines) 
+		                  && (!m_options.dwMaxBytes || m_nBytes + len <= m_options.dwMaxBytes);
+		if( m_fLastAdmitted )
+		{
+			m_out.append( pLine, len );
+			m_nLines++;
+			m_nBytes += len;
+			return;
+		}
+
+		m_nSuppressed++;
+		if( m_options.dwStormKeep )
+		{
+			if( m_tail.size() == m_options.dwStormKeep ) { m_tail.pop_front(); }
+			m_tail.push_back( std::string( pLine, len ) );
+		}
+	}
+
+	void FlushRepeats()
+	{
+		if( m_nRepeats == 1 ) 
+		{ 
+			Admit( m_prevLine.data(), m_prevLine.size() ); 
+		}
+		else if( m_nRepeats )
+		{
+			m_out += utils::strfmt( "[cr] last line repeated %lu times\r\n", m_nRepeats );
+		}
+		m_nRepeats = 0;
+	}
+
+	void FlushSuppressed()
+	{
+		if( !m_nSuppressed ) { return; }
+
+		m_out += utils::strfmt( "[cr] %lu lines suppressed\r\n", m_nSuppressed );
+		for( size_t i = 0; i < m_tail.size(); i++ ) { m_out += m_tail[i]; }
+		m_tail.clear();
+		m_nSuppressed = 0;
+	}
+
+	SRelayOptions const    &m_options;
+	DWORD                   m_dwWindowStart;
+	DWORD                   m_nLines;       // lines written in the current window
+	DWORD                   m_nBytes;       // bytes written in the current window
+	unsigned long           m_nSuppressed;  // lines dropped in the current window
+	unsigned long           m_nRepeats;     // repeats of m_prevLine not yet reported
+	EMidLine                m_eMidLine;
+	bool                    m_fHavePrev;
+	bool                    m_fLastAdmitted;
+	std::string             m_prevLine;
+	std::deque<std::string> m_tail;         // last dwStormKeep suppressed lines
+	std::string             m_out;
+
+	/* progress collapsing, see CollapseProgress() */
+	DWORD                   m_dwLastDraw;
+	bool                    m_fRewriting;   // the current line has had a bare '\r'
+	std::string             m_state;
+	size_t                  m_nShown;
+	std::string             m_crs;
+	std::string             m_chunk;
+	std::string             m_progress;     // what's left of the chunk
+};
+
+
+//==================================================================================================
+// A read of IoEngineIocp, kept in flight on one of the child's output pipes. ov comes first, so
+// the OVERLAPPED* a completion is reported with is the SIocpRead*.
+//==================================================================================================
+struct SIocpRead
+{
+	OVERLAPPED    ov;
+	DWORD         seq;       // issue order within the stream
+	bool          fPending;  // issued and not completed yet
+	bool          fDone;     // completed, waiting for its turn to be rendered
+	DWORD         nBytes;
+	DWORD         dwError;
+	LONGLONG      stamp;     // QueryPerformanceCounter() when it completed
+	BYTE          data[OUTPUT_READ_SIZE];
+};
+
+//==================================================================================================
+// One of the child's output streams as read by CRelay::IocpOutputThread(). A pipe completes its reads
+// in the order they were issued, and each completed read is reissued once it's rendered, so read
+// seq always lives in slot seq % IOCP_READ_DEPTH.
+//==================================================================================================
+struct SIocpStream
+{
+	SIocpStream() : hPipe(NULL), pStats(NULL), dwIssued(0), dwRendered(0)
+	              , fSkipOnSuccess(false), fEnded(false), fClosed(false)
+	{
+		for( int i = 0; i < IOCP_READ_DEPTH; i++ ) { pReads[i] = NULL; }
+	}
+
+	~SIocpStream()
+	{
+		for( int i = 0; i < IOCP_READ_DEPTH; i++ ) { delete pReads[i]; }
+	}
+
+	/* Issue a read into the slot. When it completes right away the completion port won't hear of it
+	 * (FILE_SKIP_COMPLETION_PORT_ON_SUCCESS, or a failure), so it's completed here.
+	*/
+	void Issue( SIocpRead *pRead )
+	{
+		::ZeroMemory( &pRead->ov, sizeof(OVERLAPPED) );
+		pRead->seq      = dwIssued++;
+		pRead->fPending = true;
+		pStats->ullCalls++;
+
+		if( ::ReadFile( hPipe, pRead->data, OUTPUT_READ_SIZE-1, NULL, &pRead->ov ) )
+		{
+			if( fSkipOnSuccess ) { Complete( pRead ); }
+		}
+		else if( (pRead->dwError = ::GetLastError()) != ERROR_IO_PENDING )
+		{
+			pRead->fPending = false;
+			pRead->fDone    = true;
+			pRead->nBytes   = 0;
+		}
+	}
+
+	void Complete( SIocpRead *pRead )
+	{
+		LARGE_INTEGER now;
+		::QueryPerformanceCounter( &now );
+
+		pRead->stamp    = now.QuadPart;
+		pRead->nBytes   = 0;
+		pRead->dwError  = ::GetOverlappedResult( hPipe, &pRead->ov, &pRead->nBytes, FALSE ) ? 0 : ::GetLastError();
+		pRead->fPending = false;
+		pRead->fDone    = true;
+		pStats->ullBytes += pRead->nBytes;
+	}
+
+	/* The read to render next, or NULL when it hasn't completed yet.
+	*/
+	SIocpRead* Next()
+	{
+		SIocpRead *pRead = pReads[dwRendered % IOCP_READ_DEPTH];
+		return (pRead->fDone && pRead->seq == dwRendered) ? pRead : NULL;
+	}
+
+	bool IsIdle() const
+	{
+		for( int i = 0; i < IOCP_READ_DEPTH; i++ ) 
+		{ 
+			if( pReads[i]->fPending || pReads[i]->fDone ) { return false; }
+		}
+		return true;
+	}
+
+	/* Stop reading. Reads still in flight complete with ERROR_OPERATION_ABORTED, or with whatever
+	 * they had read by then.
+	*/
+	void End()
+	{
+		if( fEnded ) { return; }
+		fEnded = true;
+		::CancelIoEx( hPipe, NULL );
+	}
+
+	HANDLE         hPipe;
+	SRelayIoStats *pStats;
+	SIocpRead     *pReads[IOCP_READ_DEPTH];
+	DWORD          dwIssued, dwRendered;  // sequence numbers
+	bool           fSkipOnSuccess;        // see Issue()
+	bool           fEnded;                // no more reads are issued
+	bool           fClosed;               // ended, idle, and the sink has had EndOfStream()
+};
+
+//==================================================================================================
+// Wait for the given monitoring threads to exit, once they've been told to stop.
+//==================================================================================================
+static void JoinThreads( HANDLE *hThreads, DWORD nThreads )
+{
+	if( nThreads && ::WaitForMultipleObjects( nThreads, hThreads, TRUE, INFINITE ) == WAIT_FAILED )
+	{ 
+        std::stringstream ssErr;
+        ssErr << "Failed waiting for monitor threads to die. " 
+                << GetApiErrorString( ::GetLastError(), "WaitForMultipleObjects" );
+			
+        RelayError( CR_STATUS_WINAPI, ssErr.str() );
+	}
+}
+
+//==================================================================================================
+CRelay::CRelay()
+	: m_pSink(NULL), m_pfnLine(NULL), m_pLineContext(NULL), m_pfnExit(NULL), m_pExitContext(NULL)
+	, m_pIoMgr(new CIoRedirectionManager), m_pChild(new CChildProcess), m_pMerger(new COutputMerger)
+	, m_hStdIn(NULL), m_hIoPort(NULL), m_fStarted(false), m_fDone(false)
+	, m_fAborted(false), m_fChildExited(false), m_fTreeExited(false)
+	, m_dwChildExitTime(0), m_dwExitCode(0)
+{
+	m_pThrottle[StdOutRead] = new COutputThrottle( m_options );
+	m_pThrottle[StdErrRead] = new COutputThrottle( m_options );
+	::ZeroMemory( m_ioStats, sizeof(m_ioStats) );
+
+	LARGE_INTEGER freq;
+	::QueryPerformanceFrequency( &freq );
+	m_ticksPerSec = freq.QuadPart;
+
+	m_fRingLines[StdOutRead]  = m_fRingLines[StdErrRead]  = false;
+	m_nRingCarry[StdOutRead]  = m_nRingCarry[StdErrRead]  = 0;
+	m_fEndOfStream[StdOutRead] = m_fEndOfStream[StdErrRead] = false;
+	for( int i = 0; i < NUM_EIOTHREADTYPES; i++ ) { m_hThreads[i] = NULL; }
+}
+
+CRelay::~CRelay()
+{
+	Close();
+
+	delete m_pThrottle[StdOutRead];
+	delete m_pThrottle[StdErrRead];
+	delete m_pMerger;
+	delete m_pChild;
+	delete m_pIoMgr;
+}
+
+//==================================================================================================
+// Launch the child in suspended mode so we can start up the stdio monitoring threads before 
+// resuming it. When the child process exits, the write end of the output pipes should close causing
+// ReadFile() to return ERROR_BROKEN_PIPE, causing the output monitoring threads to exit. In order to
+// signal that the input monitoring thread should shut down, we just need to close the std input 
+// handle. This causes ReadConsole to return with a nonzero (success) result with lpNumberOfCharsRead
+// set to zero. The subsequent WriteFile will then immediatly fail with ERROR_NO_DATA causing the
+// thread to exit.
+//
+// If any of it fails the child is terminated, and the threads already started are stopped, before 
+// the exit_exception is passed on.
+//==================================================================================================
+void CRelay::Run( wchar_t *cmdLine, wchar_t const *pCurDir, void *pEnvironment )
+{
+	DWORD dwThreadId;
+
+	try
+	{
+		/* Get std input handle so you can close it and force the ReadFile() to fail when you want
+		 * the input thread to exit.
+		*/
+		if( m_options.fForwardStdIn && m_options.hStdIn )
+		{
+			m_hStdIn = m_options.hStdIn;
+		}
+		else if( m_options.fForwardStdIn && (m_hStdIn = ::GetStdHandle( STD_INPUT_HANDLE )) == INVALID_HANDLE_VALUE )
+		{
+			m_hStdIn = NULL;
+
+			std::stringstream ssErr;
+			ssErr << "Could not get standard input handle. " 
+					<< GetApiErrorString( ::GetLastError(), "GetStdHandle" );
+			
+			RelayError( CR_STATUS_WINAPI, ssErr.str() );
+		}
+
+		/* Create parent-side and client-side pipe handles. The child-side handles are inheritable,
+		 * so relays running side by side take turns from here until they're closed again; else a
+		 * child could inherit another relay's pipe and hold it open.
+		*/
+		bool fIocp = (m_options.eIoEngine == IoEngineIocp);
+
+		utils::MutexLock spawnLock( g_spawnMutex );
+		m_pIoMgr->CreatePipeHandles();
+
+		STARTUPINFO si;
+		::ZeroMemory( &si, sizeof(STARTUPINFO) );
+		si.cb         = sizeof(STARTUPINFO);
+		si.dwFlags    = STARTF_USESTDHANDLES;
+		si.hStdOutput = m_pIoMgr->GetStdOutWrite();
+		si.hStdError  = m_pIoMgr->GetStdErrWrite();
+		si.hStdInput  = m_pIoMgr->GetStdInRead();
+
+		m_pChild->Create( cmdLine, si, pCurDir, pEnvironment );
+
+		/* Close child-side pipe handles as they are no longer needed in parent-side. Without stdin 
+		 * forwarding the parent-side of stdin goes as well, so the child reads EOF.
+		*/
+		m_pIoMgr->CloseChildSidePipeHandles();
+		if( !m_options.fForwardStdIn ) { m_pIoMgr->CloseStdInWrite(); }
+		spawnLock.Release();
+
+		m_oti[StdOutRead].pRelay    = this;
+		m_oti[StdOutRead].hReadPipe = m_pIoMgr->GetStdOutRead();
+		m_oti[StdOutRead].eType     = StdOutRead;
+		m_oti[StdErrRead].pRelay    = this;
+		m_oti[StdErrRead].hReadPipe = m_pIoMgr->GetStdErrRead();
+		m_oti[StdErrRead].eType     = StdErrRead;
+
+		if( fIocp )
+		{
+			/* Both streams are read by the one thread, which stands in for both readers. It renders 
+			 * in completion order, so fOrdered needs no merger.
+			*/
+			if( !(m_hIoPort = ::CreateIoCompletionPort( m_oti[StdOutRead].hReadPipe, NULL, StdOutRead, 1 ))
+				|| !::CreateIoCompletionPort( m_oti[StdErrRead].hReadPipe, m_hIoPort, StdErrRead, 1 ) )
+			{
+				std::stringstream ssErr;
+				ssErr << "Could not create i/o completion port for child stdout/stderr. " 
+						<< GetApiErrorString( ::GetLastError(), "CreateIoCompletionPort" );
+			
+				RelayError( CR_STATUS_WINAPI, ssErr.str() );
+			}
+
+			if( !(m_hThreads[StdOutRead] = ::CreateThread( NULL, 0, IocpOutputThread, 
+			                                               (LPVOID)this, 0, &dwThreadId )) )
+			{
+				std::stringstream ssErr;
+				ssErr << "Could not create monitoring thread for child stdout/stderr. " 
+						<< GetApiErrorString( ::GetLastError(), "CreateThread" );
+			
+				RelayError( CR_STATUS_WINAPI, ssErr.str() );
+			}
+		}
+		else if( !(m_hThreads[StdOutRead] = ::CreateThread( NULL, 0, ReadAndPutOutputThread, 
+			                                                (LPVOID)&m_oti[StdOutRead], 0, &dwThreadId ))
+			     || !(m_hThreads[StdErrRead] = ::CreateThread( NULL, 0, ReadAndPutOutputThread, 
+			                                                   (LPVOID)&m_oti[StdErrRead], 0, &dwThreadId )) )
+		{
+			std::stringstream ssErr;
+			ssErr << "Could not create monitoring threads for child stdout/stderr. " 
+					<< GetApiErrorString( ::GetLastError(), "CreateThread" );
+			
+			RelayError( CR_STATUS_WINAPI, ssErr.str() );
+		}
+
+		if( m_options.fOrdered && !fIocp )
+		{
+			m_pMerger->SetWindow( m_options.dwOrderWindow );
+			if( !(m_hThreads[OutputRender] = ::CreateThread( NULL, 0, RenderOrderedOutputThread, 
+			                                                 (LPVOID)this, 0, &dwThreadId )) )
+			{
+				std::stringstream ssErr;
+				ssErr << "Could not create rendering thread for child stdout/stderr. " 
+						<< GetApiErrorString( ::GetLastError(), "CreateThread" );
+			
+				RelayError( CR_STATUS_WINAPI, ssErr.str() );
+			}
+		}
+
+		/* Create the stdin thread last so its ReadFile() on stdin is not done untill the other
+		 * threads have been created successfully. 
+		*/
+		if( m_options.fForwardStdIn 
+			&& !(m_hThreads[StdInWrite] = ::CreateThread( NULL, 0, GetAndWriteInputThread, 
+			                                              (LPVOID)this, 0, &dwThreadId )) )
+		{
+			std::stringstream ssErr;
+			ssErr << "Could not create monitoring thread for parent stdin. " 
+					<< GetApiErrorString( ::GetLastError(), "CreateThread" );
+			
+			RelayError( CR_STATUS_WINAPI, ssErr.str() );
+		}
+
+		m_pChild->Resume();
+		m_fStarted = true;
+	}
+	catch( exit_exception& )
+	{
+		m_fDone = true;
+		try
+		{
+			if( m_pChild->GetProcess() ) { m_pChild->Shutdown( 0, m_options.dwShutdownKill ); }
+			StopThreads();
+		}
+		catch( exit_exception& ) { }
+		throw;
+	}
+}
+
+//==================================================================================================
+// Run the relay's event loop until redirection is complete, or dwTimeout_ms has passed. Everything
+// the loop reacts to is in a single wait set:
+//
+//   m_abortEvent          - a monitoring thread failed or Abort() was called, the child's tree is
+//                           shut down according to the dwShutdownGrace/dwShutdownKill deadlines.
+//   child process         - the child exited, its tree gets dwTreeLinger ms to follow.
+//   child tree            - (once the child has exited) every process in the tree has exited.
+//   m_endOfStream         - a stdout/stderr pipe reached EOF, and everything read from it has been
+//                           passed on. Pipes aren't waitable, so the reader signals it.
+//
+// Redirection is complete once the child has exited and both readers have drained their pipes, so
+// its exit code is known when the relay is done. If the tree is gone (or the linger period expired)
+// while a reader is still blocked, the write end of its pipe is held by a process outside the tree,
+// so the reader is told to stop and its pending read is cancelled. The stdin thread is then stopped
+// by closing our stdin handle. With fOrdered, the renderer thread is
+// left to finish writing whatever the readers queued.
+//
+// The loop's state is kept in the relay, so returning on dwTimeout_ms and polling again later picks
+// up where it left off. If it can't force the child process to exit when requested, an 
+// exit_exception is thrown, as is any failure of the monitoring threads once the relay is done.
+//==================================================================================================
+bool CRelay::Poll( DWORD dwTimeout_ms )
+{
+	enum EWaitSource { WaitAbort, WaitChild, WaitTree, WaitStream };
+
+	HANDLE      hWaitHandles[5];
+	EWaitSource waitSource[5];
+	int         waitStream[5];
+
+	DWORD dwStart = ::GetTickCount();
+
+	if( m_fDone )     { return true; }
+	if( !m_fStarted ) { RelayError( CR_STATUS_ERROR, "The relay has not been started." ); }
+
+	try
+	{
+		/* Both pipes can reach EOF before the child process is signaled (its handles are closed
+		 * as it exits), or while it runs on with them closed, so EOF alone doesn't end the loop.
+		*/
+		while(    !m_fChildExited
+		       || !(m_fTreeExited || (m_fEndOfStream[StdOutRead] && m_fEndOfStream[StdErrRead])) )
+		{
+			DWORD nHandles = 0, dwTimeout = INFINITE;
+			bool  fPollTimeout = false;
+
+			if( !m_fAborted )
+			{
+				hWaitHandles[nHandles] = m_abortEvent; 
+				waitSource[nHandles++] = WaitAbort;
+			}
+			if( !m_fChildExited )
+			{
+				hWaitHandles[nHandles] = m_pChild->GetProcess(); 
+				waitSource[nHandles++] = WaitChild;
+			}
+			else
+			{
+				DWORD dwElapsed = ::GetTickCount() - m_dwChildExitTime;
+				if( dwElapsed >= m_options.dwTreeLinger ) { break; }
+
+				dwTimeout = m_options.dwTreeLinger - dwElapsed;
+				hWaitHandles[nHandles] = m_pChild->GetTreeExitHandle(); 
+				waitSource[nHandles++] = WaitTree;
+			}
+			for( int i = StdOutRead; i <= StdErrRead; i++ )
+			{
+				if( m_fEndOfStream[i] ) { continue; }
+				hWaitHandles[nHandles] = m_endOfStream[i];
+				waitStream[nHandles]   = i;
+				waitSource[nHandles++] = WaitStream;
+			}
+
+			if( dwTimeout_ms != INFINITE )
+			{
+				DWORD dwElapsed = ::GetTickCount() - dwStart;
+				DWORD dwLeft    = (dwElapsed < dwTimeout_ms) ? dwTimeout_ms - dwElapsed : 0;
+				if( dwLeft < dwTimeout ) 
+				{ 
+					dwTimeout    = dwLeft; 
+					fPollTimeout = true; 
+				}
+			}
+
+			DWORD dwStatus = ::WaitForMultipleObjects( nHandles, hWaitHandles, FALSE, dwTimeout );
+			if( dwStatus == WAIT_TIMEOUT ) 
+			{ 
+				if( fPollTimeout ) { return false; }
+				break; 
+			}
+			if( dwStatus == WAIT_FAILED || dwStatus >= WAIT_OBJECT_0 + nHandles ) 
+			{ 
+				std::stringstream ssErr;
+				ssErr << "Failed waiting for child process to exit. " 
+						<< GetApiErrorString( ::GetLastError(), "WaitForMultipleObjects" );
+			
+				RelayError( CR_STATUS_WINAPI, ssErr.str() );
+			}
+
+			DWORD index = dwStatus - WAIT_OBJECT_0;
+			switch( waitSource[index] )
+			{
+				case WaitAbort:
+					m_fAborted = true;
+					m_pChild->Shutdown( m_options.dwShutdownGrace, m_options.dwShutdownKill );
+					/* fall through, the child has exited */
+
+				case WaitChild:
+					if( !m_fChildExited ) 
+					{ 
+						m_fChildExited    = true; 
+						m_dwChildExitTime = ::GetTickCount(); 
+					}
+					break;
+
+				case WaitTree:
+					m_fTreeExited = true;
+					break;
+
+				case WaitStream:
+					m_fEndOfStream[waitStream[index]] = true;
+					break;
+			}
+		}
+
+		Finish();
+	}
+	catch( exit_exception& )
+	{
+		if( !m_fDone )
+		{
+			m_fDone = true;
+			try { StopThreads(); } catch( exit_exception& ) { }
+		}
+		throw;
+	}
+	return true;
+}
+
+//==================================================================================================
+DWORD CRelay::Wait()
+{
+	while( !Poll( INFINITE ) ) { }
+	return m_dwExitCode;
+}
+
+//==================================================================================================
+void CRelay::Close()
+{
+	if( m_fStarted && !m_fDone )
+	{
+		Abort();
+		try { Wait(); } catch( exit_exception& ) { }
+	}
+
+	/* Cleanup any open handles for stdio, monitor threads or the child process.
+	*/
+	m_pIoMgr->DestroyPipeHandles();
+	for( int i = 0; i < NUM_EIOTHREADTYPES; i++ ) { CLOSEHANDLE( m_hThreads[i] ); }
+	CLOSEHANDLE( m_hIoPort );
+	m_pChild->Close();
+}
+
+//==================================================================================================
+DWORD CRelay::GetChildProcessId()
+{
+	return m_pChild->GetProcessId();
+}
+
+//==================================================================================================
+BOOL CRelay::GetResourceUsage( SResourceUsage &usage )
+{
+	return m_pChild->GetProcess() ? m_pChild->GetResourceUsage( usage ) : FALSE;
+}
+
+//==================================================================================================
+// Only meaningful once the relay is done, the readers update the counts without a lock.
+//==================================================================================================
+void CRelay::GetIoStats( SRelayIoStats &stats ) const
+{
+	stats.ullBytes = m_ioStats[StdOutRead].ullBytes + m_ioStats[StdErrRead].ullBytes;
+	stats.ullCalls = m_ioStats[StdOutRead].ullCalls + m_ioStats[StdErrRead].ullCalls;
+}
+
+//==================================================================================================
+// Can be called while the relay runs, the histograms are recorded without a lock.
+//==================================================================================================
+static void GetPercentiles( utils::LatencyHistogram const &histogram, SLatencyPercentiles &percentiles )
+{
+	percentiles.ullCount = histogram.Count();
+	percentiles.p50      = histogram.Percentile( 0.5 );
+	percentiles.p99      = histogram.Percentile( 0.99 );
+	percentiles.p999     = histogram.Percentile( 0.999 );
+}
+
+void CRelay::GetLatency( SRelayLatencyStats &stats ) const
+{
+	for( int i = StdOutRead; i <= StdErrRead; i++ )
+	{
+		GetPercentiles( m_endToEnd[i], stats.endToEnd[i] );
+		GetPercentiles( m_queued[i], stats.queued[i] );
+		GetPercentiles( m_render[i], stats.render[i] );
+	}
+}
+
+//==================================================================================================
+// Whatever is still running is either draining data the tree left behind, blocked on a pipe held
+// by a process outside the tree, or the stdin thread waiting for input. The readers wait on 
+// m_stopEvent along with their reads and cancel a pending read themselves, which leaves a chunk 
+// being rendered alone. The IoEngineIocp reader waits on its port instead, so it's woken with a 
+// packet of its own. The fOrdered renderer is never stopped, it ends once it has written what the
+// readers queued.
+//
+// Closing our stdin fails the stdin thread's next ReadFile(), and a ReadFile() it's blocked in is
+// cancelled; its only synchronous i/o is on stdin. Its write to the child waits on m_stopEvent too.
+//==================================================================================================
+void CRelay::StopThreads()
+{
+	m_stopThreads.Cancel();
+	m_stopEvent.Signal();
+	if( m_hIoPort ) { ::PostQueuedCompletionStatus( m_hIoPort, 0, 0, NULL ); }
+	if( m_hStdIn ) 
+	{ 
+		::CloseHandle( m_hStdIn ); 
+		m_hStdIn = NULL;
+		if( m_hThreads[StdInWrite] ) { ::CancelSynchronousIo( m_hThreads[StdInWrite] ); }
+	}
+
+	HANDLE hRunning[NUM_EIOTHREADTYPES];
+	DWORD  nRunning = 0;
+	for( int i = 0; i < NUM_EIOTHREADTYPES; i++ )
+	{
+		if( m_hThreads[i] && i != OutputRender ) { hRunning[nRunning++] = m_hThreads[i]; }
+	}
+	JoinThreads( hRunning, nRunning );
+
+	if( m_hThreads[OutputRender] ) { ::WaitForSingleObject( m_hThreads[OutputRender], INFINITE ); }
+}
+
+//==================================================================================================
+// Redirection is complete: stop the threads, pass on what they failed with and report the exit.
+//==================================================================================================
+void CRelay::Finish()
+{
+	StopThreads();
+	m_fDone = true;
+
+	/* Rethrow transported exceptions from threads
+	*/
+	for( int i = 0; i < NUM_EIOTHREADTYPES; i++ )
+	{
+		if( !(m_threadExceptions[i] == nullptr) ) 
+		{ 
+			rethrow_exception( m_threadExceptions[i] ); 
+		}
+	}
+
+	if( 0 == ::GetExitCodeProcess( m_pChild->GetProcess(), &m_dwExitCode ) )
+	{
+		std::stringstream ssErr;
+		ssErr << "Exit code for child processes in unavailiable. " 
+				<< GetApiErrorString( ::GetLastError(), "GetExitCodeProcess" );
+			
+		RelayError( CR_STATUS_WINAPI, ssErr.str() );
+	}
+
+	if( m_pfnExit ) { m_pfnExit( m_pExitContext, m_dwExitCode ); }
+}
+
+//==================================================================================================
+void CRelay::ThreadAbortChildProcess( EIoThreadType threadType, int errCode, std::string const &errMsg )
+{
+    m_threadExceptions[threadType] 
+        = copy_exception( exit_exception( errMsg.c_str(), errCode ) );
+
+    /* force child process to close which will cause the rest of our threads to exit when the child
+     * side pipe handles disconnect.
+	*/
+    m_abortEvent.Signal();
+}
+
+//==================================================================================================
+// Writing stream eStream's output failed with dwError on thread threadType.
+//==================================================================================================
+void CRelay::ThreadWriteError( EIoThreadType threadType, EIoThreadType eStream, DWORD dwError )
+{
+	std::stringstream ssErr;
+	ssErr << "Could not write to " << ((eStream == StdOutRead) ? "stdout" : "stderr") << ". " 
+			<< GetApiErrorString( dwError, "WriteFile" );
+
+	ThreadAbortChildProcess( threadType, CR_STATUS_WINAPI, ssErr.str() );
+}
+
+//==================================================================================================
+// Pass a chunk of stream eType's output on, through the stream's COutputThrottle when any 
+// throttling is configured. Returns 0 on success, or the error the sink failed with.
+//
+// readStamp is when the chunk's read returned (QueryPerformanceCounter()), the chunk's latencies
+// are recorded from it. A chunk the throttle holds back or drops entirely has only waited to be 
+// rendered; what's held back is timed with the chunk it's passed on with.
+//==================================================================================================
+DWORD CRelay::RenderOutput( EIoThreadType eType, BYTE *pData, DWORD nBytes, LONGLONG readStamp )
+{
+	LARGE_INTEGER start, end;
+	DWORD         dwError;
+
+	::QueryPerformanceCounter( &start );
+	m_queued[eType].Record( (start.QuadPart - readStamp) * 1000000 / m_ticksPerSec );
+
+	if( m_pSink ) 
+	{ 
+		LONGLONG age_ms = (start.QuadPart - readStamp) * 1000 / m_ticksPerSec;
+		m_pSink->SetReadTime( eType, utils::UnixTimeMs() - (unsigned long long)age_ms ); 
+	}
+
+	if( !m_options.dwMaxLines && !m_options.dwMaxBytes && !m_options.fCollapse && !m_options.dwProgressRate ) 
+	{ 
+		dwError = Deliver( eType, pData, nBytes ); 
+	}
+	else
+	{
+		std::string const &out = m_pThrottle[eType]->Filter( (char const*)pData, nBytes, ::GetTickCount() );
+		if( out.empty() ) { return 0; }
+		dwError = Deliver( eType, (BYTE*)out.c_str(), (DWORD)out.size() );
+	}
+
+	::QueryPerformanceCounter( &end );
+	m_render[eType].Record( (end.QuadPart - start.QuadPart) * 1000000 / m_ticksPerSec );
+	m_endToEnd[eType].Record( (end.QuadPart - readStamp) * 1000000 / m_ticksPerSec );
+	return dwError;
+}
+
+//==================================================================================================
+// The stream has ended, pass on whatever its COutputThrottle still has to report and the partial 
+// line it ended on.
+//==================================================================================================
+DWORD CRelay::RenderEndOfStream( EIoThreadType eType )
+{
+	std::string const &out = m_pThrottle[eType]->Flush();
+	DWORD dwError = out.empty() ? 0 : Deliver( eType, (BYTE*)out.c_str(), (DWORD)out.size() );
+
+	std::string &partial = m_partialLine[eType];
+	if( m_pfnLine && !partial.empty() ) 
+	{ 
+		m_pfnLine( m_pLineContext, eType, partial.data(), partial.size() ); 
+		partial.clear();
+	}
+
+	DWORD dwSinkError = m_pSink ? m_pSink->EndOfStream( eType ) : 0;
+	return dwError ? dwError : dwSinkError;
+}
+
+//==================================================================================================
+// Hand a chunk to the line callback, a line at a time, and then to the sink. A line that started
+// in an earlier chunk is collected in m_partialLine until its end arrives.
+//
+// With m_fRingLines the chunk was read into the stream reader's RingBuffer, which keeps the
+// unfinished line in place right in front of the chunk (m_nRingCarry bytes of it), so the line is
+// passed on from the ring rather than collected. Only what the reader had to spill to make room is
+// in m_partialLine then.
+//==================================================================================================
+DWORD CRelay::Deliver( EIoThreadType eType, BYTE *pData, DWORD nBytes )
+{
+	if( m_pfnLine )
+	{
+		std::string &partial = m_partialLine[eType];
+		char const  *p       = (char const*)pData;
+		char const  *end     = p + nBytes;
+		char const  *pBegin  = p - (m_fRingLines[eType] ? m_nRingCarry[eType] : 0);  // of the line
+
+		while( p < end )
+		{
+			char const *eol = (char const*)::memchr( p, '\n', end - p );
+			if( !eol ) { break; }
+
+			char const *pLine = pBegin;
+			size_t      len   = eol - pBegin;
+			if( !partial.empty() )
+			{
+				partial.append( pBegin, len );
+				pLine = partial.data();
+				len   = partial.size();
+			}
+			while( len && pLine[len - 1] == '\r' ) { len--; }
+
+			m_pfnLine( m_pLineContext, eType, pLine, len );
+			partial.clear();
+			p = pBegin = eol + 1;
+		}
+
+		if( m_fRingLines[eType] ) { m_nRingCarry[eType] = end - pBegin; }
+		else                      { partial.append( pBegin, end - pBegin ); }
+	}
+
+	return m_pSink ? m_pSink->Write( eType, pData, nBytes ) : 0;
+}
+
+//==================================================================================================
+// Monitors the child process and relay output to the sink. The thread ends when 
+// the pipe reaches EOF (ReadFile() fails with ERROR_BROKEN_PIPE once every write end is closed) or
+// when the relay has cancelled m_stopThreads. After that, a read that doesn't fill the buffer
+// means the pipe has been drained. Reads are overlapped and wait on m_stopEvent as well, so a read
+// still pending once stopping is cancelled here, with CancelIoEx() on the pipe, while a chunk being
+// rendered is always written in full. There's no polling of the pipe, each chunk costs one 
+// ReadFile().
+//
+// If the thread is waiting on a ReadFile() operation to complete, the termination of the child
+// process will result in the child-side pipe handles being closed. This in-turn will cause the
+// blocking ReadFile() operation to complete with a ERROR_BROKEN_PIPE error and the thread to exit.
+//
+// There's a slight hickup when writing to stdout/stderr in that depending on how the child 
+// process writes to its stdout/stderr streams, the ReadFile from this thread could return before
+// all the text from the child stream has be written out. In this case, the thread may have to
+// execute multiple calls to ReadFile to get the remainder of the data. The hickup is where the
+// other thread has also returned from ReadFile and takes ownership of the sink before this thread
+// has had a chance to finish reading all of the data from the stream. When this happens the output
+// from the two stream may get mixed up while being sent to the console. With fOrdered the
+// thread instead hands each chunk to the COutputMerger, stamped with its read order, and a single
+// renderer thread writes the chunks of both streams in that order (see COutputMerger).
+//==================================================================================================
+DWORD WINAPI CRelay::ReadAndPutOutputThread( LPVOID lpvThreadParam )
+{
+    BYTE          lpBuffer[OUTPUT_READ_SIZE];
+    DWORD         nBytesRead, nBytesToRead;
+	SOutputChunk *pChunk = NULL;
+    
+	SOutputThreadInfo *pOti  = (SOutputThreadInfo*)lpvThreadParam;
+	CRelay            *pThis = pOti->pRelay;
+
+	HANDLE hPipeRead = pOti->hReadPipe;
+
+	utils::Event readDone;
+	HANDLE       hWait[2] = { readDone, pThis->m_stopEvent };
+	OVERLAPPED   ov;
+
+	/* When complete lines go to a callback, and chunks are delivered as they're read, the chunks 
+	 * are read into a ring that keeps the line in progress (see Deliver()).
+	*/
+	utils::RingBuffer ring;
+	std::string      &partial   = pThis->m_partialLine[pOti->eType];
+	size_t           &nCarry    = pThis->m_nRingCarry[pOti->eType];
+	bool             &fRing     = pThis->m_fRingLines[pOti->eType];
+	bool const        fThrottle = pThis->m_options.dwMaxLines || pThis->m_options.dwMaxBytes 
+	                              || pThis->m_options.fCollapse || pThis->m_options.dwProgressRate;
+
+	fRing = pThis->m_pfnLine && !pThis->m_options.fOrdered && !fThrottle 
+	        && ring.Create( 4 * OUTPUT_READ_SIZE );
+
+    while( 1 )
+    {
+		BYTE *pData  = lpBuffer;
+		nBytesToRead = OUTPUT_READ_SIZE-1;
+		if( pThis->m_options.fOrdered ) 
+		{ 
+			pChunk = pThis->m_pMerger->GetFreeChunk( pOti->eType ); 
+			pData  = pChunk->data;
+		}
+		else if( fRing )
+		{
+			/* All but the unfinished line has been delivered. A line too long to leave room for
+			 * a full read is moved out of the way.
+			*/
+			ring.Consume( ring.ReadAvail() - nCarry );
+			if( ring.WriteSpace() <= OUTPUT_READ_SIZE )
+			{
+				partial.append( (char const*)ring.ReadPtr(), nCarry );
+				ring.Consume( nCarry );
+				nCarry = 0;
+			}
+			pData = ring.WritePtr();
+			if( ring.WriteSpace() - 1 < nBytesToRead ) { nBytesToRead = (DWORD)(ring.WriteSpace() - 1); }
+		}
+
+        nBytesRead = 0;
+		::ZeroMemory( &ov, sizeof(ov) );
+		ov.hEvent = readDone;
+		pThis->m_ioStats[pOti->eType].ullCalls++;
+
+		BOOL  fRead       = ::ReadFile( hPipeRead, pData, nBytesToRead, NULL, &ov );
+		DWORD dwLastError = fRead ? ERROR_SUCCESS : ::GetLastError();
+		if( fRead || dwLastError == ERROR_IO_PENDING )
+		{
+			if( !fRead && ::WaitForMultipleObjects( 2, hWait, FALSE, INFINITE ) != WAIT_OBJECT_0 ) 
+			{ 
+				::CancelIoEx( hPipeRead, &ov ); 
+			}
+			fRead       = ::GetOverlappedResult( hPipeRead, &ov, &nBytesRead, TRUE );
+			dwLastError = fRead ? ERROR_SUCCESS : ::GetLastError();
+		}
+		if( !fRead || !nBytesRead )
+        {
+            /* ERROR_BROKEN_PIPE means child-side pipe handle has been closed and is the normal
+			 * exit path. ERROR_OPERATION_ABORTED means the relay cancelled the read because the
+			 * pipe outlived the child's process tree.
+			*/
+			if( dwLastError != ERROR_BROKEN_PIPE 
+				&& !(dwLastError == ERROR_OPERATION_ABORTED && pThis->m_stopThreads.IsCancelled()) )
+            { 
+                std::stringstream ssErr;
+                ssErr << "Could not read from output side of " 
+                        << ((pOti->eType == StdOutRead) ? "StdOutRead" : "StdErrRead") << " pipe. " 
+                        << GetApiErrorString( dwLastError, "ReadFile" );
+                
+                pThis->ThreadAbortChildProcess( pOti->eType, CR_STATUS_WINAPI, ssErr.str() );
+            }
+            break;
+        }
+		LARGE_INTEGER readStamp;
+		::QueryPerformanceCounter( &readStamp );
+
+		pData[nBytesRead] = 0;
+		pThis->m_ioStats[pOti->eType].ullBytes += nBytesRead;
+		if( fRing ) { ring.Commit( nBytesRead ); }
+
+		if( pChunk )
+		{
+			pChunk->nBytes = nBytesRead;
+			pThis->m_pMerger->Push( pChunk );
+			pChunk = NULL;
+		}
+		else
+		{
+			DWORD dwError = pThis->RenderOutput( pOti->eType, pData, nBytesRead, readStamp.QuadPart );
+			if( dwError ) { pThis->ThreadWriteError( pOti->eType, pOti->eType, dwError ); }
+		}
+
+		/* Once stopping, a short read means what the tree left behind has been relayed.
+		*/
+		if( pThis->m_stopThreads.IsCancelled() && nBytesRead < nBytesToRead ) { break; }
+    }
+
+	/* The line the stream ends on goes to the callback from m_partialLine, like any other.
+	*/
+	if( fRing )
+	{
+		partial.append( (char const*)ring.ReadPtr() + ring.ReadAvail() - nCarry, nCarry );
+		nCarry = 0;
+		fRing  = false;
+	}
+
+	if( pThis->m_options.fOrdered )
+	{
+		if( pChunk ) { pThis->m_pMerger->Release( pChunk ); }
+		pThis->m_pMerger->EndOfStream( pOti->eType );
+	}
+	else
+	{
+		DWORD dwError = pThis->RenderEndOfStream( pOti->eType );
+		if( dwError ) { pThis->ThreadWriteError( pOti->eType, pOti->eType, dwError ); }
+	}
+	pThis->m_endOfStream[pOti->eType].Signal();
+
+	return 1;
+}
+
+//==================================================================================================
+// IoEngineIocp's reader: reads both of the child's output streams from one thread. Each stream
+// keeps IOCP_READ_DEPTH reads in flight into buffers allocated once up front, so the child has a
+// buffer to fill while the last chunk is being rendered, and the thread reaps up to IOCP_BATCH_SIZE
+// completions per wait. Reads that complete right away don't go through the port at all
+// (FILE_SKIP_COMPLETION_PORT_ON_SUCCESS). Chunks are rendered in the order each stream read them.
+//
+// The thread ends once both streams have ended, the way ReadAndPutOutputThread() does: on
+// ERROR_BROKEN_PIPE, or once stopping on a short read. When stopping, StopThreads() wakes the thread
+// and the reads still pending are cancelled with CancelIoEx(), the rendering is never interrupted.
+//==================================================================================================
+DWORD WINAPI CRelay::IocpOutputThread( LPVOID lpvThreadParam )
+{
+	CRelay          *pThis = (CRelay*)lpvThreadParam;
+	SIocpStream      streams[2];  // indexed by StdOutRead/StdErrRead
+	OVERLAPPED_ENTRY entries[IOCP_BATCH_SIZE];
+	bool             fStopping = false;
+
+	for( int i = StdOutRead; i <= StdErrRead; i++ )
+	{
+		SIocpStream &stream = streams[i];
+		stream.hPipe          = pThis->m_oti[i].hReadPipe;
+		stream.pStats         = &pThis->m_ioStats[i];
+		stream.fSkipOnSuccess = ::SetFileCompletionNotificationModes( stream.hPipe, 
+		                                                              FILE_SKIP_COMPLETION_PORT_ON_SUCCESS ) != FALSE;
+		for( int j = 0; j < IOCP_READ_DEPTH; j++ ) 
+		{ 
+			stream.pReads[j] = new SIocpRead; 
+			stream.pReads[j]->fPending = stream.pReads[j]->fDone = false;
+		}
+	}
+	for( int j = 0; j < IOCP_READ_DEPTH; j++ )
+	{
+		streams[StdOutRead].Issue( streams[StdOutRead].pReads[j] );
+		streams[StdErrRead].Issue( streams[StdErrRead].pReads[j] );
+	}
+
+	while( !streams[StdOutRead].fClosed || !streams[StdErrRead].fClosed )
+	{
+		fStopping = pThis->m_stopThreads.IsCancelled();
+
+		/* Render what has completed, in order, and put the buffers back in flight.
+		*/
+		for( int i = StdOutRead; i <= StdErrRead; i++ )
+		{
+			SIocpStream   &stream = streams[i];
+			EIoThreadType  eType  = (EIoThreadType)i;
+			SIocpRead     *pRead;
+
+			while( (pRead = stream.Next()) != NULL )
+			{
+				pRead->fDone = false;
+				stream.dwRendered++;
+
+				if( pRead->nBytes )
+				{
+					pRead->data[pRead->nBytes] = 0;
+					DWORD dwError = pThis->RenderOutput( eType, pRead->data, pRead->nBytes, pRead->stamp );
+					if( dwError ) { pThis->ThreadWriteError( StdOutRead, eType, dwError ); }
+				}
+				else if( !stream.fEnded && pRead->dwError != ERROR_BROKEN_PIPE 
+					     && !(pRead->dwError == ERROR_OPERATION_ABORTED && fStopping) )
+				{
+					std::stringstream ssErr;
+					ssErr << "Could not read from output side of " 
+							<< ((eType == StdOutRead) ? "StdOutRead" : "StdErrRead") << " pipe. " 
+							<< GetApiErrorString( pRead->dwError, "ReadFile" );
+                
+					pThis->ThreadAbortChildProcess( StdOutRead, CR_STATUS_WINAPI, ssErr.str() );
+				}
+
+				if( !pRead->nBytes || (fStopping && pRead->nBytes < OUTPUT_READ_SIZE-1) ) { stream.End(); }
+				if( !stream.fEnded ) { stream.Issue( pRead ); }
+			}
+
+			if( stream.fEnded && !stream.fClosed && stream.IsIdle() )
+			{
+				stream.fClosed = true;
+				DWORD dwError  = pThis->RenderEndOfStream( eType );
+				if( dwError ) { pThis->ThreadWriteError( StdOutRead, eType, dwError ); }
+				pThis->m_endOfStream[eType].Signal();
+			}
+		}
+		if( streams[StdOutRead].fClosed && streams[StdErrRead].fClosed ) { break; }
+
+		/* Once stopping, a read that's still pending is waiting on a pipe held open outside the tree.
+		 * Its cancellation completes through the port like any other read.
+		*/
+		if( fStopping )
+		{
+			for( int i = StdOutRead; i <= StdErrRead; i++ )
+			{
+				if( !streams[i].IsIdle() ) { ::CancelIoEx( streams[i].hPipe, NULL ); }
+			}
+		}
+
+		/* Reap the next batch of completions. A NULL OVERLAPPED is StopThreads() waking us.
+		*/
+		ULONG nEntries = 0;
+		pThis->m_ioStats[StdOutRead].ullCalls++;
+		if( !::GetQueuedCompletionStatusEx( pThis->m_hIoPort, entries, IOCP_BATCH_SIZE, &nEntries, 
+		                                    INFINITE, FALSE ) )
+		{
+			DWORD dwLastError = ::GetLastError();
+
+			std::stringstream ssErr;
+			ssErr << "Failed waiting for child stdout/stderr. " 
+					<< GetApiErrorString( dwLastError, "GetQueuedCompletionStatusEx" );
+                
+			pThis->ThreadAbortChildProcess( StdOutRead, CR_STATUS_WINAPI, ssErr.str() );
+
+			/* The buffers can't go while the system may still write to them.
+			*/
+			for( int i = StdOutRead; i <= StdErrRead; i++ )
+			{
+				streams[i].End();
+				for( int j = 0; j < IOCP_READ_DEPTH; j++ )
+				{
+					DWORD nBytes;
+					if( streams[i].pReads[j]->fPending ) 
+					{ 
+						::GetOverlappedResult( streams[i].hPipe, &streams[i].pReads[j]->ov, &nBytes, TRUE ); 
+					}
+				}
+				if( !streams[i].fClosed ) { pThis->RenderEndOfStream( (EIoThreadType)i ); }
+				pThis->m_endOfStream[i].Signal();
+			}
+			break;
+		}
+
+		for( ULONG k = 0; k < nEntries; k++ )
+		{
+			if( !entries[k].lpOverlapped ) { continue; }
+			streams[entries[k].lpCompletionKey].Complete( (SIocpRead*)entries[k].lpOverlapped );
+		}
+	}
+
+	return 1;
+}
+
+//==================================================================================================
+// With fOrdered, passes the chunks read by both output monitoring threads to the sink in the order
+// they were read. The thread ends once both streams have ended and every chunk is written.
+//==================================================================================================
+DWORD WINAPI CRelay::RenderOrderedOutputThread( LPVOID lpvThreadParam )
+{
+	CRelay       *pThis = (CRelay*)lpvThreadParam;
+	SOutputChunk *pChunk;
+
+	while( (pChunk = pThis->m_pMerger->Pop()) != NULL )
+	{
+		DWORD dwError = pThis->RenderOutput( pChunk->eType, pChunk->data, pChunk->nBytes, pChunk->stamp );
+		if( dwError ) { pThis->ThreadWriteError( OutputRender, pChunk->eType, dwError ); }
+		pThis->m_pMerger->Release( pChunk );
+	}
+
+	for( int i = StdOutRead; i <= StdErrRead; i++ )
+	{
+		DWORD dwError = pThis->RenderEndOfStream( (EIoThreadType)i );
+		if( dwError ) { pThis->ThreadWriteError( OutputRender, (EIoThreadType)i, dwError ); }
+	}
+
+	return 1;
+}
+
+//==================================================================================================
+// Monitors the console for input and relay std input to the child process. The thread ends when 
+// m_stopThreads is cancelled. 
+//
+// Because the thread may be waiting on ReadFile() to return when the relay detects that the child
+// process has exited, the relay will also close the handle to its std input. When the 
+// std input handle is closed, any pending ReadFile() operation on that handle will complete 
+// setting nBytesRead to 0. This in turn causes the subsequent WriteFile() to fail with
+// ERROR_NO_DATA and allows the thread to exit.
+//==================================================================================================
+DWORD WINAPI CRelay::GetAndWriteInputThread( LPVOID lpvThreadParam )
+{
+    BYTE read_buff[PIPE_BUFFER_SIZE];
+    DWORD nBytesRead,nBytesWritten;
+	CRelay *pThis      = (CRelay*)lpvThreadParam;
+	HANDLE  hStdIn     = pThis->m_hStdIn;
+	HANDLE  hPipeWrite = pThis->m_pIoMgr->GetStdInWrite();
+
+	utils::Event writeDone;
+	HANDLE       hWait[2] = { writeDone, pThis->m_stopEvent };
+	OVERLAPPED   ov;
+
+    /* Get input from our console and send it to child through the pipe.
+	*/
+    while( !pThis->m_stopThreads.IsCancelled() )
+    {
+        if( !::ReadFile( hStdIn, read_buff, sizeof(read_buff) - 1, &nBytesRead, NULL ) )
+		{ 
+			/* Stopping closes stdin and cancels the read, that's not an error.
+			*/
+			if( pThis->m_stopThreads.IsCancelled() ) { break; }
+
+            std::stringstream ssErr;
+            ssErr << "Could not read from stdin. " 
+                    << GetApiErrorString( ::GetLastError(), "ReadFile" );
+                
+            pThis->ThreadAbortChildProcess( StdInWrite, CR_STATUS_WINAPI, ssErr.str() );
+            break;
+        }
+        read_buff[nBytesRead] = 0;
+
+		/* The child may not be reading its input, so the write is cancelled when stopping.
+		*/
+		::ZeroMemory( &ov, sizeof(ov) );
+		ov.hEvent = writeDone;
+
+		BOOL fWritten = ::WriteFile( hPipeWrite, read_buff, nBytesRead, NULL, &ov );
+		if( !fWritten && ::GetLastError() == ERROR_IO_PENDING )
+		{
+			if( ::WaitForMultipleObjects( 2, hWait, FALSE, INFINITE ) != WAIT_OBJECT_0 ) 
+			{ 
+				::CancelIoEx( hPipeWrite, &ov ); 
+			}
+			fWritten = ::GetOverlappedResult( hPipeWrite, &ov, &nBytesWritten, TRUE );
+		}
+        if( !fWritten )
+        {
+            /* ERROR_NO_DATA means pipe was closed and is the threads normal exit path.
+			*/
+			DWORD dwLastError = ::GetLastError();
+			if( dwLastError == ERROR_OPERATION_ABORTED && pThis->m_stopThreads.IsCancelled() ) { break; }
+            if( dwLastError != ERROR_NO_DATA ) 
+            { 
+                std::stringstream ssErr;
+                ssErr << "Could not write to input side of StdInWrite pipe. " 
+                        << GetApiErrorString( dwLastError, "WriteFile" );
+                
+                pThis->ThreadAbortChildProcess( StdInWrite, CR_STATUS_WINAPI, ssErr.str() );
+            }
+            break;
+        }
+    }
+
+    return 1;
+}
@@ -0,0 +1,306 @@
+/***********************************************************************************************//**
+\file    Relay.h
+\author  hdaniel
+\version $Id$
+
+\brief Run a console process and relay its standard i/o in-process.
+
+\details
+
+The engine behind cr, usable without the command line front end. A CRelay spawns the child in its
+own job and console process group, forwards our stdin to it, reads its stdout/stderr pipes and
+hands what it reads (throttled and, with SRelayOptions::fOrdered, merged in read order) to an
+IRelaySink. Complete lines can also be delivered to a callback, and a second callback is made when
+the relay is done.
+
+CRelay::Run() starts the child and returns right away. The owner then drives the relay from its own
+loop with CRelay::Poll(), or blocks in CRelay::Wait(). The sink and the line callback are called on
+the relay's own threads, one thread per stream (one thread for both with fOrdered, or with the
+IoEngineIocp engine).
+
+Failures are reported the way the rest of cr reports them, by throwing an exit_exception. Any
+number of relays can run in one process (cr --serve runs one per client).
+
+\license
+
+This file is free and unencumbered software released into the public domain.
+
+Anyone is free to copy, modify, publish, use, compile, sell, or distribute this software, either in
+source code form or as a compiled binary, for any purpose, commercial or non-commercial, and by any
+means.
+
+In jurisdictions that recognize copyright laws, the author or authors of this software dedicate any
+and all copyright interest in the software to the public domain. We make this dedication for the
+benefit of the public at large and to the detriment of our heirs and successors. We intend this
+dedication to be an overt act of relinquishment in perpetuity of all present and future rights to
+this software under copyright law.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT
+NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+For more information, please refer to <http://unlicense.org/>
+***************************************************************************************************/
+#ifndef _relay_h_
+#define _relay_h_
+
+#include <exception>
+#include <string>
+
+#include <windows.h>
+
+#include "Utils\histogram.h"
+#include "Utils\utils.h"
+
+#define CR_STATUS_SUCCESS    0
+#define CR_STATUS_ERROR     -1
+#define CR_STATUS_WINAPI    -2
+#define CR_STATUS_ABORTED   -3
+
+class CIoRedirectionManager;
+class CChildProcess;
+class COutputMerger;
+class COutputThrottle;
+
+//==================================================================================================
+enum EIoThreadType { StdOutRead, StdErrRead, StdInWrite, OutputRender, NUM_EIOTHREADTYPES };
+
+//==================================================================================================
+struct exit_exception : public std::exception
+{
+    exit_exception( char const *szMsg, int code =CR_STATUS_ERROR )
+        : std::exception( szMsg ), m_code( code ) { }
+
+    virtual int code() const { return m_code; }
+
+private:
+    int m_code;
+};
+
+//==================================================================================================
+// Get the systems error message associated with dwErrorCode.
+//==================================================================================================
+std::string GetApiErrorString( DWORD dwErrorCode, std::string const& apiNameStr );
+
+//==================================================================================================
+// Resource usage of the whole child process tree, as reported at exit with --stats.
+//==================================================================================================
+struct SResourceUsage
+{
+	DWORD     dwProcesses;     // number of processes started in the tree
+	ULONGLONG ullUserTime;     // 100ns units
+	ULONGLONG ullKernelTime;   // 100ns units
+	ULONGLONG ullPeakMemory;   // bytes of committed memory, 0 when unknown
+	ULONGLONG ullReadBytes;
+	ULONGLONG ullWriteBytes;
+};
+
+//==================================================================================================
+// What relaying the child's output took, as reported with --stats: the bytes read from the child's
+// pipes and the system calls made to read them (waits for completions included).
+//==================================================================================================
+struct SRelayIoStats
+{
+	ULONGLONG ullBytes;
+	ULONGLONG ullCalls;
+};
+
+//==================================================================================================
+// How long the child's output took through the relay, as reported with --stats. Every chunk is 
+// timed from its ReadFile() returning to the sink returning from writing it (endToEnd), which is 
+// the time it waited to be rendered (queued: --ordered and iocp hold chunks back to render them in
+// order) plus the time the throttle and the sink took (render). In microseconds, per stream.
+//==================================================================================================
+struct SLatencyPercentiles
+{
+	ULONGLONG ullCount;
+	ULONGLONG p50, p99, p999;
+};
+
+struct SRelayLatencyStats
+{
+	SLatencyPercentiles endToEnd[2];  // indexed by StdOutRead/StdErrRead
+	SLatencyPercentiles queued[2];
+	SLatencyPercentiles render[2];
+};
+
+//==================================================================================================
+// How a CRelay reads the child's output (--io-engine).
+//
+//   IoEngineThreads - a thread per stream, blocked in ReadFile(); a system call per chunk.
+//   IoEngineIocp    - one thread for both streams, with reads kept in flight on an i/o completion
+//                     port and completions reaped in batches (see CRelay::IocpOutputThread()).
+//==================================================================================================
+enum EIoEngine { IoEngineThreads, IoEngineIocp };
+
+//==================================================================================================
+// How a CRelay runs the child and treats its output. The defaults are cr's defaults.
+//==================================================================================================
+struct SRelayOptions
+{
+	SRelayOptions()
+		: dwShutdownGrace(5000), dwShutdownKill(2000), dwTreeLinger(1000)
+		, fOrdered(false), dwOrderWindow(20)
+		, dwMaxLines(0), dwMaxBytes(0), dwStormKeep(0), fCollapse(false), dwProgressRate(0)
+		, fForwardStdIn(true), hStdIn(NULL), eIoEngine(IoEngineThreads)
+	{
+	}
+
+	DWORD     dwShutdownGrace;  // ms the child gets to exit after a CTRL_BREAK_EVENT on abort
+	DWORD     dwShutdownKill;   // ms to wait for the child tree to die once it's terminated
+	DWORD     dwTreeLinger;     // ms the child's tree may outlive the child before we stop relaying
+	bool      fOrdered;         // merge stdout/stderr in read order (see COutputMerger)
+	DWORD     dwOrderWindow;    // ms a chunk may wait for an earlier chunk of the other stream
+	DWORD     dwMaxLines;       // lines/s passed to the sink per stream, 0 is unlimited
+	DWORD     dwMaxBytes;       // bytes/s passed to the sink per stream, 0 is unlimited
+	DWORD     dwStormKeep;      // suppressed lines to pass on after the "suppressed" report
+	bool      fCollapse;        // collapse repeated lines
+	DWORD     dwProgressRate;   // redraws/s of a line rewritten in place ('\r'), 0 draws them all
+	bool      fForwardStdIn;    // relay our stdin to the child, else the child's stdin is empty
+	HANDLE    hStdIn;           // forwarded in place of our stdin when set, and closed
+	EIoEngine eIoEngine;        // how the child's output is read
+};
+
+//==================================================================================================
+// Where a CRelay delivers the child's output. Write() gets each chunk of stream eStream's output,
+// NUL terminated at pData[nBytes], and returns 0 or the error that writing it failed with (which
+// aborts the relay). EndOfStream() is called once a stream has delivered all of its output, and
+// returns an error the same way.
+//
+// Calls for the same stream never overlap, but without SRelayOptions::fOrdered the two streams are
+// delivered from different threads.
+//
+// A CRelay calls SetReadTime() before each Write() with the time the chunk was read from the child,
+// in ms since 1970-01-01 UTC. Sinks that pass chunks on to another sink pass it on as well.
+//==================================================================================================
+class IRelaySink
+{
+public:
+	virtual ~IRelaySink() { }
+
+	virtual DWORD Write( EIoThreadType eStream, BYTE *pData, DWORD nBytes ) = 0;
+	virtual DWORD EndOfStream( EIoThreadType eStream ) { return 0; }
+	virtual void  SetReadTime( EIoThreadType eStream, unsigned long long ullTime_ms ) { }
+};
+
+/* Called with each complete line of output, without its line terminator, and with the partial line
+ * a stream ends on. Runs on the thread that delivers the stream to the sink, before the sink sees
+ * the chunk the line ends in.
+*/
+typedef void (*RelayLineFn)( void *pContext, EIoThreadType eStream, char const *pLine, size_t len );
+
+/* Called once the relay is done, from the thread that completed it in Poll() or Wait().
+*/
+typedef void (*RelayExitFn)( void *pContext, DWORD dwExitCode );
+
+//==================================================================================================
+// Runs one child process and relays its standard i/o. A CRelay is good for a single Run(); options,
+// sink and callbacks are set before it.
+//
+// Only one relay in a process should forward our own stdin (SRelayOptions::fForwardStdIn without an
+// hStdIn), as finishing the relay closes the stdin handle to stop the thread blocked reading it.
+//==================================================================================================
+class CRelay
+{
+public:
+	CRelay();
+	~CRelay();
+
+	SRelayOptions& Options() { return m_options; }
+
+	void SetSink( IRelaySink *pSink ) { m_pSink = pSink; }
+	void SetLineCallback( RelayLineFn pfnLine, void *pContext ) { m_pfnLine = pfnLine; m_pLineContext = pContext; }
+	void SetExitCallback( RelayExitFn pfnExit, void *pContext ) { m_pfnExit = pfnExit; m_pExitContext = pContext; }
+
+	/* Start cmdLine and the threads relaying its i/o, and return without waiting for it. The child
+	 * runs in pCurDir with the (unicode) environment block pEnvironment, by default ours.
+	*/
+	void Run( wchar_t *cmdLine, wchar_t const *pCurDir =NULL, void *pEnvironment =NULL );
+
+	/* Run the relay's event loop for up to dwTimeout_ms. Returns true once the child, and its
+	 * process tree, are done and all of their output has been delivered; ExitCode() is valid from
+	 * then on.
+	*/
+	bool Poll( DWORD dwTimeout_ms =0 );
+
+	/* Poll() until done and return the child's exit code.
+	*/
+	DWORD Wait();
+
+	/* Shut the child's tree down, within the dwShutdownGrace/dwShutdownKill deadlines. The relay
+	 * still has to be polled to completion.
+	*/
+	void Abort() { m_abortEvent.Signal(); }
+
+	/* Abort a relay that's still running, wait for it, and release the child and the pipes. Errors
+	 * are not reported, this is what the destructor does.
+	*/
+	void Close();
+
+	bool  IsDone() const   { return m_fDone; }
+	DWORD ExitCode() const { return m_dwExitCode; }
+	DWORD GetChildProcessId();
+	BOOL  GetResourceUsage( SResourceUsage &usage );
+	void  GetIoStats( SRelayIoStats &stats ) const;
+	void  GetLatency( SRelayLatencyStats &stats ) const;
+
+private:
+	CRelay( CRelay const& );
+	CRelay& operator=( CRelay const& );
+
+	struct SOutputThreadInfo { CRelay *pRelay; HANDLE hReadPipe; EIoThreadType eType; };
+
+	static DWORD WINAPI ReadAndPutOutputThread( LPVOID lpvThreadParam );
+	static DWORD WINAPI IocpOutputThread( LPVOID lpvThreadParam );
+	static DWORD WINAPI RenderOrderedOutputThread( LPVOID lpvThreadParam );
+	static DWORD WINAPI GetAndWriteInputThread( LPVOID lpvThreadParam );
+
+	void  ThreadAbortChildProcess( EIoThreadType threadType, int errCode, std::string const &errMsg );
+	void  ThreadWriteError( EIoThreadType threadType, EIoThreadType eStream, DWORD dwError );
+	DWORD RenderOutput( EIoThreadType eType, BYTE *pData, DWORD nBytes, LONGLONG readStamp );
+	DWORD RenderEndOfStream( EIoThreadType eType );
+	DWORD Deliver( EIoThreadType eType, BYTE *pData, DWORD nBytes );
+	void  StopThreads();
+	void  Finish();
+
+	SRelayOptions          m_options;
+	IRelaySink            *m_pSink;
+	RelayLineFn            m_pfnLine;
+	void                  *m_pLineContext;
+	RelayExitFn            m_pfnExit;
+	void                  *m_pExitContext;
+
+	CIoRedirectionManager *m_pIoMgr;
+	CChildProcess         *m_pChild;
+	COutputMerger         *m_pMerger;
+	COutputThrottle       *m_pThrottle[2];   // indexed by StdOutRead/StdErrRead
+	std::string            m_partialLine[2]; // for the line callback, indexed by StdOutRead/StdErrRead
+	bool                   m_fRingLines[2];  // the reader's ring holds the unfinished line, see Deliver()
+	size_t                 m_nRingCarry[2];  // bytes of it, just before the next chunk
+	SOutputThreadInfo      m_oti[2];
+	HANDLE                 m_hThreads[NUM_EIOTHREADTYPES];
+	HANDLE                 m_hStdIn;         // our std input, closed to stop the stdin thread
+	HANDLE                 m_hIoPort;        // IoEngineIocp's completion port
+	SRelayIoStats          m_ioStats[2];     // indexed by StdOutRead/StdErrRead
+	LONGLONG               m_ticksPerSec;    // QueryPerformanceFrequency(), for the latencies
+	utils::LatencyHistogram m_endToEnd[2];   // microseconds, see SRelayLatencyStats
+	utils::LatencyHistogram m_queued[2];
+	utils::LatencyHistogram m_render[2];
+
+	utils::Event           m_abortEvent;
+	utils::CancelToken     m_stopThreads;    // redirection is complete, monitoring threads should exit
+	utils::Event           m_stopEvent;      // signalled along with m_stopThreads, for blocked i/o
+	utils::Event           m_endOfStream[2]; // a reader has relayed all of its pipe, see Poll()
+	std::exception_ptr     m_threadExceptions[NUM_EIOTHREADTYPES];
+
+	/* event loop state, see Poll() */
+	bool                   m_fStarted, m_fDone;
+	bool                   m_fAborted, m_fChildExited, m_fTreeExited;
+	bool                   m_fEndOfStream[2];  // indexed by StdOutRead/StdErrRead
+	DWORD                  m_dwChildExitTime;
+	DWORD                  m_dwExitCode;
+};
+
+#endif // _relay_h_
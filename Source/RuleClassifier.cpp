@@ -0,0 +1,299 @@
+/***********************************************************************************************//**
+\file    RuleClassifier.cpp
+\author  hdaniel
+\version $Id$
+
+\brief CRuleClassifier, line segmentation and rule matching of relayed output (see RuleClassifier.h).
+ 
+\details
+
+A classifier holds the state of one output: the line cache, the results of the chunk classified
+last and, per stream, the match of a line that's still being written. The sinks take it with
+Enter()/Leave() around Classify() and their use of its results. Anything that classifies other
+text, a server's clients or the pager's screen, has a classifier of its own started from the
+shared one, so it has the same rules and workers but none of that state.
+
+\license
+
+This file is free and unencumbered software released into the public domain.
+
+Anyone is free to copy, modify, publish, use, compile, sell, or distribute this software, either in
+source code form or as a compiled binary, for any purpose, commercial or non-commercial, and by any
+means.
+
+In jurisdictions that recognize copyright laws, the author or authors of this software dedicate any
+and all copyright interest in the software to the public domain. We make this dedication for the 
+benefit of the public at large and to the detriment of our heirs and successors. We intend this 
+dedication to be an overt act of relinquishment in perpetuity of all present and future rights to
+this software under copyright law.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT
+NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND 
+NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+For more information, please refer to <http://unlicense.org/>
+***************************************************************************************************/
+#include <cstring>
+#include <vector>
+
+#include <windows.h>
+
+#include "RuleClassifier.h"
+
+//==================================================================================================
+// Rule based classification (--rule). Complete lines are classified through m_ruleCache, so the 
+// rules run once per distinct line. A partial line at the end of a chunk isn't held back; it's
+// classified as far as it goes and the rest of the line is matched incrementally as it arrives
+// (matcher::match_stream), so a line of any length is scanned once. Without rules chunks are only
+// cut into lines.
+//
+// Lines that miss the cache are matched serially unless there's at least RULE_PARALLEL_MIN bytes of
+// them, in which case they're spread over the pool: short lines in batches of about 
+// RULE_BATCH_SIZE bytes, and lines longer than twice RULE_SEGMENT_SIZE cut into segments that are
+// scanned independently and merged afterwards. Results land in per-line (per-segment) slots, so 
+// they're put back in order before rendering regardless of which task finished first.
+//==================================================================================================
+#define RULE_PARALLEL_MIN  (64 * 1024)
+#define RULE_BATCH_SIZE    (16 * 1024)
+#define RULE_SEGMENT_SIZE  (64 * 1024)
+
+//==================================================================================================
+void CRuleClassifier::ClassifyTask( void *arg )
+{
+	SClassifyTask   *pTask = (SClassifyTask*)arg;
+	CRuleClassifier *pThis = pTask->pThis;
+
+	if( !pTask->nPieces )
+	{
+		SLine const &line = pThis->m_lines[pTask->iPiece];
+		pThis->m_rules.collect( pTask->pData + line.pos, pTask->from, pTask->to, pThis->m_segmentSpans[pTask->iSegment] );
+		return;
+	}
+
+	for( size_t i = pTask->iPiece; i < pTask->iPiece + pTask->nPieces; i++ )
+	{
+		SLine const &line = pThis->m_lines[i];
+		if( line.eKind == LineMiss ) { pThis->m_rules.match( pTask->pData + line.pos, line.len, pThis->m_lineSpans[i] ); }
+	}
+}
+
+//==================================================================================================
+void CRuleClassifier::ClassifyMissesInParallel( char const *pData )
+{
+	SClassifyTask task = { this, pData, 0, 0, 0, 0, 0 };
+	size_t        nSegments = 0, batchBytes = 0;
+
+	m_classifyTasks.clear();
+	for( size_t i = 0; i < m_lines.size(); i++ )
+	{
+		SLine const &line = m_lines[i];
+		if( line.eKind != LineMiss ) { continue; }
+
+		if( line.len >= 2 * RULE_SEGMENT_SIZE )
+		{
+			SClassifyTask segment = { this, pData, i, 0, 0, 0, 0 };
+			for( size_t from = 0; from < line.len; from += RULE_SEGMENT_SIZE )
+			{
+				segment.from     = from;
+				segment.to       = (line.len - from > RULE_SEGMENT_SIZE) ? from + RULE_SEGMENT_SIZE : line.len;
+				segment.iSegment = nSegments++;
+				m_classifyTasks.push_back( segment );
+			}
+			continue;
+		}
+
+		if( !task.nPieces ) { task.iPiece = i; }
+		task.nPieces = i + 1 - task.iPiece;
+		batchBytes  += line.len;
+		if( batchBytes >= RULE_BATCH_SIZE )
+		{
+			m_classifyTasks.push_back( task );
+			task.nPieces = 0;
+			batchBytes   = 0;
+		}
+	}
+	if( task.nPieces ) { m_classifyTasks.push_back( task ); }
+
+	if( m_segmentSpans.size() < nSegments ) { m_segmentSpans.resize( nSegments ); }
+	for( size_t i = 0; i < nSegments; i++ ) { m_segmentSpans[i].clear(); }
+
+	utils::ThreadPool::Group group;
+	for( size_t i = 0; i < m_classifyTasks.size(); i++ )
+	{
+		m_pPool->Submit( group, ClassifyTask, &m_classifyTasks[i] );
+	}
+	m_pPool->Wait( group );
+
+	/* Merge the segments of each long line, in order.
+	*/
+	for( size_t i = 0; i < m_classifyTasks.size(); i++ )
+	{
+		SClassifyTask const &segment = m_classifyTasks[i];
+		if( segment.nPieces ) { continue; }
+
+		ruleutils::spans &line = m_lineSpans[segment.iPiece];
+		ruleutils::spans &raw  = m_segmentSpans[segment.iSegment];
+		line.insert( line.end(), raw.begin(), raw.end() );
+
+		bool fLast = (i + 1 == m_classifyTasks.size()) || m_classifyTasks[i + 1].nPieces 
+		             || m_classifyTasks[i + 1].iPiece != segment.iPiece;
+		if( fLast ) { m_rules.resolve( line, 0 ); }
+	}
+}
+
+//==================================================================================================
+// Cut a chunk of stream eType's output into Lines() and compute their Spans(), unless it's the 
+// chunk classified last.
+//==================================================================================================
+void CRuleClassifier::Classify( EIoThreadType eType, char const *pData, size_t nBytes )
+{
+	if( pData == m_pChunk && nBytes == m_nChunkBytes && eType == m_eChunkType ) { return; }
+	m_pChunk      = pData;
+	m_nChunkBytes = nBytes;
+	m_eChunkType  = eType;
+
+	ruleutils::matcher::stream_state &stream = m_ruleStream[eType];
+
+	size_t nLines = 0, missBytes = 0;
+
+	m_spans.clear();
+	m_lines.clear();
+	for( size_t pos = 0, len; pos < nBytes; pos += len, nLines++ )
+	{
+		char const *eol = (char const*)::memchr( pData + pos, '\n', nBytes - pos );
+		len = eol ? (eol - (pData + pos) + 1) : (nBytes - pos);
+
+		SLine line = { pos, len, eol != NULL, 0, 0, 0, LineStream };
+		while( line.len && (pData[pos + line.len - 1] == '\n' || pData[pos + line.len - 1] == '\r') ) 
+		{ 
+			line.len--; 
+		}
+		if( m_rules.empty() ) 
+		{ 
+			m_lines.push_back( line ); 
+			continue; 
+		}
+
+		if( m_lineSpans.size() <= nLines ) { m_lineSpans.resize( nLines + 1 ); }
+		ruleutils::spans &spans = m_lineSpans[nLines];
+		spans.clear();
+
+		if( eol && stream.pos == 0 )
+		{
+			line.hash = ruleutils::hash64( pData + pos, line.len );
+
+			ruleutils::spans const *cached = m_ruleCache.find( line.hash, line.len );
+			if( cached ) 
+			{ 
+				line.eKind = LineCached;
+				spans      = *cached; 
+			}
+			else
+			{
+				line.eKind = LineMiss;
+				missBytes += line.len;
+			}
+		}
+		else
+		{
+			/* The line started in an earlier chunk, or doesn't end in this one.
+			*/
+			m_rules.match_stream( stream, pData + pos, line.len, spans );
+			if( eol ) { stream.reset(); }
+		}
+		m_lines.push_back( line );
+	}
+	if( m_rules.empty() ) { return; }
+
+	if( missBytes >= RULE_PARALLEL_MIN && m_pPool->Size() )
+	{
+		ClassifyMissesInParallel( pData );
+	}
+	else
+	{
+		for( size_t i = 0; i < nLines; i++ )
+		{
+			SLine const &line = m_lines[i];
+			if( line.eKind == LineMiss ) { m_rules.match( pData + line.pos, line.len, m_lineSpans[i] ); }
+		}
+	}
+
+	for( size_t i = 0; i < nLines; i++ )
+	{
+		SLine            &line  = m_lines[i];
+		ruleutils::spans &spans = m_lineSpans[i];
+
+		if( line.eKind == LineMiss ) { m_ruleCache.insert( line.hash, line.len ) = spans; }
+
+		line.iSpan  = m_spans.size();
+		line.nSpans = spans.size();
+		for( size_t j = 0; j < spans.size(); j++ )
+		{
+			m_spans.push_back( spans[j] );
+			m_spans.back().begin += line.pos;
+		}
+	}
+}
+
+//==================================================================================================
+CRuleClassifier::CRuleClassifier() 
+	: m_pChunk(NULL), m_nChunkBytes(0), m_eChunkType(StdOutRead), m_pOwnAttrs(NULL), m_pAttrs(NULL)
+	, m_pPool(&m_rulePool)
+{
+}
+
+//==================================================================================================
+CRuleClassifier::~CRuleClassifier()
+{
+	delete m_pOwnAttrs;
+}
+
+//==================================================================================================
+// The table is made when it's first needed, so classifiers started with Start( shared ) (the
+// server's, one per client, and the pager's) don't reserve one they never use.
+//==================================================================================================
+colorutils::attr_table& CRuleClassifier::OwnAttributes()
+{
+	if( !m_pOwnAttrs ) { m_pOwnAttrs = new colorutils::attr_table; }
+	return *m_pOwnAttrs;
+}
+
+//==================================================================================================
+void CRuleClassifier::AddRule( char const *pattern, colorutils::text_attr const &attr )
+{
+	m_pAttrs = &OwnAttributes();
+	m_rules.add( pattern, m_pAttrs->intern( attr ) );
+}
+
+//==================================================================================================
+// Rules are matched on up to four workers when large chunks come in.
+//==================================================================================================
+void CRuleClassifier::Start()
+{
+	m_pAttrs = &OwnAttributes();
+	if( m_rules.empty() ) { return; }
+
+	SYSTEM_INFO sysInfo;
+	::GetSystemInfo( &sysInfo );
+
+	m_rules.compile(); 
+	m_rulePool.Start( (sysInfo.dwNumberOfProcessors > 4) ? 4 : sysInfo.dwNumberOfProcessors - 1 );
+}
+
+//==================================================================================================
+// The pool takes tasks from any number of threads, so the classifiers share the workers as well.
+//==================================================================================================
+void CRuleClassifier::Start( CRuleClassifier const &shared )
+{
+	m_rules  = shared.m_rules;
+	m_pAttrs = shared.m_pAttrs;
+	m_pPool  = shared.m_pPool;
+}
+
+//==================================================================================================
+void CRuleClassifier::Stop()
+{
+	m_rulePool.Stop();
+}
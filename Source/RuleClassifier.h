@@ -0,0 +1,142 @@
+/***********************************************************************************************//**
+\file    RuleClassifier.h
+\author  hdaniel
+\version $Id$
+
+\brief Line segmentation and --rule matching of relayed output, shared by the sinks.
+
+\details
+
+Each chunk of output is cut into lines and, when rules are given, the spans of every line are
+found through a line cache and, for large chunks, a small thread pool. The results are kept for
+the chunk so that every sink writing it (console colors, JSON lines) works from the same
+classification rather than parsing the chunk again.
+
+\license
+
+This file is free and unencumbered software released into the public domain.
+
+Anyone is free to copy, modify, publish, use, compile, sell, or distribute this software, either in
+source code form or as a compiled binary, for any purpose, commercial or non-commercial, and by any
+means.
+
+In jurisdictions that recognize copyright laws, the author or authors of this software dedicate any
+and all copyright interest in the software to the public domain. We make this dedication for the
+benefit of the public at large and to the detriment of our heirs and successors. We intend this
+dedication to be an overt act of relinquishment in perpetuity of all present and future rights to
+this software under copyright law.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT
+NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+For more information, please refer to <http://unlicense.org/>
+***************************************************************************************************/
+#ifndef _ruleclassifier_h_
+#define _ruleclassifier_h_
+
+#include <vector>
+
+#include <windows.h>
+
+#include "Relay.h"
+#include "Utils\utils.h"
+#include "Utils\colorutils.h"
+#include "Utils\ruleutils.h"
+#include "Utils\threadpool.h"
+
+//==================================================================================================
+// Rules are added first, then Start() compiles them; or Start( shared ) takes the compiled rules and
+// the workers of a started classifier (cr --serve gives each client a classifier of its own).
+// Classify() and the results are used between Enter() and Leave(), which also serializes the sinks
+// sharing the classifier.
+//
+// Classify() remembers the chunk it classified last, so a sink that passes a chunk on to another
+// sink doesn't have it classified twice. The sink that classified a chunk calls Forget() before
+// leaving, as the same buffer will hold the stream's next chunk.
+//==================================================================================================
+class CRuleClassifier
+{
+public:
+	enum ELineKind { LineCached, LineMiss, LineStream };
+
+	struct SLine
+	{
+		size_t             pos;     // in the chunk
+		size_t             len;     // without the line terminator
+		bool               fEol;    // false for a partial line at the end of the chunk
+		size_t             iSpan;   // first of the line's Spans()
+		size_t             nSpans;
+		unsigned long long hash;    // used while classifying
+		ELineKind          eKind;
+	};
+
+	CRuleClassifier();
+	~CRuleClassifier();
+
+	/* Color occurrences of pattern with attr (--rule). The attr of a rule's spans is its id in
+	 * Attributes().
+	*/
+	void               AddRule( char const *pattern, colorutils::text_attr const &attr );
+	bool               HasRules() const                          { return !m_rules.empty(); }
+	std::string const& RuleName( size_t rule ) const             { return m_rules.pattern( rule ); }
+
+	/* The rules' attributes, and those of the sinks using the classifier. Shared with Start( shared ),
+	 * so a classifier only has a table of its own once it has rules or is started on its own.
+	 * Available once the classifier is started.
+	*/
+	colorutils::attr_table& Attributes() const { return *m_pAttrs; }
+
+	void Start();
+	void Start( CRuleClassifier const &shared );
+	void Stop();
+
+	void Enter() { m_mutex.Enter(); }
+	void Leave() { m_mutex.Leave(); }
+
+	void Classify( EIoThreadType eType, char const *pData, size_t nBytes );
+	void Forget()  { m_pChunk = NULL; }
+
+	std::vector<SLine> const& Lines() const { return m_lines; }
+	ruleutils::spans const&   Spans() const { return m_spans; }  // chunk coordinates, in order
+
+	unsigned long long CacheHits() const    { return m_ruleCache.hits(); }
+	unsigned long long CacheLookups() const { return m_ruleCache.lookups(); }
+
+private:
+	struct SClassifyTask
+	{
+		CRuleClassifier *pThis;
+		char const      *pData;    // the chunk
+		size_t           iPiece;   // first line of the batch, or the line being segmented
+		size_t           nPieces;  // lines in the batch, 0 for a segment
+		size_t           from, to; // segment of the line
+		size_t           iSegment; // m_segmentSpans slot of the segment
+	};
+
+	static void             ClassifyTask( void *arg );
+	void                    ClassifyMissesInParallel( char const *pData );
+	colorutils::attr_table& OwnAttributes();
+
+	utils::Mutex                     m_mutex;
+	char const                      *m_pChunk;        // chunk classified last, see Forget()
+	size_t                           m_nChunkBytes;
+	EIoThreadType                    m_eChunkType;
+
+	ruleutils::matcher               m_rules;         // --rule patterns
+	colorutils::attr_table          *m_pOwnAttrs;     // --rule attributes, see OwnAttributes()
+	colorutils::attr_table          *m_pAttrs;        // m_pOwnAttrs, or the shared classifier's
+	ruleutils::span_cache            m_ruleCache;     // line fingerprint -> spans
+	utils::ThreadPool                m_rulePool;      // for classifying large chunks
+	utils::ThreadPool               *m_pPool;         // m_rulePool, or the shared classifier's
+	ruleutils::matcher::stream_state m_ruleStream[2]; // indexed by StdOutRead/StdErrRead
+	std::vector<SLine>               m_lines;
+	ruleutils::spans                 m_spans;
+	std::vector<ruleutils::spans>    m_lineSpans;     // spans of each of m_lines, line relative
+	std::vector<SClassifyTask>       m_classifyTasks;
+	std::vector<ruleutils::spans>    m_segmentSpans;  // raw matches of each long line segment
+};
+
+#endif // _ruleclassifier_h_
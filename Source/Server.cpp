@@ -0,0 +1,501 @@
+/***********************************************************************************************//**
+\file    Server.cpp
+\author  hdaniel
+\version $Id$
+
+\brief CRelayServer and CRelayClient, cr --serve and --server (see Server.h).
+
+\details
+
+The server accepts clients on the main thread and serves each on a thread of its own, with a
+CRelay, sinks and a classifier of their own started from the server's, so clients never share
+state beyond the compiled rules and the classifier's workers. A request is read whole before
+anything is done with it; its sizes are capped and its strings checked before they're used, and a
+request that fails either is declined, which leaves the client to run the child itself.
+
+\license
+
+This file is free and unencumbered software released into the public domain.
+
+Anyone is free to copy, modify, publish, use, compile, sell, or distribute this software, either in
+source code form or as a compiled binary, for any purpose, commercial or non-commercial, and by any
+means.
+
+In jurisdictions that recognize copyright laws, the author or authors of this software dedicate any
+and all copyright interest in the software to the public domain. We make this dedication for the 
+benefit of the public at large and to the detriment of our heirs and successors. We intend this 
+dedication to be an overt act of relinquishment in perpetuity of all present and future rights to
+this software under copyright law.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT
+NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND 
+NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+For more information, please refer to <http://unlicense.org/>
+***************************************************************************************************/
+#include <iostream>
+#include <new>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include <windows.h>
+
+#include "Server.h"
+
+#define SERVER_PIPE_PREFIX    "\\\\.\\pipe\\cr-"
+#define SERVER_PIPE_BUFFER    4096
+#define SERVER_VERSION        1
+#define SERVER_POLL_MS        50         // how often a connection checks for client messages
+#define SERVER_CONNECT_WAIT   1000       // ms a client waits for a busy server
+#define SERVER_MAX_CMDLINE    32768      // wchar_t's, CreateProcess's own limit
+#define SERVER_MAX_CURDIR     32768
+#define SERVER_MAX_ENV        (1 << 20)  // wchar_t's, far more than any real environment block
+
+static std::stringstream g_ssErr;  // used for error message construction
+
+//==================================================================================================
+inline void ServerError( int code, std::string const &errMsg ) 
+{ 
+    throw exit_exception( errMsg.c_str(), code );
+}
+
+//==================================================================================================
+// The protocol. The client sends an SServerRequest followed by the command line, the current 
+// directory and the environment block (all wchar_t, NUL terminated), and gets an SServerReply: 
+// ServerStarted, or ServerDeclined/ServerFailed when the child wasn't started. Until the 
+// ServerExited reply the client may send ClientBreak messages (a DWORD).
+//==================================================================================================
+enum EServerMessage { ServerStarted, ServerExited, ServerFailed, ServerDeclined, ClientBreak };
+
+struct SServerRequest
+{
+	DWORD     dwVersion;
+	ULONGLONG hStdIn;          // client's handles, 0 when the child's stdin is to be empty
+	ULONGLONG hStdOut;
+	BOOL      fConsole;        // hStdOut is a console
+	WORD      defaultAttr;     // of the client's console
+	DWORD     cchCmdLine;      // wchar_t's, including the NUL
+	DWORD     cchCurDir;
+	DWORD     cchEnvironment;  // the whole block, including the final NUL
+};
+
+struct SServerReply
+{
+	DWORD              dwMessage;
+	DWORD              dwValue;    // the child's pid, exit code, or error code
+	DWORD              cchText;    // ServerFailed, length of the error message that follows
+	BOOL               fUsage;     // ServerExited, usage is valid
+	SResourceUsage     usage;
+	ULONGLONG          ullCacheHits, ullCacheLookups;
+	SRelayLatencyStats latency;    // ServerExited
+};
+
+//==================================================================================================
+// Read or write all of nBytes. The pipe is used synchronously unless hEvent is given, in which
+// case the handle is overlapped and hEvent is used to wait for each transfer. 
+//==================================================================================================
+static BOOL TransferAll( HANDLE hPipe, bool fWrite, void *pData, DWORD nBytes, HANDLE hEvent )
+{
+	BYTE *p = (BYTE*)pData;
+
+	while( nBytes )
+	{
+		OVERLAPPED ov;
+		DWORD      n = 0;
+		BOOL       fOk;
+
+		::ZeroMemory( &ov, sizeof(ov) );
+		ov.hEvent = hEvent;
+
+		fOk = fWrite ? ::WriteFile( hPipe, p, nBytes, &n, hEvent ? &ov : NULL )
+		             : ::ReadFile( hPipe, p, nBytes, &n, hEvent ? &ov : NULL );
+		if( !fOk && (!hEvent || ::GetLastError() != ERROR_IO_PENDING) ) { return FALSE; }
+		if( hEvent && !::GetOverlappedResult( hPipe, &ov, &n, TRUE ) )  { return FALSE; }
+		if( !n ) { return FALSE; }
+
+		p += n; nBytes -= n;
+	}
+	return TRUE;
+}
+
+//==================================================================================================
+static void Reply( HANDLE hPipe, SServerReply &reply, std::string const &text =std::string() )
+{
+	reply.cchText = (DWORD)text.size();
+	if( TransferAll( hPipe, true, &reply, sizeof(reply), NULL ) && !text.empty() )
+	{
+		TransferAll( hPipe, true, (void*)text.data(), (DWORD)text.size(), NULL );
+	}
+}
+
+//==================================================================================================
+CRelayServer::CRelayServer( SRelayOptions const &relayOptions, SConsoleOptions const &consoleOptions, 
+                            WORD defaultAttr, CRuleClassifier const &classifier )
+	: m_relayOptions(relayOptions), m_consoleOptions(consoleOptions), m_defaultAttr(defaultAttr)
+	, m_pClassifier(&classifier)
+{
+}
+
+//==================================================================================================
+// One pipe instance per client. The first instance is created with FILE_FLAG_FIRST_PIPE_INSTANCE,
+// so a second server of the same name fails rather than sharing the clients.
+//==================================================================================================
+void CRelayServer::Run( std::string const &name )
+{
+	std::string pipeName = SERVER_PIPE_PREFIX + name;
+
+	std::cerr << "[cr] serving on " << pipeName << std::endl;
+
+	for( DWORD dwFirst = FILE_FLAG_FIRST_PIPE_INSTANCE; ; dwFirst = 0 )
+	{
+		HANDLE hPipe = ::CreateNamedPipeA( pipeName.c_str(), PIPE_ACCESS_DUPLEX|dwFirst, 
+		                                   PIPE_TYPE_BYTE|PIPE_READMODE_BYTE|PIPE_WAIT|PIPE_REJECT_REMOTE_CLIENTS,
+		                                   PIPE_UNLIMITED_INSTANCES, SERVER_PIPE_BUFFER, SERVER_PIPE_BUFFER, 
+		                                   0, NULL );
+		if( hPipe == INVALID_HANDLE_VALUE )
+		{
+			g_ssErr.str("");
+			g_ssErr << "Could not create server pipe '" << pipeName << "'. " 
+			        << GetApiErrorString( ::GetLastError(), "CreateNamedPipe" );
+
+			ServerError( CR_STATUS_WINAPI, g_ssErr.str() );
+		}
+
+		if( !::ConnectNamedPipe( hPipe, NULL ) && ::GetLastError() != ERROR_PIPE_CONNECTED )
+		{
+			::CloseHandle( hPipe );
+			continue;
+		}
+
+		SConnection *pConnection = new SConnection;
+		pConnection->pServer     = this;
+		pConnection->hPipe       = hPipe;
+
+		HANDLE hThread = ::CreateThread( NULL, 0, ConnectionThread, pConnection, 0, NULL );
+		if( hThread ) 
+		{ 
+			::CloseHandle( hThread ); 
+		}
+		else
+		{
+			/* The client finds the pipe closed and runs the child itself. */
+			::CloseHandle( hPipe );
+			delete pConnection;
+		}
+	}
+}
+
+//==================================================================================================
+DWORD WINAPI CRelayServer::ConnectionThread( LPVOID lpvThreadParam )
+{
+	SConnection *pConnection = (SConnection*)lpvThreadParam;
+
+	pConnection->pServer->Serve( pConnection->hPipe );
+
+	::FlushFileBuffers( pConnection->hPipe );
+	::DisconnectNamedPipe( pConnection->hPipe );
+	::CloseHandle( pConnection->hPipe );
+	delete pConnection;
+	return 0;
+}
+
+//==================================================================================================
+// Run one client's child. The child's output is rendered by a CConsoleSink of its own on the 
+// client's stdout, colored with the client's console attribute as the default where the options 
+// left the server's default in place.
+//==================================================================================================
+void CRelayServer::Serve( HANDLE hPipe )
+{
+	SServerRequest       req;
+	SServerReply         reply;
+	std::vector<wchar_t> strings;
+	ULONG                ulClientPid;
+	HANDLE               hClient = NULL, hStdIn = NULL, hStdOut = NULL;
+
+	::ZeroMemory( &reply, sizeof(reply) );
+
+	if( !TransferAll( hPipe, false, &req, sizeof(req), NULL ) ) { return; }
+	/* The sizes come from the client, so they're capped before anything is allocated, and the 
+	 * strings must be NUL terminated where the client said they end.
+	*/
+	if( req.dwVersion != SERVER_VERSION 
+		|| !req.cchCmdLine || req.cchCmdLine > SERVER_MAX_CMDLINE
+		|| !req.cchCurDir  || req.cchCurDir > SERVER_MAX_CURDIR
+		|| req.cchEnvironment > SERVER_MAX_ENV || req.cchEnvironment == 1 )
+	{
+		reply.dwMessage = ServerDeclined;
+		Reply( hPipe, reply );
+		return;
+	}
+
+	try
+	{
+		strings.resize( req.cchCmdLine + req.cchCurDir + req.cchEnvironment );
+	}
+	catch( std::bad_alloc const & )
+	{
+		reply.dwMessage = ServerDeclined;
+		Reply( hPipe, reply );
+		return;
+	}
+	if( !TransferAll( hPipe, false, &strings[0], (DWORD)(strings.size() * sizeof(wchar_t)), NULL ) ) { return; }
+
+	wchar_t *cmdLine      = &strings[0];
+	wchar_t *pCurDir      = cmdLine + req.cchCmdLine;
+	wchar_t *pEnvironment = req.cchEnvironment ? pCurDir + req.cchCurDir : NULL;
+
+	if( cmdLine[req.cchCmdLine - 1] || pCurDir[req.cchCurDir - 1]
+		|| (pEnvironment && (pEnvironment[req.cchEnvironment - 1] || pEnvironment[req.cchEnvironment - 2])) )
+	{
+		reply.dwMessage = ServerDeclined;
+		Reply( hPipe, reply );
+		return;
+	}
+
+	/* Take over the client's handles. 
+	*/
+	DWORD dwConsoleMode;
+	HANDLE hProcess = ::GetCurrentProcess();
+
+	if( !::GetNamedPipeClientProcessId( hPipe, &ulClientPid )
+		|| !(hClient = ::OpenProcess( PROCESS_DUP_HANDLE, FALSE, ulClientPid ))
+		|| !::DuplicateHandle( hClient, (HANDLE)(ULONG_PTR)req.hStdOut, hProcess, &hStdOut, 0, FALSE, DUPLICATE_SAME_ACCESS )
+		|| (req.hStdIn 
+		    && !::DuplicateHandle( hClient, (HANDLE)(ULONG_PTR)req.hStdIn, hProcess, &hStdIn, 0, FALSE, DUPLICATE_SAME_ACCESS ))
+		|| (req.fConsole && !::GetConsoleMode( hStdOut, &dwConsoleMode )) )
+	{
+		if( hStdIn )  { ::CloseHandle( hStdIn ); }
+		if( hStdOut ) { ::CloseHandle( hStdOut ); }
+		if( hClient ) { ::CloseHandle( hClient ); }
+
+		reply.dwMessage = ServerDeclined;
+		Reply( hPipe, reply );
+		return;
+	}
+	::CloseHandle( hClient );
+
+	/* Relay the child with everything set up in advance.
+	*/
+	CRuleClassifier classifier;
+	classifier.Start( *m_pClassifier );
+
+	CConsoleSink    sink( req.defaultAttr, classifier );
+	SConsoleOptions &consoleOpts = sink.Options();
+
+	consoleOpts = m_consoleOptions;
+	if( consoleOpts.stdoutAttr == m_defaultAttr ) { consoleOpts.stdoutAttr = req.defaultAttr; }
+	if( consoleOpts.stderrAttr == m_defaultAttr ) { consoleOpts.stderrAttr = req.defaultAttr; }
+
+	CVtSink vtSink;
+	sink.Start( hStdOut, &vtSink );
+	vtSink.Start( consoleOpts.eVtMode, sink.OutputAttr( StdOutRead ), sink.OutputAttr( StdErrRead ), &sink );
+
+	CRelay relay;
+	relay.Options()               = m_relayOptions;
+	relay.Options().fForwardStdIn = hStdIn != NULL;
+	relay.Options().hStdIn        = hStdIn;
+	relay.SetSink( (consoleOpts.eVtMode != VtPass) ? (IRelaySink*)&vtSink : &sink );
+
+	try
+	{
+		relay.Run( cmdLine, pCurDir, pEnvironment );
+
+		reply.dwMessage = ServerStarted;
+		reply.dwValue   = relay.GetChildProcessId();
+		Reply( hPipe, reply );
+
+		/* While the child runs, take Ctrl+Break requests from the client. A client that's gone
+		 * (killed, or its console closed) won't be waiting for the output, so the tree is aborted.
+		*/
+		bool fAborted = false;
+		while( !relay.Poll( SERVER_POLL_MS ) )
+		{
+			DWORD dwMessage, nAvail;
+			if( !::PeekNamedPipe( hPipe, NULL, 0, NULL, &nAvail, NULL ) )
+			{
+				if( !fAborted ) { relay.Abort(); }
+				fAborted = true;
+			}
+			else if( nAvail >= sizeof(dwMessage) && TransferAll( hPipe, false, &dwMessage, sizeof(dwMessage), NULL )
+			         && dwMessage == ClientBreak && relay.GetChildProcessId() )
+			{
+				::GenerateConsoleCtrlEvent( CTRL_BREAK_EVENT, relay.GetChildProcessId() );
+			}
+		}
+
+		reply.dwMessage       = ServerExited;
+		reply.dwValue         = relay.ExitCode();
+		reply.fUsage          = relay.GetResourceUsage( reply.usage );
+		reply.ullCacheHits    = classifier.CacheHits();
+		reply.ullCacheLookups = classifier.CacheLookups();
+		relay.GetLatency( reply.latency );
+		Reply( hPipe, reply );
+	}
+	catch( exit_exception& except )
+	{
+		reply.dwMessage = ServerFailed;
+		reply.dwValue   = (DWORD)except.code();
+		Reply( hPipe, reply, except.what() );
+	}
+
+	relay.Close();
+	classifier.Stop();
+	::CloseHandle( hStdOut );
+}
+
+//==================================================================================================
+CRelayClient::CRelayClient()
+	: m_hPipe(INVALID_HANDLE_VALUE), m_fServed(false), m_fUsage(FALSE)
+	, m_ullCacheHits(0), m_ullCacheLookups(0)
+{
+	::ZeroMemory( &m_usage, sizeof(m_usage) );
+	::ZeroMemory( &m_latency, sizeof(m_latency) );
+}
+
+CRelayClient::~CRelayClient()
+{
+	Disconnect();
+}
+
+//==================================================================================================
+// Connect to the server of the given name. A server that's busy accepting another client gets
+// SERVER_CONNECT_WAIT ms to make a new pipe instance available.
+//==================================================================================================
+bool CRelayClient::Connect( std::string const &name )
+{
+	std::string pipeName = SERVER_PIPE_PREFIX + name;
+
+	for( int attempt = 0; attempt < 2; attempt++ )
+	{
+		m_hPipe = ::CreateFileA( pipeName.c_str(), GENERIC_READ|GENERIC_WRITE, 0, NULL, OPEN_EXISTING, 
+		                         FILE_FLAG_OVERLAPPED, NULL );
+		if( m_hPipe != INVALID_HANDLE_VALUE ) { return true; }
+
+		if( ::GetLastError() != ERROR_PIPE_BUSY 
+			|| !::WaitNamedPipeA( pipeName.c_str(), SERVER_CONNECT_WAIT ) ) 
+		{
+			break;
+		}
+	}
+	return false;
+}
+
+//==================================================================================================
+void CRelayClient::Disconnect()
+{
+	if( m_hPipe != INVALID_HANDLE_VALUE ) 
+	{ 
+		::CloseHandle( m_hPipe ); 
+		m_hPipe = INVALID_HANDLE_VALUE;
+	}
+}
+
+//==================================================================================================
+BOOL CRelayClient::Transfer( bool fWrite, void *pData, DWORD nBytes )
+{
+	utils::Event done;
+	return TransferAll( m_hPipe, fWrite, pData, nBytes, done );
+}
+
+//==================================================================================================
+// Hand cmdLine to the server with our stdio, directory and environment. Our stdin is only passed
+// on when it isn't a console (the server can't read another process' console input), otherwise the
+// child's stdin is empty as it is without stdin forwarding. Returns false when the server declined, 
+// throws an exit_exception when it failed to start the child.
+//==================================================================================================
+bool CRelayClient::Run( wchar_t const *cmdLine, WORD defaultAttr )
+{
+	SServerRequest req;
+	SServerReply   reply;
+	DWORD          dwConsoleMode;
+
+	HANDLE hStdIn  = ::GetStdHandle( STD_INPUT_HANDLE );
+	HANDLE hStdOut = ::GetStdHandle( STD_OUTPUT_HANDLE );
+
+	std::vector<wchar_t> curDir( MAX_PATH + 1 );
+	DWORD cchCurDir = ::GetCurrentDirectoryW( (DWORD)curDir.size(), &curDir[0] );
+	if( cchCurDir >= curDir.size() )
+	{
+		curDir.resize( cchCurDir );
+		cchCurDir = ::GetCurrentDirectoryW( (DWORD)curDir.size(), &curDir[0] );
+	}
+
+	wchar_t *pEnvironment = ::GetEnvironmentStringsW();
+	wchar_t *pEnd         = pEnvironment;
+	while( pEnd && (pEnd[0] || pEnd[1]) ) { pEnd++; }
+
+	::ZeroMemory( &req, sizeof(req) );
+	req.dwVersion      = SERVER_VERSION;
+	req.hStdIn         = (hStdIn && hStdIn != INVALID_HANDLE_VALUE && !::GetConsoleMode( hStdIn, &dwConsoleMode ))
+	                     ? (ULONGLONG)(ULONG_PTR)hStdIn : 0;
+	req.hStdOut        = (ULONGLONG)(ULONG_PTR)hStdOut;
+	req.fConsole       = ::GetConsoleMode( hStdOut, &dwConsoleMode );
+	req.defaultAttr    = defaultAttr;
+	req.cchCmdLine     = (DWORD)::wcslen( cmdLine ) + 1;
+	req.cchCurDir      = cchCurDir + 1;
+	req.cchEnvironment = pEnd ? (DWORD)(pEnd - pEnvironment) + 2 : 0;
+
+	BOOL fSent = Transfer( true, &req, sizeof(req) )
+	             && Transfer( true, (void*)cmdLine, req.cchCmdLine * sizeof(wchar_t) )
+	             && Transfer( true, &curDir[0], req.cchCurDir * sizeof(wchar_t) )
+	             && (!req.cchEnvironment || Transfer( true, pEnvironment, req.cchEnvironment * sizeof(wchar_t) ));
+	if( pEnvironment ) { ::FreeEnvironmentStringsW( pEnvironment ); }
+
+	if( !fSent || !Transfer( false, &reply, sizeof(reply) ) || reply.dwMessage == ServerDeclined )
+	{
+		Disconnect();
+		return false;
+	}
+
+	if( reply.dwMessage == ServerFailed )
+	{
+		std::string text( reply.cchText, ' ' );
+		if( reply.cchText ) { Transfer( false, &text[0], reply.cchText ); }
+		Disconnect();
+
+		ServerError( (int)reply.dwValue, text );
+	}
+
+	m_fServed = true;
+	return true;
+}
+
+//==================================================================================================
+// Wait for the server to report the child's exit code.
+//==================================================================================================
+DWORD CRelayClient::Wait()
+{
+	SServerReply reply;
+
+	if( !Transfer( false, &reply, sizeof(reply) ) || reply.dwMessage != ServerExited )
+	{
+		Disconnect();
+		ServerError( CR_STATUS_ERROR, "Lost the connection to the cr server." );
+	}
+
+	m_fUsage          = reply.fUsage;
+	m_usage           = reply.usage;
+	m_ullCacheHits    = reply.ullCacheHits;
+	m_ullCacheLookups = reply.ullCacheLookups;
+	m_latency         = reply.latency;
+	Disconnect();
+
+	return reply.dwValue;
+}
+
+//==================================================================================================
+void CRelayClient::Break()
+{
+	DWORD dwMessage = ClientBreak;
+	if( m_hPipe != INVALID_HANDLE_VALUE ) { Transfer( true, &dwMessage, sizeof(dwMessage) ); }
+}
+
+//==================================================================================================
+BOOL CRelayClient::GetResourceUsage( SResourceUsage &usage )
+{
+	usage = m_usage;
+	return m_fUsage;
+}
@@ -0,0 +1,129 @@
+/***********************************************************************************************//**
+\file    Server.h
+\author  hdaniel
+\version $Id$
+
+\brief Resident cr server (--serve) and the client side of it (--server).
+
+\details
+
+Build scripts run cr once per compile step, and every run pays for reading CR_CONFIG/CR_OPTS,
+compiling the --rule automaton and starting its workers before the child is even created. A cr
+started with --serve=name does that once and then waits on the named pipe \\.\pipe\cr-name. A cr
+run with --server=name connects to it and hands over its stdin/stdout, command line, current
+directory and environment; the server spawns the child, relays and colors its output straight to
+the client's stdout, and answers with the child's exit code. The client is left with little more
+than process startup.
+
+When no server is listening, or the server can't draw on the client's console, the client runs the
+child itself as usual, so --server can stay in CR_OPTS whether or not a server is running.
+
+The server duplicates the client's handles out of the client process (the client's stdout being a
+console needs Windows 8 or later, where console handles are real handles). Ctrl+C/Ctrl+Break at the
+client are passed on to the server, which sends the child's process group a CTRL_BREAK_EVENT as cr
+would. When the client goes away the server aborts the child's tree.
+
+\license
+
+This file is free and unencumbered software released into the public domain.
+
+Anyone is free to copy, modify, publish, use, compile, sell, or distribute this software, either in
+source code form or as a compiled binary, for any purpose, commercial or non-commercial, and by any
+means.
+
+In jurisdictions that recognize copyright laws, the author or authors of this software dedicate any
+and all copyright interest in the software to the public domain. We make this dedication for the
+benefit of the public at large and to the detriment of our heirs and successors. We intend this
+dedication to be an overt act of relinquishment in perpetuity of all present and future rights to
+this software under copyright law.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT
+NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+For more information, please refer to <http://unlicense.org/>
+***************************************************************************************************/
+#ifndef _server_h_
+#define _server_h_
+
+#include <string>
+
+#include <windows.h>
+
+#include "Relay.h"
+#include "ConsoleSink.h"
+#include "RuleClassifier.h"
+
+//==================================================================================================
+// Serves clients with the given options and rules, each client on a thread and with a CRelay and
+// CConsoleSink of its own. classifier must be started, and it's only used to start the classifiers
+// of the clients.
+//==================================================================================================
+class CRelayServer
+{
+public:
+	CRelayServer( SRelayOptions const &relayOptions, SConsoleOptions const &consoleOptions, 
+	              WORD defaultAttr, CRuleClassifier const &classifier );
+
+	/* Serve clients on the pipe for name until we're killed. Only returns by throwing an
+	 * exit_exception, when the pipe can't be created (another server of that name is running).
+	*/
+	void Run( std::string const &name );
+
+private:
+	struct SConnection { CRelayServer *pServer; HANDLE hPipe; };
+
+	static DWORD WINAPI ConnectionThread( LPVOID lpvThreadParam );
+
+	void Serve( HANDLE hPipe );
+
+	SRelayOptions          m_relayOptions;
+	SConsoleOptions        m_consoleOptions;
+	WORD                   m_defaultAttr;
+	CRuleClassifier const *m_pClassifier;
+};
+
+//==================================================================================================
+// Runs a child through a CRelayServer: Connect(), Run() and Wait(). Connect() and Run() return false
+// when the server can't be used, and the child should be run here instead.
+//==================================================================================================
+class CRelayClient
+{
+public:
+	CRelayClient();
+	~CRelayClient();
+
+	bool  Connect( std::string const &name );
+	bool  Run( wchar_t const *cmdLine, WORD defaultAttr );
+	DWORD Wait();
+
+	/* Have the server send the child's process group a CTRL_BREAK_EVENT. Can be called from
+	 * another thread, e.g. a console control handler, while Wait() is blocked.
+	*/
+	void  Break();
+
+	bool  IsServed() const { return m_fServed; }
+	BOOL  GetResourceUsage( SResourceUsage &usage );
+	void  GetLatency( SRelayLatencyStats &stats ) const { stats = m_latency; }
+
+	unsigned long long CacheHits() const    { return m_ullCacheHits; }
+	unsigned long long CacheLookups() const { return m_ullCacheLookups; }
+
+private:
+	CRelayClient( CRelayClient const& );
+	CRelayClient& operator=( CRelayClient const& );
+
+	BOOL Transfer( bool fWrite, void *pData, DWORD nBytes );
+	void Disconnect();
+
+	HANDLE             m_hPipe;
+	bool               m_fServed;        // the server has started the child
+	BOOL               m_fUsage;
+	SResourceUsage     m_usage;          // of the child's tree, once it's done
+	unsigned long long m_ullCacheHits, m_ullCacheLookups;
+	SRelayLatencyStats m_latency;        // of the child's output through the server's relay
+};
+
+#endif // _server_h_
@@ -0,0 +1,651 @@
+/***********************************************************************************************//**
+\file    SessionIndex.cpp
+\author  hdaniel
+\version $Id$
+
+\brief CSessionRecorder and CSessionSearch, --record and cr --search (see SessionIndex.h).
+
+\details
+
+The recorder buffers the lines and their records, and writes them SEARCH_WRITE_SIZE at a time,
+always the lines before the records, so the files of a session that's still being recorded (or
+was killed) are consistent up to the last record on disk. A segment is written after its lines
+and records, for the same reason. The search opens the files as they are, reads the segments
+that are complete, and compares the lines recorded after them.
+
+\license
+
+This file is free and unencumbered software released into the public domain.
+
+Anyone is free to copy, modify, publish, use, compile, sell, or distribute this software, either in
+source code form or as a compiled binary, for any purpose, commercial or non-commercial, and by any
+means.
+
+In jurisdictions that recognize copyright laws, the author or authors of this software dedicate any
+and all copyright interest in the software to the public domain. We make this dedication for the 
+benefit of the public at large and to the detriment of our heirs and successors. We intend this 
+dedication to be an overt act of relinquishment in perpetuity of all present and future rights to
+this software under copyright law.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT
+NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND 
+NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+For more information, please refer to <http://unlicense.org/>
+***************************************************************************************************/
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <iterator>
+#include <sstream>
+#include <string>
+
+#include <windows.h>
+
+#include "SessionIndex.h"
+
+//==================================================================================================
+static std::stringstream g_ssErr;  // used for error message construction
+
+//==================================================================================================
+inline void SessionError( int code, std::string const &errMsg ) 
+{ 
+    throw exit_exception( errMsg.c_str(), code );
+}
+
+//==================================================================================================
+// The recorder writes its files SEARCH_WRITE_SIZE bytes at a time, and writes a segment early once
+// SEARCH_MAX_POSTINGS postings (32MB) are held for it. A search compares up to SEARCH_COMPARE_LINES 
+// lines per read.
+//==================================================================================================
+#define SEARCH_WRITE_SIZE     (1024 * 1024)
+#define SEARCH_MAX_POSTINGS   (4 * 1024 * 1024)
+#define SEARCH_COMPARE_LINES  4096
+
+//==================================================================================================
+static HANDLE CreateSessionFile( std::string const &path )
+{
+	HANDLE hFile = ::CreateFileA( path.c_str(), GENERIC_WRITE, FILE_SHARE_READ, NULL, CREATE_ALWAYS, 
+	                              FILE_ATTRIBUTE_NORMAL, NULL );
+	if( hFile == INVALID_HANDLE_VALUE )
+	{
+		g_ssErr.str("");
+		g_ssErr << "Could not create --record file '" << path << "'. " 
+		        << GetApiErrorString( ::GetLastError(), "CreateFile" );
+		SessionError( CR_STATUS_WINAPI, g_ssErr.str() );
+	}
+	return hFile;
+}
+
+//==================================================================================================
+CSessionRecorder::CSessionRecorder()
+	: m_hLog(INVALID_HANDLE_VALUE), m_hIndex(INVALID_HANDLE_VALUE), m_hTrigrams(INVALID_HANDLE_VALUE)
+	, m_dwStart_ms(0), m_segmentLine(0), m_nLines(0), m_ullBytes(0), m_nSegments(0), m_fFailed(false)
+{
+}
+
+//==================================================================================================
+CSessionRecorder::~CSessionRecorder()
+{
+	CloseFiles();
+}
+
+//==================================================================================================
+void CSessionRecorder::Start( char const *path )
+{
+	m_path      = path;
+	m_hLog      = CreateSessionFile( m_path );
+	m_hIndex    = CreateSessionFile( m_path + ".idx" );
+	m_hTrigrams = CreateSessionFile( m_path + ".tri" );
+
+	FILETIME     ft;
+	SIndexHeader header;
+	::GetSystemTimeAsFileTime( &ft );
+	header.dwMagic      = SEARCH_INDEX_MAGIC;
+	header.dwVersion    = 1;
+	header.ullStartTime = ((ULONGLONG)ft.dwHighDateTime << 32) | ft.dwLowDateTime;
+	m_dwStart_ms        = ::GetTickCount();
+
+	m_index.append( (char const*)&header, sizeof(header) );
+}
+
+//==================================================================================================
+void CSessionRecorder::LineCallback( void *pContext, EIoThreadType eStream, char const *pLine, size_t len )
+{
+	static_cast<CSessionRecorder*>( pContext )->Record( eStream, pLine, len );
+}
+
+//==================================================================================================
+// Record a line, from either stream's thread. The time is taken under the lock, so the lines are
+// recorded in time order.
+//==================================================================================================
+void CSessionRecorder::Record( EIoThreadType eStream, char const *pLine, size_t len )
+{
+	utils::MutexLock lock( m_mutex );
+	if( m_fFailed ) { return; }
+
+	try
+	{
+		len = std::min( len, (size_t)~SEARCH_LINE_STDERR );
+
+		SLineRecord record;
+		record.ullOffset = m_ullBytes;
+		record.dwTime_ms = ::GetTickCount() - m_dwStart_ms;
+		record.dwLength  = (DWORD)len | (eStream == StdErrRead ? SEARCH_LINE_STDERR : 0);
+		m_index.append( (char const*)&record, sizeof(record) );
+
+		m_log.append( pLine, len );
+		m_log += '\n';
+		m_ullBytes += len + 1;
+		m_nLines++;
+
+		BYTE const *p = (BYTE const*)pLine;
+		for( size_t i = 0; i + 2 < len; i++ )
+		{
+			m_blockTrigrams.push_back( ((DWORD)p[i] << 16) | ((DWORD)p[i + 1] << 8) | p[i + 2] );
+		}
+
+		/* The lines go out before the records that refer to them, so a search of a session that's
+		 * still recorded never finds records past the end of the lines file.
+		*/
+		if( m_log.size() >= SEARCH_WRITE_SIZE || m_index.size() >= SEARCH_WRITE_SIZE )
+		{
+			WriteBuffer( m_hLog, m_log );
+			WriteBuffer( m_hIndex, m_index );
+		}
+		if( (m_nLines - m_segmentLine) % SEARCH_BLOCK_LINES == 0 ) { EndBlock(); }
+	}
+	catch( exit_exception &except )
+	{
+		m_fFailed = true;
+		m_error   = except.what();
+	}
+}
+
+//==================================================================================================
+// Add the postings of the block that ends with the last line recorded, and write the segment once
+// it's full. Called with m_mutex held.
+//==================================================================================================
+void CSessionRecorder::EndBlock()
+{
+	DWORD block = (DWORD)((m_nLines - m_segmentLine - 1) / SEARCH_BLOCK_LINES);
+
+	std::sort( m_blockTrigrams.begin(), m_blockTrigrams.end() );
+	m_blockTrigrams.erase( std::unique( m_blockTrigrams.begin(), m_blockTrigrams.end() ), 
+	                       m_blockTrigrams.end() );
+	for( size_t i = 0; i < m_blockTrigrams.size(); i++ )
+	{
+		m_postings.push_back( ((ULONGLONG)m_blockTrigrams[i] << 32) | block );
+	}
+	m_blockTrigrams.clear();
+
+	if( m_nLines - m_segmentLine >= SEARCH_SEGMENT_LINES || m_postings.size() >= SEARCH_MAX_POSTINGS )
+	{
+		WriteSegment();
+	}
+}
+
+//==================================================================================================
+// Write the segment of the lines from m_segmentLine. Its lines are written first, so a search 
+// never finds a segment for lines that aren't in the files. Called with m_mutex held.
+//==================================================================================================
+void CSessionRecorder::WriteSegment()
+{
+	if( m_nLines == m_segmentLine ) { return; }
+
+	WriteBuffer( m_hLog, m_log );
+	WriteBuffer( m_hIndex, m_index );
+
+	/* Sorted, the postings are grouped by trigram with their blocks in ascending order.
+	*/
+	std::sort( m_postings.begin(), m_postings.end() );
+
+	std::vector<STrigramEntry> entries;
+	std::string                blob;
+	DWORD                      prevBlock = 0;
+	for( size_t i = 0; i < m_postings.size(); i++ )
+	{
+		DWORD trigram = (DWORD)(m_postings[i] >> 32);
+		DWORD block   = (DWORD)m_postings[i];
+		if( entries.empty() || entries.back().dwTrigram != trigram )
+		{
+			STrigramEntry entry = { trigram, (DWORD)blob.size(), 0 };
+			entries.push_back( entry );
+			prevBlock = 0;
+		}
+		entries.back().nBlocks++;
+
+		for( DWORD delta = block - prevBlock; ; delta >>= 7 )
+		{
+			if( delta < 0x80 ) 
+			{ 
+				blob += (char)delta; 
+				break; 
+			}
+			blob += (char)((delta & 0x7F) | 0x80);
+		}
+		prevBlock = block;
+	}
+
+	STrigramSegment seg;
+	seg.dwMagic       = SEARCH_SEGMENT_MAGIC;
+	seg.nTrigrams     = (DWORD)entries.size();
+	seg.ullFirstLine  = m_segmentLine;
+	seg.nLines        = (DWORD)(m_nLines - m_segmentLine);
+	seg.nPostingBytes = (DWORD)blob.size();
+
+	std::string out( (char const*)&seg, sizeof(seg) );
+	if( !entries.empty() ) { out.append( (char const*)&entries[0], entries.size() * sizeof(STrigramEntry) ); }
+	out += blob;
+	WriteBuffer( m_hTrigrams, out );
+
+	m_postings.clear();
+	m_segmentLine = m_nLines;
+	m_nSegments++;
+}
+
+//==================================================================================================
+void CSessionRecorder::WriteBuffer( HANDLE hFile, std::string &buffer )
+{
+	DWORD dwWritten;
+
+	if( buffer.empty() ) { return; }
+	if( !::WriteFile( hFile, buffer.data(), (DWORD)buffer.size(), &dwWritten, NULL ) )
+	{
+		g_ssErr.str("");
+		g_ssErr << "Could not write --record file '" << m_path << "'. " 
+		        << GetApiErrorString( ::GetLastError(), "WriteFile" );
+		SessionError( CR_STATUS_WINAPI, g_ssErr.str() );
+	}
+	buffer.clear();
+}
+
+//==================================================================================================
+// End the last block and segment, and write what's buffered.
+//==================================================================================================
+void CSessionRecorder::Close()
+{
+	{
+		utils::MutexLock lock( m_mutex );
+		if( !m_fFailed && m_hLog != INVALID_HANDLE_VALUE )
+		{
+			try
+			{
+				if( (m_nLines - m_segmentLine) % SEARCH_BLOCK_LINES != 0 ) { EndBlock(); }
+				WriteSegment();
+				WriteBuffer( m_hLog, m_log );
+				WriteBuffer( m_hIndex, m_index );
+			}
+			catch( exit_exception &except )
+			{
+				m_fFailed = true;
+				m_error   = except.what();
+			}
+		}
+	}
+	CloseFiles();
+
+	if( m_fFailed ) { SessionError( CR_STATUS_WINAPI, m_error ); }
+}
+
+//==================================================================================================
+void CSessionRecorder::CloseFiles()
+{
+	if( m_hLog      != INVALID_HANDLE_VALUE ) { ::CloseHandle( m_hLog ); }
+	if( m_hIndex    != INVALID_HANDLE_VALUE ) { ::CloseHandle( m_hIndex ); }
+	if( m_hTrigrams != INVALID_HANDLE_VALUE ) { ::CloseHandle( m_hTrigrams ); }
+	m_hLog = m_hIndex = m_hTrigrams = INVALID_HANDLE_VALUE;
+}
+
+//==================================================================================================
+CSessionSearch::CSessionSearch()
+	: m_pSink(NULL), m_hLog(INVALID_HANDLE_VALUE), m_hIndex(INVALID_HANDLE_VALUE)
+	, m_hTrigrams(INVALID_HANDLE_VALUE), m_first(0), m_end(0)
+	, m_nMatches(0), m_nCompared(0), m_nLines(0), m_nSegments(0), m_nUnindexed(0)
+{
+}
+
+//==================================================================================================
+CSessionSearch::~CSessionSearch()
+{
+	Close();
+}
+
+//==================================================================================================
+// The session's files are shared for writing, it may still be recorded.
+//==================================================================================================
+HANDLE CSessionSearch::Open( std::string const &path, bool fOptional )
+{
+	HANDLE hFile = ::CreateFileA( path.c_str(), GENERIC_READ, FILE_SHARE_READ|FILE_SHARE_WRITE, NULL, 
+	                              OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL );
+	if( hFile == INVALID_HANDLE_VALUE && !fOptional )
+	{
+		g_ssErr.str("");
+		g_ssErr << "Could not open session file '" << path << "'. " 
+		        << GetApiErrorString( ::GetLastError(), "CreateFile" );
+		SessionError( CR_STATUS_WINAPI, g_ssErr.str() );
+	}
+	return hFile;
+}
+
+//==================================================================================================
+void CSessionSearch::Read( HANDLE hFile, ULONGLONG offset, void *pData, DWORD nBytes )
+{
+	OVERLAPPED ov = { 0 };
+	DWORD      dwRead;
+
+	ov.Offset     = (DWORD)offset;
+	ov.OffsetHigh = (DWORD)(offset >> 32);
+	if( !::ReadFile( hFile, pData, nBytes, &dwRead, &ov ) )
+	{
+		g_ssErr.str("");
+		g_ssErr << "Could not read the session. " << GetApiErrorString( ::GetLastError(), "ReadFile" );
+		SessionError( CR_STATUS_WINAPI, g_ssErr.str() );
+	}
+	if( dwRead != nBytes ) { SessionError( CR_STATUS_ERROR, "The session's files are inconsistent." ); }
+}
+
+//==================================================================================================
+// Milliseconds from the session's start to the time given by spec (see SSearchQuery), or dwDefault
+// when spec is empty.
+//==================================================================================================
+DWORD CSessionSearch::ParseTime( std::string const &spec, DWORD dwDefault )
+{
+	if( spec.empty() ) { return dwDefault; }
+
+	double seconds = -1;
+	int    h, m, s = 0;
+	char  *pEnd;
+
+	if( spec[0] == '+' )
+	{
+		seconds = ::strtod( spec.c_str() + 1, &pEnd );
+		if( *pEnd ) { seconds = -1; }
+	}
+	else if( ::sscanf( spec.c_str(), "%d:%d:%d", &h, &m, &s ) >= 2 )
+	{
+		/* That time of day, local time, on the day the session started.
+		*/
+		FILETIME   start, local, at;
+		SYSTEMTIME st;
+		start.dwLowDateTime  = (DWORD)m_header.ullStartTime;
+		start.dwHighDateTime = (DWORD)(m_header.ullStartTime >> 32);
+		::FileTimeToLocalFileTime( &start, &local );
+		::FileTimeToSystemTime( &local, &st );
+		st.wHour         = (WORD)h;
+		st.wMinute       = (WORD)m;
+		st.wSecond       = (WORD)s;
+		st.wMilliseconds = 0;
+		if( ::SystemTimeToFileTime( &st, &local ) && ::LocalFileTimeToFileTime( &local, &at ) )
+		{
+			ULONGLONG t = ((ULONGLONG)at.dwHighDateTime << 32) | at.dwLowDateTime;
+			seconds = (t > m_header.ullStartTime) ? (t - m_header.ullStartTime) / 1e7 : 0;
+		}
+	}
+
+	if( seconds < 0 )
+	{
+		g_ssErr.str("");
+		g_ssErr << "Invalid cr --search time '" << spec << "'.";
+		SessionError( CR_STATUS_ERROR, g_ssErr.str() );
+	}
+	return (seconds * 1000 >= MAXDWORD - 1) ? MAXDWORD - 1 : (DWORD)(seconds * 1000);
+}
+
+//==================================================================================================
+// The first line recorded at or after dwTime_ms, a binary search over the line records.
+//==================================================================================================
+ULONGLONG CSessionSearch::FirstLineAfter( DWORD dwTime_ms )
+{
+	ULONGLONG lo = 0, hi = m_nLines;
+	while( lo < hi )
+	{
+		ULONGLONG   mid = lo + (hi - lo) / 2;
+		SLineRecord record;
+		Read( m_hIndex, sizeof(SIndexHeader) + mid * sizeof(SLineRecord), &record, sizeof(record) );
+		if( record.dwTime_ms < dwTime_ms ) { lo = mid + 1; }
+		else                               { hi = mid; }
+	}
+	return lo;
+}
+
+//==================================================================================================
+// Find the entry of dwTrigram in the segment at offset segment, a binary search over its entries.
+//==================================================================================================
+bool CSessionSearch::Lookup( ULONGLONG segment, STrigramSegment const &seg, DWORD dwTrigram, 
+                             STrigramEntry &entry )
+{
+	DWORD lo = 0, hi = seg.nTrigrams;
+	while( lo < hi )
+	{
+		DWORD mid = lo + (hi - lo) / 2;
+		Read( m_hTrigrams, segment + sizeof(seg) + (ULONGLONG)mid * sizeof(entry), &entry, sizeof(entry) );
+		if( entry.dwTrigram == dwTrigram ) { return true; }
+		if( entry.dwTrigram < dwTrigram )  { lo = mid + 1; }
+		else                               { hi = mid; }
+	}
+	return false;
+}
+
+//==================================================================================================
+// Decode the blocks of an entry, whose postings start at offset postings + entry.dwOffset and take
+// at most 5 bytes per block.
+//==================================================================================================
+void CSessionSearch::Postings( ULONGLONG postings, STrigramEntry const &entry, std::vector<DWORD> &blocks )
+{
+	LARGE_INTEGER size;
+	::GetFileSizeEx( m_hTrigrams, &size );
+
+	ULONGLONG   at = postings + entry.dwOffset;
+	std::string data( (size_t)std::min<ULONGLONG>( 5ULL * entry.nBlocks, size.QuadPart - at ), '\0' );
+	if( !data.empty() ) { Read( m_hTrigrams, at, &data[0], (DWORD)data.size() ); }
+
+	blocks.clear();
+	size_t i     = 0;
+	DWORD  block = 0;
+	for( DWORD n = 0; n < entry.nBlocks && i < data.size(); n++ )
+	{
+		DWORD delta = 0;
+		for( int shift = 0; i < data.size(); shift += 7 )
+		{
+			BYTE b = (BYTE)data[i++];
+			delta |= (DWORD)(b & 0x7F) << shift;
+			if( !(b & 0x80) ) { break; }
+		}
+		block += delta;
+		blocks.push_back( block );
+	}
+}
+
+//==================================================================================================
+static bool FewerBlocks( STrigramEntry const &a, STrigramEntry const &b )
+{
+	return a.nBlocks < b.nBlocks;
+}
+
+//==================================================================================================
+// Intersect the blocks of the text's trigrams in a segment, rarest trigram first, and compare the 
+// lines of the blocks left that are in the time range.
+//==================================================================================================
+void CSessionSearch::SearchSegment( ULONGLONG segment, STrigramSegment const &seg )
+{
+	std::vector<STrigramEntry> found;
+	for( size_t i = 0; i < m_trigrams.size(); i++ )
+	{
+		STrigramEntry entry;
+		if( !Lookup( segment, seg, m_trigrams[i], entry ) ) { return; }
+		found.push_back( entry );
+	}
+	std::sort( found.begin(), found.end(), FewerBlocks );
+
+	ULONGLONG          postings = segment + sizeof(seg) + (ULONGLONG)seg.nTrigrams * sizeof(STrigramEntry);
+	std::vector<DWORD> blocks, other, both;
+	Postings( postings, found[0], blocks );
+	for( size_t i = 1; i < found.size() && !blocks.empty(); i++ )
+	{
+		Postings( postings, found[i], other );
+		both.clear();
+		std::set_intersection( blocks.begin(), blocks.end(), other.begin(), other.end(), 
+		                       std::back_inserter( both ) );
+		blocks.swap( both );
+	}
+
+	/* Runs of consecutive blocks are compared with one read.
+	*/
+	ULONGLONG segEnd = seg.ullFirstLine + seg.nLines;
+	for( size_t i = 0; i < blocks.size(); )
+	{
+		size_t j = i + 1;
+		while( j < blocks.size() && blocks[j] == blocks[j - 1] + 1 ) { j++; }
+
+		ULONGLONG first = seg.ullFirstLine + (ULONGLONG)blocks[i] * SEARCH_BLOCK_LINES;
+		ULONGLONG end   = std::min( first + (ULONGLONG)(j - i) * SEARCH_BLOCK_LINES, segEnd );
+		Compare( std::max( first, m_first ), std::min( end, m_end ) );
+		i = j;
+	}
+}
+
+//==================================================================================================
+// Compare the lines from first to end with the text, and deliver the ones of the query's streams
+// that contain it.
+//==================================================================================================
+void CSessionSearch::Compare( ULONGLONG first, ULONGLONG end )
+{
+	while( first < end )
+	{
+		DWORD n = (DWORD)std::min<ULONGLONG>( end - first, SEARCH_COMPARE_LINES );
+		m_records.resize( n );
+		Read( m_hIndex, sizeof(SIndexHeader) + first * sizeof(SLineRecord), &m_records[0], 
+		      n * sizeof(SLineRecord) );
+
+		/* The lines are contiguous in the lines file.
+		*/
+		ULONGLONG base = m_records[0].ullOffset;
+		SLineRecord const &last = m_records[n - 1];
+		m_text.resize( (size_t)(last.ullOffset + (last.dwLength & ~SEARCH_LINE_STDERR) - base) + 1 );
+		Read( m_hLog, base, &m_text[0], (DWORD)m_text.size() );
+
+		for( DWORD i = 0; i < n; i++ )
+		{
+			bool fStdErr = (m_records[i].dwLength & SEARCH_LINE_STDERR) != 0;
+			if( fStdErr ? !m_query.fStdErr : !m_query.fStdOut ) { continue; }
+
+			char const *pLine = m_text.data() + (size_t)(m_records[i].ullOffset - base);
+			char const *pEnd  = pLine + (m_records[i].dwLength & ~SEARCH_LINE_STDERR);
+			m_nCompared++;
+			if( std::search( pLine, pEnd, m_query.text.begin(), m_query.text.end() ) == pEnd ) { continue; }
+
+			/* "line [hh:mm:ss.mmm] text", in local time.
+			*/
+			ULONGLONG  t = m_header.ullStartTime + (ULONGLONG)m_records[i].dwTime_ms * 10000;
+			FILETIME   ft, local;
+			SYSTEMTIME st;
+			ft.dwLowDateTime  = (DWORD)t;
+			ft.dwHighDateTime = (DWORD)(t >> 32);
+			::FileTimeToLocalFileTime( &ft, &local );
+			::FileTimeToSystemTime( &local, &st );
+
+			char prefix[64];
+			size_t len = utils::strnfmt( prefix, sizeof(prefix), "%llu [%02u:%02u:%02u.%03u] ", first + i + 1,
+			                             st.wHour, st.wMinute, st.wSecond, st.wMilliseconds );
+			m_out.assign( prefix, len );
+			m_out.append( pLine, pEnd );
+			m_out += '\n';
+			m_nMatches++;
+
+			DWORD dwError = m_pSink->Write( fStdErr ? StdErrRead : StdOutRead, (BYTE*)m_out.c_str(), 
+			                                (DWORD)m_out.size() );
+			if( dwError )
+			{
+				g_ssErr.str("");
+				g_ssErr << "Could not write the search results. " << GetApiErrorString( dwError, "WriteFile" );
+				SessionError( CR_STATUS_WINAPI, g_ssErr.str() );
+			}
+		}
+		first += n;
+	}
+}
+
+//==================================================================================================
+// Narrow the search to the lines of the time range, search the segments that hold any of them, and
+// compare the lines no segment holds.
+//==================================================================================================
+void CSessionSearch::Run( char const *path, SSearchQuery const &query )
+{
+	std::string   base( path );
+	LARGE_INTEGER size;
+
+	m_query     = query;
+	m_hLog      = Open( base, false );
+	m_hIndex    = Open( base + ".idx", false );
+	m_hTrigrams = Open( base + ".tri", true );
+
+	::GetFileSizeEx( m_hIndex, &size );
+	if( (ULONGLONG)size.QuadPart >= sizeof(m_header) ) { Read( m_hIndex, 0, &m_header, sizeof(m_header) ); }
+	if( (ULONGLONG)size.QuadPart < sizeof(m_header) || m_header.dwMagic != SEARCH_INDEX_MAGIC )
+	{
+		g_ssErr.str("");
+		g_ssErr << "'" << base << "' is not a session recorded with --record.";
+		SessionError( CR_STATUS_ERROR, g_ssErr.str() );
+	}
+	m_nLines = (size.QuadPart - sizeof(m_header)) / sizeof(SLineRecord);
+
+	DWORD dwTo = ParseTime( query.to, MAXDWORD - 1 );
+	m_first    = FirstLineAfter( ParseTime( query.from, 0 ) );
+	m_end      = query.to.empty() ? m_nLines : FirstLineAfter( dwTo + 1 );
+
+	for( size_t i = 0; i + 2 < query.text.size(); i++ )
+	{
+		BYTE const *p = (BYTE const*)query.text.data() + i;
+		m_trigrams.push_back( ((DWORD)p[0] << 16) | ((DWORD)p[1] << 8) | p[2] );
+	}
+	std::sort( m_trigrams.begin(), m_trigrams.end() );
+	m_trigrams.erase( std::unique( m_trigrams.begin(), m_trigrams.end() ), m_trigrams.end() );
+
+	/* A segment cut short by a session that's still recorded, or was killed, ends the index.
+	*/
+	ULONGLONG covered = 0;
+	if( m_hTrigrams != INVALID_HANDLE_VALUE && !m_trigrams.empty() )
+	{
+		::GetFileSizeEx( m_hTrigrams, &size );
+
+		STrigramSegment seg;
+		ULONGLONG       offset = 0;
+		while( offset + sizeof(seg) <= (ULONGLONG)size.QuadPart )
+		{
+			Read( m_hTrigrams, offset, &seg, sizeof(seg) );
+
+			ULONGLONG next = offset + sizeof(seg) + (ULONGLONG)seg.nTrigrams * sizeof(STrigramEntry) 
+			                 + seg.nPostingBytes;
+			if(    seg.dwMagic != SEARCH_SEGMENT_MAGIC || next > (ULONGLONG)size.QuadPart 
+			    || seg.ullFirstLine != covered || seg.ullFirstLine + seg.nLines > m_nLines )
+			{
+				break;
+			}
+
+			m_nSegments++;
+			if( seg.ullFirstLine < m_end && seg.ullFirstLine + seg.nLines > m_first ) { SearchSegment( offset, seg ); }
+			covered = seg.ullFirstLine + seg.nLines;
+			offset  = next;
+		}
+	}
+
+	ULONGLONG first = std::max( covered, m_first );
+	m_nUnindexed    = (m_end > first) ? m_end - first : 0;
+	Compare( first, m_end );
+
+	m_pSink->EndOfStream( StdOutRead );
+	m_pSink->EndOfStream( StdErrRead );
+	Close();
+}
+
+//==================================================================================================
+void CSessionSearch::Close()
+{
+	if( m_hLog      != INVALID_HANDLE_VALUE ) { ::CloseHandle( m_hLog ); }
+	if( m_hIndex    != INVALID_HANDLE_VALUE ) { ::CloseHandle( m_hIndex ); }
+	if( m_hTrigrams != INVALID_HANDLE_VALUE ) { ::CloseHandle( m_hTrigrams ); }
+	m_hLog = m_hIndex = m_hTrigrams = INVALID_HANDLE_VALUE;
+}
@@ -0,0 +1,229 @@
+/***********************************************************************************************//**
+\file    SessionIndex.h
+\author  hdaniel
+\version $Id$
+
+\brief Record a session's output with a search index (--record), and search it (cr --search).
+
+\details
+
+A post-mortem on a long build or test run asks things like "which lines on stderr mentioned
+timeout between 02:10 and 02:15". Scanning a multi-GB capture for each such question is slow, so
+a CSessionRecorder writes the index needed to answer it while the output is relayed, and a
+CSessionSearch answers it from the index, reading only the lines that can match.
+
+A session recorded to path is three files:
+
+    path      - the lines, each ending in '\n'
+    path.idx  - an SIndexHeader, then an SLineRecord per line: its offset in path, its time, its
+                length and its stream. Lines are recorded in time order, so the lines of a time
+                range are found with a binary search.
+    path.tri  - trigram posting lists. Lines are grouped in blocks of SEARCH_BLOCK_LINES, and for
+                every trigram (3 consecutive bytes) of the blocks a segment lists the blocks it
+                appears in. A segment is written every SEARCH_SEGMENT_LINES lines, or sooner when
+                its postings take too much memory, and at the end of the session.
+
+A segment is an STrigramSegment header, its trigrams' STrigramEntry records sorted by trigram, and
+their postings: the numbers of the blocks in the segment, delta coded as LEB128 varints. Searching
+for a literal looks up each of its trigrams in each segment (a binary search), intersects their
+blocks and only reads and compares the lines of the blocks left. Lines recorded after the last
+complete segment (a session cut short) are compared one by one. Literals shorter than a trigram
+are always compared one by one.
+
+\license
+
+This file is free and unencumbered software released into the public domain.
+
+Anyone is free to copy, modify, publish, use, compile, sell, or distribute this software, either in
+source code form or as a compiled binary, for any purpose, commercial or non-commercial, and by any
+means.
+
+In jurisdictions that recognize copyright laws, the author or authors of this software dedicate any
+and all copyright interest in the software to the public domain. We make this dedication for the
+benefit of the public at large and to the detriment of our heirs and successors. We intend this
+dedication to be an overt act of relinquishment in perpetuity of all present and future rights to
+this software under copyright law.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT
+NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+For more information, please refer to <http://unlicense.org/>
+***************************************************************************************************/
+#ifndef _sessionindex_h_
+#define _sessionindex_h_
+
+#include <string>
+#include <vector>
+
+#include <windows.h>
+
+#include "Relay.h"
+#include "Utils\utils.h"
+
+//==================================================================================================
+// The on-disk records. All of them are little endian, and written as they are laid out here.
+//==================================================================================================
+#define SEARCH_BLOCK_LINES    32
+#define SEARCH_SEGMENT_LINES  (1024 * 1024)
+
+#pragma pack( push, 4 )
+
+struct SIndexHeader
+{
+	DWORD     dwMagic;        // SEARCH_INDEX_MAGIC
+	DWORD     dwVersion;
+	ULONGLONG ullStartTime;   // FILETIME (UTC) the session started at
+};
+
+struct SLineRecord
+{
+	ULONGLONG ullOffset;      // in the session's lines file
+	DWORD     dwTime_ms;      // since the session started
+	DWORD     dwLength;       // bit 31 is set for stderr lines
+};
+
+struct STrigramSegment
+{
+	DWORD     dwMagic;        // SEARCH_SEGMENT_MAGIC
+	DWORD     nTrigrams;
+	ULONGLONG ullFirstLine;   // the segment's first line, always at the start of a block
+	DWORD     nLines;
+	DWORD     nPostingBytes;
+};
+
+struct STrigramEntry
+{
+	DWORD     dwTrigram;      // (b0 << 16) | (b1 << 8) | b2
+	DWORD     dwOffset;       // of its postings, from the end of the segment's entries
+	DWORD     nBlocks;
+};
+
+#pragma pack( pop )
+
+#define SEARCH_INDEX_MAGIC    0x58495243  // "CRIX"
+#define SEARCH_SEGMENT_MAGIC  0x47545243  // "CRTG"
+#define SEARCH_LINE_STDERR    0x80000000
+
+//==================================================================================================
+// Start() creates the session's files, then a CRelay's line callback (LineCallback(), with the 
+// recorder as its context) records each line, from the relay's threads. Close() writes what's 
+// left and the last segment. Failures throw an exit_exception; those of the line callback are 
+// kept and thrown by Close().
+//==================================================================================================
+class CSessionRecorder
+{
+public:
+	CSessionRecorder();
+	~CSessionRecorder();
+
+	void Start( char const *path );
+	void Close();
+
+	static void LineCallback( void *pContext, EIoThreadType eStream, char const *pLine, size_t len );
+
+	ULONGLONG Lines() const    { return m_nLines; }
+	ULONGLONG Bytes() const    { return m_ullBytes; }
+	DWORD     Segments() const { return m_nSegments; }
+
+private:
+	CSessionRecorder( CSessionRecorder const& );
+	CSessionRecorder& operator=( CSessionRecorder const& );
+
+	void Record( EIoThreadType eStream, char const *pLine, size_t len );
+	void EndBlock();
+	void WriteSegment();
+	void WriteBuffer( HANDLE hFile, std::string &buffer );
+	void CloseFiles();
+
+	std::string             m_path;
+	HANDLE                  m_hLog;
+	HANDLE                  m_hIndex;
+	HANDLE                  m_hTrigrams;
+	utils::Mutex            m_mutex;
+	DWORD                   m_dwStart_ms;       // GetTickCount() when the session started
+	std::string             m_log;              // buffered writes
+	std::string             m_index;
+	std::vector<DWORD>      m_blockTrigrams;    // of the block being recorded
+	std::vector<ULONGLONG>  m_postings;         // (trigram << 32) | block, of the segment
+	ULONGLONG               m_segmentLine;      // the segment's first line
+	ULONGLONG               m_nLines;
+	ULONGLONG               m_ullBytes;
+	DWORD                   m_nSegments;
+	bool                    m_fFailed;
+	std::string             m_error;            // of the line callback, thrown by Close()
+};
+
+//==================================================================================================
+// What cr --search looks for: lines containing text, of the streams in the mask, recorded from 
+// 'from' to 'to'. A time is "hh:mm[:ss]", a time of day on the day the session started, or 
+// "+seconds" since it started; empty for the start or the end of the session.
+//==================================================================================================
+struct SSearchQuery
+{
+	SSearchQuery() : fStdOut(true), fStdErr(true) { }
+
+	std::string text;
+	bool        fStdOut;
+	bool        fStdErr;
+	std::string from;
+	std::string to;
+};
+
+//==================================================================================================
+// Run() searches the session recorded to path and delivers each matching line to the sink, as 
+// the stream it was recorded from, prefixed with its line number and time. Failures throw an 
+// exit_exception.
+//==================================================================================================
+class CSessionSearch
+{
+public:
+	CSessionSearch();
+	~CSessionSearch();
+
+	void SetSink( IRelaySink *pSink ) { m_pSink = pSink; }
+
+	void Run( char const *path, SSearchQuery const &query );
+
+	ULONGLONG Matches() const    { return m_nMatches; }
+	ULONGLONG Compared() const   { return m_nCompared; }
+	ULONGLONG Lines() const      { return m_nLines; }
+	DWORD     Segments() const   { return m_nSegments; }
+	ULONGLONG Unindexed() const  { return m_nUnindexed; }
+
+private:
+	CSessionSearch( CSessionSearch const& );
+	CSessionSearch& operator=( CSessionSearch const& );
+
+	HANDLE    Open( std::string const &path, bool fOptional );
+	void      Read( HANDLE hFile, ULONGLONG offset, void *pData, DWORD nBytes );
+	DWORD     ParseTime( std::string const &spec, DWORD dwDefault );
+	ULONGLONG FirstLineAfter( DWORD dwTime_ms );
+	bool      Lookup( ULONGLONG segment, STrigramSegment const &seg, DWORD dwTrigram, STrigramEntry &entry );
+	void      Postings( ULONGLONG postings, STrigramEntry const &entry, std::vector<DWORD> &blocks );
+	void      SearchSegment( ULONGLONG segment, STrigramSegment const &seg );
+	void      Compare( ULONGLONG first, ULONGLONG end );
+	void      Close();
+
+	IRelaySink              *m_pSink;
+	HANDLE                   m_hLog;
+	HANDLE                   m_hIndex;
+	HANDLE                   m_hTrigrams;
+	SIndexHeader             m_header;
+	SSearchQuery             m_query;
+	std::vector<DWORD>       m_trigrams;      // of the text
+	ULONGLONG                m_first;         // the lines recorded in the query's time range
+	ULONGLONG                m_end;
+	std::vector<SLineRecord> m_records;       // of the lines being compared
+	std::string              m_text;
+	std::string              m_out;
+	ULONGLONG                m_nMatches;
+	ULONGLONG                m_nCompared;
+	ULONGLONG                m_nLines;
+	DWORD                    m_nSegments;
+	ULONGLONG                m_nUnindexed;
+};
+
+#endif // _sessionindex_h_
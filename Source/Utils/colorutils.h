@@ -0,0 +1,359 @@
+/***********************************************************************************************//**
+\file    colorutils.h
+\author  hdaniel
+\version $Id$
+
+\brief Text attributes beyond the console's 16 colors, and the table they're interned in.
+
+\details
+
+A console attribute (a WORD) has room for 16 foreground and 16 background colors. A text_attr also
+takes the 256 colors of the xterm palette, 24-bit RGB colors and bold, which a console shows when
+virtual terminal processing is on, through SGR escape sequences.
+
+Attributes are interned into an attr_table while options are read, and from then on are passed
+around by their id. Each entry of the table carries what it takes to draw the attribute either way:
+its SGR sequence, formatted once when it's interned, and the nearest console attribute. Rendering
+a span never formats anything, it writes the entry's bytes or sets the entry's attribute.
+
+\license
+
+This file is free and unencumbered software released into the public domain.
+
+Anyone is free to copy, modify, publish, use, compile, sell, or distribute this software, either in
+source code form or as a compiled binary, for any purpose, commercial or non-commercial, and by any
+means.
+
+In jurisdictions that recognize copyright laws, the author or authors of this software dedicate any
+and all copyright interest in the software to the public domain. We make this dedication for the
+benefit of the public at large and to the detriment of our heirs and successors. We intend this
+dedication to be an overt act of relinquishment in perpetuity of all present and future rights to
+this software under copyright law.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT
+NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+For more information, please refer to <http://unlicense.org/>
+***************************************************************************************************/
+#ifndef _colorutils_h_
+#define _colorutils_h_
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <map>
+#include <string>
+#include <vector>
+
+#include <Windows.h>
+
+#include "utils.h"
+
+namespace colorutils
+{
+
+//==================================================================================================
+// Nearest console colors. A console color (0-15) has blue in bit 0 and red in bit 2, an ANSI color
+// the other way around; swapping them is its own inverse, so ansi_to_console() goes both ways.
+//==================================================================================================
+inline int ansi_to_console( int color )
+{
+	return (color & 0x0A) | ((color & 1) << 2) | ((color & 4) >> 2);
+}
+
+inline int rgb_to_ansi( int r, int g, int b )
+{
+	int hi = r > g ? (r > b ? r : b) : (g > b ? g : b);
+	int on = hi / 2;   // channels at least half as bright as the brightest are on
+	int color = (r > on ? 1 : 0) | (g > on ? 2 : 0) | (b > on ? 4 : 0);
+	return (hi < 64) ? 0 : color | ((hi > 191) ? 8 : 0);
+}
+
+inline int xterm_to_ansi( int n )
+{
+	static int const cube[6] = { 0, 95, 135, 175, 215, 255 };
+
+	if( n < 16 )  { return n; }
+	if( n < 232 ) { n -= 16; return rgb_to_ansi( cube[n / 36], cube[(n / 6) % 6], cube[n % 6] ); }
+
+	int gray = 8 + (n - 232) * 10;
+	return (gray < 64) ? 0 : (gray < 128) ? 8 : (gray < 192) ? 7 : 15;
+}
+
+//==================================================================================================
+// A foreground or background color: the console's default, a console color (0-15), a color of the
+// xterm palette (0-255) or an RGB color (0xRRGGBB).
+//==================================================================================================
+enum EColorKind { ColorDefault, ColorConsole, ColorXterm, ColorRgb };
+
+struct color
+{
+	color() : kind(ColorDefault), value(0) { }
+	color( EColorKind k, int v ) : kind(k), value(v) { }
+
+	EColorKind kind;
+	int        value;
+};
+
+struct text_attr
+{
+	text_attr() : fBold(false), fUnderline(false), fReverse(false) { }
+
+	color fg;
+	color bg;
+	bool  fBold;
+	bool  fUnderline;
+	bool  fReverse;
+};
+
+/* The text_attr of a console attribute. The grid bits of COMMON_LVB_* aren't kept.
+*/
+inline text_attr from_legacy( WORD attr )
+{
+	text_attr a;
+	a.fg         = color( ColorConsole, attr & 0x0F );
+	a.bg         = color( ColorConsole, (attr >> 4) & 0x0F );
+	a.fUnderline = (attr & COMMON_LVB_UNDERSCORE) != 0;
+	a.fReverse   = (attr & COMMON_LVB_REVERSE_VIDEO) != 0;
+	return a;
+}
+
+//==================================================================================================
+// Parse an attribute given on the command line, up to the first ':' or the end of spec, and set
+// *pEnd to where it stopped. Returns false when spec isn't one of
+//
+//   dec_attr | $hex_attr      a console attribute
+//   item[,item...]            where item is fg=c, bg=c, bold, underline or reverse and c is a
+//                             color of the xterm palette (0-255) or an RGB color (#rrggbb)
+//==================================================================================================
+inline bool _parse_color( char const *p, char const *end, color &c )
+{
+	char *pStop;
+	long  val;
+
+	if( *p == '#' )
+	{
+		val = ::strtol( p + 1, &pStop, 16 );
+		if( pStop != end || end - p != 7 ) { return false; }
+		c = color( ColorRgb, (int)val );
+		return true;
+	}
+
+	val = ::strtol( p, &pStop, 10 );
+	if( pStop != end || p == end || val < 0 || val > 255 ) { return false; }
+	c = color( ColorXterm, (int)val );
+	return true;
+}
+
+inline bool parse_attr( char const *spec, char const **pEnd, text_attr &attr )
+{
+	char *pStop;
+
+	if( *spec == '$' || (*spec >= '0' && *spec <= '9') )
+	{
+		unsigned long val = (*spec == '$') ? ::strtoul( spec + 1, &pStop, 16 ) : ::strtoul( spec, &pStop, 10 );
+		attr  = from_legacy( (WORD)(val & 0xFFFF) );
+		*pEnd = pStop;
+		return *pStop == ':' || *pStop == '\0';
+	}
+
+	attr = text_attr();
+	for( char const *p = spec; ; p++ )
+	{
+		char const *end = p + ::strcspn( p, ",:" );
+		size_t      len = end - p;
+
+		if( len == 4 && !::strncmp( p, "bold", 4 ) )                          { attr.fBold = true; }
+		else if( len == 9 && !::strncmp( p, "underline", 9 ) )                { attr.fUnderline = true; }
+		else if( len == 7 && !::strncmp( p, "reverse", 7 ) )                  { attr.fReverse = true; }
+		else if( len > 3 && !::strncmp( p, "fg=", 3 ) && _parse_color( p + 3, end, attr.fg ) ) { }
+		else if( len > 3 && !::strncmp( p, "bg=", 3 ) && _parse_color( p + 3, end, attr.bg ) ) { }
+		else
+		{
+			*pEnd = p;
+			return false;
+		}
+
+		p = end;
+		if( *p != ',' )
+		{
+			*pEnd = p;
+			return true;
+		}
+	}
+}
+
+//==================================================================================================
+// Interned text attributes, each with the SGR sequence that draws it (from a reset, "ESC [ 0 ... m")
+// and its nearest console attribute. Id 0 is the default attribute.
+//
+// The console attribute of an entry only has the bits in legacyMask; the rest, the colors the entry
+// leaves to the default, come from the console's default attribute (see legacy()). A table can
+// then be shared by consoles with different defaults (cr --serve).
+//
+// Attributes are meant to be interned while options are read, but intern() may be called from any
+// thread at any time. The entries never move, a table holds at most MAX_ATTRS of them, so an entry
+// is read by id without a lock. Once the table is full intern() returns the default attribute.
+//==================================================================================================
+typedef unsigned short attr_id;
+
+class attr_table
+{
+public:
+	enum { MAX_ATTRS = 4096, DEFAULT_ID = 0 };
+
+	struct entry
+	{
+		text_attr   attr;
+		std::string sgr;
+		std::string sgrEol;      // sgr and erase to the end of the line
+		WORD        legacy;
+		WORD        legacyMask;
+		bool        fExact;      // legacy shows the attribute as it is
+	};
+
+	attr_table() : m_nInexact(0)
+	{
+		m_entries.reserve( MAX_ATTRS );
+		intern( text_attr() );
+	}
+
+	attr_id intern( text_attr const &attr )
+	{
+		std::string sgr = _format_sgr( attr );
+
+		utils::MutexLock lock( m_mutex );
+		return _intern( attr, sgr );
+	}
+
+	/* The id of a console attribute. Used for the child's own colors (cr --vt), so it's looked up
+	 * without formatting its SGR sequence once it's been interned.
+	*/
+	attr_id intern_legacy( WORD attr )
+	{
+		utils::MutexLock lock( m_mutex );
+
+		std::map<WORD, attr_id>::const_iterator it = m_legacyIds.find( attr );
+		if( it != m_legacyIds.end() ) { return it->second; }
+
+		text_attr a  = from_legacy( attr );
+		attr_id   id = _intern( a, _format_sgr( a ) );
+		m_legacyIds[attr] = id;
+		return id;
+	}
+
+	entry const& operator[]( attr_id id ) const { return m_entries[id]; }
+
+	WORD legacy( attr_id id, WORD defaultAttr ) const
+	{
+		entry const &e = m_entries[id];
+		return (WORD)((e.legacy & e.legacyMask) | (defaultAttr & ~e.legacyMask));
+	}
+
+	/* Whether any attribute can only be shown through SGR sequences.
+	*/
+	bool needs_vt() const { return m_nInexact != 0; }
+
+private:
+	attr_table( attr_table const& );
+	attr_table& operator=( attr_table const& );
+
+	static int _nearest( color const &c )
+	{
+		switch( c.kind )
+		{
+			case ColorConsole: return c.value & 0x0F;
+			case ColorXterm:   return ansi_to_console( xterm_to_ansi( c.value ) );
+			case ColorRgb:     return ansi_to_console( rgb_to_ansi( (c.value >> 16) & 0xFF, (c.value >> 8) & 0xFF, c.value & 0xFF ) );
+			default:           return -1;
+		}
+	}
+
+	static bool _is_exact( color const &c ) 
+	{
+		return c.kind == ColorDefault || c.kind == ColorConsole || (c.kind == ColorXterm && c.value < 16);
+	}
+
+	static void _append_color( std::string &out, color const &c, int base )
+	{
+		char buf[32];
+
+		switch( c.kind )
+		{
+			case ColorConsole: {
+				int ansi = ansi_to_console( c.value & 0x0F );
+				::sprintf( buf, ";%d", (ansi & 8) ? base + 60 + (ansi & 7) : base + ansi );
+			} break;
+
+			case ColorXterm:
+				::sprintf( buf, ";%d;5;%d", base + 8, c.value & 0xFF );
+				break;
+
+			case ColorRgb:
+				::sprintf( buf, ";%d;2;%d;%d;%d", base + 8, (c.value >> 16) & 0xFF, (c.value >> 8) & 0xFF, c.value & 0xFF );
+				break;
+
+			default:
+				return;
+		}
+		out += buf;
+	}
+
+	static std::string _format_sgr( text_attr const &attr )
+	{
+		std::string sgr( "\x1b[0" );
+
+		if( attr.fBold )      { sgr += ";1"; }
+		if( attr.fUnderline ) { sgr += ";4"; }
+		if( attr.fReverse )   { sgr += ";7"; }
+		_append_color( sgr, attr.fg, 30 );
+		_append_color( sgr, attr.bg, 40 );
+		sgr += 'm';
+		return sgr;
+	}
+
+	/* The SGR sequence says all there is to an attribute, so it's the key it's interned under.
+	*/
+	attr_id _intern( text_attr const &attr, std::string const &sgr )
+	{
+		std::map<std::string, attr_id>::const_iterator it = m_ids.find( sgr );
+		if( it != m_ids.end() )             { return it->second; }
+		if( m_entries.size() == MAX_ATTRS ) { return DEFAULT_ID; }
+
+		entry e;
+		int   fg = _nearest( attr.fg );
+		int   bg = _nearest( attr.bg );
+
+		e.attr       = attr;
+		e.sgr        = sgr;
+		e.sgrEol     = sgr + "\x1b[K";
+		e.legacy     = 0;
+		e.legacyMask = COMMON_LVB_UNDERSCORE|COMMON_LVB_REVERSE_VIDEO;
+		e.fExact     = _is_exact( attr.fg ) && _is_exact( attr.bg ) && !attr.fBold;
+
+		if( fg >= 0 )         { e.legacy |= (WORD)fg;                e.legacyMask |= 0x0F; }
+		if( bg >= 0 )         { e.legacy |= (WORD)(bg << 4);         e.legacyMask |= 0xF0; }
+		if( attr.fBold )      { e.legacy |= FOREGROUND_INTENSITY;    e.legacyMask |= FOREGROUND_INTENSITY; }
+		if( attr.fUnderline ) { e.legacy |= COMMON_LVB_UNDERSCORE; }
+		if( attr.fReverse )   { e.legacy |= COMMON_LVB_REVERSE_VIDEO; }
+
+		attr_id id = (attr_id)m_entries.size();
+		m_entries.push_back( e );
+		m_ids[sgr] = id;
+		if( !e.fExact ) { m_nInexact++; }
+		return id;
+	}
+
+	utils::Mutex                   m_mutex;     // for interning
+	std::vector<entry>             m_entries;   // reserved up front, see above
+	std::map<std::string, attr_id> m_ids;       // SGR sequence -> id
+	std::map<WORD, attr_id>        m_legacyIds; // console attribute -> id
+	size_t                         m_nInexact;
+};
+
+} // namespace colorutils
+
+#endif // _colorutils_h_
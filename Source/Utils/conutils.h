@@ -66,6 +66,15 @@ namespace conutils
 				_UpdateConsoleInfo();
 				m_wDefAttr = m_csbi.wAttributes;
 			}
+
+			/* A console other than ours, through a handle to its screen buffer.
+			*/
+			explicit _tag_console( HANDLE hConsole )
+			{
+				m_hConsole = hConsole;
+				_UpdateConsoleInfo();
+				m_wDefAttr = m_csbi.wAttributes;
+			}
             
 			void set_default_attribute( WORD defAttr ) { m_wDefAttr = defAttr; }
 
@@ -0,0 +1,158 @@
+/***********************************************************************************************//**
+\file    histogram.h
+\author  hdaniel
+\version $Id$
+
+\brief Lock-free latency histogram with HDR-style log-linear buckets.
+
+\details
+
+Percentiles of a latency (p50, p99, p999) need every sample, or a histogram fine enough that the
+bucket a percentile falls in is a good answer. Buckets of equal width can't cover microseconds to
+minutes at a useful precision, so like HdrHistogram the range is split into powers of two, each
+split into the same number of linear sub-buckets: values below LatencyHistogram::SUB_COUNT have
+a bucket each, and above that a bucket is at most 1/16th of its value wide (about 3% on average).
+The 608 buckets cover up to 2^40 microseconds, larger values count in the last one.
+
+Recording is a few Interlocked operations, no lock, so the relay's threads record from the paths
+they render on without contending for anything but the bucket's cache line. Percentiles may be
+read while samples are recorded; they then reflect some of the samples in flight.
+
+\license
+
+This file is free and unencumbered software released into the public domain.
+
+Anyone is free to copy, modify, publish, use, compile, sell, or distribute this software, either in
+source code form or as a compiled binary, for any purpose, commercial or non-commercial, and by any
+means.
+
+In jurisdictions that recognize copyright laws, the author or authors of this software dedicate any
+and all copyright interest in the software to the public domain. We make this dedication for the
+benefit of the public at large and to the detriment of our heirs and successors. We intend this
+dedication to be an overt act of relinquishment in perpetuity of all present and future rights to
+this software under copyright law.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT
+NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+For more information, please refer to <http://unlicense.org/>
+***************************************************************************************************/
+#ifndef _histogram_h_
+#define _histogram_h_
+
+#include <Windows.h>
+
+#ifdef _MSC_VER
+#  include <intrin.h>
+#endif
+
+namespace utils
+{
+
+//==================================================================================================
+// Record() samples, in any unit (the relay uses microseconds), from any number of threads, and
+// read Count(), Max() and Percentile() at any time.
+//==================================================================================================
+class LatencyHistogram
+{
+public:
+	enum 
+	{ 
+		SUB_BITS    = 5,
+		SUB_COUNT   = 1 << SUB_BITS,             // buckets of width 1 at the start
+		HALF_COUNT  = SUB_COUNT / 2,             // sub-buckets per power of two after that
+		MAX_SHIFT   = 36,
+		NUM_BUCKETS = HALF_COUNT * (MAX_SHIFT + 2)
+	};
+
+	LatencyHistogram() : m_count(0), m_max(0)
+	{
+		for( int i = 0; i < NUM_BUCKETS; i++ ) { m_counts[i] = 0; }
+	}
+
+	void Record( ULONGLONG value )
+	{
+		::InterlockedIncrement( &m_counts[Bucket( value )] );
+		::InterlockedIncrement( &m_count );
+
+		LONG v = (value > 0x7FFFFFFF) ? 0x7FFFFFFF : (LONG)value;
+		for( LONG max = m_max; v > max; max = m_max )
+		{
+			if( ::InterlockedCompareExchange( &m_max, v, max ) == max ) { break; }
+		}
+	}
+
+	ULONGLONG Count() const { return (ULONG)m_count; }
+	ULONGLONG Max() const   { return (ULONG)m_max; }
+
+	/* The smallest value that fraction (0.5 for p50, 0.999 for p999) of the samples are at or 
+	 * below, as the highest value of its bucket; never more than Max(). 0 without samples.
+	*/
+	ULONGLONG Percentile( double fraction ) const
+	{
+		ULONGLONG total = 0;
+		for( int i = 0; i < NUM_BUCKETS; i++ ) { total += (ULONG)m_counts[i]; }
+		if( !total ) { return 0; }
+
+		ULONGLONG rank = (ULONGLONG)(fraction * total + 0.999999);
+		if( rank < 1 )     { rank = 1; }
+		if( rank > total ) { rank = total; }
+
+		ULONGLONG seen = 0;
+		for( int i = 0; i < NUM_BUCKETS; i++ )
+		{
+			seen += (ULONG)m_counts[i];
+			if( seen >= rank ) 
+			{ 
+				ULONGLONG high = Highest( i );
+				return (high < Max()) ? high : Max(); 
+			}
+		}
+		return Max();
+	}
+
+	/* Values below SUB_COUNT are their own bucket. Above that, shifting a value right until it's
+	 * below SUB_COUNT leaves HALF_COUNT..SUB_COUNT-1, the sub-bucket within its power of two.
+	*/
+	static int Bucket( ULONGLONG value )
+	{
+		if( value < SUB_COUNT ) { return (int)value; }
+
+		int shift = HighestBit( value ) - (SUB_BITS - 1);
+		if( shift > MAX_SHIFT ) { return NUM_BUCKETS - 1; }
+		return HALF_COUNT * shift + (int)(value >> shift);
+	}
+
+	static ULONGLONG Highest( int bucket )
+	{
+		if( bucket < SUB_COUNT ) { return (ULONGLONG)bucket; }
+
+		int shift = bucket / HALF_COUNT - 1;
+		int sub   = bucket - HALF_COUNT * shift;
+		return (((ULONGLONG)sub + 1) << shift) - 1;
+	}
+
+private:
+	static int HighestBit( ULONGLONG value )
+	{
+#ifdef _MSC_VER
+		unsigned long bit;
+		if( _BitScanReverse( &bit, (unsigned long)(value >> 32) ) ) { return (int)bit + 32; }
+		_BitScanReverse( &bit, (unsigned long)value );
+		return (int)bit;
+#else
+		return 63 - __builtin_clzll( value );
+#endif
+	}
+
+	LONG volatile m_counts[NUM_BUCKETS];
+	LONG volatile m_count;
+	LONG volatile m_max;
+};
+
+} // namespace utils
+
+#endif // _histogram_h_
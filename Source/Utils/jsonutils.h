@@ -0,0 +1,172 @@
+/***********************************************************************************************//**
+\file    jsonutils.h
+\author  hdaniel
+\version $Id$
+
+\brief JSON string escaping and UTF-8 checking for the JSON lines output.
+
+\details
+
+Almost all of a line of console output needs no escaping, so append_escaped() looks for the next
+byte that does 16 bytes at a time with SSE2 and copies everything before it in one go. Only '"',
+'\\' and control characters are escaped; bytes from 0x80 up are copied as they are, so the text
+has to be UTF-8 already. Text in another code page is converted by the caller, and append_utf8() 
+copies text that should be UTF-8 with every byte that isn't part of a well-formed sequence 
+replaced, so a record is always valid JSON.
+
+\license
+
+This file is free and unencumbered software released into the public domain.
+
+Anyone is free to copy, modify, publish, use, compile, sell, or distribute this software, either in
+source code form or as a compiled binary, for any purpose, commercial or non-commercial, and by any
+means.
+
+In jurisdictions that recognize copyright laws, the author or authors of this software dedicate any
+and all copyright interest in the software to the public domain. We make this dedication for the
+benefit of the public at large and to the detriment of our heirs and successors. We intend this
+dedication to be an overt act of relinquishment in perpetuity of all present and future rights to
+this software under copyright law.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT
+NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+For more information, please refer to <http://unlicense.org/>
+***************************************************************************************************/
+#ifndef _jsonutils_h_
+#define _jsonutils_h_
+
+#include <string>
+
+#include "utils.h"
+
+#if defined(_M_IX86) || defined(_M_X64) || defined(__SSE2__)
+#  define JSONUTILS_SSE2
+#  include <emmintrin.h>
+#  ifdef _MSC_VER
+#    include <intrin.h>
+#  endif
+#endif
+
+namespace jsonutils
+{
+
+//==================================================================================================
+// Number of bytes at the start of s[0..len) that can be copied without escaping.
+//==================================================================================================
+inline size_t clean_prefix( char const *s, size_t len )
+{
+	size_t i = 0;
+
+#ifdef JSONUTILS_SSE2
+	/* A byte needs escaping if it's '"' or '\\', or if it's a control character, which is when
+	 * max(byte, 0x1F) is still 0x1F.
+	*/
+	__m128i const quote = _mm_set1_epi8( '"' );
+	__m128i const slash = _mm_set1_epi8( '\\' );
+	__m128i const ctrl  = _mm_set1_epi8( 0x1F );
+
+	for( ; i + 16 <= len; i += 16 )
+	{
+		__m128i v   = _mm_loadu_si128( (__m128i const*)(s + i) );
+		__m128i hit = _mm_or_si128( _mm_or_si128( _mm_cmpeq_epi8( v, quote ), _mm_cmpeq_epi8( v, slash ) ),
+		                            _mm_cmpeq_epi8( _mm_max_epu8( v, ctrl ), ctrl ) );
+		int mask = _mm_movemask_epi8( hit );
+		if( mask != 0 )
+		{
+#  ifdef _MSC_VER
+			unsigned long first;
+			_BitScanForward( &first, (unsigned long)mask );
+			return i + first;
+#  else
+			return i + (size_t)__builtin_ctz( (unsigned)mask );
+#  endif
+		}
+	}
+#endif
+
+	for( ; i < len; i++ )
+	{
+		unsigned char c = (unsigned char)s[i];
+		if( c < 0x20 || c == '"' || c == '\\' ) { break; }
+	}
+	return i;
+}
+
+//==================================================================================================
+// Append s[0..len) to out, replacing each byte that isn't part of a well-formed UTF-8 sequence with
+// U+FFFD. Overlong forms, surrogates and code points above U+10FFFF are not well-formed.
+//==================================================================================================
+inline void append_utf8( std::string &out, char const *s, size_t len )
+{
+	static char const replacement[] = "\xEF\xBF\xBD";
+
+	unsigned char const *p   = (unsigned char const*)s;
+	unsigned char const *end = p + len;
+
+	while( p < end )
+	{
+		size_t n = utils::ascii_prefix( (char const*)p, end - p );
+		out.append( (char const*)p, n );
+		p += n;
+		if( p == end ) { break; }
+
+		/* Length of the sequence lead byte c starts, and the range of its first continuation byte.
+		*/
+		unsigned char c = *p, lo = 0x80, hi = 0xBF;
+		if( c >= 0xC2 && c <= 0xDF )      { n = 2; }
+		else if( c >= 0xE0 && c <= 0xEF ) { n = 3; if( c == 0xE0 ) { lo = 0xA0; } if( c == 0xED ) { hi = 0x9F; } }
+		else if( c >= 0xF0 && c <= 0xF4 ) { n = 4; if( c == 0xF0 ) { lo = 0x90; } if( c == 0xF4 ) { hi = 0x8F; } }
+		else                              { n = 0; }
+
+		bool fValid = n && (size_t)(end - p) >= n && p[1] >= lo && p[1] <= hi;
+		for( size_t i = 2; fValid && i < n; i++ ) { fValid = (p[i] & 0xC0) == 0x80; }
+
+		if( fValid ) { out.append( (char const*)p, n ); p += n; }
+		else         { out.append( replacement, 3 );    p++; }
+	}
+}
+
+//==================================================================================================
+// Append s[0..len) to out as the contents of a JSON string (without the quotes).
+//==================================================================================================
+inline void append_escaped( std::string &out, char const *s, size_t len )
+{
+	static char const hex[] = "0123456789abcdef";
+
+	while( len )
+	{
+		size_t n = clean_prefix( s, len );
+		out.append( s, n );
+		s += n; len -= n;
+		if( !len ) { break; }
+
+		unsigned char c = (unsigned char)*s++; len--;
+		switch( c )
+		{
+			case '"':  out += "\\\""; break;
+			case '\\': out += "\\\\"; break;
+			case '\n': out += "\\n";  break;
+			case '\r': out += "\\r";  break;
+			case '\t': out += "\\t";  break;
+			case '\b': out += "\\b";  break;
+			case '\f': out += "\\f";  break;
+			default: {
+				char esc[] = { '\\', 'u', '0', '0', hex[c >> 4], hex[c & 0xF] };
+				out.append( esc, sizeof(esc) );
+			} break;
+		}
+	}
+}
+
+inline void append_escaped( std::string &out, std::string const &s )
+{
+	append_escaped( out, s.data(), s.size() );
+}
+
+} // namespace jsonutils
+
+#endif // _jsonutils_h_
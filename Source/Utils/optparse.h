@@ -72,20 +72,10 @@ For more information, please refer to <http://unlicense.org/>
 #ifndef OPTPARSE_H
 #define OPTPARSE_H
 
+#include "utils.h"
+
 namespace optutils
 {
-	struct optparse_info
-	{
-		char **argv;
-		int  permute;
-		int  optind;
-		int  optopt;
-        bool opterr;
-		char *optarg;
-		char errmsg[64];
-		int  subopt;
-	};
-
 	enum optparse_argtype 
     { 
         OPTPARSE_NONE, 
@@ -102,6 +92,38 @@ namespace optutils
 		int                   val;
 	};
 
+    #define OPTPARSE_MAX_LONGOPTS    64
+
+	/**
+	 * Lookup tables compiled from an optstring/longopts pair so that each option is resolved with
+	 * a single index instead of rescanning the optstring (or longopts) for every argument. Short
+	 * options are indexed by character, long options are chained in buckets by the first character
+	 * of their name. Arrays with more than OPTPARSE_MAX_LONGOPTS entries are searched linearly.
+	 */
+	struct optparse_table
+	{
+		char const             *optstring;
+		optparse_longopt const *longopts;
+		signed char            argtype[256];   /* -1 when not in optstring */
+		signed char            longByVal[256]; /* longopts index with this val, or -1 */
+		signed char            longFirst[256]; /* first longopts index whose name starts here */
+		signed char            longNext[OPTPARSE_MAX_LONGOPTS];
+		bool                   fLongLinear;
+	};
+
+	struct optparse_info
+	{
+		char **argv;
+		int  permute;
+		int  optind;
+		int  optopt;
+        bool opterr;
+		char *optarg;
+		char errmsg[64];
+		int  subopt;
+		optparse_table table;
+	};
+
     #define OPTPARSE_LONGOPT_LAST    {0,(optutils::optparse_argtype)0,0,0}
 
 	/**
@@ -109,6 +131,22 @@ namespace optutils
 	 */
 	void optparse_init( optparse_info *optinfo, char **argv );
 
+	/**
+	 * Initialize the parser state from a raw command line string, such as the contents of an
+	 * environment variable. cmdLine is split in place (see utils::split_inplace()) into argv, which
+	 * must have room for maxArgs entries. Since there is no program name, parsing starts at argv[0].
+	 * @return the number of arguments found in cmdLine.
+	 */
+	int optparse_init( optparse_info *optinfo, char *cmdLine, char **argv, int maxArgs );
+
+	/**
+	 * Build the lookup tables for optstring and longopts (which may be NULL). optparse() and
+	 * optparse_long() do this automatically the first time they see a new optstring/longopts pair,
+	 * so each set of options is compiled once per parse rather than scanned once per argument.
+	 */
+	void optparse_compile( optparse_table *table, char const *optstring, 
+	                       optparse_longopt const *longopts );
+
 	/**
 	 * Read the next option in the argv array.
 	 * @param optstring a getopt()-formatted option string.
@@ -36,9 +36,8 @@ static char const *MSG_INVALID = "invalid option";
 static char const *MSG_MISSING = "option requires an argument";
 static char const *MSG_TOOMANY = "option takes no arguments";
 
-int optparse_long_internal( optparse_info *optinfo, char const *optstring, 
-                            optparse_longopt const *longopts, int *longindex );
-int optparse_internal( optparse_info *optinfo, char const *optstring );
+int optparse_long_internal( optparse_info *optinfo, optparse_longopt const *longopts, int *longindex );
+int optparse_internal( optparse_info *optinfo );
 
 //##################################################################################################
 // PUBLIC IMPLEMENTATION
@@ -54,13 +53,80 @@ void optparse_init( optparse_info *optinfo, char **argv )
     optinfo->subopt  = 0;
     optinfo->optarg  = 0;
     optinfo->errmsg[0] = '\0';
+    optinfo->table.optstring = 0;
+    optinfo->table.longopts  = 0;
+}
+
+//==================================================================================================
+int optparse_init( optparse_info *optinfo, char *cmdLine, char **argv, int maxArgs )
+{
+    int argc = utils::split_inplace( cmdLine, argv, maxArgs );
+    optparse_init( optinfo, argv );
+    optinfo->optind = 0;
+    return argc;
+}
+
+//==================================================================================================
+void optparse_compile( optparse_table *table, char const *optstring, 
+                       optparse_longopt const *longopts )
+{
+    table->optstring = optstring;
+    table->longopts  = longopts;
+
+    ::memset( table->argtype, -1, sizeof(table->argtype) );
+    for( char const *p = optstring; *p; p++ )
+    {
+        unsigned char opt = (unsigned char)*p;
+        if( opt == ':' || table->argtype[opt] != -1 ) { continue; }
+
+        int argType = OPTPARSE_NONE;
+        if( p[1] == ':' )
+        {
+            argType = (p[2] == ':') ? OPTPARSE_OPTIONAL : OPTPARSE_REQUIRED;
+        }
+        else if( p[0] == 'W' && p[1] == ';' )
+        {
+            argType = OPTPARSE_POSIX_2; //POSIX.2 '-W'
+            p++;
+        }
+        table->argtype[opt] = (signed char)argType;
+    }
+
+    ::memset( table->longByVal, -1, sizeof(table->longByVal) );
+    ::memset( table->longFirst, -1, sizeof(table->longFirst) );
+    table->fLongLinear = false;
+    if( !longopts ) { return; }
+
+    /* Walk backwards so that bucket chains, and longByVal, keep the first matching entry. 
+    */
+    int count = 0;
+    while( longopts[count].name || longopts[count].val ) { count++; }
+    if( count > OPTPARSE_MAX_LONGOPTS ) { table->fLongLinear = true; return; }
+
+    for( int i = count - 1; i >= 0; i-- )
+    {
+        if( longopts[i].val >= 0 && longopts[i].val < 256 ) 
+        { 
+            table->longByVal[longopts[i].val] = (signed char)i; 
+        }
+        if( longopts[i].name )
+        {
+            unsigned char first = (unsigned char)longopts[i].name[0];
+            table->longNext[i]     = table->longFirst[first];
+            table->longFirst[first] = (signed char)i;
+        }
+    }
 }
 
 //==================================================================================================
 int optparse( optparse_info *optinfo, char const *optstring )
 {
     if( *optstring && *optstring == ':' ) { optinfo->opterr = false; }
-    return optparse_internal( optinfo, optstring );
+    if( optinfo->table.optstring != optstring || optinfo->table.longopts != 0 )
+    {
+        optparse_compile( &optinfo->table, optstring, 0 );
+    }
+    return optparse_internal( optinfo );
 }
 
 //==================================================================================================
@@ -70,7 +136,11 @@ int optparse_long( optparse_info *optinfo,
                    int *longindex )
 {
     if( *optstring && *optstring == ':' ) { optinfo->opterr = false; }
-    return optparse_long_internal( optinfo, optstring, longopts, longindex );
+    if( optinfo->table.optstring != optstring || optinfo->table.longopts != longopts )
+    {
+        optparse_compile( &optinfo->table, optstring, longopts );
+    }
+    return optparse_long_internal( optinfo, longopts, longindex );
 }
 
 //==================================================================================================
@@ -127,26 +197,13 @@ static void permute( optparse_info *optinfo, int index )
 }
 
 //==================================================================================================
-static int argtype( char const *optstring, char opt )
+static inline int argtype( optparse_table const *table, char opt )
 {
-    if( opt == ':' ) { return -1; }
-    for( ; *optstring && opt != *optstring; optstring++ );
-    if( !*optstring ) { return -1; }
-
-    int argType = OPTPARSE_NONE;
-    if( optstring[1] == ':' )
-    {
-        argType = (optstring[2] == ':') ? OPTPARSE_OPTIONAL : OPTPARSE_REQUIRED;
-    }
-    else if( optstring[0] == 'W' && optstring[1] == ';' )
-    {
-        argType = OPTPARSE_POSIX_2; //POSIX.2 '-W'
-    }
-    return argType;
+    return table->argtype[(unsigned char)opt];
 }
 
 //==================================================================================================
-static int optparse_internal( optparse_info *optinfo, char const *optstring )
+static int optparse_internal( optparse_info *optinfo )
 {
     optinfo->errmsg[0] = '\0';
     optinfo->optopt = 0;
@@ -168,7 +225,7 @@ static int optparse_internal( optparse_info *optinfo, char const *optstring )
         {
             int index = optinfo->optind;
             optinfo->optind++;
-            int r = optparse_internal( optinfo, optstring );
+            int r = optparse_internal( optinfo );
             permute( optinfo, index );
             optinfo->optind--;
             return r;
@@ -181,7 +238,7 @@ static int optparse_internal( optparse_info *optinfo, char const *optstring )
 
     option += optinfo->subopt + 1;
     optinfo->optopt = option[0];
-    int type = argtype( optstring, option[0] );
+    int type = argtype( &optinfo->table, option[0] );
     char *next = optinfo->argv[optinfo->optind + 1];
 
     switch( type ) 
@@ -296,15 +353,21 @@ static char* longopts_arg( char *option )
 
 //==================================================================================================
 static int long_fallback( optparse_info *optinfo,
-                          char const *optstring,
                           optparse_longopt const *longopts,
                           int *longindex )
 {
-    int result = optparse_internal( optinfo, optstring );
+    int result = optparse_internal( optinfo );
     if( longindex != 0 ) 
     {
         *longindex = -1;
-        if( result != -1 )
+        /* Errors ('?' and ':') leave optopt naming the bad option, which must not be mapped 
+        ** back to a long option since its required argument was never parsed. */
+        bool fOption = (result != -1 && result != '?' && result != ':');
+        if( fOption && !optinfo->table.fLongLinear )
+        {
+            *longindex = optinfo->table.longByVal[(unsigned char)optinfo->optopt];
+        }
+        else if( fOption )
         {
             for( int i = 0; !longopts_end( longopts, i ); i++ )
             {
@@ -321,10 +384,12 @@ static int long_fallback( optparse_info *optinfo,
 
 //==================================================================================================
 static int optparse_long_internal( optparse_info *optinfo,
-                                   char const *optstring,
                                    optparse_longopt const *longopts,
                                    int *longindex )
 {
+    int localIndex;
+    if( longindex == 0 ) { longindex = &localIndex; }
+
     char *option = optinfo->argv[optinfo->optind];
     
     if( option == 0 ) 
@@ -338,9 +403,9 @@ static int optparse_long_internal( optparse_info *optinfo,
     } 
     else if( is_shortopt( option ) ) 
     {
-        if( argtype( optstring, option[1] ) != OPTPARSE_POSIX_2 )
+        if( argtype( &optinfo->table, option[1] ) != OPTPARSE_POSIX_2 )
         {
-            int result = long_fallback( optinfo, optstring, longopts, longindex );
+            int result = long_fallback( optinfo, longopts, longindex );
             if( *longindex != -1 ) 
             { 
                 optparse_longopt const *pLongOpt = &longopts[*longindex];
@@ -357,7 +422,7 @@ static int optparse_long_internal( optparse_info *optinfo,
         {
             int index = optinfo->optind;
             optinfo->optind++;
-            int r = optparse_long_internal( optinfo, optstring, longopts, longindex );
+            int r = optparse_long_internal( optinfo, longopts, longindex );
             permute( optinfo, index );
             optinfo->optind--;
             return r;
@@ -375,7 +440,11 @@ static int optparse_long_internal( optparse_info *optinfo,
     option += 2; /* skip "--" or "-W" */
     optinfo->optind++;
 
-    for( int i = 0; !longopts_end( longopts, i ); i++ )
+    /* Only the bucket for the first character of the option needs to be searched.
+    */
+    optparse_table const *table = &optinfo->table;
+    int i = table->fLongLinear ? 0 : table->longFirst[(unsigned char)option[0]];
+    for( ; i >= 0 && !longopts_end( longopts, i ); i = table->fLongLinear ? i + 1 : table->longNext[i] )
     {
         char const *name = longopts[i].name;
         if( longopts_match( name, option ) ) 
@@ -0,0 +1,195 @@
+/***********************************************************************************************//**
+\file    ringbuffer.h
+\author  hdaniel
+\version $Id$
+
+\brief Byte ring buffer whose contents are always contiguous in memory.
+
+\details
+
+The ring's pages are mapped twice, back to back, so the byte after the last one of the ring is the
+first one again. Whatever the ring holds, and whatever free space it has, can then be used through
+a plain pointer even when it wraps around the end: a line that's read in two pieces can be parsed
+in place without moving it to the front of a buffer first.
+
+On Windows 10 (1803) and later the two views are put in place of a reserved placeholder region, so
+nothing else can take the address space in between. VirtualAlloc2() and MapViewOfFile3() are looked
+up at run time, as older systems don't have them, and there the region is reserved, released and
+mapped again, which is retried a few times in case another thread gets the address first.
+
+A RingBuffer isn't thread safe; it belongs to the thread reading into it.
+
+\license
+
+This file is free and unencumbered software released into the public domain.
+
+Anyone is free to copy, modify, publish, use, compile, sell, or distribute this software, either in
+source code form or as a compiled binary, for any purpose, commercial or non-commercial, and by any
+means.
+
+In jurisdictions that recognize copyright laws, the author or authors of this software dedicate any
+and all copyright interest in the software to the public domain. We make this dedication for the
+benefit of the public at large and to the detriment of our heirs and successors. We intend this
+dedication to be an overt act of relinquishment in perpetuity of all present and future rights to
+this software under copyright law.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT
+NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+For more information, please refer to <http://unlicense.org/>
+***************************************************************************************************/
+#ifndef _ringbuffer_h_
+#define _ringbuffer_h_
+
+#include <Windows.h>
+
+/* Not in the Visual Studio 2010 SDK. */
+#ifndef MEM_RESERVE_PLACEHOLDER
+#  define MEM_RESERVE_PLACEHOLDER   0x00040000
+#  define MEM_REPLACE_PLACEHOLDER   0x00004000
+#  define MEM_PRESERVE_PLACEHOLDER  0x00000002
+#endif
+
+namespace utils
+{
+
+//==================================================================================================
+// Bytes are written at WritePtr() and Commit()ed, and read at ReadPtr() and Consume()d. Both
+// pointers address up to Size() contiguous bytes, of which ReadAvail() and WriteSpace() are valid.
+//==================================================================================================
+class RingBuffer
+{
+public:
+	RingBuffer() : m_pBase(NULL), m_size(0), m_read(0), m_write(0) { }
+	~RingBuffer() { Destroy(); }
+
+	/* Map a ring of at least minSize bytes, rounded up to the allocation granularity. Returns false
+	 * when the system can't map it.
+	*/
+	bool Create( size_t minSize )
+	{
+		Destroy();
+
+		SYSTEM_INFO si;
+		::GetSystemInfo( &si );
+		size_t size = (minSize + si.dwAllocationGranularity - 1)
+		              / si.dwAllocationGranularity * si.dwAllocationGranularity;
+
+		HANDLE hSection = ::CreateFileMappingA( INVALID_HANDLE_VALUE, NULL, PAGE_READWRITE,
+		                                        (DWORD)((ULONGLONG)size >> 32), (DWORD)size, NULL );
+		if( !hSection ) { return false; }
+
+		m_pBase = MapWithPlaceholders( hSection, size );
+		for( int attempt = 0; !m_pBase && attempt < 8; attempt++ )
+		{
+			m_pBase = MapAtReleasedAddress( hSection, size );
+		}
+
+		/* The views keep the section alive. */
+		::CloseHandle( hSection );
+
+		m_size = m_pBase ? size : 0;
+		m_read = m_write = 0;
+		return m_pBase != NULL;
+	}
+
+	void Destroy()
+	{
+		if( !m_pBase ) { return; }
+
+		::UnmapViewOfFile( m_pBase );
+		::UnmapViewOfFile( m_pBase + m_size );
+		m_pBase = NULL;
+		m_size  = m_read = m_write = 0;
+	}
+
+	size_t Size() const       { return m_size; }
+	size_t ReadAvail() const  { return m_write - m_read; }
+	size_t WriteSpace() const { return m_size - (m_write - m_read); }
+
+	BYTE* ReadPtr() const  { return m_pBase + m_read; }
+	BYTE* WritePtr() const { return m_pBase + m_write; }
+
+	void Commit( size_t n ) { m_write += n; }
+
+	/* Consuming the bytes before the second view brings both offsets back into the first one.
+	*/
+	void Consume( size_t n )
+	{
+		m_read += n;
+		if( m_read >= m_size )
+		{
+			m_read  -= m_size;
+			m_write -= m_size;
+		}
+	}
+
+private:
+	RingBuffer( RingBuffer const& );
+	RingBuffer& operator=( RingBuffer const& );
+
+	typedef PVOID (WINAPI *VirtualAlloc2Fn)( HANDLE hProcess, PVOID pBase, SIZE_T size, ULONG allocType,
+	                                         ULONG protect, PVOID pParams, ULONG nParams );
+	typedef PVOID (WINAPI *MapViewOfFile3Fn)( HANDLE hSection, HANDLE hProcess, PVOID pBase, ULONG64 offset,
+	                                          SIZE_T size, ULONG allocType, ULONG protect, PVOID pParams,
+	                                          ULONG nParams );
+
+	static BYTE* MapWithPlaceholders( HANDLE hSection, size_t size )
+	{
+		HMODULE hKernelBase = ::GetModuleHandleA( "kernelbase.dll" );
+		if( !hKernelBase ) { return NULL; }
+
+		VirtualAlloc2Fn  pfnVirtualAlloc2  = (VirtualAlloc2Fn)::GetProcAddress( hKernelBase, "VirtualAlloc2" );
+		MapViewOfFile3Fn pfnMapViewOfFile3 = (MapViewOfFile3Fn)::GetProcAddress( hKernelBase, "MapViewOfFile3" );
+		if( !pfnVirtualAlloc2 || !pfnMapViewOfFile3 ) { return NULL; }
+
+		/* Reserve both halves as one placeholder and split it, so each view replaces one half.
+		*/
+		BYTE *p = (BYTE*)pfnVirtualAlloc2( NULL, NULL, 2 * size, MEM_RESERVE|MEM_RESERVE_PLACEHOLDER,
+		                                   PAGE_NOACCESS, NULL, 0 );
+		if( !p ) { return NULL; }
+		if( !::VirtualFree( p, size, MEM_RELEASE|MEM_PRESERVE_PLACEHOLDER ) )
+		{
+			::VirtualFree( p, 0, MEM_RELEASE );
+			return NULL;
+		}
+
+		PVOID pView1 = pfnMapViewOfFile3( hSection, NULL, p, 0, size, MEM_REPLACE_PLACEHOLDER,
+		                                  PAGE_READWRITE, NULL, 0 );
+		PVOID pView2 = pfnMapViewOfFile3( hSection, NULL, p + size, 0, size, MEM_REPLACE_PLACEHOLDER,
+		                                  PAGE_READWRITE, NULL, 0 );
+		if( pView1 && pView2 ) { return p; }
+
+		if( pView1 ) { ::UnmapViewOfFile( pView1 ); }
+		else         { ::VirtualFree( p, 0, MEM_RELEASE ); }
+		if( pView2 ) { ::UnmapViewOfFile( pView2 ); }
+		else         { ::VirtualFree( p + size, 0, MEM_RELEASE ); }
+		return NULL;
+	}
+
+	static BYTE* MapAtReleasedAddress( HANDLE hSection, size_t size )
+	{
+		BYTE *p = (BYTE*)::VirtualAlloc( NULL, 2 * size, MEM_RESERVE, PAGE_NOACCESS );
+		if( !p ) { return NULL; }
+		::VirtualFree( p, 0, MEM_RELEASE );
+
+		PVOID pView1 = ::MapViewOfFileEx( hSection, FILE_MAP_ALL_ACCESS, 0, 0, size, p );
+		PVOID pView2 = pView1 ? ::MapViewOfFileEx( hSection, FILE_MAP_ALL_ACCESS, 0, 0, size, p + size ) : NULL;
+		if( pView1 && pView2 ) { return p; }
+
+		if( pView1 ) { ::UnmapViewOfFile( pView1 ); }
+		return NULL;
+	}
+
+	BYTE   *m_pBase;
+	size_t  m_size;
+	size_t  m_read;   // offsets from m_pBase, m_read < m_size
+	size_t  m_write;
+};
+
+} // namespace utils
+
+#endif // _ringbuffer_h_
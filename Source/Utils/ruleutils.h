@@ -0,0 +1,398 @@
+/***********************************************************************************************//**
+\file    ruleutils.h
+\author  hdaniel
+\version $Id$
+
+\brief Literal pattern matching for rule based coloring.
+ 
+\details
+
+A rule pairs a literal pattern with an attribute, a number the matcher passes on (cr uses ids of
+a colorutils::attr_table). All rules are compiled into a single Aho-Corasick automaton, stored as a
+full DFA, so classifying a line costs one table lookup per byte however many rules there are. The
+result of classifying a line is a list of non-overlapping attribute spans, picked leftmost-longest
+with earlier rules winning ties.
+
+Lines tend to repeat (warnings, progress output), so a bounded span_cache maps a line fingerprint
+(64-bit hash of its bytes plus its length) to the spans computed for it, letting the automaton run
+once per distinct line.
+
+Very long lines can be matched in independent segments (collect()/resolve()), and lines that arrive
+in pieces can be matched incrementally (match_stream()).
+
+Nothing in here depends on Windows.
+
+\license
+
+This file is free and unencumbered software released into the public domain.
+
+Anyone is free to copy, modify, publish, use, compile, sell, or distribute this software, either in
+source code form or as a compiled binary, for any purpose, commercial or non-commercial, and by any
+means.
+
+In jurisdictions that recognize copyright laws, the author or authors of this software dedicate any
+and all copyright interest in the software to the public domain. We make this dedication for the 
+benefit of the public at large and to the detriment of our heirs and successors. We intend this 
+dedication to be an overt act of relinquishment in perpetuity of all present and future rights to
+this software under copyright law.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT
+NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND 
+NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+For more information, please refer to <http://unlicense.org/>
+***************************************************************************************************/
+#ifndef _ruleutils_h_
+#define _ruleutils_h_
+
+#include <algorithm>
+#include <cstring>
+#include <deque>
+#include <string>
+#include <vector>
+
+namespace ruleutils
+{
+
+//==================================================================================================
+// A run of bytes [begin, begin+len) of a line to be written with attribute attr, matched by the
+// rule'th rule given to the matcher.
+//==================================================================================================
+struct span
+{
+    size_t         begin;
+    size_t         len;
+    unsigned short attr;
+    unsigned short rule;
+};
+
+typedef std::vector<span> spans;
+
+//==================================================================================================
+// 64-bit fingerprint of a byte range, consumed eight bytes at a time. Not cryptographic, just well
+// mixed so that distinct lines practically never collide.
+//==================================================================================================
+inline unsigned long long _mix64( unsigned long long h )
+{
+    h ^= h >> 33;  h *= 0xFF51AFD7ED558CCDULL;
+    h ^= h >> 33;  h *= 0xC4CEB9FE1A85EC53ULL;
+    h ^= h >> 33;
+    return h;
+}
+
+inline unsigned long long hash64( void const *data, size_t len )
+{
+    unsigned char const *p = (unsigned char const*)data;
+    unsigned long long   h = 0x9E3779B97F4A7C15ULL ^ ((unsigned long long)len * 0xC2B2AE3D27D4EB4FULL);
+    unsigned long long   w;
+
+    for( ; len >= 8; p += 8, len -= 8 )
+    {
+        ::memcpy( &w, p, 8 );
+        h = (h ^ _mix64( w )) * 0x9FB21C651E98DF25ULL;
+    }
+    if( len )
+    {
+        w = 0;
+        ::memcpy( &w, p, len );
+        h = (h ^ _mix64( w )) * 0x9FB21C651E98DF25ULL;
+    }
+    return _mix64( h );
+}
+
+//==================================================================================================
+// Aho-Corasick automaton over the rule patterns. add() every rule, then compile() once before 
+// calling match().
+//==================================================================================================
+class matcher
+{
+public:
+    enum { ALPHABET = 256 };
+
+    matcher() : m_maxPatLen(0) { }
+
+    void add( std::string const &pattern, unsigned short attr )
+    {
+        if( pattern.empty() ) { return; }
+        m_patterns.push_back( pattern );
+        m_attrs.push_back( attr );
+        if( pattern.size() > m_maxPatLen ) { m_maxPatLen = pattern.size(); }
+    }
+
+    bool               empty() const                { return m_patterns.empty(); }
+    size_t             max_pattern_length() const   { return m_maxPatLen; }
+    std::string const& pattern( size_t rule ) const { return m_patterns[rule]; }
+
+    void compile()
+    {
+        /* Build the trie, state 0 is the root. */
+        m_goto.assign( ALPHABET, -1 );
+        m_out.assign( 1, -1 );
+        for( size_t i = 0; i < m_patterns.size(); i++ )
+        {
+            int state = 0;
+            for( size_t j = 0; j < m_patterns[i].size(); j++ )
+            {
+                unsigned char c = (unsigned char)m_patterns[i][j];
+                if( m_goto[state * ALPHABET + c] < 0 )
+                {
+                    m_goto[state * ALPHABET + c] = (int)m_out.size();
+                    m_goto.resize( m_goto.size() + ALPHABET, -1 );
+                    m_out.push_back( -1 );
+                }
+                state = m_goto[state * ALPHABET + c];
+            }
+            if( m_out[state] < 0 ) { m_out[state] = (int)i; }  // first rule wins duplicates
+        }
+
+        /* Breadth first, turn the trie into a full DFA and compute the dictionary links (next 
+         * state along the failure chain that ends a pattern).
+        */
+        std::vector<int> fail( m_out.size(), 0 );
+        std::deque<int>  queue;
+
+        m_dict.assign( m_out.size(), -1 );
+        for( int c = 0; c < ALPHABET; c++ )
+        {
+            int next = m_goto[c];
+            if( next < 0 ) { m_goto[c] = 0; }
+            else           { queue.push_back( next ); }
+        }
+        while( !queue.empty() )
+        {
+            int state = queue.front();
+            queue.pop_front();
+
+            int f = fail[state];
+            m_dict[state] = (m_out[f] >= 0) ? f : m_dict[f];
+
+            for( int c = 0; c < ALPHABET; c++ )
+            {
+                int next = m_goto[state * ALPHABET + c];
+                if( next < 0 ) 
+                { 
+                    m_goto[state * ALPHABET + c] = m_goto[f * ALPHABET + c]; 
+                }
+                else
+                {
+                    fail[next] = m_goto[f * ALPHABET + c];
+                    queue.push_back( next );
+                }
+            }
+        }
+    }
+
+    /* Append the spans of text[0, len) to out. The automaton starts from its root, so a match is
+     * only found if it lies entirely within the text.
+    */
+    void match( char const *text, size_t len, spans &out ) const
+    {
+        size_t first = out.size();
+        collect( text, 0, len, out );
+        resolve( out, first );
+    }
+
+    /* Append the raw matches of text that end in [from, to) to raw, with no attr yet.
+     * Scanning starts max_pattern_length()-1 bytes before from, from the root, so the result 
+     * doesn't depend on what was scanned before: a long line can be cut into segments that are 
+     * collected independently (in parallel) and resolve()d together, giving the same spans as 
+     * match() on the whole line.
+    */
+    void collect( char const *text, size_t from, size_t to, spans &raw ) const
+    {
+        size_t i     = (from > m_maxPatLen - 1) ? from - (m_maxPatLen - 1) : 0;
+        int    state = 0;
+
+        for( ; i < to; i++ )
+        {
+            state = m_goto[state * ALPHABET + (unsigned char)text[i]];
+            if( i < from ) { continue; }
+
+            for( int s = (m_out[state] >= 0) ? state : m_dict[state]; s >= 0; s = m_dict[s] )
+            {
+                int    rule = m_out[s];
+                size_t n    = m_patterns[rule].size();
+                span   sp   = { i + 1 - n, n, 0, (unsigned short)rule };
+                raw.push_back( sp );
+            }
+        }
+    }
+
+    /* Turn the raw matches in v[first, end) into spans: leftmost-longest, earlier rule on ties, 
+     * no overlaps.
+    */
+    void resolve( spans &v, size_t first ) const
+    {
+        if( v.size() == first ) { return; }
+
+        std::sort( v.begin() + first, v.end(), _before );
+
+        size_t kept = first, end = 0;
+        for( size_t i = first; i < v.size(); i++ )
+        {
+            if( kept > first && v[i].begin < end ) { continue; }
+            end = v[i].begin + v[i].len;
+            v[kept] = v[i];
+            v[kept].attr = m_attrs[v[i].rule];
+            kept++;
+        }
+        v.resize( kept );
+    }
+
+    /* Where match_stream() is in a line that arrives in pieces. */
+    struct stream_state
+    {
+        stream_state() { reset(); }
+        void reset() { state = 0; pos = 0; end = 0; }
+
+        int    state;
+        size_t pos;  // bytes of the line scanned so far
+        size_t end;  // end of the last span handed out, relative to the line
+    };
+
+    /* Append the spans of the next piece of a line to out, relative to text. Matches that started
+     * in an earlier piece are cut at the piece's start. Each byte is scanned once however many
+     * pieces the line arrives in, but unlike match() a span handed out for an earlier piece can't
+     * be replaced by a longer one found later.
+    */
+    void match_stream( stream_state &st, char const *text, size_t len, spans &out ) const
+    {
+        size_t first = out.size();
+        for( size_t i = 0; i < len; i++ )
+        {
+            st.state = m_goto[st.state * ALPHABET + (unsigned char)text[i]];
+            for( int s = (m_out[st.state] >= 0) ? st.state : m_dict[st.state]; s >= 0; s = m_dict[s] )
+            {
+                int    rule = m_out[s];
+                size_t n    = m_patterns[rule].size();
+                span   sp   = { st.pos + i + 1 - n, n, 0, (unsigned short)rule };
+                out.push_back( sp );
+            }
+        }
+        resolve( out, first );
+
+        size_t kept = first;
+        for( size_t i = first; i < out.size(); i++ )
+        {
+            span sp = out[i];
+            if( sp.begin < st.end ) 
+            { 
+                if( sp.begin + sp.len <= st.end ) { continue; }
+                sp.len  -= st.end - sp.begin;
+                sp.begin = st.end;
+            }
+            if( sp.begin < st.pos ) { sp.len -= st.pos - sp.begin; sp.begin = st.pos; }
+
+            st.end    = sp.begin + sp.len;
+            sp.begin -= st.pos;
+            out[kept++] = sp;
+        }
+        out.resize( kept );
+        st.pos += len;
+    }
+
+private:
+    static bool _before( span const &a, span const &b )
+    {
+        if( a.begin != b.begin ) { return a.begin < b.begin; }
+        if( a.len != b.len )     { return a.len > b.len; }
+        return a.rule < b.rule;
+    }
+
+    std::vector<std::string>    m_patterns;
+    std::vector<unsigned short> m_attrs;
+    size_t                      m_maxPatLen;
+    std::vector<int>            m_goto;  // ALPHABET entries per state
+    std::vector<int>            m_out;   // rule ending at a state, -1 if none
+    std::vector<int>            m_dict;  // dictionary link of a state, -1 if none
+};
+
+//==================================================================================================
+// Bounded cache from line fingerprint to spans. Two-way set associative with least recently used
+// replacement, so its size never grows past the number of entries it was created with.
+//==================================================================================================
+class span_cache
+{
+public:
+    explicit span_cache( size_t nEntries =4096 ) : m_clock(0), m_hits(0), m_lookups(0)
+    {
+        size_t nSets = 1;
+        while( nSets * 2 < nEntries ) { nSets <<= 1; }
+        m_mask = nSets - 1;
+        m_entries.resize( nSets * 2 );
+    }
+
+    /* Spans cached for a line, or NULL. */
+    spans const* find( unsigned long long hash, size_t len )
+    {
+        m_lookups++;
+        entry *e = &m_entries[(hash & m_mask) * 2];
+        for( int i = 0; i < 2; i++ )
+        {
+            if( e[i].used && e[i].hash == hash && e[i].len == len )
+            {
+                e[i].stamp = ++m_clock;
+                m_hits++;
+                return &e[i].sp;
+            }
+        }
+        return NULL;
+    }
+
+    /* Make room for a line's spans, the returned list is empty and must be filled by the caller. */
+    spans& insert( unsigned long long hash, size_t len )
+    {
+        entry *e = &m_entries[(hash & m_mask) * 2];
+        entry *victim = (!e[0].used || (e[1].used && e[0].stamp < e[1].stamp)) ? &e[0] : &e[1];
+
+        victim->used  = true;
+        victim->hash  = hash;
+        victim->len   = len;
+        victim->stamp = ++m_clock;
+        victim->sp.clear();
+        return victim->sp;
+    }
+
+    unsigned long long hits() const    { return m_hits; }
+    unsigned long long lookups() const { return m_lookups; }
+
+private:
+    struct entry 
+    { 
+        entry() : used(false), hash(0), len(0), stamp(0) { }
+
+        bool               used;
+        unsigned long long hash;
+        size_t             len;
+        unsigned long long stamp;
+        spans              sp;
+    };
+
+    std::vector<entry> m_entries;
+    size_t             m_mask;
+    unsigned long long m_clock;
+    unsigned long long m_hits;
+    unsigned long long m_lookups;
+};
+
+//==================================================================================================
+// Spans of a complete line, computed by m or taken from cache.
+//==================================================================================================
+inline spans const& classify( matcher const &m, span_cache &cache, char const *line, size_t len )
+{
+    unsigned long long hash = hash64( line, len );
+
+    spans const *cached = cache.find( hash, len );
+    if( cached ) { return *cached; }
+
+    spans &sp = cache.insert( hash, len );
+    m.match( line, len, sp );
+    return sp;
+}
+
+} // namespace ruleutils
+
+#endif // ifndef _ruleutils_h_
+/* */
@@ -0,0 +1,218 @@
+/***********************************************************************************************//**
+\file    threadpool.h
+\author  hdaniel
+\version $Id$
+
+\brief Small work-stealing thread pool.
+ 
+\details
+
+Visual Studio 2010 has neither std::thread nor a task library, so this is a minimal pool of Win32
+threads for splitting CPU bound work (rule matching on large output) into tasks. Each worker owns a
+task queue, and the submitting thread spreads tasks over the queues. A worker takes work from the
+back of its own queue and, once that's empty, steals from the front of the others, so uneven tasks
+still keep every worker busy. The thread waiting for a task group runs tasks itself until there's
+nothing left to steal, and then sleeps until the workers have finished the rest of the group, so a
+pool with no workers is just serial execution. Submit() and Wait() may be called from any number of
+threads at once, a pool can be shared.
+
+\license
+
+This file is free and unencumbered software released into the public domain.
+
+Anyone is free to copy, modify, publish, use, compile, sell, or distribute this software, either in
+source code form or as a compiled binary, for any purpose, commercial or non-commercial, and by any
+means.
+
+In jurisdictions that recognize copyright laws, the author or authors of this software dedicate any
+and all copyright interest in the software to the public domain. We make this dedication for the 
+benefit of the public at large and to the detriment of our heirs and successors. We intend this 
+dedication to be an overt act of relinquishment in perpetuity of all present and future rights to
+this software under copyright law.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT
+NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND 
+NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+For more information, please refer to <http://unlicense.org/>
+***************************************************************************************************/
+#ifndef _threadpool_h_
+#define _threadpool_h_
+
+#ifndef WINDOWS_MEAN_AND_LEAN
+#  define WINDOWS_MEAN_AND_LEAN
+#endif
+#include <Windows.h>
+
+#include <deque>
+#include <vector>
+
+#include "utils.h"
+
+namespace utils
+{
+
+//==================================================================================================
+class ThreadPool
+{
+public:
+	typedef void (*TaskFn)( void *arg );
+
+	/* Tasks submitted against a group can be waited for together. */
+	class Group
+	{
+	public:
+		Group() : m_nPending(0) { }
+	private:
+		friend class ThreadPool;
+		volatile LONG m_nPending;
+	};
+
+	ThreadPool() : m_hWork(0), m_fStop(0), m_next(0) { }
+	~ThreadPool() { Stop(); }
+
+	/* Start nThreads workers; with 0 every task runs on the thread that waits for it.
+	*/
+	bool Start( unsigned nThreads )
+	{
+		m_queues.resize( nThreads + 1 );   // the last queue is the waiting thread's
+		for( size_t i = 0; i < m_queues.size(); i++ ) { m_queues[i] = new SQueue; }
+
+		if( !nThreads ) { return true; }
+		if( !(m_hWork = ::CreateSemaphore( NULL, 0, 0x7FFFFFFF, NULL )) ) { return false; }
+
+		for( unsigned i = 0; i < nThreads; i++ )
+		{
+			SWorker *pWorker = new SWorker;
+			pWorker->pPool   = this;
+			pWorker->index   = i;
+			if( !(pWorker->hThread = ::CreateThread( NULL, 0, WorkerThread, pWorker, 0, NULL )) )
+			{
+				delete pWorker;
+				break;
+			}
+			m_workers.push_back( pWorker );
+		}
+		return true;
+	}
+
+	void Stop()
+	{
+		::InterlockedExchange( &m_fStop, 1 );
+		if( m_hWork ) { ::ReleaseSemaphore( m_hWork, (LONG)m_workers.size(), NULL ); }
+		for( size_t i = 0; i < m_workers.size(); i++ )
+		{
+			::WaitForSingleObject( m_workers[i]->hThread, INFINITE );
+			::CloseHandle( m_workers[i]->hThread );
+			delete m_workers[i];
+		}
+		m_workers.clear();
+
+		for( size_t i = 0; i < m_queues.size(); i++ ) { delete m_queues[i]; }
+		m_queues.clear();
+
+		if( m_hWork ) { ::CloseHandle( m_hWork ); m_hWork = 0; }
+	}
+
+	size_t Size() const { return m_workers.size(); }
+
+	void Submit( Group &group, TaskFn fn, void *arg )
+	{
+		STask task = { fn, arg, &group };
+		::InterlockedIncrement( &group.m_nPending );
+
+		SQueue *pQueue = m_queues[(ULONG)::InterlockedIncrement( &m_next ) % m_queues.size()];
+		pQueue->mutex.Enter();
+		pQueue->tasks.push_back( task );
+		pQueue->mutex.Leave();
+
+		if( m_hWork ) { ::ReleaseSemaphore( m_hWork, 1, NULL ); }
+	}
+
+	/* Run tasks until every task of group has completed. Once every queue is empty the group's 
+	 * remaining tasks are running on workers, and the last of them to finish wakes us.
+	*/
+	void Wait( Group &group )
+	{
+		while( group.m_nPending && RunOne( m_queues.size() - 1 ) ) { }
+
+		MutexLock lock( m_doneMutex );
+		while( group.m_nPending ) { m_groupDone.Wait( m_doneMutex ); }
+	}
+
+private:
+	struct STask  { TaskFn fn; void *arg; Group *pGroup; };
+	struct SQueue { Mutex mutex; std::deque<STask> tasks; };
+
+	struct SWorker
+	{
+		ThreadPool *pPool;
+		size_t      index;
+		HANDLE      hThread;
+	};
+
+	/* Run one task, from the back of queue self or else stolen from the front of another queue.
+	 * Returns false when every queue was empty.
+	*/
+	bool RunOne( size_t self )
+	{
+		STask task;
+		bool  fFound = false;
+
+		for( size_t i = 0; i < m_queues.size() && !fFound; i++ )
+		{
+			size_t  victim = (self + i) % m_queues.size();
+			SQueue *pQueue = m_queues[victim];
+
+			pQueue->mutex.Enter();
+			if( !pQueue->tasks.empty() )
+			{
+				if( victim == self ) { task = pQueue->tasks.back();  pQueue->tasks.pop_back(); }
+				else                 { task = pQueue->tasks.front(); pQueue->tasks.pop_front(); }
+				fFound = true;
+			}
+			pQueue->mutex.Leave();
+		}
+		if( !fFound ) { return false; }
+
+		/* The group may be gone as soon as its count reaches 0, so only the pool is touched after.
+		*/
+		task.fn( task.arg );
+		if( !::InterlockedDecrement( &task.pGroup->m_nPending ) )
+		{
+			MutexLock lock( m_doneMutex );
+			m_groupDone.WakeAll();
+		}
+		return true;
+	}
+
+	static DWORD WINAPI WorkerThread( LPVOID lpvThreadParam )
+	{
+		SWorker    *pWorker = (SWorker*)lpvThreadParam;
+		ThreadPool *pPool   = pWorker->pPool;
+
+		/* The semaphore is released once per task, but a task may have been run by someone else
+		 * by the time we get to it; then there's simply nothing to do.
+		*/
+		while( ::WaitForSingleObject( pPool->m_hWork, INFINITE ) == WAIT_OBJECT_0 && !pPool->m_fStop )
+		{
+			while( pPool->RunOne( pWorker->index ) ) { }
+		}
+		return 0;
+	}
+
+	HANDLE                m_hWork;    // counts submitted tasks
+	volatile LONG         m_fStop;
+	volatile LONG         m_next;     // round-robin queue for the next Submit()
+	Mutex                 m_doneMutex;
+	ConditionVariable     m_groupDone;  // a group's last task has completed
+	std::vector<SQueue*>  m_queues;   // one per worker, plus one for the waiting thread
+	std::vector<SWorker*> m_workers;
+};
+
+} // namespace utils
+
+#endif // ifndef _threadpool_h_
+/* */
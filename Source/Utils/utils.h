@@ -39,17 +39,39 @@ For more information, please refer to <http://unlicense.org/>
 #ifndef _utils_h_
 #define _utils_h_
 
-#ifndef WINDOWS_MEAN_AND_LEAN
-#  define WINDOWS_MEAN_AND_LEAN
+#ifdef _WIN32
+#  ifndef WINDOWS_MEAN_AND_LEAN
+#    define WINDOWS_MEAN_AND_LEAN
+#  endif
+#  include <Windows.h>
 #endif
-#include <Windows.h>
 
+#include <cstdarg>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cwchar>
 #include <vector>
 #include <string>
 
+#if defined(_M_IX86) || defined(_M_X64) || defined(__SSE2__)
+#  define UTILS_SSE2
+#  include <emmintrin.h>
+#  ifdef _MSC_VER
+#    include <intrin.h>
+#  endif
+#endif
+
+/* Visual Studio 2010 doesn't provide va_copy, but its va_list is a plain pointer.
+*/
+#ifndef va_copy
+#  define va_copy( dst, src ) ((dst) = (src))
+#endif
+
 namespace utils
 {
 
+#ifdef _WIN32
 //==================================================================================================
 // Visual Studio 2010 doesn't support std::mutex.
 //==================================================================================================
@@ -62,9 +84,48 @@ public:
     void Leave( void ) { ::LeaveCriticalSection( &m_critSection ); }
 
 private:
+	friend class ConditionVariable;
 	CRITICAL_SECTION m_critSection;
 };
 
+//==================================================================================================
+// Holds a Mutex until the end of the scope, or until Release(), so an exception can't leave it
+// entered.
+//==================================================================================================
+class MutexLock
+{
+public:
+	explicit MutexLock( Mutex &mutex ) : m_pMutex(&mutex) { m_pMutex->Enter(); }
+	~MutexLock() { Release(); }
+
+	void Release() { if( m_pMutex ) { m_pMutex->Leave(); m_pMutex = NULL; } }
+
+private:
+	MutexLock( MutexLock const& );
+	MutexLock& operator=( MutexLock const& );
+
+	Mutex *m_pMutex;
+};
+
+//==================================================================================================
+// Visual Studio 2010 doesn't support std::condition_variable either. Waiting requires the Mutex to
+// be entered, and it is entered again when Wait() returns.
+//==================================================================================================
+class ConditionVariable
+{
+public:
+	ConditionVariable() { ::InitializeConditionVariable( &m_cv ); }
+
+	BOOL Wait( Mutex &mutex, DWORD dwTimeout_ms =INFINITE ) {
+		return ::SleepConditionVariableCS( &m_cv, &mutex.m_critSection, dwTimeout_ms );
+	}
+	void WakeOne() { ::WakeConditionVariable( &m_cv ); }
+	void WakeAll() { ::WakeAllConditionVariable( &m_cv ); }
+
+private:
+	CONDITION_VARIABLE m_cv;
+};
+
 //==================================================================================================
 class Event
 {
@@ -82,72 +143,378 @@ private:
 	HANDLE m_event;
 };
 
+//==================================================================================================
+// A one-way flag for asking other threads to stop. Unlike an Event it can be tested in a hot loop
+// without a system call.
+//==================================================================================================
+class CancelToken
+{
+public:
+	CancelToken() : m_fCancelled(0) { }
+
+	void Cancel()            { ::InterlockedExchange( &m_fCancelled, 1 ); }
+	bool IsCancelled() const { return m_fCancelled != 0; }
+
+private:
+	volatile LONG m_fCancelled;
+};
+
+//==================================================================================================
+// Milliseconds since 1970-01-01 UTC.
+//==================================================================================================
+inline unsigned long long UnixTimeMs()
+{
+	FILETIME ft;
+	::GetSystemTimeAsFileTime( &ft );
+
+	ULARGE_INTEGER t;
+	t.LowPart  = ft.dwLowDateTime;
+	t.HighPart = ft.dwHighDateTime;
+
+	/* FILETIME counts 100ns intervals since 1601-01-01 */
+	return (t.QuadPart - 116444736000000000ULL) / 10000;
+}
+#endif // ifdef _WIN32
+
+//==================================================================================================
+// Visual Studio 2010 doesn't have std::string_view either. A strview is a non-owning pointer and
+// length pair over characters that live somewhere else (a pipe buffer, the command line, ...).
+//==================================================================================================
+template<typename T>
+struct basic_strview
+{
+    basic_strview() : ptr(0), len(0) { }
+    basic_strview( T const *p, size_t n ) : ptr(p), len(n) { }
+    basic_strview( T const *p ) : ptr(p), len(p ? std::char_traits<T>::length( p ) : 0) { }
+    basic_strview( std::basic_string<T> const &s ) : ptr(s.c_str()), len(s.length()) { }
+
+    T const *begin() const { return ptr; }
+    T const *end() const   { return ptr + len; }
+    size_t   size() const  { return len; }
+    bool     empty() const { return len == 0; }
+
+    T const &operator[]( size_t i ) const { return ptr[i]; }
+
+    std::basic_string<T> str() const { return std::basic_string<T>( ptr, len ); }
+
+    T const *ptr;
+    size_t   len;
+};
+
+typedef basic_strview<char>    strview;
+typedef basic_strview<wchar_t> wstrview;
+
 //==================================================================================================
 // Some basic string utilities every application should have.
+//
+// The conversion functions taking a destination buffer never allocate. dstLen is the size of the
+// buffer in characters, including room for the terminating NUL. They return the length the complete
+// conversion requires (not counting the NUL); dst is only valid when that length is less than dstLen,
+// so calling them with a NULL or too small buffer is a one-pass size query. Pure ASCII input, which
+// is what we see most of the time, is widened/narrowed without calling into the OS.
 //==================================================================================================
-inline std::wstring str2wstr( std::string const &string_in ) 
+enum ECodePage { CodePageAnsi, CodePageUtf8 };
+
+//--------------------------------------------------------------------------------------------------
+// Returns the number of leading bytes in s that are 7-bit ASCII, testing 16 bytes at a time with
+// SSE2 (a machine word at a time without it).
+//--------------------------------------------------------------------------------------------------
+inline size_t ascii_prefix( char const *s, size_t n )
 {
-	std::vector<wchar_t> buffer;
-    buffer.resize( string_in.length() + 1 );
-	::MultiByteToWideChar( CP_ACP, 0, string_in.c_str(), -1, &buffer[0], (int)string_in.length() );
-	std::wstring wstring_out( &buffer[0] );
-	return wstring_out;
+    size_t i = 0;
+#ifdef UTILS_SSE2
+    for( ; i + 16 <= n; i += 16 )
+    {
+        int mask = _mm_movemask_epi8( _mm_loadu_si128( (__m128i const*)(s + i) ) );
+        if( mask != 0 )
+        {
+#  ifdef _MSC_VER
+            unsigned long first;
+            _BitScanForward( &first, (unsigned long)mask );
+            return i + first;
+#  else
+            return i + (size_t)__builtin_ctz( (unsigned)mask );
+#  endif
+        }
+    }
+#endif
+    for( ; i + sizeof(size_t) <= n; i += sizeof(size_t) )
+    {
+        size_t word;
+        ::memcpy( &word, s + i, sizeof(size_t) );
+        if( word & ((size_t)-1 / 0xFF * 0x80) ) { break; }
+    }
+    while( i < n && !(s[i] & 0x80) ) { i++; }
+    return i;
 }
 
 //--------------------------------------------------------------------------------------------------
-inline std::string wstr2str( std::wstring const &wstring_in ) 
+inline size_t ascii_prefix( wchar_t const *s, size_t n )
 {
-	std::vector<char> buffer; 
-    buffer.resize( wstring_in.length() + 1 );
-	::WideCharToMultiByte( CP_ACP, 0, wstring_in.c_str(), -1, &buffer[0], 
-		                   (int)wstring_in.length(), NULL, NULL );
-	std::string string_out( &buffer[0] );
-	return string_out;
+    size_t i = 0;
+    while( i < n && (unsigned long)s[i] < 0x80 ) { i++; }
+    return i;
 }
 
 //--------------------------------------------------------------------------------------------------
-inline std::wstring str2wstrU( std::string const &str )
+// Portable UTF-8 <-> wchar_t (UTF-16 where wchar_t is 16 bits, UTF-32 otherwise) codec. Malformed
+// sequences are replaced with U+FFFD.
+//--------------------------------------------------------------------------------------------------
+inline size_t _utf8_decode( char const *s, size_t n, wchar_t *dst, size_t dstLen )
 {
-    std::wstring wstr;
-    int wstrSize = ::MultiByteToWideChar( CP_UTF8, 0, str.c_str(), -1, 0, 0 );
-    if( wstrSize > 0 )
+    unsigned char const *p = (unsigned char const *)s, *pEnd = p + n;
+    size_t out = 0;
+    while( p < pEnd )
     {
-        std::vector<wchar_t> buffer( wstrSize );
-        ::MultiByteToWideChar( CP_UTF8, 0, str.c_str(), -1, &buffer[0], wstrSize );
-        wstr.assign( buffer.begin(), buffer.end() - 1 );
+        unsigned long cp = *p++;
+        int           more = 0;
+        if( cp >= 0xF0 && cp < 0xF5 )      { cp &= 0x07; more = 3; }
+        else if( cp >= 0xE0 && cp < 0xF0 ) { cp &= 0x0F; more = 2; }
+        else if( cp >= 0xC2 && cp < 0xE0 ) { cp &= 0x1F; more = 1; }
+        else if( cp >= 0x80 )              { cp = 0xFFFD; }
+
+        for( ; more && p < pEnd && (*p & 0xC0) == 0x80; more-- ) { cp = (cp << 6) | (*p++ & 0x3F); }
+        if( more ) { cp = 0xFFFD; }
+
+        if( sizeof(wchar_t) == 2 && cp > 0xFFFF )
+        {
+            if( out + 2 < dstLen )
+            {
+                dst[out]   = (wchar_t)(0xD800 + ((cp - 0x10000) >> 10));
+                dst[out+1] = (wchar_t)(0xDC00 + ((cp - 0x10000) & 0x3FF));
+            }
+            out += 2;
+        }
+        else
+        {
+            if( out + 1 < dstLen ) { dst[out] = (wchar_t)cp; }
+            out++;
+        }
     }
-    return wstr;
+    return out;
 }
 
 //--------------------------------------------------------------------------------------------------
-inline std::string wstr2strU( std::wstring const &wstr )
+inline size_t _utf8_encode( wchar_t const *s, size_t n, char *dst, size_t dstLen )
 {
-    std::string str;
-    int strSize = ::WideCharToMultiByte( CP_UTF8, 0, wstr.c_str(), -1, 0, 0, 0, 0 );
-    if( strSize > 0 )
+    size_t out = 0;
+    for( size_t i = 0; i < n; i++ )
     {
-        std::vector<char> buffer( strSize );
-        ::WideCharToMultiByte( CP_UTF8, 0, wstr.c_str(), -1, &buffer[0], strSize, 0, 0 );
-        str.assign( buffer.begin(), buffer.end() - 1 );
+        unsigned long cp = (unsigned long)s[i];
+        if( sizeof(wchar_t) == 2 && cp >= 0xD800 && cp < 0xDC00 && i + 1 < n
+            && (unsigned long)s[i+1] >= 0xDC00 && (unsigned long)s[i+1] < 0xE000 )
+        {
+            cp = 0x10000 + ((cp - 0xD800) << 10) + ((unsigned long)s[++i] - 0xDC00);
+        }
+        else if( (cp >= 0xD800 && cp < 0xE000) || cp > 0x10FFFF ) { cp = 0xFFFD; }
+
+        char   seq[4];
+        size_t seqLen;
+        if( cp < 0x80 )         { seq[0] = (char)cp; seqLen = 1; }
+        else if( cp < 0x800 )   { seq[0] = (char)(0xC0 | (cp >> 6));  seqLen = 2; }
+        else if( cp < 0x10000 ) { seq[0] = (char)(0xE0 | (cp >> 12)); seqLen = 3; }
+        else                    { seq[0] = (char)(0xF0 | (cp >> 18)); seqLen = 4; }
+        for( size_t k = 1; k < seqLen; k++ ) 
+        { 
+            seq[k] = (char)(0x80 | ((cp >> (6 * (seqLen - 1 - k))) & 0x3F)); 
+        }
+
+        if( out + seqLen < dstLen ) { ::memcpy( dst + out, seq, seqLen ); }
+        out += seqLen;
     }
-    return str;
+    return out;
 }
 
 //--------------------------------------------------------------------------------------------------
-inline std::string strvfmt( char const *fmt, va_list args )
+inline size_t str2wstr( strview src, wchar_t *dst, size_t dstLen, ECodePage cp =CodePageAnsi )
 {
-	int iResult = -1, iLen = 255;
-	std::vector<char> vBuffer;
-	while( iResult == -1 ) 
+    size_t nAscii = ascii_prefix( src.ptr, src.len );
+    if( nAscii == src.len )
     {
-		vBuffer.assign( iLen+1, 0 );
-        iResult = ::_vsnprintf_s( &vBuffer[0], iLen, iLen-1, fmt, args );
-		iLen *= 2;
-	}
-    std::string ret;
-	ret.assign( &vBuffer[0] );
+        if( src.len < dstLen )
+        {
+            for( size_t i = 0; i < src.len; i++ ) { dst[i] = (wchar_t)src.ptr[i]; }
+            dst[src.len] = 0;
+        }
+        return src.len;
+    }
+
+    size_t required;
+#ifdef _WIN32
+    /* Optimistically convert straight into dst; only fall back to a size query when it's too small.
+    */
+    UINT codePage = (cp == CodePageUtf8) ? CP_UTF8 : CP_ACP;
+    int  nWide = (dst && dstLen > 1)
+        ? ::MultiByteToWideChar( codePage, 0, src.ptr, (int)src.len, dst, (int)(dstLen - 1) ) : 0;
+    if( nWide > 0 ) { dst[nWide] = 0; return (size_t)nWide; }
+    required = (size_t)::MultiByteToWideChar( codePage, 0, src.ptr, (int)src.len, NULL, 0 );
+#else
+    if( cp == CodePageUtf8 )
+    {
+        required = _utf8_decode( src.ptr, src.len, dst, dstLen );
+    }
+    else
+    {
+        std::mbstate_t state = std::mbstate_t();
+        char const *p = src.ptr, *pEnd = src.ptr + src.len;
+        required = 0;
+        while( p < pEnd )
+        {
+            wchar_t wc;
+            size_t  n = std::mbrtowc( &wc, p, pEnd - p, &state );
+            if( n == (size_t)-1 || n == (size_t)-2 ) { wc = L'?'; n = 1; state = std::mbstate_t(); }
+            else if( n == 0 )                        { n = 1; }
+            if( required + 1 < dstLen ) { dst[required] = wc; }
+            required++;
+            p += n;
+        }
+    }
+    if( required < dstLen ) { dst[required] = 0; }
+#endif
+    return required;
+}
+
+//--------------------------------------------------------------------------------------------------
+inline size_t wstr2str( wstrview src, char *dst, size_t dstLen, ECodePage cp =CodePageAnsi )
+{
+    size_t nAscii = ascii_prefix( src.ptr, src.len );
+    if( nAscii == src.len )
+    {
+        if( src.len < dstLen )
+        {
+            for( size_t i = 0; i < src.len; i++ ) { dst[i] = (char)src.ptr[i]; }
+            dst[src.len] = 0;
+        }
+        return src.len;
+    }
+
+    size_t required;
+#ifdef _WIN32
+    UINT codePage = (cp == CodePageUtf8) ? CP_UTF8 : CP_ACP;
+    int  nBytes = (dst && dstLen > 1)
+        ? ::WideCharToMultiByte( codePage, 0, src.ptr, (int)src.len, dst, (int)(dstLen - 1), NULL, NULL ) 
+        : 0;
+    if( nBytes > 0 ) { dst[nBytes] = 0; return (size_t)nBytes; }
+    required = (size_t)::WideCharToMultiByte( codePage, 0, src.ptr, (int)src.len, NULL, 0, NULL, NULL );
+#else
+    if( cp == CodePageUtf8 )
+    {
+        required = _utf8_encode( src.ptr, src.len, dst, dstLen );
+    }
+    else
+    {
+        std::mbstate_t state = std::mbstate_t();
+        char mb[16];
+        required = 0;
+        for( size_t i = 0; i < src.len; i++ )
+        {
+            size_t n = std::wcrtomb( mb, src.ptr[i], &state );
+            if( n == (size_t)-1 ) { mb[0] = '?'; n = 1; state = std::mbstate_t(); }
+            if( required + n < dstLen ) { ::memcpy( dst + required, mb, n ); }
+            required += n;
+        }
+    }
+    if( required < dstLen ) { dst[required] = 0; }
+#endif
+    return required;
+}
+
+//--------------------------------------------------------------------------------------------------
+inline size_t str2wstrU( strview src, wchar_t *dst, size_t dstLen ) 
+    { return str2wstr( src, dst, dstLen, CodePageUtf8 ); }
+
+inline size_t wstr2strU( wstrview src, char *dst, size_t dstLen ) 
+    { return wstr2str( src, dst, dstLen, CodePageUtf8 ); }
+
+//--------------------------------------------------------------------------------------------------
+// Convenience versions returning std::[w]string. These convert straight into the string's own
+// storage; for str2wstr the result can never be longer than the input so there is only one pass.
+//--------------------------------------------------------------------------------------------------
+inline std::wstring str2wstr( std::string const &string_in, ECodePage cp =CodePageAnsi ) 
+{
+    std::wstring wstring_out( string_in.length(), L'\0' );
+    if( string_in.empty() ) { return wstring_out; }
+
+    size_t len = str2wstr( string_in, &wstring_out[0], wstring_out.length() + 1, cp );
+    if( len > string_in.length() )
+    {
+        wstring_out.resize( len );
+        str2wstr( string_in, &wstring_out[0], len + 1, cp );
+    }
+    wstring_out.resize( len );
+    return wstring_out;
+}
+
+//--------------------------------------------------------------------------------------------------
+inline std::string wstr2str( std::wstring const &wstring_in, ECodePage cp =CodePageAnsi ) 
+{
+    std::string string_out( wstring_in.length(), '\0' );
+    if( wstring_in.empty() ) { return string_out; }
+
+    size_t len = wstr2str( wstring_in, &string_out[0], string_out.length() + 1, cp );
+    if( len > wstring_in.length() )
+    {
+        string_out.resize( len );
+        wstr2str( wstring_in, &string_out[0], len + 1, cp );
+    }
+    string_out.resize( len );
+    return string_out;
+}
+
+//--------------------------------------------------------------------------------------------------
+inline std::wstring str2wstrU( std::string const &str ) { return str2wstr( str, CodePageUtf8 ); }
+
+//--------------------------------------------------------------------------------------------------
+inline std::string wstr2strU( std::wstring const &wstr ) { return wstr2str( wstr, CodePageUtf8 ); }
+
+//--------------------------------------------------------------------------------------------------
+// vsnprintf() with C99 semantics on every platform: output is always NUL-terminated (truncated if
+// need be) and the return value is the length the complete output requires. args is not consumed.
+//--------------------------------------------------------------------------------------------------
+inline size_t strvnfmt( char *buf, size_t bufLen, char const *fmt, va_list args )
+{
+    va_list ap;
+    int     iResult;
+
+    va_copy( ap, args );
+#ifdef _MSC_VER
+    iResult = (buf && bufLen) ? ::_vsnprintf_s( buf, bufLen, _TRUNCATE, fmt, ap ) : -1;
+    va_end( ap );
+    if( iResult < 0 ) 
+    {
+        va_copy( ap, args );
+        iResult = ::_vscprintf( fmt, ap ); 
+        va_end( ap );
+    }
+#else
+    iResult = ::vsnprintf( buf, bufLen, fmt, ap );
+    va_end( ap );
+#endif
+    return (iResult < 0) ? 0 : (size_t)iResult;
+}
+
+//--------------------------------------------------------------------------------------------------
+inline size_t strnfmt( char *buf, size_t bufLen, char const *fmt, ... )
+{
+    va_list args;
+    va_start( args, fmt );
+    size_t len = strvnfmt( buf, bufLen, fmt, args );
+    va_end( args );
+    return len;
+}
+
+//--------------------------------------------------------------------------------------------------
+inline std::string strvfmt( char const *fmt, va_list args )
+{
+    char   stackBuf[256];
+    size_t len = strvnfmt( stackBuf, sizeof(stackBuf), fmt, args );
+    if( len < sizeof(stackBuf) ) { return std::string( stackBuf, len ); }
+
+    std::string ret( len, '\0' );
+    strvnfmt( &ret[0], len + 1, fmt, args );
     return ret;
 }
+
 //--------------------------------------------------------------------------------------------------
 inline std::string strfmt( char const *fmt, ... )
 {
@@ -159,30 +526,173 @@ inline std::string strfmt( char const *fmt, ... )
 }
 
 //==================================================================================================
-// Microsoft doesn't provide an equivelent narrow ('A') version of CommandLineToArgW.
+// Allocation-free command line splitter. Arguments are split using the same rules as the 2008+
+// C runtime and CommandLineToArgvW():
+//
+//  - arguments are separated by spaces/tabs outside of double quotes;
+//  - 2n backslashes followed by '"' produce n backslashes and the quote toggles quoted mode;
+//  - 2n+1 backslashes followed by '"' produce n backslashes and a literal '"';
+//  - inside quotes, '""' produces a literal '"';
+//  - backslashes not followed by '"' are literal;
+//  - the program name (when fProgramName is set) ends at the closing quote if it starts with one,
+//    otherwise at the first space/tab, and never interprets backslashes.
+//
+// next_raw() returns the argument exactly as it appears on the command line while next() also
+// unescapes it into a caller buffer. Since an unescaped argument is never longer than its raw form,
+// next() may write over the command line itself (out == raw.ptr), which is what split_inplace()
+// does to produce a NUL-terminated argv without allocating.
 //==================================================================================================
-inline LPSTR* CommandLineToArgvA( LPCSTR lpCmdLine, int *pNumArgs )
+template<typename T>
+class basic_cmdline
 {
-    if( sizeof(CHAR) > sizeof(WCHAR) ) { return NULL; }
+public:
+    explicit basic_cmdline( T const *cmdLine, bool fProgramName =false )
+        : m_p(cmdLine), m_fProgramName(fProgramName)
+    {
+    }
 
-    std::wstring strCmdLineW = str2wstr( lpCmdLine );
-    
-    int numArgsW = 0;
-    LPWSTR *argvW = ::CommandLineToArgvW( strCmdLineW.c_str(), &numArgsW );
-    if( !argvW ) { return NULL; }
+    /* Position of the first unparsed argument, i.e. the 'rest' of the command line.
+    */
+    T const *tail() { _SkipBlanks(); return m_p; }
 
-    LPSTR *argvA = reinterpret_cast<LPSTR*>( argvW );
-    for( int i = 0; i < numArgsW; i++ )
+    bool next_raw( basic_strview<T> &raw )
     {
-        std::string strCmdLineA = wstr2str( argvW[i] );
-
-        /* overwrite wide character string with ascii string. As long as sizeof(CHAR) <=
-           sizeof(WCHAR) there shouldn't be any problems 
+        _SkipBlanks();
+        if( !m_p || !*m_p ) { return false; }
+
+        T const *begin = m_p;
+        if( m_fProgramName )
+        {
+            m_fProgramName = false;
+            if( *m_p == '"' ) { for( m_p++; *m_p && *m_p != '"'; m_p++ ); if( *m_p ) { m_p++; } }
+            else              { for( ; *m_p && !_IsBlank( *m_p ); m_p++ ); }
+        }
+        else
+        {
+            bool fInQuote = false;
+            while( *m_p && (fInQuote || !_IsBlank( *m_p )) )
+            {
+                if( *m_p == '\\' )
+                {
+                    size_t nSlash = 0;
+                    for( ; *m_p == '\\'; m_p++ ) { nSlash++; }
+                    if( *m_p == '"' && (nSlash & 1) ) { m_p++; } /* escaped, literal quote */
+                }
+                else if( *m_p == '"' )
+                {
+                    if( fInQuote && m_p[1] == '"' ) { m_p += 2; }
+                    else                            { fInQuote = !fInQuote; m_p++; }
+                }
+                else
+                {
+                    m_p++;
+                }
+            }
+        }
+        raw = basic_strview<T>( begin, m_p - begin );
+
+        /* Consume the separator so callers that NUL-terminate in place don't cut off the tail.
         */
-        ::strcpy( argvA[i], strCmdLineA.c_str() );
+        if( _IsBlank( *m_p ) ) { m_p++; }
+        return true;
     }
 
-    *pNumArgs = numArgsW;
+    bool next( basic_strview<T> &arg, T *out )
+    {
+        basic_strview<T> raw;
+        bool             fProgramName = m_fProgramName;
+        if( !next_raw( raw ) ) { return false; }
+
+        T const *p = raw.ptr, *pEnd = raw.ptr + raw.len;
+        T       *o = out;
+        if( fProgramName )
+        {
+            for( ; p < pEnd; p++ ) { if( *p != '"' ) { *o++ = *p; } }
+        }
+        else
+        {
+            bool fInQuote = false;
+            while( p < pEnd )
+            {
+                if( *p == '\\' )
+                {
+                    size_t nSlash = 0;
+                    for( ; p < pEnd && *p == '\\'; p++ ) { nSlash++; }
+                    if( p < pEnd && *p == '"' )
+                    {
+                        for( size_t i = 0; i < nSlash / 2; i++ ) { *o++ = '\\'; }
+                        if( nSlash & 1 ) { *o++ = '"'; p++; }
+                    }
+                    else
+                    {
+                        for( size_t i = 0; i < nSlash; i++ ) { *o++ = '\\'; }
+                    }
+                }
+                else if( *p == '"' )
+                {
+                    if( fInQuote && p + 1 < pEnd && p[1] == '"' ) { *o++ = '"'; p += 2; }
+                    else                                          { fInQuote = !fInQuote; p++; }
+                }
+                else
+                {
+                    *o++ = *p++;
+                }
+            }
+        }
+        arg = basic_strview<T>( out, o - out );
+        return true;
+    }
+
+private:
+    static bool _IsBlank( T c ) { return c == ' ' || c == '\t'; }
+    void        _SkipBlanks()   { while( m_p && _IsBlank( *m_p ) ) { m_p++; } }
+
+    T const *m_p;
+    bool     m_fProgramName;
+};
+
+typedef basic_cmdline<char>    cmdline;
+typedef basic_cmdline<wchar_t> wcmdline;
+
+//--------------------------------------------------------------------------------------------------
+// Split cmdLine in place into NUL-terminated arguments. Up to maxArgs-1 pointers are stored in argv,
+// followed by a terminating NULL. Returns the total number of arguments found. An argv with
+// (length/2 + 2) entries is always large enough.
+//--------------------------------------------------------------------------------------------------
+template<typename T>
+inline int split_inplace( T *cmdLine, T **argv, int maxArgs, bool fProgramName =false )
+{
+    basic_cmdline<T> cl( cmdLine, fProgramName );
+    basic_strview<T> arg;
+    int              argc = 0;
+
+    while( cl.next( arg, (T*)cl.tail() ) )
+    {
+        ((T*)arg.ptr)[arg.len] = 0;
+        if( argc < maxArgs - 1 ) { argv[argc] = (T*)arg.ptr; }
+        argc++;
+    }
+    if( maxArgs > 0 ) { argv[argc < maxArgs - 1 ? argc : maxArgs - 1] = 0; }
+    return argc;
+}
+
+#ifdef _WIN32
+//==================================================================================================
+// Microsoft doesn't provide an equivelent narrow ('A') version of CommandLineToArgW. The argument
+// pointers and strings are placed in a single LocalAlloc() block, just like CommandLineToArgvW().
+//==================================================================================================
+inline LPSTR* CommandLineToArgvA( LPCSTR lpCmdLine, int *pNumArgs )
+{
+    size_t len     = ::strlen( lpCmdLine );
+    int    maxArgs = (int)(len / 2) + 2;
+
+    LPSTR *argvA = (LPSTR*)::LocalAlloc( LMEM_FIXED, maxArgs * sizeof(LPSTR) + len + 1 );
+    if( !argvA ) { return NULL; }
+
+    LPSTR pStrings = (LPSTR)(argvA + maxArgs);
+    ::memcpy( pStrings, lpCmdLine, len + 1 );
+
+    *pNumArgs = split_inplace( pStrings, argvA, maxArgs, true );
 
     /* client is still responsible for calling ::LocalFree() on returned argument buffer 
 	*/
@@ -275,6 +785,8 @@ inline DWORD CopyResource( LPCTSTR szResFilepath, LPCTSTR lpType,
     return resData.size();
 }
 
+#endif // ifdef _WIN32
+
 } // namespace utils
 
 #endif // ifndef _utils_h_
@@ -0,0 +1,332 @@
+/***********************************************************************************************//**
+\file    vtparse.h
+\author  hdaniel
+\version $Id$
+
+\brief Table-driven parser for the VT/ANSI escape sequences in a child's output.
+
+\details
+
+Tools that color their own output (git, cargo, clang -fcolor-diagnostics) write SGR sequences,
+"ESC [ params m", which show up as garbage on a console without VT processing. The parser splits a
+byte stream into text and sequences, so sequences can be dropped and SGR turned into console
+attributes.
+
+The parser is the DEC/VT500 state machine, reduced to what's needed to find where each sequence
+ends: a byte is mapped to one of a few classes, and the class and the current state look up the
+action and the next state in a single table. Sequences may be split across chunks, the parser keeps
+its state between calls. Outside of a sequence the only byte of interest is ESC, so text is skipped
+16 bytes at a time with SSE2 and passed on in one piece; plain text pays one compare per 16 bytes.
+
+Only 7-bit sequences are recognized. The 8-bit C1 controls (0x80-0x9F) are left alone, as they are
+part of UTF-8 text and of most ANSI code pages.
+
+\license
+
+This file is free and unencumbered software released into the public domain.
+
+Anyone is free to copy, modify, publish, use, compile, sell, or distribute this software, either in
+source code form or as a compiled binary, for any purpose, commercial or non-commercial, and by any
+means.
+
+In jurisdictions that recognize copyright laws, the author or authors of this software dedicate any
+and all copyright interest in the software to the public domain. We make this dedication for the
+benefit of the public at large and to the detriment of our heirs and successors. We intend this
+dedication to be an overt act of relinquishment in perpetuity of all present and future rights to
+this software under copyright law.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT
+NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+For more information, please refer to <http://unlicense.org/>
+***************************************************************************************************/
+#ifndef _vtparse_h_
+#define _vtparse_h_
+
+#include <string>
+
+#include <windows.h>
+
+#include "colorutils.h"
+
+#if defined(_M_IX86) || defined(_M_X64) || defined(__SSE2__)
+#  define VTPARSE_SSE2
+#  include <emmintrin.h>
+#  ifdef _MSC_VER
+#    include <intrin.h>
+#  endif
+#endif
+
+namespace vtutils
+{
+
+//==================================================================================================
+// Number of bytes at the start of s[0..len) before the first ESC.
+//==================================================================================================
+inline size_t text_prefix( char const *s, size_t len )
+{
+	size_t i = 0;
+
+#ifdef VTPARSE_SSE2
+	__m128i const esc = _mm_set1_epi8( 0x1B );
+
+	for( ; i + 16 <= len; i += 16 )
+	{
+		int mask = _mm_movemask_epi8( _mm_cmpeq_epi8( _mm_loadu_si128( (__m128i const*)(s + i) ), esc ) );
+		if( mask != 0 )
+		{
+#  ifdef _MSC_VER
+			unsigned long first;
+			_BitScanForward( &first, (unsigned long)mask );
+			return i + first;
+#  else
+			return i + (size_t)__builtin_ctz( (unsigned)mask );
+#  endif
+		}
+	}
+#endif
+
+	for( ; i < len && s[i] != 0x1B; i++ ) { }
+	return i;
+}
+
+//==================================================================================================
+// The parser's byte classes, states and actions. A table entry is (action << 4) | next state.
+//==================================================================================================
+enum EByteClass
+{
+	ClsCtrl,     // C0 controls but the ones below
+	ClsBel,      // 0x07, ends an OSC string
+	ClsCan,      // CAN and SUB, cancel a sequence
+	ClsEsc,
+	ClsInter,    // 0x20-0x2F, intermediates
+	ClsDigit,    // 0x30-0x39
+	ClsSep,      // ':' and ';'
+	ClsPriv,     // 0x3C-0x3F, private markers
+	ClsCsi,      // '['
+	ClsOsc,      // ']'
+	ClsStr,      // 'P', 'X', '^' and '_', start DCS/SOS/PM/APC strings
+	ClsFinal,    // the rest of 0x40-0x7E
+	ClsDel,
+	ClsHigh,     // 0x80-0xFF
+	NUM_BYTECLASSES
+};
+
+enum EState
+{
+	StGround, StEscape, StEscInter, StCsiEntry, StCsiParam, StCsiInter, StCsiIgnore, StOsc, StString,
+	NUM_STATES
+};
+
+enum EAction { ActNone, ActPrint, ActExecute, ActClear, ActCollect, ActParam, ActCsiDispatch, ActEscDispatch };
+
+static unsigned char const s_byteClass[256] =
+{
+	0,0,0,0,0,0,0,1, 0,0,0,0,0,0,0,0,  0,0,0,0,0,0,0,0, 2,0,2,3,0,0,0,0,  // 0x00
+	4,4,4,4,4,4,4,4, 4,4,4,4,4,4,4,4,  5,5,5,5,5,5,5,5, 5,5,6,6,7,7,7,7,  // 0x20
+	11,11,11,11,11,11,11,11, 11,11,11,11,11,11,11,11,                     // 0x40
+	10,11,11,11,11,11,11,11, 10,11,11,8,11,9,10,10,                       // 0x50
+	11,11,11,11,11,11,11,11, 11,11,11,11,11,11,11,11,                     // 0x60
+	11,11,11,11,11,11,11,11, 11,11,11,11,11,11,11,12,                     // 0x70
+	13,13,13,13,13,13,13,13, 13,13,13,13,13,13,13,13,  13,13,13,13,13,13,13,13, 13,13,13,13,13,13,13,13,
+	13,13,13,13,13,13,13,13, 13,13,13,13,13,13,13,13,  13,13,13,13,13,13,13,13, 13,13,13,13,13,13,13,13,
+	13,13,13,13,13,13,13,13, 13,13,13,13,13,13,13,13,  13,13,13,13,13,13,13,13, 13,13,13,13,13,13,13,13,
+	13,13,13,13,13,13,13,13, 13,13,13,13,13,13,13,13,  13,13,13,13,13,13,13,13, 13,13,13,13,13,13,13,13
+};
+
+#define VT_(action, state)  (unsigned char)(((action) << 4) | (St##state))
+#define VT_N(state)        VT_(ActNone, state)
+#define VT_P(state)        VT_(ActPrint, state)
+#define VT_X(state)        VT_(ActExecute, state)
+#define VT_C(state)        VT_(ActClear, state)
+#define VT_L(state)        VT_(ActCollect, state)
+#define VT_A(state)        VT_(ActParam, state)
+#define VT_D(state)        VT_(ActCsiDispatch, state)
+#define VT_E(state)        VT_(ActEscDispatch, state)
+
+/* Controls inside a sequence take effect as if they were outside of it, a byte that can't be part
+ * of a sequence ends it and is text again.
+*/
+static unsigned char const s_transitions[NUM_STATES][NUM_BYTECLASSES] =
+{
+	/*              Ctrl             Bel              Can           Esc           Inter            Digit            Sep              Priv             Csi             Osc           Str           Final         Del              High */
+	/* Ground    */ { VT_P(Ground),    VT_P(Ground),    VT_P(Ground), VT_C(Escape), VT_P(Ground),    VT_P(Ground),    VT_P(Ground),    VT_P(Ground),    VT_P(Ground),   VT_P(Ground), VT_P(Ground), VT_P(Ground), VT_P(Ground),    VT_P(Ground) },
+	/* Escape    */ { VT_X(Escape),    VT_X(Escape),    VT_N(Ground), VT_C(Escape), VT_L(EscInter),  VT_E(Ground),    VT_E(Ground),    VT_E(Ground),    VT_C(CsiEntry), VT_N(Osc),    VT_N(String), VT_E(Ground), VT_N(Escape),    VT_P(Ground) },
+	/* EscInter  */ { VT_X(EscInter),  VT_X(EscInter),  VT_N(Ground), VT_C(Escape), VT_L(EscInter),  VT_E(Ground),    VT_E(Ground),    VT_E(Ground),    VT_E(Ground),   VT_E(Ground), VT_E(Ground), VT_E(Ground), VT_N(EscInter),  VT_P(Ground) },
+	/* CsiEntry  */ { VT_X(CsiEntry),  VT_X(CsiEntry),  VT_N(Ground), VT_C(Escape), VT_L(CsiInter),  VT_A(CsiParam),  VT_A(CsiParam),  VT_L(CsiParam),  VT_D(Ground),   VT_D(Ground), VT_D(Ground), VT_D(Ground), VT_N(CsiEntry),  VT_P(Ground) },
+	/* CsiParam  */ { VT_X(CsiParam),  VT_X(CsiParam),  VT_N(Ground), VT_C(Escape), VT_L(CsiInter),  VT_A(CsiParam),  VT_A(CsiParam),  VT_N(CsiIgnore), VT_D(Ground),   VT_D(Ground), VT_D(Ground), VT_D(Ground), VT_N(CsiParam),  VT_P(Ground) },
+	/* CsiInter  */ { VT_X(CsiInter),  VT_X(CsiInter),  VT_N(Ground), VT_C(Escape), VT_L(CsiInter),  VT_N(CsiIgnore), VT_N(CsiIgnore), VT_N(CsiIgnore), VT_D(Ground),   VT_D(Ground), VT_D(Ground), VT_D(Ground), VT_N(CsiInter),  VT_P(Ground) },
+	/* CsiIgnore */ { VT_X(CsiIgnore), VT_X(CsiIgnore), VT_N(Ground), VT_C(Escape), VT_N(CsiIgnore), VT_N(CsiIgnore), VT_N(CsiIgnore), VT_N(CsiIgnore), VT_N(Ground),   VT_N(Ground), VT_N(Ground), VT_N(Ground), VT_N(CsiIgnore), VT_P(Ground) },
+	/* Osc       */ { VT_N(Osc),       VT_N(Ground),    VT_N(Ground), VT_C(Escape), VT_N(Osc),       VT_N(Osc),       VT_N(Osc),       VT_N(Osc),       VT_N(Osc),      VT_N(Osc),    VT_N(Osc),    VT_N(Osc),    VT_N(Osc),       VT_N(Osc) },
+	/* String    */ { VT_N(String),    VT_N(String),    VT_N(Ground), VT_C(Escape), VT_N(String),    VT_N(String),    VT_N(String),    VT_N(String),    VT_N(String),   VT_N(String), VT_N(String), VT_N(String), VT_N(String),    VT_N(String) }
+};
+
+#undef VT_N
+#undef VT_P
+#undef VT_X
+#undef VT_C
+#undef VT_L
+#undef VT_A
+#undef VT_D
+#undef VT_E
+#undef VT_
+
+//==================================================================================================
+// Splits a stream into text and escape sequences. Handler has
+//
+//   void text( char const *p, size_t len );        // output as is, called with the longest runs it can
+//   void sgr( int const *params, size_t nParams ); // an SGR sequence, "ESC [ 0 m" for "ESC [ m"
+//
+// Every other sequence is dropped.
+//==================================================================================================
+class parser
+{
+public:
+	enum { MAX_PARAMS = 32 };
+
+	parser() : m_state(StGround), m_fCollected(false), m_nParams(0) { }
+
+	bool in_sequence() const { return m_state != StGround; }
+	void reset()             { m_state = StGround; }
+
+	template<class Handler>
+	void parse( char const *p, size_t len, Handler &handler )
+	{
+		char const *end = p + len;
+
+		while( p < end )
+		{
+			if( m_state == StGround )
+			{
+				size_t n = text_prefix( p, end - p );
+				if( n ) { handler.text( p, n ); }
+				p += n;
+				if( p == end ) { break; }
+			}
+
+			unsigned char c     = (unsigned char)*p++;
+			unsigned char entry = s_transitions[m_state][s_byteClass[c]];
+			switch( entry >> 4 )
+			{
+				case ActPrint:
+				case ActExecute:
+					handler.text( (char const*)&p[-1], 1 );
+					break;
+
+				case ActClear:
+					m_fCollected = false;
+					m_nParams    = 0;
+					m_params[0]  = 0;
+					break;
+
+				case ActCollect:
+					m_fCollected = true;
+					break;
+
+				case ActParam:
+					if( !m_nParams ) { m_nParams = 1; }
+					if( c == ';' || c == ':' )
+					{
+						if( m_nParams < MAX_PARAMS ) { m_params[m_nParams++] = 0; }
+					}
+					else if( m_params[m_nParams - 1] < 65535 )
+					{
+						m_params[m_nParams - 1] = m_params[m_nParams - 1] * 10 + (c - '0');
+					}
+					break;
+
+				case ActCsiDispatch:
+					if( c == 'm' && !m_fCollected )
+					{
+						if( !m_nParams ) { m_nParams = 1; }
+						handler.sgr( m_params, m_nParams );
+					}
+					break;
+
+				default:
+					break;
+			}
+			m_state = (EState)(entry & 0x0F);
+		}
+	}
+
+private:
+	EState m_state;
+	bool   m_fCollected;            // intermediates or a private marker, not a plain SGR
+	size_t m_nParams;
+	int    m_params[MAX_PARAMS];
+};
+
+//==================================================================================================
+// Console attribute for the text following an SGR sequence. attr is the attribute so far and
+// base what a reset (0, 39, 49) returns to. 256 color and RGB colors take the nearest console color.
+//==================================================================================================
+inline WORD _ansi_to_fg( int color ) { return (WORD)colorutils::ansi_to_console( color ); }
+
+inline WORD apply_sgr( WORD attr, WORD base, int const *params, size_t nParams )
+{
+	WORD const fgColor = FOREGROUND_RED|FOREGROUND_GREEN|FOREGROUND_BLUE;
+	WORD const fgMask  = fgColor|FOREGROUND_INTENSITY;
+	WORD const bgMask  = BACKGROUND_RED|BACKGROUND_GREEN|BACKGROUND_BLUE|BACKGROUND_INTENSITY;
+
+	for( size_t i = 0; i < nParams; i++ )
+	{
+		int p = params[i];
+
+		if( p == 0 )                    { attr = base; }
+		else if( p == 1 )               { attr |= FOREGROUND_INTENSITY; }
+		else if( p == 22 )              { attr = (WORD)((attr & ~FOREGROUND_INTENSITY) | (base & FOREGROUND_INTENSITY)); }
+		else if( p == 4 )               { attr |= COMMON_LVB_UNDERSCORE; }
+		else if( p == 24 )              { attr &= ~COMMON_LVB_UNDERSCORE; }
+		else if( p == 7 )               { attr |= COMMON_LVB_REVERSE_VIDEO; }
+		else if( p == 27 )              { attr &= ~COMMON_LVB_REVERSE_VIDEO; }
+		else if( p >= 30 && p <= 37 )   { attr = (WORD)((attr & ~fgColor) | _ansi_to_fg( p - 30 )); }
+		else if( p >= 90 && p <= 97 )   { attr = (WORD)((attr & ~fgMask) | _ansi_to_fg( p - 90 + 8 )); }
+		else if( p >= 40 && p <= 47 )   { attr = (WORD)((attr & ~bgMask) | (_ansi_to_fg( p - 40 ) << 4)); }
+		else if( p >= 100 && p <= 107 ) { attr = (WORD)((attr & ~bgMask) | (_ansi_to_fg( p - 100 + 8 ) << 4)); }
+		else if( p == 39 )              { attr = (WORD)((attr & ~fgMask) | (base & fgMask)); }
+		else if( p == 49 )              { attr = (WORD)((attr & ~bgMask) | (base & bgMask)); }
+		else if( p == 38 || p == 48 )
+		{
+			int color = -1;
+			if( i + 2 < nParams && params[i + 1] == 5 )
+			{
+				color = colorutils::xterm_to_ansi( params[i + 2] & 0xFF );
+				i += 2;
+			}
+			else if( i + 4 < nParams && params[i + 1] == 2 )
+			{
+				color = colorutils::rgb_to_ansi( params[i + 2] & 0xFF, params[i + 3] & 0xFF, params[i + 4] & 0xFF );
+				i += 4;
+			}
+			if( color >= 0 && p == 38 ) { attr = (WORD)((attr & ~fgMask) | _ansi_to_fg( color )); }
+			if( color >= 0 && p == 48 ) { attr = (WORD)((attr & ~bgMask) | (_ansi_to_fg( color ) << 4)); }
+		}
+	}
+	return attr;
+}
+
+//==================================================================================================
+// Append s[0..len) to out without its escape sequences, for output that isn't colored (logs).
+// A sequence cut off at the end of s is dropped.
+//==================================================================================================
+struct _strip_handler
+{
+	std::string *pOut;
+	void text( char const *p, size_t len ) { pOut->append( p, len ); }
+	void sgr( int const*, size_t )         { }
+};
+
+inline void append_stripped( std::string &out, char const *s, size_t len )
+{
+	parser         vt;
+	_strip_handler handler = { &out };
+	vt.parse( s, len, handler );
+}
+
+} // namespace vtutils
+
+#endif // _vtparse_h_
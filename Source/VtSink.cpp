@@ -0,0 +1,128 @@
+/***********************************************************************************************//**
+\file    VtSink.cpp
+\author  hdaniel
+\version $Id$
+
+\brief CVtSink, escape sequence removal and SGR colors of the relayed output (see VtSink.h).
+
+\details
+
+Each stream has a vtutils::parser of its own, fed from that stream's thread only, so a sequence
+split across two reads is finished with the next chunk and the streams need no locking. A chunk is
+stripped into a per-stream buffer, which the next sink reads from until its Write() returns; the
+colors tracked for the chunk are kept alongside it for the console sink, as spans of that buffer.
+
+\license
+
+This file is free and unencumbered software released into the public domain.
+
+Anyone is free to copy, modify, publish, use, compile, sell, or distribute this software, either in
+source code form or as a compiled binary, for any purpose, commercial or non-commercial, and by any
+means.
+
+In jurisdictions that recognize copyright laws, the author or authors of this software dedicate any
+and all copyright interest in the software to the public domain. We make this dedication for the 
+benefit of the public at large and to the detriment of our heirs and successors. We intend this 
+dedication to be an overt act of relinquishment in perpetuity of all present and future rights to
+this software under copyright law.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT
+NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND 
+NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+For more information, please refer to <http://unlicense.org/>
+***************************************************************************************************/
+#include <string>
+
+#include <windows.h>
+
+#include "VtSink.h"
+
+//==================================================================================================
+// Text is passed on as is, and with colors tracked a run in a color other than the stream's own
+// extends the last span when it's in the same color.
+//==================================================================================================
+void CVtSink::SHandler::text( char const *p, size_t len )
+{
+	SStream &stream = *pStream;
+	size_t   pos    = stream.text.size();
+
+	stream.text.append( p, len );
+	if( !stream.fColors || stream.attr == stream.baseAttr ) { return; }
+
+	if( !stream.colors.empty() )
+	{
+		ruleutils::span &last = stream.colors.back();
+		if( last.attr == stream.attr && last.begin + last.len == pos )
+		{
+			last.len += len;
+			return;
+		}
+	}
+
+	ruleutils::span sp = { pos, len, stream.attr, 0 };
+	stream.colors.push_back( sp );
+}
+
+void CVtSink::SHandler::sgr( int const *params, size_t nParams )
+{
+	SStream &stream = *pStream;
+	if( stream.fColors ) { stream.attr = vtutils::apply_sgr( stream.attr, stream.baseAttr, params, nParams ); }
+}
+
+//==================================================================================================
+CVtSink::CVtSink()
+	: m_eMode(VtPass), m_pNext(NULL)
+{
+	for( int i = StdOutRead; i <= StdErrRead; i++ )
+	{
+		m_stream[i].baseAttr = m_stream[i].attr = 0;
+		m_stream[i].fColors  = false;
+	}
+}
+
+//==================================================================================================
+void CVtSink::Start( EVtMode eMode, WORD stdoutAttr, WORD stderrAttr, IRelaySink *pNext )
+{
+	m_eMode = eMode;
+	m_pNext = pNext;
+
+	m_stream[StdOutRead].baseAttr = m_stream[StdOutRead].attr = stdoutAttr;
+	m_stream[StdErrRead].baseAttr = m_stream[StdErrRead].attr = stderrAttr;
+	m_stream[StdOutRead].fColors  = m_stream[StdErrRead].fColors = (eMode == VtTranslate || eMode == VtMerge);
+}
+
+//==================================================================================================
+// Pass the chunk on without its escape sequences. A chunk that was nothing but (the rest of) a
+// sequence isn't passed on at all.
+//==================================================================================================
+DWORD CVtSink::Write( EIoThreadType eStream, BYTE *pData, DWORD nBytes )
+{
+	if( m_eMode == VtPass ) { return m_pNext->Write( eStream, pData, nBytes ); }
+
+	SStream  &stream  = m_stream[eStream];
+	SHandler  handler = { &stream };
+
+	stream.text.clear();
+	stream.colors.clear();
+	stream.parser.parse( (char const*)pData, nBytes, handler );
+
+	if( stream.text.empty() ) { return 0; }
+	return m_pNext->Write( eStream, (BYTE*)stream.text.c_str(), (DWORD)stream.text.size() );
+}
+
+//==================================================================================================
+DWORD CVtSink::EndOfStream( EIoThreadType eStream )
+{
+	m_stream[eStream].text.clear();
+	m_stream[eStream].colors.clear();
+	return m_pNext->EndOfStream( eStream );
+}
+
+//==================================================================================================
+void CVtSink::SetReadTime( EIoThreadType eStream, unsigned long long ullTime_ms )
+{
+	m_pNext->SetReadTime( eStream, ullTime_ms );
+}
@@ -0,0 +1,108 @@
+/***********************************************************************************************//**
+\file    VtSink.h
+\author  hdaniel
+\version $Id$
+
+\brief IRelaySink that takes the VT/ANSI escape sequences out of the child's output (--vt).
+
+\details
+
+Sits in front of the other sinks and passes each chunk on without its escape sequences, so the
+rules, the JSON records and the console all work on the text the child meant to show. With
+VtTranslate and VtMerge the colors the child gave its text with SGR sequences are kept as console
+attributes, as spans of the chunk that was passed on, for the console sink to draw.
+
+\license
+
+This file is free and unencumbered software released into the public domain.
+
+Anyone is free to copy, modify, publish, use, compile, sell, or distribute this software, either in
+source code form or as a compiled binary, for any purpose, commercial or non-commercial, and by any
+means.
+
+In jurisdictions that recognize copyright laws, the author or authors of this software dedicate any
+and all copyright interest in the software to the public domain. We make this dedication for the
+benefit of the public at large and to the detriment of our heirs and successors. We intend this
+dedication to be an overt act of relinquishment in perpetuity of all present and future rights to
+this software under copyright law.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT
+NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+For more information, please refer to <http://unlicense.org/>
+***************************************************************************************************/
+#ifndef _vtsink_h_
+#define _vtsink_h_
+
+#include <string>
+
+#include <windows.h>
+
+#include "Relay.h"
+#include "Utils\ruleutils.h"
+#include "Utils\vtparse.h"
+
+//==================================================================================================
+// What's done with the escape sequences in the child's output (--vt).
+//
+//   VtPass      - written as they are, for consoles that process them (the default).
+//   VtStrip     - dropped.
+//   VtTranslate - dropped, with SGR colors drawn as console attributes in place of -o/-e.
+//   VtMerge     - dropped, with SGR colors drawn as console attributes over -o/-e.
+//==================================================================================================
+enum EVtMode { VtPass, VtStrip, VtTranslate, VtMerge };
+
+//==================================================================================================
+// Start() is given the mode, the attribute of each stream an SGR reset returns to, and the sink the
+// chunks are passed on to.
+//
+// Colors() are the child's colors for the chunk being passed on, valid during the call to the next
+// sink. Each stream has a parser and a color of its own, so a sequence or a color carries over from
+// one chunk to the next.
+//==================================================================================================
+class CVtSink : public IRelaySink
+{
+public:
+	CVtSink();
+
+	void Start( EVtMode eMode, WORD stdoutAttr, WORD stderrAttr, IRelaySink *pNext );
+
+	EVtMode Mode() const { return m_eMode; }
+
+	/* Spans of the chunk passed on that the child colored, in order; empty with VtStrip.
+	*/
+	ruleutils::spans const& Colors( EIoThreadType eStream ) const { return m_stream[eStream].colors; }
+
+	virtual DWORD Write( EIoThreadType eStream, BYTE *pData, DWORD nBytes );
+	virtual DWORD EndOfStream( EIoThreadType eStream );
+	virtual void  SetReadTime( EIoThreadType eStream, unsigned long long ullTime_ms );
+
+private:
+	struct SStream
+	{
+		vtutils::parser  parser;
+		std::string      text;      // the chunk without its escape sequences
+		ruleutils::spans colors;
+		WORD             baseAttr;  // what an SGR reset returns to
+		WORD             attr;      // the child's current color
+		bool             fColors;   // track colors, VtTranslate or VtMerge
+	};
+
+	/* Handler of vtutils::parser, for one stream.
+	*/
+	struct SHandler
+	{
+		SStream *pStream;
+		void text( char const *p, size_t len );
+		void sgr( int const *params, size_t nParams );
+	};
+
+	EVtMode     m_eMode;
+	IRelaySink *m_pNext;
+	SStream     m_stream[2];  // indexed by StdOutRead/StdErrRead
+};
+
+#endif // _vtsink_h_
@@ -0,0 +1,67 @@
+/***********************************************************************************************//**
+\file    bench.cpp
+\author  hdaniel
+\version $Id$
+
+\brief crbench, runs the benchmarks of Tests\ (see bench.h).
+
+\details
+
+crbench lists the benchmarks linked in. "crbench all" runs all of them with their defaults, and
+"crbench name [args]" runs one. The exit code is the number of benchmarks that failed their bound.
+
+\license
+
+This file is free and unencumbered software released into the public domain.
+
+Anyone is free to copy, modify, publish, use, compile, sell, or distribute this software, either in
+source code form or as a compiled binary, for any purpose, commercial or non-commercial, and by any
+means.
+
+In jurisdictions that recognize copyright laws, the author or authors of this software dedicate any
+and all copyright interest in the software to the public domain. We make this dedication for the
+benefit of the public at large and to the detriment of our heirs and successors. We intend this
+dedication to be an overt act of relinquishment in perpetuity of all present and future rights to
+this software under copyright law.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT
+NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+For more information, please refer to <http://unlicense.org/>
+***************************************************************************************************/
+#include <cstring>
+
+#include "bench.h"
+
+//==================================================================================================
+int main( int argc, char *argv[] )
+{
+	int nFailed = 0;
+
+	if( argc < 2 )
+	{
+		std::printf( "usage: crbench all | <name> [args]\n\n" );
+		for( bench::SBench *pBench = bench::FirstBench(); pBench; pBench = pBench->pNext )
+		{
+			std::printf( "  %s\n", pBench->name );
+		}
+		return 0;
+	}
+
+	bool fAll = std::strcmp( argv[1], "all" ) == 0;
+	for( bench::SBench *pBench = bench::FirstBench(); pBench; pBench = pBench->pNext )
+	{
+		if( !fAll && std::strcmp( pBench->name, argv[1] ) ) { continue; }
+
+		std::printf( "%s\n", pBench->name );
+		if( !pBench->pfnBench( fAll ? 0 : argc - 2, fAll ? NULL : argv + 2 ) ) 
+		{ 
+			std::printf( "  [FAILED]\n" );
+			nFailed++; 
+		}
+	}
+	return nFailed;
+}
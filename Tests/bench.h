@@ -0,0 +1,110 @@
+/***********************************************************************************************//**
+\file    bench.h
+\author  hdaniel
+\version $Id$
+
+\brief Benchmarks and measurements of cr (see bench.cpp).
+
+\details
+
+A benchmark is a function defined with BENCH( name ), given the arguments that follow its name on
+crbench's command line. Benchmarks print what they measured and, where the request that
+introduced the code under test set a bound (a number of system calls per MB, say), return false
+when it's exceeded, so crbench's exit code can gate on it. They time with the performance counter
+and take the best of a few runs, which is the least disturbed by the rest of the machine.
+
+\license
+
+This file is free and unencumbered software released into the public domain.
+
+Anyone is free to copy, modify, publish, use, compile, sell, or distribute this software, either in
+source code form or as a compiled binary, for any purpose, commercial or non-commercial, and by any
+means.
+
+In jurisdictions that recognize copyright laws, the author or authors of this software dedicate any
+and all copyright interest in the software to the public domain. We make this dedication for the
+benefit of the public at large and to the detriment of our heirs and successors. We intend this
+dedication to be an overt act of relinquishment in perpetuity of all present and future rights to
+this software under copyright law.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT
+NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+For more information, please refer to <http://unlicense.org/>
+***************************************************************************************************/
+#ifndef _bench_h_
+#define _bench_h_
+
+#include <cstdio>
+
+#include <windows.h>
+
+namespace bench
+{
+
+typedef bool (*BenchFn)( int argc, char *argv[] );
+
+struct SBench
+{
+	char const *name;
+	BenchFn     pfnBench;
+	SBench     *pNext;
+};
+
+inline SBench*& FirstBench() { static SBench *pFirst = 0; return pFirst; }
+inline SBench*& LastBench()  { static SBench *pLast = 0; return pLast; }
+
+struct SRegister
+{
+	SRegister( SBench &bench ) 
+	{ 
+		bench.pNext = 0;
+		if( LastBench() ) { LastBench()->pNext = &bench; } 
+		else              { FirstBench() = &bench; }
+		LastBench() = &bench;
+	}
+};
+
+//==================================================================================================
+// Seconds since construction or the last Restart().
+//==================================================================================================
+class Timer
+{
+public:
+	Timer() { ::QueryPerformanceFrequency( &m_freq ); Restart(); }
+
+	void   Restart()       { ::QueryPerformanceCounter( &m_start ); }
+	double Seconds() const 
+	{ 
+		LARGE_INTEGER now;
+		::QueryPerformanceCounter( &now );
+		return (double)(now.QuadPart - m_start.QuadPart) / (double)m_freq.QuadPart;
+	}
+
+private:
+	LARGE_INTEGER m_freq;
+	LARGE_INTEGER m_start;
+};
+
+//==================================================================================================
+// Print the time per operation of nOps operations that took the given seconds.
+//==================================================================================================
+inline void Report( char const *what, double seconds, unsigned long long nOps )
+{
+	std::printf( "  %-44s %12.1f ns/op\n", what, seconds * 1e9 / (double)nOps );
+}
+
+} // namespace bench
+
+#define BENCH( name )                                               \
+	static bool name( int argc, char *argv[] );                     \
+	static bench::SBench    name##_bench = { #name, name, 0 };      \
+	static bench::SRegister name##_register( name##_bench );        \
+	static bool name( int argc, char *argv[] )
+
+#define BENCH_RUNS 5  // runs a measurement is repeated for, the best one counts
+
+#endif // _bench_h_
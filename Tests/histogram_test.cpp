@@ -0,0 +1,129 @@
+/***********************************************************************************************//**
+\file    histogram_test.cpp
+\author  hdaniel
+\version $Id$
+
+\brief Tests of Source\Utils\histogram.h.
+
+\details
+
+histogram.h's buckets, which must be contiguous and never wider than 1/16th of their values, and
+LatencyHistogram's Count(), Max() and Percentile() on known samples, including from several threads
+at once. It uses the Interlocked functions, so unlike the other tests here it needs Windows.
+
+\license
+
+This file is free and unencumbered software released into the public domain.
+
+Anyone is free to copy, modify, publish, use, compile, sell, or distribute this software, either in
+source code form or as a compiled binary, for any purpose, commercial or non-commercial, and by any
+means.
+
+In jurisdictions that recognize copyright laws, the author or authors of this software dedicate any
+and all copyright interest in the software to the public domain. We make this dedication for the
+benefit of the public at large and to the detriment of our heirs and successors. We intend this
+dedication to be an overt act of relinquishment in perpetuity of all present and future rights to
+this software under copyright law.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT
+NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+For more information, please refer to <http://unlicense.org/>
+***************************************************************************************************/
+#include <windows.h>
+
+#include "../Source/Utils/histogram.h"
+#include "test.h"
+
+typedef utils::LatencyHistogram Histogram;
+
+#define THREAD_SAMPLES  100000  // samples each thread of record_threads records
+
+//==================================================================================================
+TEST( histogram_buckets )
+{
+	/* Each bucket starts right after the one before it ends.
+	*/
+	for( int b = 0; b < Histogram::NUM_BUCKETS; b++ )
+	{
+		CHECK( Histogram::Bucket( Histogram::Highest( b ) ) == b );
+		if( b > 0 ) { CHECK( Histogram::Bucket( Histogram::Highest( b - 1 ) + 1 ) == b ); }
+	}
+
+	/* Small values have a bucket each, larger ones share buckets at most value/16 wide, and what's
+	 * past the last bucket counts in it.
+	*/
+	for( ULONGLONG v = 0; v < Histogram::SUB_COUNT; v++ )
+	{
+		CHECK( Histogram::Bucket( v ) == (int)v && Histogram::Highest( (int)v ) == v );
+	}
+	for( int bit = 5; bit < 41; bit++ )
+	{
+		ULONGLONG values[] = { 1ULL << bit, (1ULL << bit) + 1, (3ULL << bit) / 2, (2ULL << bit) - 1 };
+		for( int i = 0; i < 4; i++ )
+		{
+			ULONGLONG high = Histogram::Highest( Histogram::Bucket( values[i] ) );
+			CHECK( high >= values[i] && high - values[i] <= values[i] / 16 );
+		}
+	}
+	CHECK( Histogram::Bucket( 1ULL << 41 ) == Histogram::NUM_BUCKETS - 1 );
+	CHECK( Histogram::Bucket( ~0ULL ) == Histogram::NUM_BUCKETS - 1 );
+}
+
+//==================================================================================================
+TEST( histogram_percentiles )
+{
+	Histogram h;
+	CHECK( h.Count() == 0 && h.Max() == 0 && h.Percentile( 0.5 ) == 0 );
+
+	for( ULONGLONG v = 1; v <= 1000; v++ ) { h.Record( v ); }
+	CHECK( h.Count() == 1000 && h.Max() == 1000 );
+
+	/* The highest value of the percentile's bucket: at least the exact one, at most 1/16th more,
+	 * and never more than Max().
+	*/
+	double const    fractions[] = { 0.5, 0.9, 0.99, 0.999 };
+	ULONGLONG const exact[]     = { 500, 900, 990, 999 };
+	for( int i = 0; i < 4; i++ )
+	{
+		ULONGLONG p = h.Percentile( fractions[i] );
+		CHECK( p >= exact[i] && p <= exact[i] + exact[i] / 16 );
+	}
+	CHECK( h.Percentile( 0.0 ) == 1 );
+	CHECK( h.Percentile( 1.0 ) == 1000 );
+
+	/* A sample past what Max() holds.
+	*/
+	h.Record( 1ULL << 40 );
+	CHECK( h.Count() == 1001 && h.Max() == 0x7FFFFFFF && h.Percentile( 1.0 ) == 0x7FFFFFFF );
+}
+
+//==================================================================================================
+// Record THREAD_SAMPLES samples of 1..100 into the histogram.
+//==================================================================================================
+static DWORD WINAPI RecordThread( LPVOID lpvThreadParam )
+{
+	Histogram *pHistogram = (Histogram*)lpvThreadParam;
+	for( int i = 0; i < THREAD_SAMPLES; i++ ) { pHistogram->Record( 1 + i % 100 ); }
+	return 0;
+}
+
+//==================================================================================================
+TEST( histogram_threads )
+{
+	Histogram h;
+	HANDLE    hThreads[4];
+
+	for( int i = 0; i < 4; i++ ) { hThreads[i] = ::CreateThread( NULL, 0, RecordThread, &h, 0, NULL ); }
+	::WaitForMultipleObjects( 4, hThreads, TRUE, INFINITE );
+	for( int i = 0; i < 4; i++ ) { ::CloseHandle( hThreads[i] ); }
+
+	/* No sample lost, and the percentiles of 1..100 evenly.
+	*/
+	CHECK( h.Count() == 4 * THREAD_SAMPLES && h.Max() == 100 );
+	CHECK( h.Percentile( 0.5 ) >= 50 && h.Percentile( 0.5 ) <= 53 );
+	CHECK( h.Percentile( 1.0 ) == 100 );
+}
@@ -0,0 +1,158 @@
+/***********************************************************************************************//**
+\file    jsonutils_test.cpp
+\author  hdaniel
+\version $Id$
+
+\brief Tests of Source\Utils\jsonutils.h.
+
+\details
+
+jsonutils.h's scanner for bytes to escape, at every length and position across the 16 byte blocks
+the SSE2 version works in (compared with a byte at a time), its JSON string escaping, and its UTF-8
+repair, with the well-formed sequences at the edges of each length and the kinds of malformed ones
+it replaces.
+
+Where SSE2 is there (x86-64, or x86 with -msse2) the SSE2 scanner is tested; g++ -U__SSE2__ tests
+the byte at a time loop on its own.
+
+\license
+
+This file is free and unencumbered software released into the public domain.
+
+Anyone is free to copy, modify, publish, use, compile, sell, or distribute this software, either in
+source code form or as a compiled binary, for any purpose, commercial or non-commercial, and by any
+means.
+
+In jurisdictions that recognize copyright laws, the author or authors of this software dedicate any
+and all copyright interest in the software to the public domain. We make this dedication for the
+benefit of the public at large and to the detriment of our heirs and successors. We intend this
+dedication to be an overt act of relinquishment in perpetuity of all present and future rights to
+this software under copyright law.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT
+NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+For more information, please refer to <http://unlicense.org/>
+***************************************************************************************************/
+#include <cstring>
+#include <string>
+
+#include "../Source/Utils/jsonutils.h"
+#include "test.h"
+
+#define FFFD "\xEF\xBF\xBD"
+
+static bool NeedsEscape( unsigned char c ) { return c < 0x20 || c == '"' || c == '\\'; }
+
+/* append_escaped() of s, and append_utf8() of s, as strings.
+*/
+static std::string Escaped( std::string const &s )
+{
+	std::string out;
+	jsonutils::append_escaped( out, s );
+	return out;
+}
+
+static std::string Repaired( std::string const &s )
+{
+	std::string out;
+	jsonutils::append_utf8( out, s.data(), s.size() );
+	return out;
+}
+
+//==================================================================================================
+TEST( clean_prefix )
+{
+	char buf[48];
+
+	/* Every byte value, at every position of every length up to three blocks.
+	*/
+	for( int c = 0; c < 256; c++ )
+	{
+		for( size_t len = 1; len <= sizeof(buf); len += 7 )
+		{
+			for( size_t i = 0; i < len; i++ )
+			{
+				std::memset( buf, 'a', sizeof(buf) );
+				buf[i] = (char)c;
+				CHECK( jsonutils::clean_prefix( buf, len ) == (NeedsEscape( (unsigned char)c ) ? i : len) );
+			}
+		}
+	}
+	CHECK( jsonutils::clean_prefix( "", 0 ) == 0 );
+
+	/* The first of several.
+	*/
+	std::memset( buf, 'a', sizeof(buf) );
+	buf[20] = '\\';  buf[30] = '"';  buf[40] = '\n';
+	CHECK( jsonutils::clean_prefix( buf, sizeof(buf) ) == 20 );
+	CHECK( jsonutils::clean_prefix( buf + 21, sizeof(buf) - 21 ) == 9 );
+}
+
+//==================================================================================================
+TEST( append_escaped )
+{
+	CHECK( Escaped( "" ) == "" );
+	CHECK( Escaped( "plain text" ) == "plain text" );
+	CHECK( Escaped( "say \"hi\"\\" ) == "say \\\"hi\\\"\\\\" );
+	CHECK( Escaped( "a\tb\r\n\b\f" ) == "a\\tb\\r\\n\\b\\f" );
+	CHECK( Escaped( std::string( "\0\x01\x1F\x7F", 4 ) ) == "\\u0000\\u0001\\u001f\x7F" );
+	CHECK( Escaped( "\xC3\xA9\xFF" ) == "\xC3\xA9\xFF" );
+
+	/* Escapes after a clean block, and appending to what's there.
+	*/
+	std::string line( 40, 'x' );
+	line[17] = '"';
+	std::string out = "{";
+	jsonutils::append_escaped( out, line.data(), line.size() );
+	CHECK( out == "{" + line.substr( 0, 17 ) + "\\\"" + line.substr( 18 ) );
+}
+
+//==================================================================================================
+TEST( append_utf8_valid )
+{
+	/* The first and last code point of each length, and a line of them longer than a block.
+	*/
+	char const *valid[] =
+	{
+		"\x7F",
+		"\xC2\x80", "\xDF\xBF",
+		"\xE0\xA0\x80", "\xED\x9F\xBF", "\xEE\x80\x80", "\xEF\xBF\xBF",
+		"\xF0\x90\x80\x80", "\xF4\x8F\xBF\xBF"
+	};
+	std::string all;
+	for( size_t i = 0; i < sizeof(valid) / sizeof(valid[0]); i++ )
+	{
+		CHECK( Repaired( valid[i] ) == valid[i] );
+		all += valid[i];
+		all += "0123456789";
+	}
+	CHECK( Repaired( all ) == all );
+}
+
+//==================================================================================================
+TEST( append_utf8_malformed )
+{
+	/* Each byte that isn't part of a well-formed sequence is replaced on its own, and what follows
+	 * it is looked at again.
+	*/
+	CHECK( Repaired( "\x80" ) == FFFD );                          // stray continuation byte
+	CHECK( Repaired( "\xC0\x80" ) == FFFD FFFD );                 // overlong 2 byte form
+	CHECK( Repaired( "\xC1\xBF" ) == FFFD FFFD );
+	CHECK( Repaired( "\xE0\x9F\xBF" ) == FFFD FFFD FFFD );        // overlong 3 byte form
+	CHECK( Repaired( "\xF0\x8F\xBF\xBF" ) == FFFD FFFD FFFD FFFD ); // overlong 4 byte form
+	CHECK( Repaired( "\xED\xA0\x80" ) == FFFD FFFD FFFD );        // surrogate
+	CHECK( Repaired( "\xF4\x90\x80\x80" ) == FFFD FFFD FFFD FFFD ); // above U+10FFFF
+	CHECK( Repaired( "\xF5\xFE\xFF" ) == FFFD FFFD FFFD );        // never lead bytes
+	CHECK( Repaired( "\xE2\x28\xA1" ) == FFFD "(" FFFD );         // bad first continuation
+	CHECK( Repaired( "\xE2\x82\x28" ) == FFFD FFFD "(" );         // bad second continuation
+	CHECK( Repaired( "a\xE2\x82" ) == "a" FFFD FFFD );            // cut short by the end
+
+	/* A code page's text, after ASCII longer than a block.
+	*/
+	std::string cp1252 = std::string( 20, 'a' ) + "caf\xE9 \x80";
+	CHECK( Repaired( cp1252 ) == std::string( 20, 'a' ) + "caf" FFFD " " FFFD );
+}
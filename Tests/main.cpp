@@ -0,0 +1,59 @@
+/***********************************************************************************************//**
+\file    main.cpp
+\author  hdaniel
+\version $Id$
+
+\brief Runs the tests of Tests\ (see test.h).
+
+\details
+
+Runs the tests linked in, all of them or those whose name contains the argument, and returns the
+number that failed.
+
+\license
+
+This file is free and unencumbered software released into the public domain.
+
+Anyone is free to copy, modify, publish, use, compile, sell, or distribute this software, either in
+source code form or as a compiled binary, for any purpose, commercial or non-commercial, and by any
+means.
+
+In jurisdictions that recognize copyright laws, the author or authors of this software dedicate any
+and all copyright interest in the software to the public domain. We make this dedication for the
+benefit of the public at large and to the detriment of our heirs and successors. We intend this
+dedication to be an overt act of relinquishment in perpetuity of all present and future rights to
+this software under copyright law.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT
+NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+For more information, please refer to <http://unlicense.org/>
+***************************************************************************************************/
+#include <cstring>
+
+#include "test.h"
+
+//==================================================================================================
+int main( int argc, char *argv[] )
+{
+	int nRun = 0, nFailed = 0;
+
+	for( test::STest *pTest = test::FirstTest(); pTest; pTest = pTest->pNext )
+	{
+		if( argc > 1 && !std::strstr( pTest->name, argv[1] ) ) { continue; }
+
+		int nFailures = test::Failures();
+		pTest->pfnTest();
+		nRun++;
+
+		bool fFailed = test::Failures() != nFailures;
+		if( fFailed ) { nFailed++; }
+		std::printf( "%s %s\n", fFailed ? "[FAILED]" : "[ok]    ", pTest->name );
+	}
+
+	std::printf( "%d of %d tests failed\n", nFailed, nRun );
+	return nFailed;
+}
@@ -0,0 +1,308 @@
+/***********************************************************************************************//**
+\file    relay_bench.cpp
+\author  hdaniel
+\version $Id$
+
+\brief Measurements of the relay (Source\Relay.cpp).
+
+\details
+
+Measurements of CRelay, run in process on a child that's crbench itself: "crbench <name> --child
+..." writes the output the measurement asks for and exits.
+
+relay_io relays RELAY_MB MB of lines, written RELAY_WRITE_SIZE bytes at a time, with each of the
+--io-engine engines, threads and iocp, and counts the i/o operations it took per MB with
+GetProcessIoCounters(): reads, and the other operations, which include pipe peeks. With them are
+the relay's own calls per MB (CRelay::GetIoStats()), and the MB/s. Neither engine peeks, the
+readers stop on EOF, so the other operations are a handful for the whole run and not one per read;
+the measurement fails when there's one per MB or more.
+
+relay_order has the child write numbered lines to stdout and stderr in short bursts, one
+WriteFile() per line, and counts the lines the sink gets after a line with a higher number,
+without and with SRelayOptions::fOrdered. It fails only when lines are lost; how many come out of
+order depends on the machine, the point is the difference --ordered makes.
+
+\license
+
+This file is free and unencumbered software released into the public domain.
+
+Anyone is free to copy, modify, publish, use, compile, sell, or distribute this software, either in
+source code form or as a compiled binary, for any purpose, commercial or non-commercial, and by any
+means.
+
+In jurisdictions that recognize copyright laws, the author or authors of this software dedicate any
+and all copyright interest in the software to the public domain. We make this dedication for the
+benefit of the public at large and to the detriment of our heirs and successors. We intend this
+dedication to be an overt act of relinquishment in perpetuity of all present and future rights to
+this software under copyright law.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT
+NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+For more information, please refer to <http://unlicense.org/>
+***************************************************************************************************/
+#include <cstdlib>
+#include <cstring>
+#include <string>
+
+#include "../Source/Relay.h"
+#include "../Source/Utils/utils.h"
+#include "bench.h"
+
+#define RELAY_MB          64     // MB of output relayed
+#define RELAY_LINE        80     // bytes per line, '\n' included
+#define RELAY_WRITE_SIZE  65536  // bytes per WriteFile() of the child
+#define ORDER_LINES       200000 // numbered lines written to stdout and stderr
+
+//==================================================================================================
+// Counts what the relay delivers, and drops it.
+//==================================================================================================
+class CCountingSink : public IRelaySink
+{
+public:
+	CCountingSink()
+	{
+		::ZeroMemory( m_ullBytes, sizeof(m_ullBytes) );
+		::ZeroMemory( m_ullWrites, sizeof(m_ullWrites) );
+	}
+
+	virtual DWORD Write( EIoThreadType eStream, BYTE *pData, DWORD nBytes )
+	{
+		m_ullBytes[eStream] += nBytes;
+		m_ullWrites[eStream]++;
+		return 0;
+	}
+
+	ULONGLONG Bytes() const  { return m_ullBytes[StdOutRead] + m_ullBytes[StdErrRead]; }
+	ULONGLONG Writes() const { return m_ullWrites[StdOutRead] + m_ullWrites[StdErrRead]; }
+
+private:
+	ULONGLONG m_ullBytes[2];  // indexed by StdOutRead/StdErrRead
+	ULONGLONG m_ullWrites[2];
+};
+
+//==================================================================================================
+// The child: write ullBytes of lines to stdout, dwWriteSize bytes at a time.
+//==================================================================================================
+static bool WriteLines( ULONGLONG ullBytes, DWORD dwWriteSize )
+{
+	HANDLE      hOut = ::GetStdHandle( STD_OUTPUT_HANDLE );
+	std::string line( RELAY_LINE - 1, 'x' );
+	std::string block;
+
+	line += '\n';
+	while( block.size() < dwWriteSize ) { block += line; }
+
+	for( ULONGLONG ullWritten = 0; ullWritten < ullBytes; )
+	{
+		DWORD dwWritten;
+		DWORD n = (ullBytes - ullWritten < dwWriteSize) ? (DWORD)(ullBytes - ullWritten) : dwWriteSize;
+		if( !::WriteFile( hOut, block.data(), n, &dwWritten, NULL ) ) { return false; }
+		ullWritten += dwWritten;
+	}
+	return true;
+}
+
+//==================================================================================================
+// Checks the order of numbered lines ("%u\n"), as it's given them from both streams.
+//==================================================================================================
+class COrderSink : public IRelaySink
+{
+public:
+	COrderSink() : m_nLines(0), m_nOutOfOrder(0), m_last(0) { }
+
+	virtual DWORD Write( EIoThreadType eStream, BYTE *pData, DWORD nBytes )
+	{
+		utils::MutexLock lock( m_mutex );
+
+		std::string &partial = m_partial[eStream];
+		for( DWORD i = 0; i < nBytes; i++ )
+		{
+			if( pData[i] != '\n' )
+			{
+				partial += (char)pData[i];
+				continue;
+			}
+
+			unsigned long n = std::strtoul( partial.c_str(), NULL, 10 );
+			if( m_nLines && n < m_last ) { m_nOutOfOrder++; }
+			if( n > m_last )             { m_last = n; }
+			m_nLines++;
+			partial.clear();
+		}
+		return 0;
+	}
+
+	unsigned long Lines() const      { return m_nLines; }
+	unsigned long OutOfOrder() const { return m_nOutOfOrder; }
+
+private:
+	utils::Mutex  m_mutex;        // without fOrdered the streams are delivered from two threads
+	std::string   m_partial[2];   // indexed by StdOutRead/StdErrRead
+	unsigned long m_nLines;
+	unsigned long m_nOutOfOrder;  // lines after a line with a higher number
+	unsigned long m_last;         // highest number so far
+};
+
+//==================================================================================================
+// The child: write nLines numbered lines, switching between stdout and stderr after bursts of 1 to
+// 8 lines.
+//==================================================================================================
+static bool WriteNumberedLines( unsigned long nLines )
+{
+	HANDLE        hOut[2] = { ::GetStdHandle( STD_OUTPUT_HANDLE ), ::GetStdHandle( STD_ERROR_HANDLE ) };
+	int           iStream = 0, nBurst = 1;
+	unsigned long seed    = 1;
+
+	for( unsigned long i = 0; i < nLines; i++ )
+	{
+		if( --nBurst == 0 )
+		{
+			seed    = seed * 1103515245 + 12345;
+			nBurst  = 1 + (int)((seed >> 16) % 8);
+			iStream = !iStream;
+		}
+
+		char  line[16];
+		DWORD dwWritten, n = (DWORD)utils::strnfmt( line, sizeof(line), "%lu\n", i );
+		if( !::WriteFile( hOut[iStream], line, n, &dwWritten, NULL ) ) { return false; }
+	}
+	return true;
+}
+
+//==================================================================================================
+// What relaying the child's output took.
+//==================================================================================================
+struct SRelayRun
+{
+	double    seconds;
+	ULONGLONG ullBytes;         // delivered to the sink
+	ULONGLONG ullWrites;        // sink Write()s
+	ULONGLONG ullReads;         // our process' read operations
+	ULONGLONG ullOther;         // and other i/o operations
+	ULONGLONG ullRelayCalls;    // reads and waits the relay counted itself
+};
+
+//==================================================================================================
+// Relay "crbench <childArgs>" to pSink (a CCountingSink when NULL) with the given engine. Throws an
+// exit_exception when the relay fails.
+//==================================================================================================
+static void RunRelay( EIoEngine eEngine, char const *childArgs, SRelayRun &run,
+                      IRelaySink *pSink =NULL, bool fOrdered =false )
+{
+	char self[MAX_PATH];
+	::GetModuleFileNameA( NULL, self, MAX_PATH );
+	std::wstring cmdLine = utils::str2wstr( utils::strfmt( "\"%s\" %s", self, childArgs ) );
+
+	CCountingSink sink;
+	CRelay        relay;
+	relay.Options().fForwardStdIn = false;
+	relay.Options().eIoEngine     = eEngine;
+	relay.Options().fOrdered      = fOrdered;
+	relay.SetSink( pSink ? pSink : &sink );
+
+	IO_COUNTERS before, after;
+	::GetProcessIoCounters( ::GetCurrentProcess(), &before );
+	bench::Timer timer;
+
+	relay.Run( &cmdLine[0] );
+	relay.Wait();
+
+	run.seconds = timer.Seconds();
+	::GetProcessIoCounters( ::GetCurrentProcess(), &after );
+
+	SRelayIoStats ioStats;
+	relay.GetIoStats( ioStats );
+
+	run.ullBytes      = sink.Bytes();
+	run.ullWrites     = sink.Writes();
+	run.ullReads      = after.ReadOperationCount - before.ReadOperationCount;
+	run.ullOther      = after.OtherOperationCount - before.OtherOperationCount;
+	run.ullRelayCalls = ioStats.ullCalls;
+}
+
+//==================================================================================================
+static void ReportRun( char const *what, SRelayRun const &run )
+{
+	double mb = (double)run.ullBytes / (1024 * 1024);
+
+	std::printf( "  %-8s %6.0f MB/s, per MB: %7.1f reads %6.2f other i/o %7.1f relay calls %7.1f chunks\n",
+	             what, mb / run.seconds, run.ullReads / mb, run.ullOther / mb, run.ullRelayCalls / mb,
+	             run.ullWrites / mb );
+}
+
+//==================================================================================================
+// relay_io [MB]
+//==================================================================================================
+BENCH( relay_io )
+{
+	if( argc >= 3 && !std::strcmp( argv[0], "--child" ) )
+	{
+		return WriteLines( _strtoui64( argv[1], NULL, 10 ), (DWORD)std::strtoul( argv[2], NULL, 10 ) );
+	}
+
+	ULONGLONG   ullBytes  = (ULONGLONG)((argc >= 1) ? std::strtoul( argv[0], NULL, 10 ) : RELAY_MB) << 20;
+	std::string childArgs = utils::strfmt( "relay_io --child %llu %u", ullBytes, RELAY_WRITE_SIZE );
+
+	static EIoEngine const engines[]     = { IoEngineThreads, IoEngineIocp };
+	static char const     *engineNames[] = { "threads", "iocp" };
+
+	bool fOk = true;
+	try
+	{
+		for( int i = 0; i < 2; i++ )
+		{
+			SRelayRun run;
+			RunRelay( engines[i], childArgs.c_str(), run );
+			ReportRun( engineNames[i], run );
+
+			double mb = (double)run.ullBytes / (1024 * 1024);
+			fOk = fOk && run.ullBytes == ullBytes && run.ullOther < mb;
+		}
+	}
+	catch( exit_exception &except )
+	{
+		std::printf( "  %s\n", except.what() );
+		return false;
+	}
+	return fOk;
+}
+
+//==================================================================================================
+// relay_order [lines]
+//==================================================================================================
+BENCH( relay_order )
+{
+	if( argc >= 2 && !std::strcmp( argv[0], "--child" ) )
+	{
+		return WriteNumberedLines( std::strtoul( argv[1], NULL, 10 ) );
+	}
+
+	unsigned long nLines    = (argc >= 1) ? std::strtoul( argv[0], NULL, 10 ) : ORDER_LINES;
+	std::string   childArgs = utils::strfmt( "relay_order --child %lu", nLines );
+	bool          fOk       = true;
+
+	try
+	{
+		for( int ordered = 0; ordered <= 1; ordered++ )
+		{
+			COrderSink sink;
+			SRelayRun  run;
+			RunRelay( IoEngineThreads, childArgs.c_str(), run, &sink, ordered != 0 );
+
+			std::printf( "  %-10s %lu of %lu lines out of order (%.3f%%), %.0f lines/s\n",
+			             ordered ? "--ordered" : "unordered", sink.OutOfOrder(), sink.Lines(),
+			             100.0 * sink.OutOfOrder() / (sink.Lines() ? sink.Lines() : 1), sink.Lines() / run.seconds );
+			if( sink.Lines() != nLines ) { fOk = false; }
+		}
+	}
+	catch( exit_exception &except )
+	{
+		std::printf( "  %s\n", except.what() );
+		return false;
+	}
+	return fOk;
+}
@@ -0,0 +1,286 @@
+/***********************************************************************************************//**
+\file    render_bench.cpp
+\author  hdaniel
+\version $Id$
+
+\brief Benchmarks of the console sink's rendering (Source\ConsoleSink.cpp).
+
+\details
+
+CConsoleSink's render step, PutOutputT() instantiated for the options, against the loop it
+replaced, which looked at the options for every line and colored the output whether it was a
+console or not. Both render the same lines of build output, in RENDER_CHUNK byte chunks cut where
+a pipe read would cut them, to NUL and, when crbench has a console, to a screen buffer of its own
+that's never shown. The time is per line rendered.
+
+With -l -s the old loop and PutOutputT() make the same console calls, so the difference on the
+console is the per line checks and the clear_eol() the old loop made twice for the last line. On
+NUL PutOutputT() makes no console calls at all. The rules case adds three --rule patterns, which
+only color on a console.
+
+\license
+
+This file is free and unencumbered software released into the public domain.
+
+Anyone is free to copy, modify, publish, use, compile, sell, or distribute this software, either in
+source code form or as a compiled binary, for any purpose, commercial or non-commercial, and by any
+means.
+
+In jurisdictions that recognize copyright laws, the author or authors of this software dedicate any
+and all copyright interest in the software to the public domain. We make this dedication for the
+benefit of the public at large and to the detriment of our heirs and successors. We intend this
+dedication to be an overt act of relinquishment in perpetuity of all present and future rights to
+this software under copyright law.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT
+NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+For more information, please refer to <http://unlicense.org/>
+***************************************************************************************************/
+#include <cstdlib>
+#include <string>
+#include <vector>
+
+#include <windows.h>
+
+#include "../Source/ConsoleSink.h"
+#include "../Source/RuleClassifier.h"
+#include "../Source/Utils/conutils.h"
+#include "../Source/Utils/utils.h"
+#include "bench.h"
+
+#define RENDER_MB          16    // rendered to NUL
+#define RENDER_CONSOLE_KB  1024  // rendered to the screen buffer, consoles are slow
+#define RENDER_CHUNK       4096  // bytes per chunk, what a pipe read returns
+
+typedef std::vector< std::vector<BYTE> > Chunks;
+
+namespace old
+{
+
+/* The render loop of ReadAndPutOutputThread() as it was before CConsoleSink::PutOutputT(), with
+ * the options it read from globals passed in.
+*/
+static char* lineTok( char** begin )
+{
+    if( !begin || !*begin || !**begin ) { return 0; }
+
+    char* p   = *begin;
+
+    /* skip leading newline, adjust begin if \r\r\n is encountered */
+    if( p[0] == '\r' )
+    {
+        if( p[1] == '\r' && p[2] == '\n' ) { p+=3; (*begin)++; }
+        else if( p[1] == '\n' )            { p+=2; }
+        else                               { p++; }
+    }
+
+    /* find trailing newline */
+    while( *p )
+    {
+        if( p[0] == '\r' )
+		{
+			if( p[1] == '\n' || p[1] == '\r' && p[2] == '\n' ) { break; }
+		}
+        p++;
+    }
+
+    return p;
+}
+
+struct SOptions
+{
+	HANDLE                  hStdWrite;
+	conutils::_tag_console *pConsole;
+	WORD                    outputAttr;
+	WORD                    defaultAttr;
+	bool                    fLineMode;
+	bool                    fSkipLastEol;
+	utils::Mutex            mutex;
+};
+
+static DWORD PutOutput( SOptions &o, BYTE *lpBuffer )
+{
+	DWORD nBytesWritten;
+	WORD  lineAttr = o.fLineMode ? o.outputAttr : o.defaultAttr;
+
+	o.mutex.Enter();
+	o.pConsole->set_attribute( o.outputAttr );
+
+	BYTE *begin = &lpBuffer[0];
+	BYTE *end = (BYTE*)lineTok( (char**)&begin );
+
+	while( end != NULL )
+	{
+		if( !::WriteFile( o.hStdWrite, begin, (DWORD)(end - begin), &nBytesWritten, NULL ) )
+		{
+			o.mutex.Leave();
+			return ::GetLastError();
+		}
+		begin = end;
+		end = (BYTE*)lineTok( (char**)&begin );
+
+		o.pConsole->clear_eol( lineAttr );
+
+		if( end == NULL )
+		{
+			if( nBytesWritten == 2 && o.fSkipLastEol )
+				{ o.pConsole->clear_eol( o.defaultAttr ); }
+			else
+				{ o.pConsole->clear_eol( lineAttr ); }
+		}
+	}
+
+	o.pConsole->set_attribute( o.defaultAttr );
+	o.mutex.Leave();
+	return 0;
+}
+
+} // namespace old
+
+//==================================================================================================
+// nBytes or a little more of build output lines, cut into nul terminated RENDER_CHUNK byte chunks.
+//==================================================================================================
+static void MakeChunks( size_t nBytes, Chunks &chunks, unsigned long &nLines )
+{
+	std::string text;
+	for( nLines = 0; text.size() < nBytes; nLines++ )
+	{
+		text += utils::strfmt( "%6lu>c:\\src\\module%lu.cpp(%lu): warning C4996: 'strcpy' was declared "
+		                       "deprecated\r\n", nLines, nLines % 97, nLines % 1000 );
+	}
+
+	chunks.clear();
+	for( size_t pos = 0; pos < text.size(); pos += RENDER_CHUNK )
+	{
+		size_t len = (text.size() - pos < RENDER_CHUNK) ? text.size() - pos : RENDER_CHUNK;
+		chunks.push_back( std::vector<BYTE>( text.begin() + pos, text.begin() + pos + len ) );
+		chunks.back().push_back( 0 );
+	}
+}
+
+//==================================================================================================
+// Render the chunks with the old loop, the best of BENCH_RUNS runs.
+//==================================================================================================
+static bool TimeOld( char const *what, HANDLE hOutput, WORD defaultAttr, bool fLineMode,
+                     bool fSkipLastEol, Chunks &chunks, unsigned long nLines )
+{
+	conutils::_tag_console console( hOutput );
+	old::SOptions          o;
+	double                 best = 1e9;
+
+	o.hStdWrite    = hOutput;
+	o.pConsole     = &console;
+	o.outputAttr   = FOREGROUND_GREEN | FOREGROUND_INTENSITY;
+	o.defaultAttr  = defaultAttr;
+	o.fLineMode    = fLineMode;
+	o.fSkipLastEol = fSkipLastEol;
+
+	for( int run = 0; run < BENCH_RUNS; run++ )
+	{
+		bench::Timer timer;
+		for( size_t i = 0; i < chunks.size(); i++ )
+		{
+			if( old::PutOutput( o, &chunks[i][0] ) ) { return false; }
+		}
+		double seconds = timer.Seconds();
+		if( seconds < best ) { best = seconds; }
+	}
+	bench::Report( what, best, nLines );
+	return true;
+}
+
+//==================================================================================================
+// Render the chunks through a CConsoleSink, the best of BENCH_RUNS runs.
+//==================================================================================================
+static bool TimeSink( char const *what, HANDLE hOutput, WORD defaultAttr, bool fLineMode, bool fSkipLastEol,
+                      bool fRules, Chunks &chunks, unsigned long nLines )
+{
+	CRuleClassifier classifier;
+	double          best = 1e9;
+
+	if( fRules )
+	{
+		colorutils::text_attr attr = colorutils::from_legacy( FOREGROUND_RED | FOREGROUND_INTENSITY );
+		classifier.AddRule( "warning", attr );
+		classifier.AddRule( "C4996", attr );
+		classifier.AddRule( "deprecated", attr );
+	}
+	classifier.Start();
+
+	CConsoleSink sink( defaultAttr, classifier );
+	sink.Options().stdoutAttr   = FOREGROUND_GREEN | FOREGROUND_INTENSITY;
+	sink.Options().fLineMode    = fLineMode;
+	sink.Options().fSkipLastEol = fSkipLastEol;
+	sink.Start( hOutput );
+
+	bool fOk = true;
+	for( int run = 0; run < BENCH_RUNS && fOk; run++ )
+	{
+		bench::Timer timer;
+		for( size_t i = 0; i < chunks.size() && fOk; i++ )
+		{
+			fOk = !sink.Write( StdOutRead, &chunks[i][0], (DWORD)(chunks[i].size() - 1) );
+		}
+		double seconds = timer.Seconds();
+		if( seconds < best ) { best = seconds; }
+	}
+	classifier.Stop();
+
+	if( fOk ) { bench::Report( what, best, nLines ); }
+	return fOk;
+}
+
+//==================================================================================================
+// Every case on one output.
+//==================================================================================================
+static bool TimeCases( HANDLE hOutput, WORD defaultAttr, size_t nBytes )
+{
+	Chunks        chunks;
+	unsigned long nLines;
+	MakeChunks( nBytes, chunks, nLines );
+
+	return TimeOld(  "old loop",               hOutput, defaultAttr, false, false, chunks, nLines )
+	    && TimeSink( "PutOutputT",             hOutput, defaultAttr, false, false, false, chunks, nLines )
+	    && TimeOld(  "old loop -l -s",         hOutput, defaultAttr, true, true, chunks, nLines )
+	    && TimeSink( "PutOutputT -l -s",       hOutput, defaultAttr, true, true, false, chunks, nLines )
+	    && TimeSink( "PutOutputT -l -s rules", hOutput, defaultAttr, true, true, true, chunks, nLines );
+}
+
+//==================================================================================================
+// render [MB [console kB]]
+//==================================================================================================
+BENCH( render )
+{
+	size_t nBytes        = ((argc >= 1) ? std::strtoul( argv[0], NULL, 10 ) : RENDER_MB) << 20;
+	size_t nConsoleBytes = ((argc >= 2) ? std::strtoul( argv[1], NULL, 10 ) : RENDER_CONSOLE_KB) << 10;
+	bool   fOk;
+
+	HANDLE hNul = ::CreateFileA( "NUL", GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_WRITE, NULL,
+	                             OPEN_EXISTING, 0, NULL );
+	if( hNul == INVALID_HANDLE_VALUE ) { return false; }
+
+	std::printf( "  to NUL, ns per line:\n" );
+	fOk = TimeCases( hNul, FOREGROUND_RED | FOREGROUND_GREEN | FOREGROUND_BLUE, nBytes );
+	::CloseHandle( hNul );
+
+	HANDLE hBuffer = ::CreateConsoleScreenBuffer( GENERIC_READ | GENERIC_WRITE,
+	                                              FILE_SHARE_READ | FILE_SHARE_WRITE, NULL,
+	                                              CONSOLE_TEXTMODE_BUFFER, NULL );
+	if( hBuffer == INVALID_HANDLE_VALUE )
+	{
+		std::printf( "  no console, not rendering to one\n" );
+		return fOk;
+	}
+
+	CONSOLE_SCREEN_BUFFER_INFO csbi;
+	::GetConsoleScreenBufferInfo( hBuffer, &csbi );
+
+	std::printf( "  to a console, ns per line:\n" );
+	fOk = TimeCases( hBuffer, csbi.wAttributes, nConsoleBytes ) && fOk;
+	::CloseHandle( hBuffer );
+	return fOk;
+}
@@ -0,0 +1,348 @@
+/***********************************************************************************************//**
+\file    ruleutils_test.cpp
+\author  hdaniel
+\version $Id$
+
+\brief Tests of Source\Utils\ruleutils.h.
+
+\details
+
+ruleutils.h's matcher, checked against a brute force leftmost-longest search on generated text,
+for whole lines, for lines collected in segments and for lines that arrive in pieces; its span_cache
+(hits, misses and least recently used replacement) and hash64().
+
+\license
+
+This file is free and unencumbered software released into the public domain.
+
+Anyone is free to copy, modify, publish, use, compile, sell, or distribute this software, either in
+source code form or as a compiled binary, for any purpose, commercial or non-commercial, and by any
+means.
+
+In jurisdictions that recognize copyright laws, the author or authors of this software dedicate any
+and all copyright interest in the software to the public domain. We make this dedication for the
+benefit of the public at large and to the detriment of our heirs and successors. We intend this
+dedication to be an overt act of relinquishment in perpetuity of all present and future rights to
+this software under copyright law.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT
+NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+For more information, please refer to <http://unlicense.org/>
+***************************************************************************************************/
+#include <algorithm>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include "../Source/Utils/ruleutils.h"
+#include "test.h"
+
+using ruleutils::span;
+using ruleutils::spans;
+
+/* Compile a matcher from "|" separated patterns, rule i gets attribute i+1.
+*/
+static void Compile( ruleutils::matcher &m, char const *patterns )
+{
+	std::string all( patterns );
+	size_t      rule = 0, pos = 0;
+
+	for( ;; )
+	{
+		size_t bar = all.find( '|', pos );
+		m.add( all.substr( pos, bar - pos ), (unsigned short)(++rule) );
+		if( bar == std::string::npos ) { break; }
+		pos = bar + 1;
+	}
+	m.compile();
+}
+
+/* The spans match() should give: at each position the longest pattern starting there (the earlier
+ * rule of equally long ones), continuing after its end.
+*/
+static spans BruteForce( ruleutils::matcher const &m, size_t nRules, std::string const &text )
+{
+	spans out;
+	for( size_t i = 0; i < text.size(); )
+	{
+		span best = { i, 0, 0, 0 };
+		for( size_t rule = 0; rule < nRules; rule++ )
+		{
+			std::string const &pat = m.pattern( rule );
+			if( pat.size() > best.len && text.compare( i, pat.size(), pat ) == 0 )
+			{
+				best.len  = pat.size();
+				best.attr = (unsigned short)(rule + 1);
+				best.rule = (unsigned short)rule;
+			}
+		}
+		if( !best.len ) { i++; continue; }
+		out.push_back( best );
+		i += best.len;
+	}
+	return out;
+}
+
+static bool Same( spans const &a, spans const &b )
+{
+	if( a.size() != b.size() ) { return false; }
+	for( size_t i = 0; i < a.size(); i++ )
+	{
+		if( a[i].begin != b[i].begin || a[i].len != b[i].len || a[i].attr != b[i].attr ) { return false; }
+	}
+	return true;
+}
+
+/* Text over a small alphabet, so the patterns below overlap a lot.
+*/
+static std::string Generate( size_t len, unsigned long seed )
+{
+	std::string text( len, ' ' );
+	for( size_t i = 0; i < len; i++ )
+	{
+		seed    = seed * 1103515245 + 12345;
+		text[i] = "abc "[(seed >> 16) % 4];
+	}
+	return text;
+}
+
+static char const g_patterns[] = "ab|abc|bca|c|cab|abcab|b a|aaa|ba";
+static size_t const g_nRules   = 9;
+
+//==================================================================================================
+TEST( hash64 )
+{
+	char buf[32] = "the quick brown fox jumps over";
+
+	/* Every length, from an unaligned address: equal bytes hash equal, one flipped bit doesn't,
+	 * and neither does the same bytes with a different length.
+	*/
+	for( size_t len = 1; len < 24; len++ )
+	{
+		unsigned long long h = ruleutils::hash64( buf + 1, len );
+		CHECK( h == ruleutils::hash64( std::string( buf + 1, len ).c_str(), len ) );
+		CHECK( h != ruleutils::hash64( buf + 1, len - 1 ) );
+
+		buf[len] ^= 1;
+		CHECK( h != ruleutils::hash64( buf + 1, len ) );
+		buf[len] ^= 1;
+	}
+	CHECK( ruleutils::hash64( "\0", 1 ) != ruleutils::hash64( "\0\0", 2 ) );
+}
+
+//==================================================================================================
+TEST( match_rules )
+{
+	ruleutils::matcher m;
+	spans              sp;
+
+	/* Leftmost-longest, overlapped matches dropped, empty patterns ignored, the first of two equal
+	 * patterns wins, and bytes above 0x7F are just bytes.
+	*/
+	m.add( "err", 1 );
+	m.add( "error", 2 );
+	m.add( "or", 3 );
+	m.add( "", 4 );
+	m.add( "warn", 5 );
+	m.add( "warn", 6 );
+	m.add( "\xC3\xA9t\xC3\xA9", 7 );
+	m.compile();
+	CHECK( m.max_pattern_length() == 5 );
+
+	m.match( "an error or warning \xC3\xA9t\xC3\xA9", 25, sp );
+	CHECK( sp.size() == 4 );
+	CHECK( sp[0].begin == 3 && sp[0].len == 5 && sp[0].attr == 2 );
+	CHECK( sp[1].begin == 9 && sp[1].len == 2 && sp[1].attr == 3 );
+	CHECK( sp[2].begin == 12 && sp[2].len == 4 && sp[2].attr == 5 && sp[2].rule == 3 );
+	CHECK( sp[3].begin == 20 && sp[3].len == 5 && sp[3].attr == 7 );
+
+	/* match() appends, and finds nothing in text without patterns or in empty text.
+	*/
+	m.match( "nothing here", 12, sp );
+	m.match( "", 0, sp );
+	CHECK( sp.size() == 4 );
+
+	ruleutils::matcher none;
+	none.compile();
+	none.match( "abc", 3, sp );
+	CHECK( none.empty() && sp.size() == 4 );
+}
+
+//==================================================================================================
+TEST( match_brute_force )
+{
+	ruleutils::matcher m;
+	Compile( m, g_patterns );
+
+	for( unsigned long seed = 1; seed <= 200; seed++ )
+	{
+		std::string text = Generate( seed, seed );
+		spans       sp;
+
+		m.match( text.data(), text.size(), sp );
+		CHECK( Same( sp, BruteForce( m, g_nRules, text ) ) );
+	}
+}
+
+//==================================================================================================
+TEST( match_segments )
+{
+	ruleutils::matcher m;
+	Compile( m, g_patterns );
+
+	std::string text = Generate( 500, 7 );
+	spans       whole;
+	m.match( text.data(), text.size(), whole );
+
+	/* Segments of any size, collected one after the other, resolve to what match() gives.
+	*/
+	for( size_t segment = 1; segment <= 40; segment++ )
+	{
+		spans raw;
+		for( size_t from = 0; from < text.size(); from += segment )
+		{
+			m.collect( text.data(), from, std::min( from + segment, text.size() ), raw );
+		}
+		m.resolve( raw, 0 );
+		CHECK( Same( raw, whole ) );
+	}
+}
+
+//==================================================================================================
+TEST( match_stream )
+{
+	ruleutils::matcher m;
+	Compile( m, g_patterns );
+
+	/* In one piece it's match().
+	*/
+	std::string                      text = Generate( 300, 11 );
+	ruleutils::matcher::stream_state st;
+	spans                            whole, streamed;
+
+	m.match( text.data(), text.size(), whole );
+	m.match_stream( st, text.data(), text.size(), streamed );
+	CHECK( Same( streamed, whole ) );
+
+	/* In pieces of any size, the spans never overlap and stay within their piece.
+	*/
+	for( size_t piece = 1; piece <= 9; piece++ )
+	{
+		size_t end = 0;
+
+		st.reset();
+		for( size_t pos = 0; pos < text.size(); pos += piece )
+		{
+			size_t len = std::min( piece, text.size() - pos );
+			spans  sp;
+
+			m.match_stream( st, text.data() + pos, len, sp );
+			for( size_t i = 0; i < sp.size(); i++ )
+			{
+				CHECK( sp[i].len > 0 && sp[i].begin + sp[i].len <= len && pos + sp[i].begin >= end );
+				end = pos + sp[i].begin + sp[i].len;
+			}
+		}
+	}
+
+	/* With patterns that don't overlap each other, they are match()'s spans, each cut at the start
+	 * of the piece it ends in (what came before has been written already).
+	*/
+	ruleutils::matcher words;
+	std::string        wordText;
+	Compile( words, "error|warn|fatal" );
+	for( size_t i = 0; i < 20; i++ ) { wordText += (i % 3) ? "fatal warnerror " : "x errorwarn "; }
+
+	whole.clear();
+	words.match( wordText.data(), wordText.size(), whole );
+	for( size_t piece = 1; piece <= 9; piece++ )
+	{
+		std::string expected( wordText.size(), '-' ), colored( wordText.size(), '-' );
+		for( size_t i = 0; i < whole.size(); i++ )
+		{
+			size_t end   = whole[i].begin + whole[i].len;
+			size_t begin = std::max( whole[i].begin, (end - 1) / piece * piece );
+			expected.replace( begin, end - begin, end - begin, (char)('0' + whole[i].attr) );
+		}
+
+		st.reset();
+		for( size_t pos = 0; pos < wordText.size(); pos += piece )
+		{
+			spans sp;
+			words.match_stream( st, wordText.data() + pos, std::min( piece, wordText.size() - pos ), sp );
+			for( size_t i = 0; i < sp.size(); i++ )
+			{
+				colored.replace( pos + sp[i].begin, sp[i].len, sp[i].len, (char)('0' + sp[i].attr) );
+			}
+		}
+		CHECK( colored == expected );
+	}
+
+	/* A match across pieces is cut at the piece's start, and a span handed out stays even when a
+	 * longer match turns up in the next piece.
+	*/
+	ruleutils::matcher m2;
+	spans              sp;
+	Compile( m2, "error|ab|abcd" );
+
+	st.reset();
+	m2.match_stream( st, "an er", 5, sp );
+	CHECK( sp.empty() );
+	m2.match_stream( st, "ror", 3, sp );
+	CHECK( sp.size() == 1 && sp[0].begin == 0 && sp[0].len == 3 && sp[0].attr == 1 );
+
+	sp.clear();
+	st.reset();
+	m2.match_stream( st, "ab", 2, sp );
+	m2.match_stream( st, "cd", 2, sp );
+	CHECK( sp.size() == 2 );
+	CHECK( sp[0].begin == 0 && sp[0].len == 2 && sp[0].attr == 2 );
+	CHECK( sp[1].begin == 0 && sp[1].len == 2 && sp[1].attr == 3 );
+}
+
+//==================================================================================================
+TEST( span_cache )
+{
+	/* Four entries are two sets of two, hashes 0, 2 and 4 all go to the first set.
+	*/
+	ruleutils::span_cache cache( 4 );
+
+	CHECK( cache.find( 0, 10 ) == NULL );
+	span sp = { 1, 2, 3, 4 };
+	cache.insert( 0, 10 ).push_back( sp );
+	cache.insert( 2, 10 );
+
+	CHECK( cache.find( 0, 10 ) != NULL && cache.find( 0, 10 )->size() == 1 );
+	CHECK( cache.find( 0, 11 ) == NULL );
+
+	/* 0 was used last, so 4 replaces 2. 1 goes to the other set and replaces nothing.
+	*/
+	cache.insert( 4, 10 );
+	cache.insert( 1, 10 );
+	CHECK( cache.find( 0, 10 ) != NULL && cache.find( 0, 10 )->at( 0 ).attr == 3 );
+	CHECK( cache.find( 2, 10 ) == NULL );
+	CHECK( cache.find( 4, 10 ) != NULL && cache.find( 4, 10 )->empty() );
+	CHECK( cache.find( 1, 10 ) != NULL );
+
+	CHECK( cache.lookups() == 10 && cache.hits() == 7 );
+}
+
+//==================================================================================================
+TEST( classify )
+{
+	ruleutils::matcher    m;
+	ruleutils::span_cache cache;
+	Compile( m, g_patterns );
+
+	std::string  text  = Generate( 100, 3 );
+	spans const &first = ruleutils::classify( m, cache, text.data(), text.size() );
+	CHECK( Same( first, BruteForce( m, g_nRules, text ) ) );
+	CHECK( cache.lookups() == 1 && cache.hits() == 0 );
+
+	spans const &again = ruleutils::classify( m, cache, text.data(), text.size() );
+	CHECK( &again == &first && cache.hits() == 1 );
+}
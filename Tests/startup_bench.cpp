@@ -0,0 +1,174 @@
+/***********************************************************************************************//**
+\file    startup_bench.cpp
+\author  hdaniel
+\version $Id$
+
+\brief Measurement of cr's startup, with and without a --server.
+
+\details
+
+What a cr invocation costs before and after --server, for a build that runs cr on every step: the
+time from starting "cr cmd /c rem" until it has exited, run STARTUP_RUNS times one after the
+other, against the same through a cr --serve server the bench starts (and ends) itself. It's
+measured without rules and with STARTUP_RULES --rule options, which a served client doesn't have to
+parse or compile since the server's options are used.
+
+cr.exe is looked for next to crbench.exe, where the solution builds both, unless a path is given.
+
+\license
+
+This file is free and unencumbered software released into the public domain.
+
+Anyone is free to copy, modify, publish, use, compile, sell, or distribute this software, either in
+source code form or as a compiled binary, for any purpose, commercial or non-commercial, and by any
+means.
+
+In jurisdictions that recognize copyright laws, the author or authors of this software dedicate any
+and all copyright interest in the software to the public domain. We make this dedication for the
+benefit of the public at large and to the detriment of our heirs and successors. We intend this
+dedication to be an overt act of relinquishment in perpetuity of all present and future rights to
+this software under copyright law.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT
+NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+For more information, please refer to <http://unlicense.org/>
+***************************************************************************************************/
+#include <cstdlib>
+#include <string>
+#include <vector>
+
+#include <windows.h>
+
+#include "../Source/Utils/utils.h"
+#include "bench.h"
+
+#define STARTUP_RUNS   100  // invocations per case
+#define STARTUP_RULES  50   // --rule options of the cases with rules
+
+//==================================================================================================
+// Start cmdLine. Unless phProcess is given to return the process in, wait for it to exit.
+//==================================================================================================
+static bool Start( std::string const &cmdLine, HANDLE *phProcess =NULL )
+{
+	std::vector<char>   cmd( cmdLine.begin(), cmdLine.end() );
+	STARTUPINFOA        si = { sizeof(si) };
+	PROCESS_INFORMATION pi;
+
+	cmd.push_back( 0 );
+	if( !::CreateProcessA( NULL, &cmd[0], NULL, NULL, FALSE, 0, NULL, NULL, &si, &pi ) ) { return false; }
+	::CloseHandle( pi.hThread );
+
+	if( phProcess )
+	{
+		*phProcess = pi.hProcess;
+		return true;
+	}
+
+	DWORD dwExitCode = 1;
+	::WaitForSingleObject( pi.hProcess, INFINITE );
+	::GetExitCodeProcess( pi.hProcess, &dwExitCode );
+	::CloseHandle( pi.hProcess );
+	return dwExitCode == 0;
+}
+
+//==================================================================================================
+// Start "cr <options> --serve=name" and wait for its pipe, NULL when it doesn't come up.
+//==================================================================================================
+static HANDLE StartServer( std::string const &cr, std::string const &options, std::string const &name )
+{
+	HANDLE      hServer;
+	std::string pipeName = "\\\\.\\pipe\\cr-" + name;
+	std::string cmdLine  = utils::strfmt( "\"%s\" %s --serve=%s", cr.c_str(), options.c_str(), name.c_str() );
+
+	if( !Start( cmdLine, &hServer ) ) { return NULL; }
+	for( int i = 0; i < 500; i++ )
+	{
+		if( ::WaitNamedPipeA( pipeName.c_str(), 1 ) ) { return hServer; }
+		if( ::WaitForSingleObject( hServer, 10 ) == WAIT_OBJECT_0 ) { break; }
+	}
+	::TerminateProcess( hServer, 1 );
+	::CloseHandle( hServer );
+	return NULL;
+}
+
+//==================================================================================================
+// Time nRuns of cmdLine, after one that isn't timed.
+//==================================================================================================
+static bool TimeRuns( char const *what, std::string const &cmdLine, int nRuns )
+{
+	if( !Start( cmdLine ) )
+	{
+		std::printf( "  could not run %s\n", cmdLine.c_str() );
+		return false;
+	}
+
+	bench::Timer timer;
+	for( int i = 0; i < nRuns; i++ )
+	{
+		if( !Start( cmdLine ) ) { return false; }
+	}
+	std::printf( "  %-44s %8.2f ms per invocation\n", what, timer.Seconds() * 1000.0 / nRuns );
+	return true;
+}
+
+//==================================================================================================
+// startup [runs [cr.exe]]
+//==================================================================================================
+BENCH( startup )
+{
+	int         nRuns = (argc >= 1) ? std::atoi( argv[0] ) : STARTUP_RUNS;
+	std::string cr;
+
+	if( argc >= 2 )
+	{
+		cr = argv[1];
+	}
+	else
+	{
+		char self[MAX_PATH];
+		::GetModuleFileNameA( NULL, self, MAX_PATH );
+		cr = self;
+		cr = cr.substr( 0, cr.find_last_of( '\\' ) + 1 ) + "cr.exe";
+	}
+
+	std::string rules;
+	for( int i = 0; i < STARTUP_RULES; i++ ) { rules += utils::strfmt( " --rule=12:pattern%d", i ); }
+
+	std::string name   = utils::strfmt( "crbench-%lu", ::GetCurrentProcessId() );
+	HANDLE      hPlain = StartServer( cr, "", name );
+	HANDLE      hRules = StartServer( cr, rules, name + "-rules" );
+	bool        fOk    = hPlain && hRules;
+
+	if( !fOk )
+	{
+		std::printf( "  could not start %s --serve\n", cr.c_str() );
+	}
+	else
+	{
+		std::string quoted = "\"" + cr + "\"";
+		fOk =    TimeRuns( "cr cmd /c rem", quoted + " cmd /c rem", nRuns )
+		      && TimeRuns( "cr --server cmd /c rem", quoted + " --server=" + name + " cmd /c rem", nRuns )
+		      && TimeRuns( "cr --rule... cmd /c rem", quoted + rules + " cmd /c rem", nRuns )
+		      && TimeRuns( "cr --server (with rules) cmd /c rem",
+		                   quoted + " --server=" + name + "-rules cmd /c rem", nRuns );
+
+		/* A client whose server went away runs the child itself, which would go unnoticed in the
+		 * times, so the servers have to be still up.
+		*/
+		fOk = fOk && ::WaitForSingleObject( hPlain, 0 ) == WAIT_TIMEOUT
+		          && ::WaitForSingleObject( hRules, 0 ) == WAIT_TIMEOUT;
+	}
+
+	HANDLE hServers[] = { hPlain, hRules };
+	for( int i = 0; i < 2; i++ )
+	{
+		if( !hServers[i] ) { continue; }
+		::TerminateProcess( hServers[i], 0 );
+		::CloseHandle( hServers[i] );
+	}
+	return fOk;
+}
@@ -0,0 +1,98 @@
+/***********************************************************************************************//**
+\file    test.h
+\author  hdaniel
+\version $Id$
+
+\brief Self-checking tests of cr's headers (see main.cpp).
+
+\details
+
+A test is a function defined with TEST( name ) that CHECK()s what it expects. Tests register
+themselves at startup and main() (Tests\main.cpp) runs them in the order they're defined in,
+reports each failed CHECK() with its file and line, and returns the number of tests that failed,
+so the build (Build\Tests.vcxproj runs crtests after linking it) or a script can gate on it.
+
+The tests of the headers that don't need Windows build with any compiler, which is how they're
+run on Linux:
+
+    g++ -o crtests Tests/main.cpp Tests/utils_test.cpp Tests/ruleutils_test.cpp \
+        Tests/jsonutils_test.cpp && ./crtests
+
+\license
+
+This file is free and unencumbered software released into the public domain.
+
+Anyone is free to copy, modify, publish, use, compile, sell, or distribute this software, either in
+source code form or as a compiled binary, for any purpose, commercial or non-commercial, and by any
+means.
+
+In jurisdictions that recognize copyright laws, the author or authors of this software dedicate any
+and all copyright interest in the software to the public domain. We make this dedication for the
+benefit of the public at large and to the detriment of our heirs and successors. We intend this
+dedication to be an overt act of relinquishment in perpetuity of all present and future rights to
+this software under copyright law.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT
+NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+For more information, please refer to <http://unlicense.org/>
+***************************************************************************************************/
+#ifndef _test_h_
+#define _test_h_
+
+#include <cstdio>
+
+namespace test
+{
+
+typedef void (*TestFn)();
+
+struct STest
+{
+	char const *name;
+	TestFn      pfnTest;
+	STest      *pNext;
+};
+
+//==================================================================================================
+// The registered tests, and the number of failed checks so far.
+//==================================================================================================
+inline STest*& FirstTest() { static STest *pFirst = 0; return pFirst; }
+inline STest*& LastTest()  { static STest *pLast = 0; return pLast; }
+inline int&    Failures()  { static int nFailures = 0; return nFailures; }
+
+struct SRegister
+{
+	SRegister( STest &test ) 
+	{ 
+		test.pNext = 0;
+		if( LastTest() ) { LastTest()->pNext = &test; } 
+		else             { FirstTest() = &test; }
+		LastTest() = &test;
+	}
+};
+
+inline bool Check( bool fOk, char const *expr, char const *file, int line )
+{
+	if( !fOk )
+	{
+		std::printf( "%s(%d): CHECK( %s ) failed\n", file, line, expr );
+		Failures()++;
+	}
+	return fOk;
+}
+
+} // namespace test
+
+#define TEST( name )                                                \
+	static void name();                                             \
+	static test::STest     name##_test = { #name, name, 0 };        \
+	static test::SRegister name##_register( name##_test );          \
+	static void name()
+
+#define CHECK( expr ) test::Check( (expr) ? true : false, #expr, __FILE__, __LINE__ )
+
+#endif // _test_h_
@@ -0,0 +1,168 @@
+/***********************************************************************************************//**
+\file    utils_bench.cpp
+\author  hdaniel
+\version $Id$
+
+\brief Benchmarks of Source\Utils\utils.h.
+
+\details
+
+utils.h's conversions and formatting against the versions they replaced, which allocated a
+temporary vector per call and copied it into the result. The inputs are a typical line of build
+output, and the same line with non-ASCII characters, which takes the code page path.
+
+\license
+
+This file is free and unencumbered software released into the public domain.
+
+Anyone is free to copy, modify, publish, use, compile, sell, or distribute this software, either in
+source code form or as a compiled binary, for any purpose, commercial or non-commercial, and by any
+means.
+
+In jurisdictions that recognize copyright laws, the author or authors of this software dedicate any
+and all copyright interest in the software to the public domain. We make this dedication for the
+benefit of the public at large and to the detriment of our heirs and successors. We intend this
+dedication to be an overt act of relinquishment in perpetuity of all present and future rights to
+this software under copyright law.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT
+NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+For more information, please refer to <http://unlicense.org/>
+***************************************************************************************************/
+#include <string>
+#include <vector>
+
+#include "../Source/Utils/utils.h"
+#include "bench.h"
+
+#define CONV_CALLS  200000  // calls per run
+
+namespace old
+{
+
+/* The conversions and strvfmt() as they were before utils.h had allocation-free versions.
+*/
+inline std::wstring str2wstr( std::string const &string_in ) 
+{
+	std::vector<wchar_t> buffer;
+	buffer.resize( string_in.length() + 1 );
+	::MultiByteToWideChar( CP_ACP, 0, string_in.c_str(), -1, &buffer[0], (int)string_in.length() );
+	std::wstring wstring_out( &buffer[0] );
+	return wstring_out;
+}
+
+inline std::string wstr2strU( std::wstring const &wstr )
+{
+	std::string str;
+	int strSize = ::WideCharToMultiByte( CP_UTF8, 0, wstr.c_str(), -1, 0, 0, 0, 0 );
+	if( strSize > 0 )
+	{
+		std::vector<char> buffer( strSize );
+		::WideCharToMultiByte( CP_UTF8, 0, wstr.c_str(), -1, &buffer[0], strSize, 0, 0 );
+		str.assign( buffer.begin(), buffer.end() - 1 );
+	}
+	return str;
+}
+
+inline std::string strvfmt( char const *fmt, va_list args )
+{
+	int iResult = -1, iLen = 255;
+	std::vector<char> vBuffer;
+	while( iResult == -1 ) 
+	{
+		vBuffer.assign( iLen+1, 0 );
+		iResult = ::_vsnprintf_s( &vBuffer[0], iLen, iLen-1, fmt, args );
+		iLen *= 2;
+	}
+	std::string ret;
+	ret.assign( &vBuffer[0] );
+	return ret;
+}
+
+inline std::string strfmt( char const *fmt, ... )
+{
+	va_list args;
+	va_start( args, fmt );
+	std::string fmtStr = strvfmt( fmt, args );
+	va_end( args );
+	return fmtStr;
+}
+
+} // namespace old
+
+//==================================================================================================
+// Time CONV_CALLS calls of fn( arg ), the best of BENCH_RUNS runs. The results' lengths are summed 
+// so the calls can't be optimized away.
+//==================================================================================================
+template<typename Fn, typename Arg>
+static void TimeCalls( char const *what, Fn fn, Arg const &arg )
+{
+	double best  = 1e9;
+	size_t total = 0;
+
+	for( int run = 0; run < BENCH_RUNS; run++ )
+	{
+		bench::Timer timer;
+		for( int i = 0; i < CONV_CALLS; i++ ) { total += fn( arg ).size(); }
+		double seconds = timer.Seconds();
+		if( seconds < best ) { best = seconds; }
+	}
+	if( total ) { bench::Report( what, best, CONV_CALLS ); }
+}
+
+static std::wstring NewStr2Wstr( std::string const &s )  { return utils::str2wstr( s ); }
+static std::wstring OldStr2Wstr( std::string const &s )  { return old::str2wstr( s ); }
+static std::string  NewWstr2StrU( std::wstring const &s ) { return utils::wstr2strU( s ); }
+static std::string  OldWstr2StrU( std::wstring const &s ) { return old::wstr2strU( s ); }
+
+static std::string NewStrfmt( std::string const &s ) 
+{ 
+	return utils::strfmt( "%s(%d): %s", "file.cpp", 42, s.c_str() ); 
+}
+
+static std::string OldStrfmt( std::string const &s ) 
+{ 
+	return old::strfmt( "%s(%d): %s", "file.cpp", 42, s.c_str() ); 
+}
+
+//==================================================================================================
+// The conversions of a line into a caller's buffer, and into a std::[w]string, old and new.
+//==================================================================================================
+BENCH( conversions )
+{
+	std::string  line   = "c:\\build\\src\\module\\file.cpp(1234): warning C4996: 'strcpy': unsafe";
+	std::string  utf8   = "c:\\build\\src\\m\xC3\xB6" "dule\\file.cpp(1234): warning: caf\xC3\xA9 \xE2\x82\xAC";
+	std::wstring wide   = utils::str2wstr( line );
+	std::wstring wideU  = utils::str2wstrU( utf8 );
+	std::string  longer( 600, 'x' );
+
+	TimeCalls( "str2wstr ascii, old", OldStr2Wstr, line );
+	TimeCalls( "str2wstr ascii, new", NewStr2Wstr, line );
+	TimeCalls( "wstr2strU ascii, old", OldWstr2StrU, wide );
+	TimeCalls( "wstr2strU ascii, new", NewWstr2StrU, wide );
+	TimeCalls( "wstr2strU non-ascii, old", OldWstr2StrU, wideU );
+	TimeCalls( "wstr2strU non-ascii, new", NewWstr2StrU, wideU );
+	TimeCalls( "strfmt short, old", OldStrfmt, line );
+	TimeCalls( "strfmt short, new", NewStrfmt, line );
+	TimeCalls( "strfmt 600 chars, old", OldStrfmt, longer );
+	TimeCalls( "strfmt 600 chars, new", NewStrfmt, longer );
+
+	/* Into a buffer of the caller's, which the old versions had no equivalent of.
+	*/
+	wchar_t buf[256];
+	double  best = 1e9;
+	size_t  total = 0;
+	for( int run = 0; run < BENCH_RUNS; run++ )
+	{
+		bench::Timer timer;
+		for( int i = 0; i < CONV_CALLS; i++ ) { total += utils::str2wstr( line, buf, 256 ); }
+		double seconds = timer.Seconds();
+		if( seconds < best ) { best = seconds; }
+	}
+	if( total ) { bench::Report( "str2wstr ascii into a buffer", best, CONV_CALLS ); }
+	return true;
+}
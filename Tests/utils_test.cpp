@@ -0,0 +1,282 @@
+/***********************************************************************************************//**
+\file    utils_test.cpp
+\author  hdaniel
+\version $Id$
+
+\brief Tests of Source\Utils\utils.h.
+
+\details
+
+utils.h's string conversions and formatting, and its command line splitter. The conversions are
+checked on their ASCII fast path, through the code page (UTF-8, which is the same everywhere) and
+as size queries, with buffers that are exactly large enough and one character short. The splitter
+is checked against each of its quoting rules and, on Windows, against CommandLineToArgvW().
+
+\license
+
+This file is free and unencumbered software released into the public domain.
+
+Anyone is free to copy, modify, publish, use, compile, sell, or distribute this software, either in
+source code form or as a compiled binary, for any purpose, commercial or non-commercial, and by any
+means.
+
+In jurisdictions that recognize copyright laws, the author or authors of this software dedicate any
+and all copyright interest in the software to the public domain. We make this dedication for the
+benefit of the public at large and to the detriment of our heirs and successors. We intend this
+dedication to be an overt act of relinquishment in perpetuity of all present and future rights to
+this software under copyright law.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT
+NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+For more information, please refer to <http://unlicense.org/>
+***************************************************************************************************/
+#include <cstring>
+#include <string>
+
+#include "../Source/Utils/utils.h"
+#include "test.h"
+
+/* "héllo € 𝄞" in UTF-8 and as wchar_t's; the last character is outside the BMP, a surrogate pair 
+ * where wchar_t is 16 bits.
+*/
+static char const    g_utf8[] = "h\xC3\xA9llo \xE2\x82\xAC \xF0\x9D\x84\x9E";
+static wchar_t const g_wide[] = L"h\x00E9llo \x20AC " L"\U0001D11E";
+
+//==================================================================================================
+TEST( ascii_prefix )
+{
+	char buf[40];
+
+	for( size_t len = 0; len < sizeof(buf); len++ )
+	{
+		std::memset( buf, 'a', sizeof(buf) );
+		CHECK( utils::ascii_prefix( buf, len ) == len );
+
+		for( size_t i = 0; i < len; i++ )
+		{
+			buf[i] = (char)0x80;
+			CHECK( utils::ascii_prefix( buf, len ) == i );
+			buf[i] = 'a';
+		}
+	}
+
+	CHECK( utils::ascii_prefix( L"abc\x00E9", 4 ) == 3 );
+}
+
+//==================================================================================================
+TEST( str2wstr_ascii )
+{
+	wchar_t buf[8];
+
+	CHECK( utils::str2wstr( "abc", buf, 8 ) == 3 );
+	CHECK( std::wcscmp( buf, L"abc" ) == 0 );
+
+	/* Exactly large enough, one short (a size query that leaves buf alone), and no buffer at all.
+	*/
+	CHECK( utils::str2wstr( "abcdefg", buf, 8 ) == 7 && std::wcscmp( buf, L"abcdefg" ) == 0 );
+	buf[0] = L'x';
+	CHECK( utils::str2wstr( "abcdefgh", buf, 8 ) == 8 && buf[0] == L'x' );
+	CHECK( utils::str2wstr( "abcdefgh", NULL, 0 ) == 8 );
+
+	CHECK( utils::str2wstr( "", buf, 8 ) == 0 && buf[0] == 0 );
+	CHECK( utils::str2wstr( utils::strview( "abcdef", 2 ), buf, 8 ) == 2 && std::wcscmp( buf, L"ab" ) == 0 );
+}
+
+//==================================================================================================
+TEST( wstr2str_ascii )
+{
+	char buf[8];
+
+	CHECK( utils::wstr2str( L"abc", buf, 8 ) == 3 && std::strcmp( buf, "abc" ) == 0 );
+	buf[0] = 'x';
+	CHECK( utils::wstr2str( L"abcdefgh", buf, 8 ) == 8 && buf[0] == 'x' );
+	CHECK( utils::wstr2str( L"abcdefgh", NULL, 0 ) == 8 );
+	CHECK( utils::wstr2str( std::wstring( L"abc" ) ) == "abc" );
+}
+
+//==================================================================================================
+TEST( utf8_round_trip )
+{
+	size_t  nWide = std::wcslen( g_wide );
+	size_t  nUtf8 = std::strlen( g_utf8 );
+	wchar_t wide[32];
+	char    utf8[32];
+
+	CHECK( utils::str2wstrU( g_utf8, NULL, 0 ) == nWide );
+	CHECK( utils::str2wstrU( g_utf8, wide, nWide + 1 ) == nWide && std::wcscmp( wide, g_wide ) == 0 );
+
+	CHECK( utils::wstr2strU( g_wide, NULL, 0 ) == nUtf8 );
+	CHECK( utils::wstr2strU( g_wide, utf8, nUtf8 + 1 ) == nUtf8 && std::strcmp( utf8, g_utf8 ) == 0 );
+
+	/* The std::string versions, including the one that has to grow its result.
+	*/
+	CHECK( utils::str2wstrU( std::string( g_utf8 ) ) == g_wide );
+	CHECK( utils::wstr2strU( std::wstring( g_wide ) ) == g_utf8 );
+	CHECK( utils::wstr2strU( utils::str2wstrU( std::string( g_utf8 ) ) ) == g_utf8 );
+}
+
+//==================================================================================================
+TEST( utf8_malformed )
+{
+	/* A lead byte without its continuation, and a stray continuation byte.
+	*/
+	CHECK( utils::str2wstrU( std::string( "a\xC3(b" ) ) == L"a\xFFFD(b" );
+	CHECK( utils::str2wstrU( std::string( "a\x80z" ) ) == L"a\xFFFDz" );
+}
+
+//==================================================================================================
+TEST( strnfmt )
+{
+	char buf[8];
+
+	CHECK( utils::strnfmt( buf, sizeof(buf), "%d-%s", 42, "ab" ) == 5 && std::strcmp( buf, "42-ab" ) == 0 );
+
+	/* Truncated output is still terminated, and the length returned is the complete one.
+	*/
+	CHECK( utils::strnfmt( buf, sizeof(buf), "%s", "0123456789" ) == 10 && std::strcmp( buf, "0123456" ) == 0 );
+	CHECK( utils::strnfmt( NULL, 0, "%s", "0123456789" ) == 10 );
+}
+
+//==================================================================================================
+TEST( strfmt )
+{
+	CHECK( utils::strfmt( "%s=%u", "x", 7u ) == "x=7" );
+	CHECK( utils::strfmt( "" ).empty() );
+
+	/* Longer than strvfmt()'s stack buffer, so args are used twice.
+	*/
+	std::string big( 1000, 'y' );
+	CHECK( utils::strfmt( "[%s]%d", big.c_str(), 5 ) == "[" + big + "]5" );
+}
+
+//==================================================================================================
+// Split cmdLine (a copy of it) and compare the arguments with the expected ones, separated by '|'.
+//==================================================================================================
+static bool Splits( char const *cmdLine, char const *expected, bool fProgramName =false )
+{
+	std::string line( cmdLine );
+	char       *argv[16];
+	int         argc = utils::split_inplace( &line[0], argv, 16, fProgramName );
+
+	std::string args;
+	for( int i = 0; i < argc; i++ ) { args += (i ? "|" : "") + std::string( argv[i] ); }
+	if( args != expected ) { std::printf( "  [%s] split as [%s]\n", cmdLine, args.c_str() ); }
+	return args == expected && argv[argc] == NULL;
+}
+
+//==================================================================================================
+TEST( split_rules )
+{
+	CHECK( Splits( "", "" ) );
+	CHECK( Splits( "  \t ", "" ) );
+	CHECK( Splits( "a b\tc", "a|b|c" ) );
+	CHECK( Splits( "  a   b  ", "a|b" ) );
+	CHECK( Splits( "\"a b\" c", "a b|c" ) );
+	CHECK( Splits( "a\"b c\"d e", "ab cd|e" ) );
+	CHECK( Splits( "\"\" x", "|x" ) );
+
+	/* 2n backslashes and a quote: n backslashes, and the quote toggles quoting. 2n+1: n backslashes
+	 * and a literal quote. Backslashes without a quote are literal.
+	*/
+	CHECK( Splits( "a\\\\\"b c\"", "a\\b c" ) );
+	CHECK( Splits( "a\\\\\\\"b c", "a\\\"b|c" ) );
+	CHECK( Splits( "c:\\dir\\ x\\\\y", "c:\\dir\\|x\\\\y" ) );
+
+	/* Doubled quotes in quotes. */
+	CHECK( Splits( "\"a\"\"b\" c", "a\"b|c" ) );
+}
+
+//==================================================================================================
+TEST( split_program_name )
+{
+	/* The program name never unescapes backslashes, and ends at its closing quote. 
+	*/
+	CHECK( Splits( "\"c:\\pro gram\\x.exe\" a \"b c\"", "c:\\pro gram\\x.exe|a|b c", true ) );
+	CHECK( Splits( "c:\\x\\\"y z", "c:\\x\\y|z", true ) );
+	CHECK( Splits( "x.exe", "x.exe", true ) );
+}
+
+//==================================================================================================
+TEST( split_truncated_argv )
+{
+	char  line[] = "a b c d";
+	char *argv[3];
+
+	CHECK( utils::split_inplace( line, argv, 3 ) == 4 );
+	CHECK( std::strcmp( argv[0], "a" ) == 0 && std::strcmp( argv[1], "b" ) == 0 && argv[2] == NULL );
+}
+
+//==================================================================================================
+TEST( cmdline_raw_and_tail )
+{
+	utils::cmdline cl( "cr -o red \"my prog\" \"x y\" z", true );
+	utils::strview raw;
+
+	CHECK( cl.next_raw( raw ) && raw.str() == "cr" );
+	CHECK( cl.next_raw( raw ) && raw.str() == "-o" );
+	CHECK( cl.next_raw( raw ) && raw.str() == "red" );
+
+	/* What's left is the child's command line, exactly as it was given.
+	*/
+	CHECK( std::string( cl.tail() ) == "\"my prog\" \"x y\" z" );
+	CHECK( cl.next_raw( raw ) && raw.str() == "\"my prog\"" );
+
+	wchar_t         line[] = L"a \"b c\"";
+	wchar_t        *argv[4];
+	CHECK( utils::split_inplace( line, argv, 4 ) == 2 && std::wcscmp( argv[1], L"b c" ) == 0 );
+}
+
+#ifdef _WIN32
+//==================================================================================================
+// The splitter agrees with the system's CommandLineToArgvW(), and CommandLineToArgvA() (which is
+// built on the splitter) with both. Doubled quotes inside quotes are left out: the system's splitter
+// predates the 2008 C runtime's rule for them, which the splitter follows.
+//==================================================================================================
+TEST( split_matches_system )
+{
+	static wchar_t const *cases[] = 
+	{
+		L"x.exe",
+		L"x.exe a b",
+		L"\"c:\\pro gram\\x.exe\" \"a b\" c",
+		L"x \"\"",
+		L"x a\\\\\"b c\"",
+		L"x a\\\\\\\"b",
+		L"x c:\\dir\\ \\\\server\\share",
+		L"x \t a\t\tb ",
+		L"x \"a\"b\"c\" d",
+		L"x \"unterminated b",
+	};
+
+	for( size_t i = 0; i < sizeof(cases) / sizeof(cases[0]); i++ )
+	{
+		int     nSystem = 0;
+		LPWSTR *system  = ::CommandLineToArgvW( cases[i], &nSystem );
+
+		std::wstring line( cases[i] );
+		wchar_t     *argv[32];
+		int          argc = utils::split_inplace( &line[0], argv, 32, true );
+
+		CHECK( system && argc == nSystem );
+		for( int j = 0; system && j < argc && j < nSystem; j++ ) 
+		{ 
+			CHECK( std::wcscmp( argv[j], system[j] ) == 0 ); 
+		}
+
+		int    nNarrow = 0;
+		LPSTR *narrow  = utils::CommandLineToArgvA( utils::wstr2str( cases[i] ).c_str(), &nNarrow );
+		CHECK( narrow && nNarrow == nSystem );
+		for( int j = 0; narrow && j < nNarrow && j < nSystem; j++ ) 
+		{ 
+			CHECK( utils::wstr2str( system[j] ) == narrow[j] ); 
+		}
+
+		::LocalFree( system );
+		::LocalFree( narrow );
+	}
+}
+#endif